@@ -0,0 +1,343 @@
+#include "search.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Aho-Corasick automaton with a dense transition table.
+ *
+ * Bytes that occur in no pattern all behave the same, so the alphabet is first
+ * reduced to equivalence classes: class 0 for every unused byte and one class per
+ * byte that does occur. The goto function is then completed into a full DFA over
+ * those classes, so the scan loop is one table lookup per input byte with no failure
+ * link chasing.
+ *
+ * Table entries are row offsets (state * num_classes) rather than state numbers, and
+ * the top bit marks states that report at least one match, directly or through the
+ * dictionary suffix links.
+ */
+
+#define MP_TERMINAL 0x80000000u
+#define MP_ROW_MASK 0x7fffffffu
+
+typedef struct {
+	long pattern_id;
+	long length;
+	long next;           // next output of the same state, -1 terminated
+} mp_output;
+
+typedef struct {
+	uint8_t classes[256];
+	long num_classes;
+	long num_states;
+	uint32_t *delta;     // num_states * num_classes entries
+	long *first_output;  // per state, index into outputs or -1
+	long *dict_link;     // per state, nearest suffix state with an output or -1
+	mp_output *outputs;
+	long num_outputs;
+	long num_patterns;
+	uint32_t state;      // streaming state carried between #feed calls
+	long position;       // bytes fed so far
+	VALUE patterns;
+} multi_pattern;
+
+static multi_pattern* get_mp_from_self(VALUE self) {
+	multi_pattern *mp;
+	Data_Get_Struct(self, multi_pattern, mp);
+	return mp;
+}
+
+static void mp_mark(void *ptr) {
+	if (ptr) {
+		multi_pattern *mp = ptr;
+		rb_gc_mark(mp->patterns);
+	}
+}
+
+static void mp_free(void *ptr) {
+	if (ptr) {
+		multi_pattern *mp = ptr;
+		xfree(mp->delta);
+		xfree(mp->first_output);
+		xfree(mp->dict_link);
+		xfree(mp->outputs);
+		xfree(mp);
+	}
+}
+
+static VALUE mp_alloc(VALUE klass) {
+	multi_pattern *mp = ALLOC(multi_pattern);
+	memset(mp, 0, sizeof(multi_pattern));
+	mp->patterns = Qnil;
+	return Data_Wrap_Struct(klass, mp_mark, mp_free, mp);
+}
+
+static uint32_t mp_state_of(const multi_pattern *mp, uint32_t entry) {
+	return (entry & MP_ROW_MASK) / mp->num_classes;
+}
+
+static void mp_build(multi_pattern *mp, VALUE patterns) {
+	long i, j, c, total = 1, head, tail, state;
+	long A, max_states;
+	uint32_t *delta;
+	long *fail, *queue;
+
+	// Byte classes
+	memset(mp->classes, 0, sizeof(mp->classes));
+	A = 1;
+	for (i = 0; i < RARRAY_LEN(patterns); i++) {
+		VALUE pattern = RARRAY_AREF(patterns, i);
+		const unsigned char *p = (const unsigned char *) RSTRING_PTR(pattern);
+		for (j = 0; j < RSTRING_LEN(pattern); j++) {
+			if (!mp->classes[p[j]]) mp->classes[p[j]] = (uint8_t) A++;
+		}
+		total += RSTRING_LEN(pattern);
+	}
+	mp->num_classes = A;
+	max_states = total;
+	if ((double) max_states * A > MP_ROW_MASK) rb_raise(rb_eArgError, "pattern set is too large");
+
+	// Trie, with 0 marking a missing edge (the root can never be a child)
+	delta = mp->delta = ALLOC_N(uint32_t, max_states * A);
+	memset(delta, 0, sizeof(uint32_t) * max_states * A);
+	mp->first_output = ALLOC_N(long, max_states);
+	mp->dict_link = ALLOC_N(long, max_states);
+	mp->outputs = ALLOC_N(mp_output, RARRAY_LEN(patterns));
+	mp->num_states = 1;
+	mp->first_output[0] = -1;
+	for (i = 0; i < RARRAY_LEN(patterns); i++) {
+		VALUE pattern = RARRAY_AREF(patterns, i);
+		const unsigned char *p = (const unsigned char *) RSTRING_PTR(pattern);
+		state = 0;
+		for (j = 0; j < RSTRING_LEN(pattern); j++) {
+			c = mp->classes[p[j]];
+			if (!delta[state * A + c]) {
+				mp->first_output[mp->num_states] = -1;
+				delta[state * A + c] = (uint32_t) (mp->num_states++ * A);
+			}
+			state = delta[state * A + c] / A;
+		}
+		mp->outputs[mp->num_outputs].pattern_id = i;
+		mp->outputs[mp->num_outputs].length = RSTRING_LEN(pattern);
+		mp->outputs[mp->num_outputs].next = mp->first_output[state];
+		mp->first_output[state] = mp->num_outputs++;
+	}
+
+	// Breadth-first pass computing failure links and completing the DFA. When a state
+	// is dequeued its failure state is already complete, so missing edges copy from it.
+	fail = ALLOC_N(long, mp->num_states);
+	queue = ALLOC_N(long, mp->num_states);
+	head = tail = 0;
+	fail[0] = 0;
+	mp->dict_link[0] = -1;
+	for (c = 0; c < A; c++) {
+		uint32_t next = delta[c];
+		if (next) {
+			state = next / A;
+			fail[state] = 0;
+			mp->dict_link[state] = -1;
+			queue[tail++] = state;
+		}
+	}
+	while (head < tail) {
+		long s = queue[head++];
+		for (c = 0; c < A; c++) {
+			uint32_t next = delta[s * A + c];
+			if (next) {
+				long t = next / A;
+				long f = delta[fail[s] * A + c] / A;
+				fail[t] = f;
+				mp->dict_link[t] = mp->first_output[f] >= 0 ? f : mp->dict_link[f];
+				queue[tail++] = t;
+			} else {
+				delta[s * A + c] = delta[fail[s] * A + c];
+			}
+		}
+	}
+	xfree(queue);
+	xfree(fail);
+
+	// Flag the transitions into reporting states
+	for (i = 0; i < mp->num_states * A; i++) {
+		state = delta[i] / A;
+		if (mp->first_output[state] >= 0 || mp->dict_link[state] >= 0) delta[i] |= MP_TERMINAL;
+	}
+	mp->state = 0;
+	mp->position = 0;
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Search::MultiPattern.new(patterns)
+ *
+ * Compiles an array of non-empty strings into an automaton. Pattern ids in the
+ * results are indices into this array.
+ */
+static VALUE mp_init(VALUE self, VALUE patterns) {
+	multi_pattern *mp = get_mp_from_self(self);
+	long i;
+	VALUE copy;
+
+	if (mp->delta) rb_raise(rb_eRuntimeError, "MultiPattern is already initialized");
+	patterns = rb_Array(patterns);
+	copy = rb_ary_new2(RARRAY_LEN(patterns));
+	for (i = 0; i < RARRAY_LEN(patterns); i++) {
+		VALUE pattern = RARRAY_AREF(patterns, i);
+		StringValue(pattern);
+		pattern = rb_str_new_frozen(pattern);
+		if (RSTRING_LEN(pattern) == 0) rb_raise(rb_eArgError, "patterns must not be empty");
+		rb_ary_push(copy, pattern);
+	}
+	rb_obj_freeze(copy);
+	mp->patterns = copy;
+	mp->num_patterns = RARRAY_LEN(copy);
+	mp_build(mp, copy);
+	return self;
+}
+
+static void mp_check_initialized(multi_pattern *mp) {
+	if (!mp->delta) rb_raise(rb_eRuntimeError, "uninitialized MultiPattern");
+}
+
+/*
+ * Runs the automaton over text starting in *state. Every match is yielded if a block
+ * is given, otherwise appended to result as [pattern_id, offset] where offset is the
+ * byte offset of the match start plus base.
+ */
+static void mp_scan(multi_pattern *mp, VALUE text, uint32_t *state, long base, VALUE result) {
+	const uint32_t *delta = mp->delta;
+	const uint8_t *classes = mp->classes;
+	const unsigned char *p = (const unsigned char *) RSTRING_PTR(text);
+	long len = RSTRING_LEN(text), i, s, o;
+	int yield = rb_block_given_p();
+	uint32_t entry = *state;
+
+	for (i = 0; i < len; i++) {
+		entry = delta[(entry & MP_ROW_MASK) + classes[p[i]]];
+		if (!(entry & MP_TERMINAL)) continue;
+		s = mp_state_of(mp, entry);
+		if (mp->first_output[s] < 0) s = mp->dict_link[s];
+		while (s >= 0) {
+			for (o = mp->first_output[s]; o >= 0; o = mp->outputs[o].next) {
+				VALUE id = LONG2FIX(mp->outputs[o].pattern_id);
+				VALUE offset = LONG2NUM(base + i + 1 - mp->outputs[o].length);
+				if (yield) rb_yield_values(2, id, offset);
+				else rb_ary_push(result, rb_assoc_new(id, offset));
+			}
+			s = mp->dict_link[s];
+		}
+		// The block may have triggered a compacting GC
+		if (yield) p = (const unsigned char *) RSTRING_PTR(text);
+	}
+	*state = entry & MP_ROW_MASK;
+}
+
+/*
+ * call-seq:
+ *     search(text) -> [[pattern_id, offset], ...]
+ *     search(text) { |pattern_id, offset| ... } -> self
+ *
+ * Returns every occurrence of every pattern in text, including overlapping ones,
+ * ordered by where they end. Offsets are byte offsets of the match start. The
+ * streaming state used by #feed is not affected.
+ *
+ * Complexity: O(n + number of matches)
+ *
+ *   mp = Algorithms::Search::MultiPattern.new(%w(he she his hers))
+ *   mp.search("ushers") #=> [[1, 1], [0, 2], [3, 2]]
+ */
+static VALUE mp_search(VALUE self, VALUE text) {
+	multi_pattern *mp = get_mp_from_self(self);
+	uint32_t state = 0;
+	VALUE result;
+
+	mp_check_initialized(mp);
+	text = rb_str_new_frozen(StringValue(text));
+	result = rb_block_given_p() ? Qnil : rb_ary_new();
+	mp_scan(mp, text, &state, 0, result);
+	RB_GC_GUARD(text);
+	return NIL_P(result) ? self : result;
+}
+
+/*
+ * call-seq:
+ *     feed(chunk) -> [[pattern_id, offset], ...]
+ *     feed(chunk) { |pattern_id, offset| ... } -> self
+ *
+ * Scans the next chunk of a stream. The automaton state is kept between calls, so
+ * matches spanning chunk boundaries are found, and offsets count bytes from the start
+ * of the stream. Use #reset to start a new stream.
+ *
+ *   mp = Algorithms::Search::MultiPattern.new(["needle"])
+ *   mp.feed("hay nee") #=> []
+ *   mp.feed("dle hay") #=> [[0, 4]]
+ */
+static VALUE mp_feed(VALUE self, VALUE chunk) {
+	multi_pattern *mp = get_mp_from_self(self);
+	uint32_t state;
+	long base;
+	VALUE result;
+
+	mp_check_initialized(mp);
+	chunk = rb_str_new_frozen(StringValue(chunk));
+	result = rb_block_given_p() ? Qnil : rb_ary_new();
+	state = mp->state;
+	base = mp->position;
+	// Advance the stream first so that a block calling #feed or #reset sees a consistent state
+	mp->position += RSTRING_LEN(chunk);
+	mp_scan(mp, chunk, &state, base, result);
+	mp->state = state;
+	RB_GC_GUARD(chunk);
+	return NIL_P(result) ? self : result;
+}
+
+/*
+ * call-seq:
+ *     match?(text) -> true or false
+ *
+ * Returns true if any pattern occurs in text. Stops at the first match.
+ */
+static VALUE mp_is_match(VALUE self, VALUE text) {
+	multi_pattern *mp = get_mp_from_self(self);
+	const unsigned char *p, *end;
+	uint32_t entry = 0;
+
+	mp_check_initialized(mp);
+	StringValue(text);
+	p = (const unsigned char *) RSTRING_PTR(text);
+	end = p + RSTRING_LEN(text);
+	while (p < end) {
+		entry = mp->delta[(entry & MP_ROW_MASK) + mp->classes[*p++]];
+		if (entry & MP_TERMINAL) return Qtrue;
+	}
+	return Qfalse;
+}
+
+// Forgets the streaming state so the next #feed starts a new stream at offset 0.
+static VALUE mp_reset(VALUE self) {
+	multi_pattern *mp = get_mp_from_self(self);
+	mp->state = 0;
+	mp->position = 0;
+	return self;
+}
+
+static VALUE mp_patterns(VALUE self) {
+	return get_mp_from_self(self)->patterns;
+}
+
+static VALUE mp_size(VALUE self) {
+	return LONG2NUM(get_mp_from_self(self)->num_patterns);
+}
+
+static VALUE cMultiPattern;
+
+void Init_multi_pattern(VALUE mSearch) {
+	cMultiPattern = rb_define_class_under(mSearch, "MultiPattern", rb_cObject);
+	rb_define_alloc_func(cMultiPattern, mp_alloc);
+	rb_define_method(cMultiPattern, "initialize", mp_init, 1);
+	rb_define_method(cMultiPattern, "search", mp_search, 1);
+	rb_define_method(cMultiPattern, "feed", mp_feed, 1);
+	rb_define_method(cMultiPattern, "match?", mp_is_match, 1);
+	rb_define_method(cMultiPattern, "reset", mp_reset, 0);
+	rb_define_method(cMultiPattern, "patterns", mp_patterns, 0);
+	rb_define_method(cMultiPattern, "size", mp_size, 0);
+}
@@ -0,0 +1,327 @@
+#include "search.h"
+#include "ruby/encoding.h"
+#include <string.h>
+
+/*
+ * Compiled single pattern search.
+ *
+ * The common case is handled by a prefilter: the pattern byte that is expected to be
+ * rarest in typical text is located with memchr, which libc implements with SIMD, and
+ * each candidate is verified with memcmp. When candidates turn out to be dense enough
+ * that verification dominates, the scan switches to Knuth-Morris-Pratt for the rest of
+ * the text, which keeps the worst case linear.
+ */
+
+typedef struct {
+	char *bytes;
+	long length;
+	long *failure;   // failure[j]: longest proper border of the first j bytes
+	long rare_offset;
+	unsigned char rare_byte;
+	VALUE source;
+} pattern;
+
+typedef struct {
+	const char *hay;
+	long n;
+	long pos;        // next candidate start (prefilter) or next byte to consume (KMP)
+	long start;
+	long verify_cost;
+	int kmp;
+	long j;
+} pattern_scan;
+
+static unsigned char byte_rank[256];
+
+// Rough frequency order of bytes in text and logs; anything not listed counts as rare
+static void init_byte_rank(void) {
+	static const char frequent[] =
+		" etaoinsrhldcumfpgwybvkxjqz\nETAOINSRHLDCUMFPGWYBVKXJQZ0123456789"
+		".,-'\":;/()=_\t\r<>[]{}!?*&#@$%+|\\^~`";
+	long i, len = sizeof(frequent) - 1;
+	memset(byte_rank, 0, sizeof(byte_rank));
+	for (i = 0; i < len; i++) {
+		byte_rank[(unsigned char) frequent[i]] = (unsigned char) (len - i);
+	}
+}
+
+static pattern* get_pattern_from_self(VALUE self) {
+	pattern *pat;
+	Data_Get_Struct(self, pattern, pat);
+	return pat;
+}
+
+static void pattern_mark(void *ptr) {
+	if (ptr) {
+		pattern *pat = ptr;
+		rb_gc_mark(pat->source);
+	}
+}
+
+static void pattern_free(void *ptr) {
+	if (ptr) {
+		pattern *pat = ptr;
+		xfree(pat->bytes);
+		xfree(pat->failure);
+		xfree(pat);
+	}
+}
+
+static VALUE pattern_alloc(VALUE klass) {
+	pattern *pat = ALLOC(pattern);
+	memset(pat, 0, sizeof(pattern));
+	pat->source = Qnil;
+	return Data_Wrap_Struct(klass, pattern_mark, pattern_free, pat);
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Search::Pattern.new(substring)
+ *
+ * Compiles substring (which must not be empty) for repeated searching.
+ */
+static VALUE pattern_init(VALUE self, VALUE source) {
+	pattern *pat = get_pattern_from_self(self);
+	long m, i, k;
+
+	if (pat->bytes) rb_raise(rb_eRuntimeError, "Pattern is already initialized");
+	StringValue(source);
+	m = RSTRING_LEN(source);
+	if (m == 0) rb_raise(rb_eArgError, "pattern must not be empty");
+	pat->source = rb_str_new_frozen(source);
+	pat->length = m;
+	pat->bytes = ALLOC_N(char, m);
+	memcpy(pat->bytes, RSTRING_PTR(source), m);
+
+	pat->failure = ALLOC_N(long, m + 1);
+	pat->failure[0] = 0;
+	if (m > 0) pat->failure[1] = 0;
+	for (i = 1, k = 0; i < m; i++) {
+		while (k > 0 && pat->bytes[i] != pat->bytes[k]) k = pat->failure[k];
+		if (pat->bytes[i] == pat->bytes[k]) k++;
+		pat->failure[i + 1] = k;
+	}
+
+	pat->rare_offset = 0;
+	for (i = 1; i < m; i++) {
+		if (byte_rank[(unsigned char) pat->bytes[i]] < byte_rank[(unsigned char) pat->bytes[pat->rare_offset]])
+			pat->rare_offset = i;
+	}
+	pat->rare_byte = (unsigned char) pat->bytes[pat->rare_offset];
+	return self;
+}
+
+static pattern* get_initialized_pattern(VALUE self) {
+	pattern *pat = get_pattern_from_self(self);
+	if (!pat->bytes) rb_raise(rb_eRuntimeError, "uninitialized Pattern");
+	return pat;
+}
+
+static void pattern_scan_init(pattern_scan *sc, const char *hay, long n) {
+	sc->hay = hay;
+	sc->n = n;
+	sc->pos = 0;
+	sc->start = 0;
+	sc->verify_cost = 0;
+	sc->kmp = 0;
+	sc->j = 0;
+}
+
+// Returns the byte offset of the next (possibly overlapping) occurrence, or -1
+static long pattern_scan_next(const pattern *pat, pattern_scan *sc) {
+	const char *hay = sc->hay, *p;
+	long m = pat->length, n = sc->n, x, j;
+
+	while (!sc->kmp) {
+		if (sc->pos + m > n) return -1;
+		p = memchr(hay + sc->pos + pat->rare_offset, pat->rare_byte, n - m + 1 - sc->pos);
+		if (!p) {
+			sc->pos = n;
+			return -1;
+		}
+		x = (p - hay) - pat->rare_offset;
+		sc->pos = x + 1;
+		if (memcmp(hay + x, pat->bytes, m) == 0) return x;
+		// Verification is bounded by m per candidate; once it outweighs the bytes the
+		// prefilter skipped, fall back to KMP from here on
+		sc->verify_cost += m;
+		if (sc->verify_cost > 4 * (sc->pos - sc->start) + 4096) {
+			sc->kmp = 1;
+			sc->j = 0;
+		}
+	}
+
+	j = sc->j;
+	for (x = sc->pos; x < n; x++) {
+		char c = hay[x];
+		while (j > 0 && pat->bytes[j] != c) j = pat->failure[j];
+		if (pat->bytes[j] == c) j++;
+		if (j == m) {
+			sc->j = pat->failure[m];
+			sc->pos = x + 1;
+			return x + 1 - m;
+		}
+	}
+	sc->j = j;
+	sc->pos = n;
+	return -1;
+}
+
+// Converts ascending byte offsets into character offsets without rescanning the prefix
+typedef struct {
+	VALUE str;
+	rb_encoding *enc;
+	int single_byte;
+	long byte_pos;
+	long char_pos;
+} offset_conv;
+
+static void offset_conv_init(offset_conv *conv, VALUE str) {
+	conv->str = str;
+	conv->enc = rb_enc_get(str);
+	conv->single_byte = rb_enc_mbmaxlen(conv->enc) == 1 || rb_enc_str_coderange(str) == ENC_CODERANGE_7BIT;
+	conv->byte_pos = 0;
+	conv->char_pos = 0;
+}
+
+// Matches that start in the middle of a character are not matches in Ruby's sense
+static int offset_conv_on_boundary(offset_conv *conv, long byte) {
+	const char *s = RSTRING_PTR(conv->str);
+	if (conv->single_byte) return 1;
+	return rb_enc_left_char_head(s, s + byte, s + RSTRING_LEN(conv->str), conv->enc) == s + byte;
+}
+
+static long offset_conv_chars(offset_conv *conv, long byte) {
+	const char *s = RSTRING_PTR(conv->str);
+	if (conv->single_byte) return byte;
+	conv->char_pos += rb_enc_strlen(s + conv->byte_pos, s + byte, conv->enc);
+	conv->byte_pos = byte;
+	return conv->char_pos;
+}
+
+static VALUE prepare_haystack(pattern *pat, VALUE str) {
+	StringValue(str);
+	rb_enc_check(str, pat->source);
+	return rb_str_new_frozen(str);
+}
+
+/*
+ * Calls fn for every occurrence in str, in order, until it returns 0. fn receives the
+ * byte offset; the character offset is available through conv.
+ */
+static long pattern_each_match(pattern *pat, VALUE str, int (*fn)(long byte, offset_conv *conv, void *arg), void *arg) {
+	pattern_scan sc;
+	offset_conv conv;
+	long byte, count = 0;
+
+	offset_conv_init(&conv, str);
+	pattern_scan_init(&sc, RSTRING_PTR(str), RSTRING_LEN(str));
+	while ((byte = pattern_scan_next(pat, &sc)) >= 0) {
+		if (!offset_conv_on_boundary(&conv, byte)) continue;
+		count++;
+		if (fn && !fn(byte, &conv, arg)) break;
+		// A block may have triggered a compacting GC
+		sc.hay = RSTRING_PTR(str);
+	}
+	return count;
+}
+
+static int collect_first(long byte, offset_conv *conv, void *arg) {
+	*(VALUE *) arg = LONG2NUM(offset_conv_chars(conv, byte));
+	return 0;
+}
+
+static int collect_all(long byte, offset_conv *conv, void *arg) {
+	rb_ary_push(*(VALUE *) arg, LONG2NUM(offset_conv_chars(conv, byte)));
+	return 1;
+}
+
+static int yield_offset(long byte, offset_conv *conv, void *arg) {
+	rb_yield(LONG2NUM(offset_conv_chars(conv, byte)));
+	return 1;
+}
+
+/*
+ * call-seq:
+ *     first(string) -> Integer or nil
+ *
+ * Returns the character index of the first occurrence in string, or nil.
+ *
+ *   pattern = Algorithms::Search::Pattern.new("ABCDABD")
+ *   pattern.first("ABC ABCDAB ABCDABCDABDE") #=> 15
+ */
+static VALUE pattern_first(VALUE self, VALUE str) {
+	pattern *pat = get_initialized_pattern(self);
+	VALUE result = Qnil;
+	str = prepare_haystack(pat, str);
+	pattern_each_match(pat, str, collect_first, &result);
+	RB_GC_GUARD(str);
+	return result;
+}
+
+/*
+ * call-seq:
+ *     all(string) -> [Integer, ...]
+ *
+ * Returns the character index of every occurrence in string, overlapping ones included.
+ *
+ *   Algorithms::Search::Pattern.new("aba").all("ababa") #=> [0, 2]
+ */
+static VALUE pattern_all(VALUE self, VALUE str) {
+	pattern *pat = get_initialized_pattern(self);
+	VALUE result = rb_ary_new();
+	str = prepare_haystack(pat, str);
+	pattern_each_match(pat, str, collect_all, &result);
+	RB_GC_GUARD(str);
+	return result;
+}
+
+/*
+ * call-seq:
+ *     count(string) -> Integer
+ *
+ * Returns the number of occurrences in string, overlapping ones included.
+ */
+static VALUE pattern_count(VALUE self, VALUE str) {
+	pattern *pat = get_initialized_pattern(self);
+	long count;
+	str = prepare_haystack(pat, str);
+	count = pattern_each_match(pat, str, NULL, NULL);
+	RB_GC_GUARD(str);
+	return LONG2NUM(count);
+}
+
+/*
+ * call-seq:
+ *     each_offset(string) { |index| ... } -> self
+ *     each_offset(string) -> Enumerator
+ *
+ * Yields the character index of every occurrence in string, overlapping ones included.
+ */
+static VALUE pattern_each_offset(VALUE self, VALUE str) {
+	pattern *pat = get_initialized_pattern(self);
+	RETURN_ENUMERATOR(self, 1, &str);
+	str = prepare_haystack(pat, str);
+	pattern_each_match(pat, str, yield_offset, NULL);
+	RB_GC_GUARD(str);
+	return self;
+}
+
+static VALUE pattern_source(VALUE self) {
+	return get_initialized_pattern(self)->source;
+}
+
+static VALUE cPattern;
+
+void Init_pattern(VALUE mSearch) {
+	init_byte_rank();
+	cPattern = rb_define_class_under(mSearch, "Pattern", rb_cObject);
+	rb_define_alloc_func(cPattern, pattern_alloc);
+	rb_define_method(cPattern, "initialize", pattern_init, 1);
+	rb_define_method(cPattern, "first", pattern_first, 1);
+	rb_define_method(cPattern, "all", pattern_all, 1);
+	rb_define_method(cPattern, "count", pattern_count, 1);
+	rb_define_method(cPattern, "each_offset", pattern_each_offset, 1);
+	rb_define_method(cPattern, "source", pattern_source, 0);
+	rb_define_alias(cPattern, "to_s", "source");
+}
@@ -0,0 +1,12 @@
+#include "search.h"
+
+static VALUE mAlgorithms;
+static VALUE mSearch;
+
+void Init_CSearch() {
+	mAlgorithms = rb_define_module("Algorithms");
+	mSearch = rb_define_module_under(mAlgorithms, "Search");
+	Init_multi_pattern(mSearch);
+	Init_pattern(mSearch);
+	Init_sorted_index(mSearch);
+}
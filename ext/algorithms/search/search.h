@@ -0,0 +1,10 @@
+#ifndef ALGORITHMS_SEARCH_H
+#define ALGORITHMS_SEARCH_H
+
+#include "ruby.h"
+
+void Init_multi_pattern(VALUE mSearch);
+void Init_pattern(VALUE mSearch);
+void Init_sorted_index(VALUE mSearch);
+
+#endif
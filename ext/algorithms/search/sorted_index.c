@@ -0,0 +1,374 @@
+#include "search.h"
+#include <math.h>
+
+/*
+ * An immutable sorted array of numbers stored in Eytzinger (BFS) order.
+ *
+ * Key k's children are 2k and 2k + 1, so the first few levels of every search share the
+ * same cache lines, and the descendants four levels down are contiguous and can be
+ * prefetched one iteration ahead. The search loop is branch-free: it only decides which
+ * child to visit, and the in-order position is recovered at the end from the path taken.
+ *
+ * Keys are stored as longs when every element is a Fixnum and as doubles otherwise. Integers
+ * that a double cannot hold exactly still compare exactly: rounding keeps the order, so only
+ * the keys that round to the same double as the query can be in doubt, and those few are
+ * compared as Ruby numbers.
+ */
+
+#if defined(__GNUC__)
+#define SI_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define SI_PREFETCH(p)
+#endif
+
+#define SI_BATCH 16
+
+typedef struct {
+	long size;
+	int integer;      // keys are longs rather than doubles
+	int inexact;      // some double keys are rounded Integers
+	long *ikeys;      // 1-based, Eytzinger order
+	double *dkeys;
+	long *positions;  // positions[k]: index in the sorted array of Eytzinger slot k
+	VALUE values;     // frozen copy of the sorted array
+} sorted_index;
+
+static sorted_index* get_sorted_index_from_self(VALUE self) {
+	sorted_index *index;
+	Data_Get_Struct(self, sorted_index, index);
+	return index;
+}
+
+static void sorted_index_mark(void *ptr) {
+	if (ptr) {
+		sorted_index *index = ptr;
+		rb_gc_mark(index->values);
+	}
+}
+
+static void sorted_index_free(void *ptr) {
+	if (ptr) {
+		sorted_index *index = ptr;
+		xfree(index->ikeys);
+		xfree(index->dkeys);
+		xfree(index->positions);
+		xfree(index);
+	}
+}
+
+static VALUE sorted_index_alloc(VALUE klass) {
+	sorted_index *index = ALLOC(sorted_index);
+	memset(index, 0, sizeof(sorted_index));
+	index->values = Qnil;
+	return Data_Wrap_Struct(klass, sorted_index_mark, sorted_index_free, index);
+}
+
+// Strips the trailing right turns (and the final left turn) off a search path
+static long eytz_unwind(unsigned long k) {
+#if defined(__GNUC__)
+	return (long) (k >> __builtin_ctzl(~k) >> 1);
+#else
+	while (k & 1) k >>= 1;
+	return (long) (k >> 1);
+#endif
+}
+
+// Each search returns the Eytzinger slot of the answer, or 0 if it is past the end
+#define SI_PREFETCH_STRIDE(type) (64 / sizeof(type))
+#define DEFINE_EYTZ_SEARCH(name, type, step) \
+static long name(const type *b, long n, type x) { \
+	unsigned long k = 1; \
+	while (k <= (unsigned long) n) { \
+		SI_PREFETCH(b + k * SI_PREFETCH_STRIDE(type)); \
+		k = 2 * k + (step); \
+	} \
+	return eytz_unwind(k); \
+}
+
+DEFINE_EYTZ_SEARCH(eytz_lower_long, long, (b[k] < x))
+DEFINE_EYTZ_SEARCH(eytz_upper_long, long, (b[k] <= x))
+DEFINE_EYTZ_SEARCH(eytz_lower_double, double, (b[k] < x))
+DEFINE_EYTZ_SEARCH(eytz_upper_double, double, (b[k] <= x))
+
+// Lays out sorted positions in-order over the implicit tree rooted at slot k
+static long eytz_fill(sorted_index *index, const long *ikeys, const double *dkeys, long i, long k) {
+	if (k <= index->size) {
+		i = eytz_fill(index, ikeys, dkeys, i, 2 * k);
+		if (index->integer) index->ikeys[k] = ikeys[i];
+		else index->dkeys[k] = dkeys[i];
+		index->positions[k] = i++;
+		i = eytz_fill(index, ikeys, dkeys, i, 2 * k + 1);
+	}
+	return i;
+}
+
+static ID id_cmp, id_eq;
+
+static double number_to_double(VALUE num) {
+	double d;
+	if (!FIXNUM_P(num) && !RB_TYPE_P(num, T_BIGNUM) && !RB_FLOAT_TYPE_P(num))
+		rb_raise(rb_eTypeError, "SortedIndex only holds Integers and Floats");
+	d = NUM2DBL(num);
+	if (isnan(d)) rb_raise(rb_eArgError, "NaN cannot be ordered");
+	return d;
+}
+
+// Whether num, an Integer or Float, is exactly d
+static int double_is_exact(VALUE num, double d) {
+	if (RB_FLOAT_TYPE_P(num)) return 1;
+	// Fixnums lie well inside the range of long, so the cast is safe
+	if (FIXNUM_P(num)) return (long) d == FIX2LONG(num);
+	return RTEST(rb_funcall(num, id_eq, 1, DBL2NUM(d)));
+}
+
+static int number_compare(VALUE a, VALUE b) {
+	return rb_cmpint(rb_funcall(a, id_cmp, 1, b), a, b);
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Search::SortedIndex.new(sorted_array)
+ *
+ * Copies an ascending array of Integers and Floats into the index. Raises ArgumentError
+ * if the array is not sorted.
+ *
+ * Complexity: O(n)
+ */
+static VALUE sorted_index_init(VALUE self, VALUE array) {
+	sorted_index *index = get_sorted_index_from_self(self);
+	VALUE keys_v = 0;
+	long n, i, *ikeys = NULL;
+	double *dkeys = NULL;
+	int integer = 1;
+
+	if (index->positions) rb_raise(rb_eRuntimeError, "SortedIndex is already initialized");
+	array = rb_ary_dup(rb_convert_type(array, T_ARRAY, "Array", "to_ary"));
+	n = RARRAY_LEN(array);
+	for (i = 0; i < n; i++) {
+		if (!FIXNUM_P(RARRAY_AREF(array, i))) integer = 0;
+	}
+
+	if (integer) {
+		ikeys = ALLOCV_N(long, keys_v, n + 1);
+		for (i = 0; i < n; i++) {
+			ikeys[i] = FIX2LONG(RARRAY_AREF(array, i));
+			if (i > 0 && ikeys[i - 1] > ikeys[i]) rb_raise(rb_eArgError, "array is not sorted");
+		}
+	} else {
+		int previous_exact = 1;
+		dkeys = ALLOCV_N(double, keys_v, n + 1);
+		for (i = 0; i < n; i++) {
+			VALUE key = RARRAY_AREF(array, i);
+			int exact;
+			dkeys[i] = number_to_double(key);
+			exact = double_is_exact(key, dkeys[i]);
+			if (!exact) index->inexact = 1;
+			if (i > 0 && (dkeys[i - 1] > dkeys[i] || (dkeys[i - 1] == dkeys[i] && !(exact && previous_exact) &&
+					number_compare(RARRAY_AREF(array, i - 1), key) > 0))) {
+				rb_raise(rb_eArgError, "array is not sorted");
+			}
+			previous_exact = exact;
+		}
+	}
+
+	index->size = n;
+	index->integer = integer;
+	if (integer) index->ikeys = ALLOC_N(long, n + 1);
+	else index->dkeys = ALLOC_N(double, n + 1);
+	index->positions = ALLOC_N(long, n + 1);
+	eytz_fill(index, ikeys, dkeys, 0, 1);
+	ALLOCV_END(keys_v);
+	index->values = rb_ary_freeze(array);
+	return self;
+}
+
+static sorted_index* get_initialized_index(VALUE self) {
+	sorted_index *index = get_sorted_index_from_self(self);
+	if (!index->positions) rb_raise(rb_eRuntimeError, "uninitialized SortedIndex");
+	return index;
+}
+
+/*
+ * Position of the first key >= query (or > query when upper is set). Queries that cannot
+ * be represented as keys (Floats against integer keys, Bignums) are rounded or clamped so
+ * that the answer is the same as comparing against the exact value.
+ */
+static long sorted_index_bound(const sorted_index *index, VALUE query, int upper) {
+	long n = index->size, slot, key;
+
+	if (!index->integer) {
+		double d = number_to_double(query);
+		long lo, hi;
+		if (!index->inexact && double_is_exact(query, d)) {
+			slot = upper ? eytz_upper_double(index->dkeys, n, d) : eytz_lower_double(index->dkeys, n, d);
+			return slot ? index->positions[slot] : n;
+		}
+		// The answer lies among the keys that round to d
+		slot = eytz_lower_double(index->dkeys, n, d);
+		lo = slot ? index->positions[slot] : n;
+		slot = eytz_upper_double(index->dkeys, n, d);
+		hi = slot ? index->positions[slot] : n;
+		while (lo < hi) {
+			long mid = lo + (hi - lo) / 2;
+			int cmp = number_compare(RARRAY_AREF(index->values, mid), query);
+			if (upper ? cmp <= 0 : cmp < 0) lo = mid + 1;
+			else hi = mid;
+		}
+		return lo;
+	}
+
+	if (FIXNUM_P(query)) {
+		key = FIX2LONG(query);
+	} else if (RB_TYPE_P(query, T_BIGNUM)) {
+		return RBIGNUM_POSITIVE_P(query) ? n : 0;
+	} else {
+		double d = number_to_double(query);
+		// Every Fixnum lies strictly inside (-2**63, 2**63)
+		if (d >= 9223372036854775808.0) return n;
+		if (d < -9223372036854775808.0) return 0;
+		// key >= d <=> key >= ceil(d); key > d <=> key > floor(d)
+		key = (long) (upper ? floor(d) : ceil(d));
+	}
+	slot = upper ? eytz_upper_long(index->ikeys, n, key) : eytz_lower_long(index->ikeys, n, key);
+	return slot ? index->positions[slot] : n;
+}
+
+/*
+ * call-seq:
+ *     lower_bound(number) -> Integer
+ *
+ * Returns the index of the first element >= number, or size if there is none. This is
+ * also the number of elements < number, its rank.
+ *
+ * Complexity: O(lg n)
+ *
+ *   index = Algorithms::Search::SortedIndex.new([1, 3, 3, 7])
+ *   index.lower_bound(3) #=> 1
+ *   index.lower_bound(8) #=> 4
+ */
+static VALUE sorted_index_lower_bound(VALUE self, VALUE query) {
+	return LONG2NUM(sorted_index_bound(get_initialized_index(self), query, 0));
+}
+
+/*
+ * call-seq:
+ *     upper_bound(number) -> Integer
+ *
+ * Returns the index of the first element > number, or size if there is none.
+ *
+ * Complexity: O(lg n)
+ *
+ *   Algorithms::Search::SortedIndex.new([1, 3, 3, 7]).upper_bound(3) #=> 3
+ */
+static VALUE sorted_index_upper_bound(VALUE self, VALUE query) {
+	return LONG2NUM(sorted_index_bound(get_initialized_index(self), query, 1));
+}
+
+/*
+ * call-seq:
+ *     include?(number) -> true or false
+ *
+ * Complexity: O(lg n)
+ */
+static VALUE sorted_index_include(VALUE self, VALUE query) {
+	sorted_index *index = get_initialized_index(self);
+	long pos = sorted_index_bound(index, query, 0);
+	if (pos == index->size) return Qfalse;
+	return rb_equal(RARRAY_AREF(index->values, pos), query);
+}
+
+/*
+ * call-seq:
+ *     lower_bound_many(numbers) -> [Integer, ...]
+ *
+ * Same as calling lower_bound for each of numbers, but the searches are interleaved so
+ * that the cache misses of several of them overlap.
+ */
+static VALUE sorted_index_lower_bound_many(VALUE self, VALUE queries) {
+	sorted_index *index = get_initialized_index(self);
+	long count, n = index->size, i, lane, lanes, pending;
+	unsigned long k[SI_BATCH];
+	long ikey[SI_BATCH];
+	double dkey[SI_BATCH];
+	VALUE result;
+
+	queries = rb_convert_type(queries, T_ARRAY, "Array", "to_ary");
+	count = RARRAY_LEN(queries);
+	result = rb_ary_new_capa(count);
+	for (i = 0; i < count; i += SI_BATCH) {
+		lanes = count - i < SI_BATCH ? count - i : SI_BATCH;
+		pending = 0;
+		for (lane = 0; lane < lanes; lane++) {
+			VALUE query = RARRAY_AREF(queries, i + lane);
+			k[lane] = 1;
+			if (index->integer && FIXNUM_P(query)) {
+				ikey[lane] = FIX2LONG(query);
+				pending++;
+			} else if (!index->integer && !index->inexact &&
+					double_is_exact(query, dkey[lane] = number_to_double(query))) {
+				pending++;
+			} else {
+				// Mixed queries, and any that a double would round, take the scalar path
+				ikey[lane] = sorted_index_bound(index, query, 0);
+				k[lane] = 0;
+			}
+		}
+		while (pending > 0) {
+			pending = 0;
+			for (lane = 0; lane < lanes; lane++) {
+				unsigned long slot = k[lane];
+				if (slot == 0 || slot > (unsigned long) n) continue;
+				if (index->integer) {
+					SI_PREFETCH(index->ikeys + slot * SI_PREFETCH_STRIDE(long));
+					k[lane] = 2 * slot + (index->ikeys[slot] < ikey[lane]);
+				} else {
+					SI_PREFETCH(index->dkeys + slot * SI_PREFETCH_STRIDE(double));
+					k[lane] = 2 * slot + (index->dkeys[slot] < dkey[lane]);
+				}
+				pending++;
+			}
+		}
+		for (lane = 0; lane < lanes; lane++) {
+			long pos;
+			if (k[lane] == 0) {
+				pos = ikey[lane];
+			} else {
+				long slot = eytz_unwind(k[lane]);
+				pos = slot ? index->positions[slot] : n;
+			}
+			rb_ary_push(result, LONG2NUM(pos));
+		}
+	}
+	return result;
+}
+
+static VALUE sorted_index_aref(VALUE self, VALUE i) {
+	return rb_ary_entry(get_initialized_index(self)->values, NUM2LONG(i));
+}
+
+static VALUE sorted_index_size(VALUE self) {
+	return LONG2NUM(get_initialized_index(self)->size);
+}
+
+static VALUE sorted_index_to_a(VALUE self) {
+	return rb_ary_dup(get_initialized_index(self)->values);
+}
+
+static VALUE cSortedIndex;
+
+void Init_sorted_index(VALUE mSearch) {
+	id_cmp = rb_intern("<=>");
+	id_eq = rb_intern("==");
+	cSortedIndex = rb_define_class_under(mSearch, "SortedIndex", rb_cObject);
+	rb_define_alloc_func(cSortedIndex, sorted_index_alloc);
+	rb_define_method(cSortedIndex, "initialize", sorted_index_init, 1);
+	rb_define_method(cSortedIndex, "lower_bound", sorted_index_lower_bound, 1);
+	rb_define_alias(cSortedIndex, "rank", "lower_bound");
+	rb_define_method(cSortedIndex, "upper_bound", sorted_index_upper_bound, 1);
+	rb_define_method(cSortedIndex, "include?", sorted_index_include, 1);
+	rb_define_method(cSortedIndex, "lower_bound_many", sorted_index_lower_bound_many, 1);
+	rb_define_method(cSortedIndex, "[]", sorted_index_aref, 1);
+	rb_define_method(cSortedIndex, "size", sorted_index_size, 0);
+	rb_define_alias(cSortedIndex, "length", "size");
+	rb_define_method(cSortedIndex, "to_a", sorted_index_to_a, 0);
+}
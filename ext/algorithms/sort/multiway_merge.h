@@ -0,0 +1,105 @@
+/*
+ * Stable multiway merge of sorted runs, as a template.
+ *
+ * Define MWAY_NAME, MWAY_TYPE, MWAY_KEY(x) (a uint64_t in the desired order) and
+ * MWAY_VALUE(x) (the VALUE to emit) before including this file. It defines
+ *
+ *   MWAY_NAME_split(runs, lens, k, rank, pos)  - pos[i]: how many elements of run i belong
+ *                                                to the first rank elements of the merge
+ *   MWAY_NAME_merge(runs, from, to, k, heap, out) - merges runs[i][from[i]...to[i]] into out
+ *
+ * Ties go to the lower numbered run, so merging runs that are consecutive slices of the
+ * input keeps the merge stable, and independent splits of the same runs agree with each
+ * other; this is what lets every output partition be merged by a different thread.
+ */
+
+#define MWAY_CAT2(a, b) a##_##b
+#define MWAY_CAT(a, b) MWAY_CAT2(a, b)
+#define MWAY_FN(suffix) MWAY_CAT(MWAY_NAME, suffix)
+
+// Number of elements of run with key < key (or <= key when upper is set)
+static long MWAY_FN(bound)(const MWAY_TYPE *run, long len, uint64_t key, int upper) {
+	long lo = 0, hi = len;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		uint64_t k = MWAY_KEY(run[mid]);
+		if (k < key || (upper && k == key)) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static void MWAY_FN(split)(MWAY_TYPE **runs, const long *lens, long k, long rank, long *pos) {
+	uint64_t lo = 0, hi = UINT64_MAX, key;
+	long i, total = 0, below = 0, remaining;
+
+	for (i = 0; i < k; i++) total += lens[i];
+	if (rank >= total) {
+		for (i = 0; i < k; i++) pos[i] = lens[i];
+		return;
+	}
+	// key = the rank-th smallest key: the smallest key with more than rank keys <= it
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		long count = 0;
+		for (i = 0; i < k; i++) count += MWAY_FN(bound)(runs[i], lens[i], mid, 1);
+		if (count > rank) hi = mid;
+		else lo = mid + 1;
+	}
+	key = lo;
+	for (i = 0; i < k; i++) {
+		pos[i] = MWAY_FN(bound)(runs[i], lens[i], key, 0);
+		below += pos[i];
+	}
+	// Hand out the keys equal to key in run order
+	remaining = rank - below;
+	for (i = 0; i < k && remaining > 0; i++) {
+		long equal = MWAY_FN(bound)(runs[i], lens[i], key, 1) - pos[i];
+		long take = equal < remaining ? equal : remaining;
+		pos[i] += take;
+		remaining -= take;
+	}
+}
+
+static inline int MWAY_FN(before)(MWAY_TYPE **runs, const long *at, long a, long b) {
+	uint64_t ka = MWAY_KEY(runs[a][at[a]]), kb = MWAY_KEY(runs[b][at[b]]);
+	return ka < kb || (ka == kb && a < b);
+}
+
+static void MWAY_FN(sift_down)(MWAY_TYPE **runs, const long *at, long *heap, long size, long i) {
+	long top = heap[i], child;
+	while ((child = 2 * i + 1) < size) {
+		if (child + 1 < size && MWAY_FN(before)(runs, at, heap[child + 1], heap[child])) child++;
+		if (!MWAY_FN(before)(runs, at, heap[child], top)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = top;
+}
+
+// from is advanced in place; heap needs room for k entries
+static void MWAY_FN(merge)(MWAY_TYPE **runs, long *from, const long *to, long k, long *heap, VALUE *out) {
+	long size = 0, i;
+	for (i = 0; i < k; i++) {
+		if (from[i] < to[i]) heap[size++] = i;
+	}
+	for (i = size / 2 - 1; i >= 0; i--) MWAY_FN(sift_down)(runs, from, heap, size, i);
+	while (size > 1) {
+		long run = heap[0];
+		*out++ = MWAY_VALUE(runs[run][from[run]]);
+		if (++from[run] == to[run]) heap[0] = heap[--size];
+		MWAY_FN(sift_down)(runs, from, heap, size, 0);
+	}
+	if (size == 1) {
+		long run = heap[0];
+		while (from[run] < to[run]) *out++ = MWAY_VALUE(runs[run][from[run]++]);
+	}
+}
+
+#undef MWAY_FN
+#undef MWAY_CAT
+#undef MWAY_CAT2
+#undef MWAY_NAME
+#undef MWAY_TYPE
+#undef MWAY_KEY
+#undef MWAY_VALUE
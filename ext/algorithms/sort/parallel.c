@@ -0,0 +1,250 @@
+#include "sort.h"
+
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <unistd.h>
+
+#define MWAY_NAME mway_fixnum
+#define MWAY_TYPE uint64_t
+#define MWAY_KEY(x) (x)
+#define MWAY_VALUE(x) sort_fixnum_value(x)
+#include "multiway_merge.h"
+
+#define MWAY_NAME mway_pairs
+#define MWAY_TYPE sort_pair
+#define MWAY_KEY(x) ((x).key)
+#define MWAY_VALUE(x) ((x).value)
+#include "multiway_merge.h"
+
+/*
+ * Parallel sort of Fixnum and Float arrays.
+ *
+ * The keys are unpacked into a native buffer and cut into one chunk per thread. Each
+ * thread radix sorts its chunk, then merges one equal-sized slice of the output, whose
+ * boundaries it finds by splitting all sorted chunks at the same global ranks. The whole
+ * job runs without the GVL; only unpacking and the final copy back into the Array hold it.
+ */
+
+#define PAR_MAX_THREADS 256
+// Smallest chunk worth a thread of its own
+#define PAR_MIN_CHUNK 65536
+
+typedef struct {
+	enum sort_kind kind;
+	long n;
+	long num_threads;
+	void *elements;    // uint64_t keys or sort_pairs
+	void *tmp;         // same size as elements; reused for the merged VALUEs
+	long *bounds;      // chunk t is [bounds[t], bounds[t + 1])
+	long *scratch;     // 4 * num_threads longs per thread
+	volatile int cancel;
+} par_job;
+
+typedef struct {
+	par_job *job;
+	long index;
+	void (*phase)(par_job *job, long t);
+} par_worker;
+
+static void par_sort_chunk(par_job *job, long t) {
+	long from = job->bounds[t], len = job->bounds[t + 1] - from;
+	if (job->kind == SORT_FIXNUM) {
+		sort_fixnum_keys((uint64_t *) job->elements + from, (uint64_t *) job->tmp + from, len);
+	} else {
+		sort_float_pairs((sort_pair *) job->elements + from, (sort_pair *) job->tmp + from, len);
+	}
+}
+
+static void par_merge_slice(par_job *job, long t) {
+	long k = job->num_threads, i;
+	long *lens = job->scratch + 4 * k * t, *from = lens + k, *to = from + k, *heap = to + k;
+	long rank_from = job->n * t / k, rank_to = job->n * (t + 1) / k;
+	VALUE *out = (VALUE *) job->tmp + rank_from;
+
+	for (i = 0; i < k; i++) lens[i] = job->bounds[i + 1] - job->bounds[i];
+	if (job->kind == SORT_FIXNUM) {
+		uint64_t *runs[PAR_MAX_THREADS];
+		for (i = 0; i < k; i++) runs[i] = (uint64_t *) job->elements + job->bounds[i];
+		mway_fixnum_split(runs, lens, k, rank_from, from);
+		mway_fixnum_split(runs, lens, k, rank_to, to);
+		mway_fixnum_merge(runs, from, to, k, heap, out);
+	} else {
+		sort_pair *runs[PAR_MAX_THREADS];
+		for (i = 0; i < k; i++) runs[i] = (sort_pair *) job->elements + job->bounds[i];
+		mway_pairs_split(runs, lens, k, rank_from, from);
+		mway_pairs_split(runs, lens, k, rank_to, to);
+		mway_pairs_merge(runs, from, to, k, heap, out);
+	}
+}
+
+static void* par_worker_run(void *arg) {
+	par_worker *w = arg;
+	if (!w->job->cancel) w->phase(w->job, w->index);
+	return NULL;
+}
+
+// Runs phase for every chunk, one thread each, and waits for all of them
+static void par_run_phase(par_job *job, par_worker *workers, void (*phase)(par_job *job, long t)) {
+	long t;
+#ifdef HAVE_PTHREAD_H
+	pthread_t threads[PAR_MAX_THREADS];
+	char started[PAR_MAX_THREADS];
+	for (t = 0; t < job->num_threads; t++) {
+		workers[t].phase = phase;
+		started[t] = 0;
+	}
+	for (t = 1; t < job->num_threads; t++) {
+		started[t] = pthread_create(&threads[t], NULL, par_worker_run, &workers[t]) == 0;
+	}
+	par_worker_run(&workers[0]);
+	for (t = 1; t < job->num_threads; t++) {
+		if (started[t]) pthread_join(threads[t], NULL);
+		else par_worker_run(&workers[t]);
+	}
+#else
+	for (t = 0; t < job->num_threads; t++) {
+		workers[t].phase = phase;
+		par_worker_run(&workers[t]);
+	}
+#endif
+}
+
+static void* par_job_run(void *arg) {
+	par_job *job = arg;
+	par_worker workers[PAR_MAX_THREADS];
+	long t;
+	for (t = 0; t < job->num_threads; t++) {
+		workers[t].job = job;
+		workers[t].index = t;
+	}
+	par_run_phase(job, workers, par_sort_chunk);
+	par_run_phase(job, workers, par_merge_slice);
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void par_job_cancel(void *arg) {
+	par_job *job = arg;
+	job->cancel = 1;
+}
+#endif
+
+static long default_thread_count(long n) {
+	long cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+#endif
+	if (cpus > n / PAR_MIN_CHUNK + 1) cpus = n / PAR_MIN_CHUNK + 1;
+	return cpus;
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Sort.parallel_sort(array, threads: nil) -> array
+ *
+ * Sorts array in place, splitting the work across native threads that run without the
+ * GVL. threads defaults to the number of online processors, scaled down for arrays too
+ * small to be worth it. Only Arrays of Fixnums or of Floats are sorted in parallel; Arrays
+ * of Strings fall back to native_sort! and anything else to Array#sort!. Stable.
+ *
+ * Complexity: O(n / threads) per thread for chunk sorting, plus O(n lg threads / threads)
+ * for the merge
+ *
+ *   Algorithms::Sort.parallel_sort([5, 4, 3, 1, 2], threads: 2) #=> [1, 2, 3, 4, 5]
+ */
+static VALUE sort_parallel_sort(int argc, VALUE *argv, VALUE self) {
+	VALUE ary, opts, snapshot = Qnil;
+	VALUE kwargs[1] = { Qundef };
+	ID kwarg_ids[1];
+	VALUE elements_v = 0, tmp_v = 0, bounds_v = 0, scratch_v = 0;
+	enum sort_kind kind;
+	long n, i, t, num_threads, elem_size;
+	int presorted;
+	par_job job;
+
+	rb_scan_args(argc, argv, "1:", &ary, &opts);
+	kwarg_ids[0] = rb_intern("threads");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 1, kwargs);
+	Check_Type(ary, T_ARRAY);
+
+	n = RARRAY_LEN(ary);
+	if (kwargs[0] != Qundef && !NIL_P(kwargs[0])) {
+		num_threads = NUM2LONG(kwargs[0]);
+		if (num_threads < 1) rb_raise(rb_eArgError, "threads must be positive");
+	} else {
+		num_threads = default_thread_count(n);
+	}
+	if (num_threads > PAR_MAX_THREADS) num_threads = PAR_MAX_THREADS;
+	if (num_threads > n / 2) num_threads = n / 2 > 0 ? n / 2 : 1;
+
+	if (n < 2) return ary;
+	kind = sort_classify(ary);
+	if (kind == SORT_STRING || (kind != SORT_OTHER && num_threads == 1)) return sort_native_sort(self, ary);
+	if (kind == SORT_OTHER) return rb_ary_sort_bang(ary);
+	rb_ary_modify(ary);
+	presorted = sort_presorted(ary, kind);
+	if (presorted > 0) return ary;
+	if (presorted < 0) return rb_ary_reverse(ary);
+
+	elem_size = kind == SORT_FIXNUM ? sizeof(uint64_t) : sizeof(sort_pair);
+	job.kind = kind;
+	job.n = n;
+	job.num_threads = num_threads;
+	job.elements = ALLOCV(elements_v, elem_size * n);
+	job.tmp = ALLOCV(tmp_v, elem_size * n);
+	job.bounds = ALLOCV_N(long, bounds_v, num_threads + 1);
+	job.scratch = ALLOCV_N(long, scratch_v, 4 * num_threads * num_threads);
+	for (t = 0; t <= num_threads; t++) job.bounds[t] = n * t / num_threads;
+	if (kind == SORT_FIXNUM) {
+		uint64_t *keys = job.elements;
+		for (i = 0; i < n; i++) keys[i] = sort_fixnum_key(RARRAY_AREF(ary, i));
+	} else {
+		sort_pair *pairs = job.elements;
+		// Heap allocated Floats must stay alive while the buffers are the only other reference
+		snapshot = rb_ary_subseq(ary, 0, n);
+		for (i = 0; i < n; i++) {
+			VALUE v = RARRAY_AREF(ary, i);
+			pairs[i].key = sort_double_key(RFLOAT_VALUE(v));
+			pairs[i].value = v;
+		}
+	}
+
+	do {
+		job.cancel = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(par_job_run, &job, par_job_cancel, &job);
+#else
+		par_job_run(&job);
+#endif
+		// Raises if the interrupt was meant to stop us; otherwise the chunks still hold the
+		// same elements and the job can simply be run again
+		if (job.cancel) rb_thread_check_ints();
+	} while (job.cancel);
+
+	// Other Ruby threads could run while the GVL was released
+	if (RARRAY_LEN(ary) != n) rb_raise(rb_eRuntimeError, "array modified during sort");
+	rb_ary_modify(ary);
+	if (kind == SORT_FIXNUM) {
+		RARRAY_PTR_USE(ary, ptr, {
+			memcpy(ptr, job.tmp, sizeof(VALUE) * n);
+		});
+	} else {
+		// The array may have let go of its Floats meanwhile, so go through the write barrier
+		for (i = 0; i < n; i++) RARRAY_ASET(ary, i, ((VALUE *) job.tmp)[i]);
+	}
+	ALLOCV_END(scratch_v);
+	ALLOCV_END(bounds_v);
+	ALLOCV_END(tmp_v);
+	ALLOCV_END(elements_v);
+	RB_GC_GUARD(snapshot);
+	return ary;
+}
+
+void Init_parallel_sort(VALUE mSort) {
+	rb_define_singleton_method(mSort, "parallel_sort", sort_parallel_sort, -1);
+}
@@ -0,0 +1,243 @@
+/*
+ * Pattern-defeating quicksort (Orson Peters, 2016), as a template.
+ *
+ * Define PDQ_NAME, PDQ_TYPE and PDQ_LESS(a, b) before including this file; it defines
+ * PDQ_NAME(array, n) and undefines the parameters again, so it can be included once per
+ * element type.
+ *
+ * Median-of-3 (ninther for large ranges) pivots, insertion sort for small ranges, and a
+ * partial insertion sort when a partition is found to need no swaps give linear time on
+ * sorted, reversed and similar inputs. Unbalanced partitions shuffle a few elements to
+ * break adversarial patterns, and too many of them switch to heapsort, bounding the
+ * worst case at O(n lg n).
+ */
+
+#define PDQ_CAT2(a, b) a##_##b
+#define PDQ_CAT(a, b) PDQ_CAT2(a, b)
+#define PDQ_FN(suffix) PDQ_CAT(PDQ_NAME, suffix)
+
+#ifndef PDQ_INSERTION_SORT_THRESHOLD
+#define PDQ_INSERTION_SORT_THRESHOLD 24
+#define PDQ_NINTHER_THRESHOLD 128
+#define PDQ_PARTIAL_INSERTION_SORT_LIMIT 8
+#endif
+
+static inline void PDQ_FN(swap)(PDQ_TYPE *a, PDQ_TYPE *b) {
+	PDQ_TYPE tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static inline void PDQ_FN(sort2)(PDQ_TYPE *a, PDQ_TYPE *b) {
+	if (PDQ_LESS(*b, *a)) PDQ_FN(swap)(a, b);
+}
+
+static inline void PDQ_FN(sort3)(PDQ_TYPE *a, PDQ_TYPE *b, PDQ_TYPE *c) {
+	PDQ_FN(sort2)(a, b);
+	PDQ_FN(sort2)(b, c);
+	PDQ_FN(sort2)(a, b);
+}
+
+// Stable, so it is also used on its own for small inputs that must keep equal keys in order
+static void PDQ_FN(insertion_sort)(PDQ_TYPE *begin, PDQ_TYPE *end) {
+	PDQ_TYPE *cur;
+	if (begin == end) return;
+	for (cur = begin + 1; cur != end; cur++) {
+		PDQ_TYPE *sift = cur, *sift_1 = cur - 1;
+		if (PDQ_LESS(*sift, *sift_1)) {
+			PDQ_TYPE tmp = *sift;
+			do {
+				*sift-- = *sift_1;
+			} while (sift != begin && PDQ_LESS(tmp, *--sift_1));
+			*sift = tmp;
+		}
+	}
+}
+
+// Assumes *(begin - 1) is not greater than any element in [begin, end)
+static void PDQ_FN(unguarded_insertion_sort)(PDQ_TYPE *begin, PDQ_TYPE *end) {
+	PDQ_TYPE *cur;
+	if (begin == end) return;
+	for (cur = begin + 1; cur != end; cur++) {
+		PDQ_TYPE *sift = cur, *sift_1 = cur - 1;
+		if (PDQ_LESS(*sift, *sift_1)) {
+			PDQ_TYPE tmp = *sift;
+			do {
+				*sift-- = *sift_1;
+			} while (PDQ_LESS(tmp, *--sift_1));
+			*sift = tmp;
+		}
+	}
+}
+
+// Gives up (returning 0) after a few moves so that it is cheap when the guess is wrong
+static int PDQ_FN(partial_insertion_sort)(PDQ_TYPE *begin, PDQ_TYPE *end) {
+	PDQ_TYPE *cur;
+	long limit = 0;
+	if (begin == end) return 1;
+	for (cur = begin + 1; cur != end; cur++) {
+		PDQ_TYPE *sift = cur, *sift_1 = cur - 1;
+		if (limit > PDQ_PARTIAL_INSERTION_SORT_LIMIT) return 0;
+		if (PDQ_LESS(*sift, *sift_1)) {
+			PDQ_TYPE tmp = *sift;
+			do {
+				*sift-- = *sift_1;
+			} while (sift != begin && PDQ_LESS(tmp, *--sift_1));
+			*sift = tmp;
+			limit += cur - sift;
+		}
+	}
+	return 1;
+}
+
+static void PDQ_FN(sift_down)(PDQ_TYPE *a, long i, long n) {
+	PDQ_TYPE tmp = a[i];
+	long child;
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && PDQ_LESS(a[child], a[child + 1])) child++;
+		if (!PDQ_LESS(tmp, a[child])) break;
+		a[i] = a[child];
+		i = child;
+	}
+	a[i] = tmp;
+}
+
+static void PDQ_FN(heapsort)(PDQ_TYPE *begin, PDQ_TYPE *end) {
+	long n = end - begin, i;
+	for (i = n / 2 - 1; i >= 0; i--) PDQ_FN(sift_down)(begin, i, n);
+	for (i = n - 1; i > 0; i--) {
+		PDQ_FN(swap)(begin, begin + i);
+		PDQ_FN(sift_down)(begin, 0, i);
+	}
+}
+
+/*
+ * Partitions [begin, end) around *begin, putting elements equal to the pivot on the right.
+ * Sets *already_partitioned when no swaps were needed.
+ */
+static PDQ_TYPE* PDQ_FN(partition_right)(PDQ_TYPE *begin, PDQ_TYPE *end, int *already_partitioned) {
+	PDQ_TYPE pivot = *begin, *first = begin, *last = end, *pivot_pos;
+
+	while (PDQ_LESS(*++first, pivot));
+	if (first - 1 == begin) {
+		while (first < last && !PDQ_LESS(*--last, pivot));
+	} else {
+		while (!PDQ_LESS(*--last, pivot));
+	}
+	*already_partitioned = first >= last;
+	while (first < last) {
+		PDQ_FN(swap)(first, last);
+		while (PDQ_LESS(*++first, pivot));
+		while (!PDQ_LESS(*--last, pivot));
+	}
+	pivot_pos = first - 1;
+	*begin = *pivot_pos;
+	*pivot_pos = pivot;
+	return pivot_pos;
+}
+
+// Puts elements equal to the pivot on the left; used when many keys repeat
+static PDQ_TYPE* PDQ_FN(partition_left)(PDQ_TYPE *begin, PDQ_TYPE *end) {
+	PDQ_TYPE pivot = *begin, *first = begin, *last = end, *pivot_pos;
+
+	while (PDQ_LESS(pivot, *--last));
+	if (last + 1 == end) {
+		while (first < last && !PDQ_LESS(pivot, *++first));
+	} else {
+		while (!PDQ_LESS(pivot, *++first));
+	}
+	while (first < last) {
+		PDQ_FN(swap)(first, last);
+		while (PDQ_LESS(pivot, *--last));
+		while (!PDQ_LESS(pivot, *++first));
+	}
+	pivot_pos = last;
+	*begin = *pivot_pos;
+	*pivot_pos = pivot;
+	return pivot_pos;
+}
+
+static void PDQ_FN(loop)(PDQ_TYPE *begin, PDQ_TYPE *end, int bad_allowed, int leftmost) {
+	for (;;) {
+		long size = end - begin, s2, l_size, r_size;
+		PDQ_TYPE *pivot_pos;
+		int already_partitioned;
+
+		if (size < PDQ_INSERTION_SORT_THRESHOLD) {
+			if (leftmost) PDQ_FN(insertion_sort)(begin, end);
+			else PDQ_FN(unguarded_insertion_sort)(begin, end);
+			return;
+		}
+
+		s2 = size / 2;
+		if (size > PDQ_NINTHER_THRESHOLD) {
+			PDQ_FN(sort3)(begin, begin + s2, end - 1);
+			PDQ_FN(sort3)(begin + 1, begin + (s2 - 1), end - 2);
+			PDQ_FN(sort3)(begin + 2, begin + (s2 + 1), end - 3);
+			PDQ_FN(sort3)(begin + (s2 - 1), begin + s2, begin + (s2 + 1));
+			PDQ_FN(swap)(begin, begin + s2);
+		} else {
+			PDQ_FN(sort3)(begin + s2, begin, end - 1);
+		}
+
+		// If the pivot equals the element before this range, everything equal to it is
+		// already in place; skip past it
+		if (!leftmost && !PDQ_LESS(*(begin - 1), *begin)) {
+			begin = PDQ_FN(partition_left)(begin, end) + 1;
+			continue;
+		}
+
+		pivot_pos = PDQ_FN(partition_right)(begin, end, &already_partitioned);
+		l_size = pivot_pos - begin;
+		r_size = end - (pivot_pos + 1);
+
+		if (l_size < size / 8 || r_size < size / 8) {
+			if (--bad_allowed == 0) {
+				PDQ_FN(heapsort)(begin, end);
+				return;
+			}
+			if (l_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+				PDQ_FN(swap)(begin, begin + l_size / 4);
+				PDQ_FN(swap)(pivot_pos - 1, pivot_pos - l_size / 4);
+				if (l_size > PDQ_NINTHER_THRESHOLD) {
+					PDQ_FN(swap)(begin + 1, begin + (l_size / 4 + 1));
+					PDQ_FN(swap)(begin + 2, begin + (l_size / 4 + 2));
+					PDQ_FN(swap)(pivot_pos - 2, pivot_pos - (l_size / 4 + 1));
+					PDQ_FN(swap)(pivot_pos - 3, pivot_pos - (l_size / 4 + 2));
+				}
+			}
+			if (r_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+				PDQ_FN(swap)(pivot_pos + 1, pivot_pos + (1 + r_size / 4));
+				PDQ_FN(swap)(end - 1, end - r_size / 4);
+				if (r_size > PDQ_NINTHER_THRESHOLD) {
+					PDQ_FN(swap)(pivot_pos + 2, pivot_pos + (2 + r_size / 4));
+					PDQ_FN(swap)(pivot_pos + 3, pivot_pos + (3 + r_size / 4));
+					PDQ_FN(swap)(end - 2, end - (1 + r_size / 4));
+					PDQ_FN(swap)(end - 3, end - (2 + r_size / 4));
+				}
+			}
+		} else if (already_partitioned
+				&& PDQ_FN(partial_insertion_sort)(begin, pivot_pos)
+				&& PDQ_FN(partial_insertion_sort)(pivot_pos + 1, end)) {
+			return;
+		}
+
+		PDQ_FN(loop)(begin, pivot_pos, bad_allowed, leftmost);
+		begin = pivot_pos + 1;
+		leftmost = 0;
+	}
+}
+
+static void PDQ_NAME(PDQ_TYPE *a, long n) {
+	int log2 = 0;
+	long size = n;
+	while (size >>= 1) log2++;
+	if (n > 1) PDQ_FN(loop)(a, a + n, log2 > 0 ? log2 : 1, 1);
+}
+
+#undef PDQ_FN
+#undef PDQ_CAT
+#undef PDQ_CAT2
+#undef PDQ_NAME
+#undef PDQ_TYPE
+#undef PDQ_LESS
@@ -0,0 +1,45 @@
+/*
+ * LSD radix sort on 64 bit keys, as a template.
+ *
+ * Define RADIX_NAME, RADIX_TYPE and RADIX_KEY(x) (yielding a uint64_t whose unsigned order
+ * is the desired order) before including this file; it defines
+ * RADIX_NAME(array, tmp, n), where tmp has room for n elements.
+ *
+ * All eight byte histograms are built in one pass, and passes in which every key has the
+ * same byte are skipped, so narrow key ranges cost proportionally fewer passes. The sort
+ * is stable.
+ */
+
+static void RADIX_NAME(RADIX_TYPE *a, RADIX_TYPE *tmp, long n) {
+	long counts[8][256];
+	RADIX_TYPE *src = a, *dst = tmp, *swap;
+	long i, pass;
+
+	if (n < 2) return;
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < n; i++) {
+		uint64_t key = RADIX_KEY(a[i]);
+		for (pass = 0; pass < 8; pass++) counts[pass][(key >> (8 * pass)) & 0xff]++;
+	}
+	for (pass = 0; pass < 8; pass++) {
+		long *count = counts[pass], offset = 0, c;
+		int shift = 8 * pass;
+		if (count[(RADIX_KEY(a[0]) >> shift) & 0xff] == n) continue;
+		for (c = 0; c < 256; c++) {
+			long next = offset + count[c];
+			count[c] = offset;
+			offset = next;
+		}
+		for (i = 0; i < n; i++) {
+			dst[count[(RADIX_KEY(src[i]) >> shift) & 0xff]++] = src[i];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != a) memcpy(a, src, sizeof(RADIX_TYPE) * n);
+}
+
+#undef RADIX_NAME
+#undef RADIX_TYPE
+#undef RADIX_KEY
@@ -0,0 +1,150 @@
+#include "sort.h"
+
+#define SEL_NAME select_fixnum
+#define SEL_TYPE uint64_t
+#define SEL_LESS(a, b) ((a) < (b))
+#include "select.h"
+
+#define SEL_NAME select_pairs
+#define SEL_TYPE sort_pair
+#define SEL_LESS(a, b) ((a).key < (b).key)
+#include "select.h"
+
+/*
+ * Native selection for Arrays of only Fixnums or only Floats. Each function returns nil
+ * for other Arrays so that the Ruby side can fall back to <=> or a key block.
+ */
+
+typedef struct {
+	enum sort_kind kind;
+	long n;
+	uint64_t *keys;
+	sort_pair *pairs;
+} select_buf;
+
+// Unpacks ary into buf, with room for extra more elements; returns 0 if ary is not a
+// numeric Array. Nothing may raise between this and select_free.
+static int select_unpack(VALUE ary, select_buf *buf, long extra) {
+	long i;
+	if (!RB_TYPE_P(ary, T_ARRAY) || RARRAY_LEN(ary) == 0) return 0;
+	buf->kind = sort_classify(ary);
+	if (buf->kind != SORT_FIXNUM && buf->kind != SORT_FLOAT) return 0;
+	buf->n = RARRAY_LEN(ary);
+	buf->keys = NULL;
+	buf->pairs = NULL;
+	if (buf->kind == SORT_FIXNUM) {
+		buf->keys = ALLOC_N(uint64_t, buf->n + extra);
+		for (i = 0; i < buf->n; i++) buf->keys[i] = sort_fixnum_key(RARRAY_AREF(ary, i));
+	} else {
+		buf->pairs = ALLOC_N(sort_pair, buf->n + extra);
+		for (i = 0; i < buf->n; i++) {
+			VALUE v = RARRAY_AREF(ary, i);
+			buf->pairs[i].key = sort_double_key(RFLOAT_VALUE(v));
+			buf->pairs[i].value = v;
+		}
+	}
+	return 1;
+}
+
+static void select_free(select_buf *buf) {
+	xfree(buf->keys);
+	xfree(buf->pairs);
+}
+
+static VALUE select_value(const select_buf *buf, const void *elements, long i) {
+	if (buf->kind == SORT_FIXNUM) return sort_fixnum_value(((const uint64_t *) elements)[i]);
+	return ((const sort_pair *) elements)[i].value;
+}
+
+static void select_write_back(VALUE ary, const select_buf *buf) {
+	long i;
+	const void *elements = buf->kind == SORT_FIXNUM ? (const void *) buf->keys : (const void *) buf->pairs;
+	RARRAY_PTR_USE(ary, ptr, {
+		for (i = 0; i < buf->n; i++) ptr[i] = select_value(buf, elements, i);
+	});
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Sort.native_nth_element!(array, k) -> element or nil
+ *
+ * Native version of Algorithms::Sort.nth_element for Arrays of only Fixnums or only
+ * Floats; returns nil for other Arrays.
+ */
+static VALUE sort_native_nth_element(VALUE self, VALUE ary, VALUE rb_k) {
+	select_buf buf;
+	long k = NUM2LONG(rb_k);
+
+	if (!RB_TYPE_P(ary, T_ARRAY)) return Qnil;
+	if (k < 0 || k >= RARRAY_LEN(ary)) rb_raise(rb_eIndexError, "index %ld out of range for %ld elements", k, RARRAY_LEN(ary));
+	rb_ary_modify(ary);
+	if (!select_unpack(ary, &buf, 0)) return Qnil;
+	if (buf.kind == SORT_FIXNUM) select_fixnum_nth(buf.keys, buf.n, k);
+	else select_pairs_nth(buf.pairs, buf.n, k);
+	select_write_back(ary, &buf);
+	select_free(&buf);
+	return RARRAY_AREF(ary, k);
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Sort.native_partial_sort!(array, k) -> array or nil
+ *
+ * Native version of Algorithms::Sort.partial_sort for Arrays of only Fixnums or only
+ * Floats; returns nil for other Arrays.
+ */
+static VALUE sort_native_partial_sort(VALUE self, VALUE ary, VALUE rb_k) {
+	select_buf buf;
+	long k = NUM2LONG(rb_k);
+
+	if (k < 0) rb_raise(rb_eArgError, "k must not be negative");
+	if (!RB_TYPE_P(ary, T_ARRAY)) return Qnil;
+	rb_ary_modify(ary);
+	if (!select_unpack(ary, &buf, k < RARRAY_LEN(ary) ? k : RARRAY_LEN(ary))) return Qnil;
+	if (k > buf.n) k = buf.n;
+	if (buf.kind == SORT_FIXNUM) {
+		if (k < buf.n) select_fixnum_nth(buf.keys, buf.n, k);
+		sort_fixnum_keys(buf.keys, buf.keys + buf.n, k);
+	} else {
+		if (k < buf.n) select_pairs_nth(buf.pairs, buf.n, k);
+		sort_float_pairs(buf.pairs, buf.pairs + buf.n, k);
+	}
+	select_write_back(ary, &buf);
+	select_free(&buf);
+	return ary;
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Sort.native_top_k(array, k) -> [element, ...] or nil
+ *
+ * Native version of Algorithms::Sort.top_k without a block, for Arrays of only Fixnums or
+ * only Floats; returns nil for other Arrays.
+ */
+static VALUE sort_native_top_k(VALUE self, VALUE ary, VALUE rb_k) {
+	select_buf buf;
+	long k = NUM2LONG(rb_k), count, i;
+	VALUE result;
+
+	if (k < 0) rb_raise(rb_eArgError, "k must not be negative");
+	if (!select_unpack(ary, &buf, k < RARRAY_LEN(ary) ? k : RARRAY_LEN(ary))) return Qnil;
+	if (buf.kind == SORT_FIXNUM) {
+		uint64_t *heap = buf.keys + buf.n;
+		count = select_fixnum_top(buf.keys, buf.n, k, heap);
+		result = rb_ary_new_capa(count);
+		for (i = 0; i < count; i++) rb_ary_push(result, sort_fixnum_value(heap[i]));
+	} else {
+		sort_pair *heap = buf.pairs + buf.n;
+		count = select_pairs_top(buf.pairs, buf.n, k, heap);
+		result = rb_ary_new_capa(count);
+		for (i = 0; i < count; i++) rb_ary_push(result, heap[i].value);
+	}
+	select_free(&buf);
+	return result;
+}
+
+void Init_select(VALUE mSort) {
+	rb_define_singleton_method(mSort, "native_nth_element!", sort_native_nth_element, 2);
+	rb_define_singleton_method(mSort, "native_partial_sort!", sort_native_partial_sort, 2);
+	rb_define_singleton_method(mSort, "native_top_k", sort_native_top_k, 2);
+}
@@ -0,0 +1,124 @@
+/*
+ * Selection kernels, as a template.
+ *
+ * Define SEL_NAME, SEL_TYPE and SEL_LESS(a, b) before including this file. It defines
+ *
+ *   SEL_NAME_nth(a, n, k)       - introselect: afterwards a[k] is the element a full sort
+ *                                 would put there, nothing before it is greater and
+ *                                 nothing after it is smaller
+ *   SEL_NAME_top(a, n, k, heap) - copies the k greatest elements of a into heap, greatest
+ *                                 first, using a bounded min-heap; returns how many
+ *
+ * Introselect partitions around a median-of-3 pivot, three ways so that runs of equal keys
+ * cost nothing, and switches to median-of-medians pivots once it has done 2 lg n rounds
+ * without finishing, which bounds the worst case at O(n).
+ */
+
+#define SEL_CAT2(a, b) a##_##b
+#define SEL_CAT(a, b) SEL_CAT2(a, b)
+#define SEL_FN(suffix) SEL_CAT(SEL_NAME, suffix)
+
+static inline void SEL_FN(swap)(SEL_TYPE *a, SEL_TYPE *b) {
+	SEL_TYPE tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void SEL_FN(insertion_sort)(SEL_TYPE *a, long n) {
+	long i, j;
+	for (i = 1; i < n; i++) {
+		SEL_TYPE tmp = a[i];
+		for (j = i; j > 0 && SEL_LESS(tmp, a[j - 1]); j--) a[j] = a[j - 1];
+		a[j] = tmp;
+	}
+}
+
+static long SEL_FN(median_of_3)(SEL_TYPE *a, long i, long j, long k) {
+	if (SEL_LESS(a[i], a[j])) {
+		if (SEL_LESS(a[j], a[k])) return j;
+		return SEL_LESS(a[i], a[k]) ? k : i;
+	}
+	if (SEL_LESS(a[i], a[k])) return i;
+	return SEL_LESS(a[j], a[k]) ? k : j;
+}
+
+static void SEL_FN(nth)(SEL_TYPE *a, long n, long k);
+
+// Moves the median of each group of five to the front and selects the median of those
+static long SEL_FN(median_of_medians)(SEL_TYPE *a, long n) {
+	long groups = 0, i;
+	for (i = 0; i < n; i += 5) {
+		long len = n - i < 5 ? n - i : 5;
+		SEL_FN(insertion_sort)(a + i, len);
+		SEL_FN(swap)(a + groups++, a + i + len / 2);
+	}
+	SEL_FN(nth)(a, groups, groups / 2);
+	return groups / 2;
+}
+
+static void SEL_FN(nth)(SEL_TYPE *a, long n, long k) {
+	long lo = 0, hi = n, size = n;
+	int budget = 0;
+	while (size >>= 1) budget += 2;
+
+	while (hi - lo > 16) {
+		long p, lt, gt, i;
+		SEL_TYPE pivot;
+		if (budget-- > 0) p = SEL_FN(median_of_3)(a, lo, lo + (hi - lo) / 2, hi - 1);
+		else p = lo + SEL_FN(median_of_medians)(a + lo, hi - lo);
+		pivot = a[p];
+
+		// [lo, lt) < pivot, [lt, i) == pivot, [gt, hi) > pivot
+		lt = lo;
+		gt = hi;
+		i = lo;
+		while (i < gt) {
+			if (SEL_LESS(a[i], pivot)) SEL_FN(swap)(a + lt++, a + i++);
+			else if (SEL_LESS(pivot, a[i])) SEL_FN(swap)(a + i, a + --gt);
+			else i++;
+		}
+		if (k < lt) hi = lt;
+		else if (k >= gt) lo = gt;
+		else return;
+	}
+	SEL_FN(insertion_sort)(a + lo, hi - lo);
+}
+
+static void SEL_FN(sift_down)(SEL_TYPE *heap, long size, long i) {
+	SEL_TYPE top = heap[i];
+	long child;
+	while ((child = 2 * i + 1) < size) {
+		if (child + 1 < size && SEL_LESS(heap[child + 1], heap[child])) child++;
+		if (!SEL_LESS(heap[child], top)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = top;
+}
+
+static long SEL_FN(top)(const SEL_TYPE *a, long n, long k, SEL_TYPE *heap) {
+	long size = 0, i;
+	if (k > n) k = n;
+	if (k <= 0) return 0;
+	for (i = 0; i < k; i++) heap[size++] = a[i];
+	for (i = size / 2 - 1; i >= 0; i--) SEL_FN(sift_down)(heap, size, i);
+	for (i = k; i < n; i++) {
+		if (SEL_LESS(heap[0], a[i])) {
+			heap[0] = a[i];
+			SEL_FN(sift_down)(heap, size, 0);
+		}
+	}
+	// Heapsort with a min-heap leaves the greatest element first
+	for (i = size - 1; i > 0; i--) {
+		SEL_FN(swap)(heap, heap + i);
+		SEL_FN(sift_down)(heap, i, 0);
+	}
+	return size;
+}
+
+#undef SEL_FN
+#undef SEL_CAT
+#undef SEL_CAT2
+#undef SEL_NAME
+#undef SEL_TYPE
+#undef SEL_LESS
@@ -0,0 +1,176 @@
+#include "sort.h"
+
+#define PDQ_NAME pdqsort_u64
+#define PDQ_TYPE uint64_t
+#define PDQ_LESS(a, b) ((a) < (b))
+#include "pdqsort.h"
+
+// Ties are broken by original index, which makes the unstable pdqsort stable
+static inline int string_pair_less(const sort_pair *a, const sort_pair *b) {
+	int cmp = sort_str_cmp(a->value, b->value);
+	return cmp < 0 || (cmp == 0 && a->key < b->key);
+}
+
+#define PDQ_NAME pdqsort_string_pairs
+#define PDQ_TYPE sort_pair
+#define PDQ_LESS(a, b) string_pair_less(&(a), &(b))
+#include "pdqsort.h"
+
+#define RADIX_NAME radix_sort_u64
+#define RADIX_TYPE uint64_t
+#define RADIX_KEY(x) (x)
+#include "radix.h"
+
+#define RADIX_NAME radix_sort_pairs
+#define RADIX_TYPE sort_pair
+#define RADIX_KEY(x) ((x).key)
+#include "radix.h"
+
+// Below this size a comparison sort beats the fixed cost of the radix histograms
+#define SORT_RADIX_THRESHOLD 256
+
+void sort_fixnum_keys(uint64_t *keys, uint64_t *tmp, long n) {
+	if (n < SORT_RADIX_THRESHOLD) pdqsort_u64(keys, n);
+	else radix_sort_u64(keys, tmp, n);
+}
+
+// Equal Floats may be distinct objects, so this has to be stable: always radix
+void sort_float_pairs(sort_pair *pairs, sort_pair *tmp, long n) {
+	radix_sort_pairs(pairs, tmp, n);
+}
+
+// pairs[i].key must hold the original index of pairs[i].value
+void sort_string_pairs(sort_pair *pairs, long n) {
+	pdqsort_string_pairs(pairs, n);
+}
+
+enum sort_kind sort_classify(VALUE ary) {
+	long i, n = RARRAY_LEN(ary);
+	VALUE first;
+
+	if (n == 0) return SORT_OTHER;
+	first = RARRAY_AREF(ary, 0);
+	if (FIXNUM_P(first)) {
+		for (i = 1; i < n; i++) {
+			if (!FIXNUM_P(RARRAY_AREF(ary, i))) return SORT_OTHER;
+		}
+		return SORT_FIXNUM;
+	}
+	if (RB_FLOAT_TYPE_P(first)) {
+		for (i = 0; i < n; i++) {
+			VALUE v = RARRAY_AREF(ary, i);
+			// NaN has no place in the order <=> defines
+			if (!RB_FLOAT_TYPE_P(v) || isnan(RFLOAT_VALUE(v))) return SORT_OTHER;
+		}
+		return SORT_FLOAT;
+	}
+	if (RB_TYPE_P(first, T_STRING)) {
+		for (i = 0; i < n; i++) {
+			VALUE v = RARRAY_AREF(ary, i);
+			// Subclasses may redefine <=>
+			if (!RB_TYPE_P(v, T_STRING) || rb_obj_class(v) != rb_cString) return SORT_OTHER;
+		}
+		return SORT_STRING;
+	}
+	return SORT_OTHER;
+}
+
+static int sort_value_cmp(enum sort_kind kind, VALUE a, VALUE b) {
+	switch (kind) {
+		case SORT_FIXNUM: {
+			long x = FIX2LONG(a), y = FIX2LONG(b);
+			return (x > y) - (x < y);
+		}
+		case SORT_FLOAT: {
+			double x = RFLOAT_VALUE(a), y = RFLOAT_VALUE(b);
+			return (x > y) - (x < y);
+		}
+		default:
+			return sort_str_cmp(a, b);
+	}
+}
+
+// 1 if ary is already in order, -1 if it is strictly descending, 0 otherwise
+int sort_presorted(VALUE ary, enum sort_kind kind) {
+	long i, n = RARRAY_LEN(ary);
+	int cmp = sort_value_cmp(kind, RARRAY_AREF(ary, 0), RARRAY_AREF(ary, 1));
+
+	if (cmp <= 0) {
+		for (i = 2; i < n; i++) {
+			if (sort_value_cmp(kind, RARRAY_AREF(ary, i - 1), RARRAY_AREF(ary, i)) > 0) return 0;
+		}
+		return 1;
+	}
+	for (i = 2; i < n; i++) {
+		if (sort_value_cmp(kind, RARRAY_AREF(ary, i - 1), RARRAY_AREF(ary, i)) <= 0) return 0;
+	}
+	return -1;
+}
+
+/*
+ * call-seq:
+ *     Algorithms::Sort.native_sort!(array) -> array or nil
+ *
+ * Sorts array in place if it holds only Fixnums, only Floats (no NaN) or only Strings,
+ * and returns it. Returns nil, leaving array untouched, for anything else. The sort is
+ * stable.
+ *
+ * Fixnums and Floats are radix sorted on their bits; Strings are sorted with
+ * pattern-defeating quicksort. Arrays that are already sorted or strictly descending are
+ * detected in one pass.
+ *
+ * Complexity: O(n) for numbers, O(n lg n) comparisons for Strings
+ */
+VALUE sort_native_sort(VALUE self, VALUE ary) {
+	enum sort_kind kind;
+	long n, i;
+	int presorted;
+
+	if (!RB_TYPE_P(ary, T_ARRAY)) return Qnil;
+	n = RARRAY_LEN(ary);
+	if (n < 2) return ary;
+	kind = sort_classify(ary);
+	if (kind == SORT_OTHER) return Qnil;
+	rb_ary_modify(ary);
+
+	presorted = sort_presorted(ary, kind);
+	if (presorted > 0) return ary;
+	if (presorted < 0) return rb_ary_reverse(ary);
+
+	if (kind == SORT_FIXNUM) {
+		uint64_t *keys = ALLOC_N(uint64_t, 2 * n);
+		for (i = 0; i < n; i++) keys[i] = sort_fixnum_key(RARRAY_AREF(ary, i));
+		sort_fixnum_keys(keys, keys + n, n);
+		RARRAY_PTR_USE(ary, ptr, {
+			for (i = 0; i < n; i++) ptr[i] = sort_fixnum_value(keys[i]);
+		});
+		xfree(keys);
+	} else {
+		sort_pair *pairs = ALLOC_N(sort_pair, kind == SORT_FLOAT ? 2 * n : n);
+		for (i = 0; i < n; i++) {
+			VALUE v = RARRAY_AREF(ary, i);
+			pairs[i].key = kind == SORT_FLOAT ? sort_double_key(RFLOAT_VALUE(v)) : (uint64_t) i;
+			pairs[i].value = v;
+		}
+		if (kind == SORT_FLOAT) sort_float_pairs(pairs, pairs + n, n);
+		else sort_string_pairs(pairs, n);
+		// Only reorders values the array already references, so no write barrier is needed
+		RARRAY_PTR_USE(ary, ptr, {
+			for (i = 0; i < n; i++) ptr[i] = pairs[i].value;
+		});
+		xfree(pairs);
+	}
+	return ary;
+}
+
+static VALUE mAlgorithms;
+static VALUE mSort;
+
+void Init_CSort() {
+	mAlgorithms = rb_define_module("Algorithms");
+	mSort = rb_define_module_under(mAlgorithms, "Sort");
+	rb_define_singleton_method(mSort, "native_sort!", sort_native_sort, 1);
+	Init_parallel_sort(mSort);
+	Init_select(mSort);
+	Init_stable_sort(mSort);
+}
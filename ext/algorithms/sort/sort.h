@@ -0,0 +1,65 @@
+#ifndef ALGORITHMS_SORT_H
+#define ALGORITHMS_SORT_H
+
+#include "ruby.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Shared pieces of the CSort kernels. Arrays that hold only Fixnums, only Floats or only
+ * Strings are unpacked into plain C buffers, sorted there, and written back; anything
+ * else is left to the Ruby implementations.
+ */
+
+enum sort_kind {
+	SORT_OTHER,
+	SORT_FIXNUM,
+	SORT_FLOAT,
+	SORT_STRING
+};
+
+// A Float or String together with what it is ordered by
+typedef struct {
+	uint64_t key;     // order-preserving bits of the Float, or the original index of the String
+	VALUE value;
+} sort_pair;
+
+#define SORT_SIGN_BIT ((uint64_t) 1 << 63)
+
+static inline uint64_t sort_fixnum_key(VALUE v) {
+	return (uint64_t) FIX2LONG(v) ^ SORT_SIGN_BIT;
+}
+
+static inline VALUE sort_fixnum_value(uint64_t key) {
+	return LONG2FIX((long) (key ^ SORT_SIGN_BIT));
+}
+
+// IEEE 754 bits with the sign flipped (or all bits, for negatives) compare as unsigned ints
+static inline uint64_t sort_double_key(double d) {
+	uint64_t bits;
+	if (d == 0.0) d = 0.0; // -0.0 == 0.0
+	memcpy(&bits, &d, sizeof(bits));
+	return (bits & SORT_SIGN_BIT) ? ~bits : bits | SORT_SIGN_BIT;
+}
+
+static inline int sort_str_cmp(VALUE a, VALUE b) {
+	long la = RSTRING_LEN(a), lb = RSTRING_LEN(b);
+	int r = memcmp(RSTRING_PTR(a), RSTRING_PTR(b), la < lb ? la : lb);
+	if (r != 0) return r;
+	if (la != lb) return la < lb ? -1 : 1;
+	return rb_str_cmp(a, b);
+}
+
+enum sort_kind sort_classify(VALUE ary);
+void sort_fixnum_keys(uint64_t *keys, uint64_t *tmp, long n);
+void sort_float_pairs(sort_pair *pairs, sort_pair *tmp, long n);
+void sort_string_pairs(sort_pair *pairs, long n);
+int sort_presorted(VALUE ary, enum sort_kind kind);
+VALUE sort_native_sort(VALUE self, VALUE ary);
+
+void Init_parallel_sort(VALUE mSort);
+void Init_select(VALUE mSort);
+void Init_stable_sort(VALUE mSort);
+
+#endif
@@ -0,0 +1,115 @@
+#include "sort.h"
+
+/*
+ * Key-caching stable sort. The block runs once per element up front; the keys are then
+ * sorted together with the index of their element, unboxed to order-preserving 64 bit
+ * ints when they are all Fixnums or all Floats, compared with memcmp when they are all
+ * Strings, and with <=> otherwise. Unboxed keys are radix sorted unless they are mostly
+ * in order already.
+ */
+
+typedef struct {
+	uint64_t key;
+	long index;
+} stable_item;
+
+typedef struct {
+	VALUE key;
+	long index;
+} stable_value_item;
+
+static ID id_cmp;
+
+static int stable_generic_cmp(VALUE a, VALUE b) {
+	if (FIXNUM_P(a) && FIXNUM_P(b)) {
+		long x = FIX2LONG(a), y = FIX2LONG(b);
+		return (x > y) - (x < y);
+	}
+	return rb_cmpint(rb_funcallv(a, id_cmp, 1, &b), a, b);
+}
+
+#define TS_NAME timsort_items
+#define TS_TYPE stable_item
+#define TS_LESS(a, b) ((a).key < (b).key)
+#include "timsort.h"
+
+#define RADIX_NAME radix_sort_items
+#define RADIX_TYPE stable_item
+#define RADIX_KEY(x) ((x).key)
+#include "radix.h"
+
+// Fewer descents than this fraction of n and the input counts as mostly presorted
+#define STABLE_PRESORTED_RATIO 64
+
+// Radix sorting is faster on shuffled numbers; natural merging wins when there are few runs
+static void stable_sort_items(stable_item *items, stable_item *tmp, long n) {
+	long i, descents = 0;
+	for (i = 1; i < n; i++) descents += items[i].key < items[i - 1].key;
+	if (descents <= n / STABLE_PRESORTED_RATIO) timsort_items(items, tmp, n);
+	else radix_sort_items(items, tmp, n);
+}
+
+#define TS_NAME timsort_string_items
+#define TS_TYPE stable_value_item
+#define TS_LESS(a, b) (sort_str_cmp((a).key, (b).key) < 0)
+#include "timsort.h"
+
+#define TS_NAME timsort_generic_items
+#define TS_TYPE stable_value_item
+#define TS_LESS(a, b) (stable_generic_cmp((a).key, (b).key) < 0)
+#include "timsort.h"
+
+/*
+ * call-seq:
+ *     Algorithms::Sort.native_stable_sort_by(array) { |element| key } -> new_array
+ *
+ * Native version of Algorithms::Sort.stable_sort_by for Arrays. Without a block, the
+ * elements are their own keys.
+ */
+static VALUE sort_native_stable_sort_by(VALUE self, VALUE ary) {
+	VALUE values, keys, result, items_v = 0;
+	enum sort_kind kind;
+	long n, i;
+
+	Check_Type(ary, T_ARRAY);
+	// The block may change ary; sort the elements it was called with
+	values = rb_ary_subseq(ary, 0, RARRAY_LEN(ary));
+	n = RARRAY_LEN(values);
+	keys = rb_ary_new_capa(n);
+	for (i = 0; i < n; i++) {
+		VALUE v = RARRAY_AREF(values, i);
+		rb_ary_push(keys, rb_block_given_p() ? rb_yield(v) : v);
+	}
+	if (n < 2) return values;
+
+	result = rb_ary_new_capa(n);
+	kind = sort_classify(keys);
+	if (kind == SORT_FIXNUM || kind == SORT_FLOAT) {
+		stable_item *items = ALLOCV(items_v, sizeof(stable_item) * 2 * n);
+		for (i = 0; i < n; i++) {
+			VALUE k = RARRAY_AREF(keys, i);
+			items[i].key = kind == SORT_FIXNUM ? sort_fixnum_key(k) : sort_double_key(RFLOAT_VALUE(k));
+			items[i].index = i;
+		}
+		stable_sort_items(items, items + n, n);
+		for (i = 0; i < n; i++) rb_ary_push(result, RARRAY_AREF(values, items[i].index));
+	} else {
+		// Exceptions from <=> leave the buffer to the GC
+		stable_value_item *items = ALLOCV(items_v, sizeof(stable_value_item) * 2 * n);
+		for (i = 0; i < n; i++) {
+			items[i].key = RARRAY_AREF(keys, i);
+			items[i].index = i;
+		}
+		if (kind == SORT_STRING) timsort_string_items(items, items + n, n);
+		else timsort_generic_items(items, items + n, n);
+		for (i = 0; i < n; i++) rb_ary_push(result, RARRAY_AREF(values, items[i].index));
+	}
+	ALLOCV_END(items_v);
+	RB_GC_GUARD(keys);
+	return result;
+}
+
+void Init_stable_sort(VALUE mSort) {
+	id_cmp = rb_intern("<=>");
+	rb_define_singleton_method(mSort, "native_stable_sort_by", sort_native_stable_sort_by, 1);
+}
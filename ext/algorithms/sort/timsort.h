@@ -0,0 +1,162 @@
+/*
+ * TimSort-style natural merge sort, as a template.
+ *
+ * Define TS_NAME, TS_TYPE and TS_LESS(a, b) before including this file; it defines
+ * TS_NAME(array, tmp, n), where tmp has room for n elements.
+ *
+ * The input is cut into its natural runs (strictly descending ones are reversed in place),
+ * short runs are extended to a minimum length with binary insertion sort, and runs are
+ * merged off a stack whose lengths are kept growing faster than the Fibonacci numbers.
+ * Each merge first skips the prefix of the left run and the suffix of the right run that
+ * are already in place, so sorted or nearly sorted input costs O(n) comparisons. The sort
+ * is stable.
+ */
+
+#define TS_CAT2(a, b) a##_##b
+#define TS_CAT(a, b) TS_CAT2(a, b)
+#define TS_FN(suffix) TS_CAT(TS_NAME, suffix)
+
+#ifndef TS_MIN_MERGE
+#define TS_MIN_MERGE 32
+// Enough for any n that fits in a long, given the run length invariants
+#define TS_MAX_STACK 96
+
+static long ts_min_run(long n) {
+	long r = 0;
+	while (n >= TS_MIN_MERGE) {
+		r |= n & 1;
+		n >>= 1;
+	}
+	return n + r;
+}
+#endif
+
+// a[0, sorted) is already in order
+static void TS_FN(insertion_sort)(TS_TYPE *a, long n, long sorted) {
+	long i;
+	for (i = sorted; i < n; i++) {
+		TS_TYPE x = a[i];
+		long lo = 0, hi = i;
+		while (lo < hi) {
+			long mid = lo + (hi - lo) / 2;
+			if (TS_LESS(x, a[mid])) hi = mid;
+			else lo = mid + 1;
+		}
+		memmove(a + lo + 1, a + lo, sizeof(TS_TYPE) * (i - lo));
+		a[lo] = x;
+	}
+}
+
+// Length of the run starting at a[0], which is left in ascending order
+static long TS_FN(count_run)(TS_TYPE *a, long n) {
+	long i = 1;
+	if (n < 2) return n;
+	if (TS_LESS(a[1], a[0])) {
+		long lo, hi;
+		while (i + 1 < n && TS_LESS(a[i + 1], a[i])) i++;
+		// Strictly descending, so reversing it cannot reorder equal elements
+		for (lo = 0, hi = i; lo < hi; lo++, hi--) {
+			TS_TYPE tmp = a[lo];
+			a[lo] = a[hi];
+			a[hi] = tmp;
+		}
+	} else {
+		while (i + 1 < n && !TS_LESS(a[i + 1], a[i])) i++;
+	}
+	return i + 1;
+}
+
+// Number of elements of a that are <= x
+static long TS_FN(upper_bound)(const TS_TYPE *a, long n, TS_TYPE x) {
+	long lo = 0, hi = n;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if (TS_LESS(x, a[mid])) hi = mid;
+		else lo = mid + 1;
+	}
+	return lo;
+}
+
+// Number of elements of a that are < x
+static long TS_FN(lower_bound)(const TS_TYPE *a, long n, TS_TYPE x) {
+	long lo = 0, hi = n;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if (TS_LESS(a[mid], x)) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Merges the adjacent runs a[0, na) and a[na, na + nb)
+static void TS_FN(merge)(TS_TYPE *a, long na, long nb, TS_TYPE *tmp) {
+	TS_TYPE *b = a + na;
+	long skip = TS_FN(upper_bound)(a, na, b[0]), i = 0, j = 0, k = 0;
+
+	a += skip;
+	na -= skip;
+	if (na == 0) return;
+	nb = TS_FN(lower_bound)(b, nb, a[na - 1]);
+	if (nb == 0) return;
+
+	// Writes into a never overtake the unread part of b
+	memcpy(tmp, a, sizeof(TS_TYPE) * na);
+	while (i < na && j < nb) {
+		if (TS_LESS(b[j], tmp[i])) a[k++] = b[j++];
+		else a[k++] = tmp[i++];
+	}
+	memcpy(a + k, tmp + i, sizeof(TS_TYPE) * (na - i));
+}
+
+static void TS_NAME(TS_TYPE *a, TS_TYPE *tmp, long n) {
+	long base[TS_MAX_STACK], len[TS_MAX_STACK];
+	long lo = 0, min_run = ts_min_run(n), m;
+	int depth = 0;
+
+#define TS_MERGE_AT(i) do { \
+		TS_FN(merge)(a + base[i], len[i], len[(i) + 1], tmp); \
+		len[i] += len[(i) + 1]; \
+		if ((i) + 2 < depth) { \
+			base[(i) + 1] = base[(i) + 2]; \
+			len[(i) + 1] = len[(i) + 2]; \
+		} \
+		depth--; \
+	} while (0)
+
+	while (lo < n) {
+		long run = TS_FN(count_run)(a + lo, n - lo);
+		if (run < min_run) {
+			long forced = n - lo < min_run ? n - lo : min_run;
+			TS_FN(insertion_sort)(a + lo, forced, run);
+			run = forced;
+		}
+		base[depth] = lo;
+		len[depth] = run;
+		depth++;
+		lo += run;
+
+		// Restore len[i - 2] > len[i - 1] + len[i] and len[i - 1] > len[i] down the stack
+		while (depth > 1) {
+			m = depth - 2;
+			if ((m > 0 && len[m - 1] <= len[m] + len[m + 1]) || (m > 1 && len[m - 2] <= len[m - 1] + len[m])) {
+				if (len[m - 1] < len[m + 1]) m--;
+			} else if (len[m] > len[m + 1]) {
+				break;
+			}
+			TS_MERGE_AT(m);
+		}
+	}
+	while (depth > 1) {
+		m = depth - 2;
+		if (m > 0 && len[m - 1] < len[m + 1]) m--;
+		TS_MERGE_AT(m);
+	}
+#undef TS_MERGE_AT
+}
+
+#undef TS_FN
+#undef TS_CAT
+#undef TS_CAT2
+#undef TS_NAME
+#undef TS_TYPE
+#undef TS_LESS
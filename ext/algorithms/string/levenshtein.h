@@ -0,0 +1,117 @@
+#ifndef ALGORITHMS_LEVENSHTEIN_H
+#define ALGORITHMS_LEVENSHTEIN_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Bit-parallel Levenshtein distance (Myers 1999, with Hyyrö's block
+ * extension for patterns longer than one machine word).
+ *
+ * The pattern is compiled once into one bit mask per byte value and block, after
+ * which each text byte costs O(ceil(m / 64)) word operations instead of O(m)
+ * matrix cells. Everything in here is plain C with no Ruby calls, so it is safe
+ * to run without the GVL.
+ */
+
+#define LEV_WORD_BITS 64
+
+typedef struct {
+	long length;       // pattern length in bytes
+	long blocks;       // number of 64 bit words per column
+	uint64_t *peq;     // peq[c * blocks + b]: bit i set if pattern[b*64 + i] == c
+} lev_pattern;
+
+static size_t lev_pattern_peq_size(long length) {
+	long blocks = (length + LEV_WORD_BITS - 1) / LEV_WORD_BITS;
+	if (blocks == 0) blocks = 1;
+	return sizeof(uint64_t) * 256 * blocks;
+}
+
+// peq must point to lev_pattern_peq_size(length) bytes
+static void lev_pattern_init(lev_pattern *p, const char *pattern, long length, uint64_t *peq) {
+	long i;
+	p->length = length;
+	p->blocks = (length + LEV_WORD_BITS - 1) / LEV_WORD_BITS;
+	if (p->blocks == 0) p->blocks = 1;
+	p->peq = peq;
+	memset(peq, 0, lev_pattern_peq_size(length));
+	for (i = 0; i < length; i++) {
+		unsigned char c = (unsigned char) pattern[i];
+		peq[c * p->blocks + i / LEV_WORD_BITS] |= (uint64_t) 1 << (i % LEV_WORD_BITS);
+	}
+}
+
+/*
+ * Distance between the compiled pattern and text. If the distance is known to
+ * exceed max the search is abandoned and max + 1 is returned. Pass a negative
+ * max for an exact answer. work must hold 2 * p->blocks words.
+ */
+static long lev_pattern_distance(const lev_pattern *p, const char *text, long n, long max, uint64_t *work) {
+	long m = p->length, blocks = p->blocks, score = m, j, b;
+	int last_bit;
+	uint64_t last_mask;
+	uint64_t *pv = work, *mv = work + blocks;
+
+	if (m == 0) return n;
+	if (n == 0) return m;
+	last_bit = (int) ((m - 1) % LEV_WORD_BITS);
+	last_mask = (uint64_t) 1 << last_bit;
+	if (max >= 0 && (m > n ? m - n : n - m) > max) return max + 1;
+
+	if (blocks == 1) {
+		uint64_t Pv = ~(uint64_t) 0, Mv = 0;
+		for (j = 0; j < n; j++) {
+			uint64_t Eq = p->peq[(unsigned char) text[j]];
+			uint64_t Xv = Eq | Mv;
+			uint64_t Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+			uint64_t Ph = Mv | ~(Xh | Pv);
+			uint64_t Mh = Pv & Xh;
+			if (Ph & last_mask) score++;
+			else if (Mh & last_mask) score--;
+			Ph = (Ph << 1) | 1; // top row of the DP matrix grows by one per column
+			Mh <<= 1;
+			Pv = Mh | ~(Xv | Ph);
+			Mv = Ph & Xv;
+			// Each remaining column can lower the score by at most one
+			if (max >= 0 && score - (n - j - 1) > max) return max + 1;
+		}
+		return score;
+	}
+
+	for (b = 0; b < blocks; b++) {
+		pv[b] = ~(uint64_t) 0;
+		mv[b] = 0;
+	}
+	for (j = 0; j < n; j++) {
+		const uint64_t *eq_col = p->peq + (unsigned char) text[j] * blocks;
+		int hin = 1;
+		for (b = 0; b < blocks; b++) {
+			uint64_t Pv = pv[b], Mv = mv[b], Eq = eq_col[b];
+			uint64_t Xv, Xh, Ph, Mh;
+			int hout = 0;
+			Xv = Eq | Mv;
+			if (hin < 0) Eq |= 1;
+			Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+			Ph = Mv | ~(Xh | Pv);
+			Mh = Pv & Xh;
+			if (b == blocks - 1) {
+				if (Ph & last_mask) score++;
+				else if (Mh & last_mask) score--;
+			}
+			if (Ph >> (LEV_WORD_BITS - 1)) hout = 1;
+			else if (Mh >> (LEV_WORD_BITS - 1)) hout = -1;
+			Ph <<= 1;
+			Mh <<= 1;
+			if (hin < 0) Mh |= 1;
+			else if (hin > 0) Ph |= 1;
+			pv[b] = Mh | ~(Xv | Ph);
+			mv[b] = Ph & Xv;
+			hin = hout;
+		}
+		if (max >= 0 && score - (n - j - 1) > max) return max + 1;
+	}
+	return score;
+}
+
+#endif
@@ -1,4 +1,13 @@
 #include "ruby.h"
+#include "levenshtein.h"
+
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <unistd.h>
 
 long min_three(long a, long b, long c) {
 	long min = a;
@@ -57,6 +66,260 @@ static VALUE lev_dist(VALUE self, VALUE str1, VALUE str2) {
 	return LONG2FIX(levenshtein_distance( str1, str2 ));
 }
 
+typedef struct {
+	long dist;
+	long index;
+} lev_match;
+
+// (dist, index) pairs are ordered lexicographically so that results are deterministic
+static int lev_match_less(const lev_match *a, const lev_match *b) {
+	return a->dist < b->dist || (a->dist == b->dist && a->index < b->index);
+}
+
+// Bounded max-heap: heap[0] is the worst of the k best matches seen so far
+static void lev_heap_push(lev_match *heap, long *size, long k, lev_match m) {
+	long i, child;
+	lev_match tmp;
+	if (*size < k) {
+		i = (*size)++;
+		heap[i] = m;
+		while (i > 0 && lev_match_less(&heap[(i - 1) / 2], &heap[i])) {
+			tmp = heap[i]; heap[i] = heap[(i - 1) / 2]; heap[(i - 1) / 2] = tmp;
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+	if (!lev_match_less(&m, &heap[0])) return;
+	heap[0] = m;
+	i = 0;
+	while ((child = 2 * i + 1) < *size) {
+		if (child + 1 < *size && lev_match_less(&heap[child], &heap[child + 1])) child++;
+		if (!lev_match_less(&heap[i], &heap[child])) break;
+		tmp = heap[i]; heap[i] = heap[child]; heap[child] = tmp;
+		i = child;
+	}
+}
+
+static int lev_match_cmp(const void *a, const void *b) {
+	if (lev_match_less(a, b)) return -1;
+	if (lev_match_less(b, a)) return 1;
+	return 0;
+}
+
+typedef struct {
+	const lev_pattern *pattern;
+	const char *buf;
+	const long *offsets;   // candidate i is buf[offsets[i]...offsets[i+1]]
+	long from, to;         // from moves up as candidates are done, so a cancelled run can resume
+	long k, max;
+	lev_match *heap;
+	long heap_size;
+	uint64_t *work;
+	volatile int *cancel;
+} lev_worker;
+
+static void* lev_worker_run(void *arg) {
+	lev_worker *w = arg;
+	long i, d, limit;
+	lev_match m;
+	for (i = w->from; i < w->to; i++) {
+		if ((i & 1023) == 0 && *w->cancel) {
+			w->from = i;
+			return NULL;
+		}
+		limit = w->max;
+		if (w->heap_size == w->k) {
+			// A tie with the current worst cannot win since indices only grow
+			if (w->heap[0].dist == 0) break;
+			if (limit < 0 || w->heap[0].dist - 1 < limit) limit = w->heap[0].dist - 1;
+		}
+		d = lev_pattern_distance(w->pattern, w->buf + w->offsets[i], w->offsets[i+1] - w->offsets[i], limit, w->work);
+		if (limit >= 0 && d > limit) continue;
+		m.dist = d;
+		m.index = i;
+		lev_heap_push(w->heap, &w->heap_size, w->k, m);
+	}
+	w->from = w->to;
+	return NULL;
+}
+
+typedef struct {
+	lev_worker *workers;
+	long num_workers;
+	volatile int cancel;
+} lev_job;
+
+static void* lev_job_run(void *arg) {
+	lev_job *job = arg;
+	long t;
+#ifdef HAVE_PTHREAD_H
+	pthread_t *threads = malloc(sizeof(pthread_t) * job->num_workers);
+	char *started = calloc(job->num_workers, 1);
+	if (threads && started) {
+		for (t = 1; t < job->num_workers; t++) {
+			started[t] = pthread_create(&threads[t], NULL, lev_worker_run, &job->workers[t]) == 0;
+		}
+	}
+	lev_worker_run(&job->workers[0]);
+	for (t = 1; t < job->num_workers; t++) {
+		if (threads && started && started[t]) pthread_join(threads[t], NULL);
+		else lev_worker_run(&job->workers[t]);
+	}
+	free(threads);
+	free(started);
+#else
+	for (t = 0; t < job->num_workers; t++) {
+		lev_worker_run(&job->workers[t]);
+	}
+#endif
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void lev_job_cancel(void *arg) {
+	lev_job *job = arg;
+	job->cancel = 1;
+}
+#endif
+
+static long default_thread_count(long n) {
+	long cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+#endif
+	// Spawning a thread only pays off for a reasonably sized slice of the input
+	if (cpus > n / 4096 + 1) cpus = n / 4096 + 1;
+	return cpus;
+}
+
+/*
+ * call-seq:
+ *     Algorithms::String.levenshtein_top_k(query, candidates, k, max: nil, threads: nil) -> [[distance, index], ...]
+ *
+ * Returns the k candidates closest to query by Levenshtein distance as [distance, index]
+ * pairs, best first, with ties broken by the lower index. If max is given, candidates
+ * further than max edits away are left out. The query is compiled into bit-parallel
+ * masks once and the candidates are split across native threads that run without
+ * the GVL; threads defaults to the number of online processors.
+ *
+ *   Algorithms::String.levenshtein_top_k("kitten", ["sitting", "mitten", "kitchen"], 2) #=> [[1, 1], [2, 2]]
+ */
+static VALUE lev_top_k(int argc, VALUE *argv, VALUE self) {
+	VALUE query, candidates, rb_k, opts, result;
+	VALUE kwargs[2] = { Qundef, Qundef };
+	ID kwarg_ids[2];
+	VALUE buf_v = 0, offsets_v = 0, peq_v = 0, work_v = 0, heaps_v = 0, workers_v = 0;
+	long n, i, k, max = -1, num_threads, total = 0, found = 0, t;
+	char *buf;
+	long *offsets;
+	uint64_t *peq, *work;
+	lev_match *heaps, *merged;
+	lev_pattern pattern;
+	lev_job job;
+
+	rb_scan_args(argc, argv, "3:", &query, &candidates, &rb_k, &opts);
+	kwarg_ids[0] = rb_intern("max");
+	kwarg_ids[1] = rb_intern("threads");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 2, kwargs);
+
+	StringValue(query);
+	Check_Type(candidates, T_ARRAY);
+	k = NUM2LONG(rb_k);
+	if (k < 0) rb_raise(rb_eArgError, "k must not be negative");
+	if (kwargs[0] != Qundef && !NIL_P(kwargs[0])) {
+		max = NUM2LONG(kwargs[0]);
+		if (max < 0) rb_raise(rb_eArgError, "max must not be negative");
+	}
+	num_threads = 0;
+	if (kwargs[1] != Qundef && !NIL_P(kwargs[1])) {
+		num_threads = NUM2LONG(kwargs[1]);
+		if (num_threads < 1) rb_raise(rb_eArgError, "threads must be positive");
+	}
+
+	// No Ruby code may run from here on: a to_int or to_str could change the candidates
+	// between measuring and copying them
+	n = RARRAY_LEN(candidates);
+	for (i = 0; i < n; i++) {
+		VALUE str = RARRAY_AREF(candidates, i);
+		Check_Type(str, T_STRING);
+		total += RSTRING_LEN(str);
+	}
+	if (k > n) k = n;
+	result = rb_ary_new2(k);
+	if (k == 0) return result;
+
+	if (num_threads == 0) num_threads = default_thread_count(n);
+	if (num_threads > n) num_threads = n;
+
+	// Copy the candidates into one buffer so no Ruby object is touched without the GVL
+	buf = ALLOCV(buf_v, total + 1);
+	offsets = ALLOCV_N(long, offsets_v, n + 1);
+	total = 0;
+	for (i = 0; i < n; i++) {
+		VALUE str = RARRAY_AREF(candidates, i);
+		offsets[i] = total;
+		memcpy(buf + total, RSTRING_PTR(str), RSTRING_LEN(str));
+		total += RSTRING_LEN(str);
+	}
+	offsets[n] = total;
+
+	peq = ALLOCV(peq_v, lev_pattern_peq_size(RSTRING_LEN(query)));
+	lev_pattern_init(&pattern, RSTRING_PTR(query), RSTRING_LEN(query), peq);
+
+	work = ALLOCV_N(uint64_t, work_v, 2 * pattern.blocks * num_threads);
+	heaps = ALLOCV_N(lev_match, heaps_v, k * num_threads);
+	job.workers = ALLOCV_N(lev_worker, workers_v, num_threads);
+	job.num_workers = num_threads;
+	for (t = 0; t < num_threads; t++) {
+		lev_worker *w = &job.workers[t];
+		w->pattern = &pattern;
+		w->buf = buf;
+		w->offsets = offsets;
+		w->from = n * t / num_threads;
+		w->to = n * (t + 1) / num_threads;
+		w->k = k;
+		w->max = max;
+		w->heap = heaps + k * t;
+		w->heap_size = 0;
+		w->work = work + 2 * pattern.blocks * t;
+		w->cancel = &job.cancel;
+	}
+
+	do {
+		job.cancel = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(lev_job_run, &job, lev_job_cancel, &job);
+#else
+		lev_job_run(&job);
+#endif
+		// Raises if the interrupt was meant to stop us; otherwise each worker picks up its
+		// heap and its slice where it left off
+		if (job.cancel) rb_thread_check_ints();
+	} while (job.cancel);
+
+	// Each worker's heap is compacted to the front of the shared buffer, then the
+	// union of at most num_threads * k matches is sorted and cut down to k.
+	merged = heaps;
+	for (t = 0; t < num_threads; t++) {
+		memmove(merged + found, job.workers[t].heap, sizeof(lev_match) * job.workers[t].heap_size);
+		found += job.workers[t].heap_size;
+	}
+	qsort(merged, found, sizeof(lev_match), lev_match_cmp);
+	if (found > k) found = k;
+	for (i = 0; i < found; i++) {
+		rb_ary_push(result, rb_assoc_new(LONG2FIX(merged[i].dist), LONG2FIX(merged[i].index)));
+	}
+
+	ALLOCV_END(workers_v);
+	ALLOCV_END(heaps_v);
+	ALLOCV_END(work_v);
+	ALLOCV_END(peq_v);
+	ALLOCV_END(offsets_v);
+	ALLOCV_END(buf_v);
+	return result;
+}
+
 static VALUE mAlgorithms;
 static VALUE mString;
 
@@ -64,5 +327,6 @@ void Init_CString() {
 	mAlgorithms = rb_define_module("Algorithms");
 	mString = rb_define_module_under(mAlgorithms, "String");
 	rb_define_singleton_method(mString, "levenshtein_dist", lev_dist, 2);
+	rb_define_singleton_method(mString, "levenshtein_top_k", lev_top_k, -1);
 }
 
@@ -0,0 +1,274 @@
+#include "ruby.h"
+#include "levenshtein.h"
+
+/*
+ * A Burkhard-Keller tree over byte strings using Levenshtein distance.
+ *
+ * Every node stores one word; a child hangs off its parent under the edge labelled
+ * with the distance between the two words. By the triangle inequality, a search for
+ * words within max of a term only has to descend into edges labelled
+ * d - max .. d + max, where d is the distance from the term to the node's word.
+ *
+ * Nodes live in one flat array and the word bytes in one flat buffer, so the tree
+ * costs a few words per entry on top of the text itself.
+ */
+
+typedef struct {
+	long offset;        // word bytes live at buf[offset, length]
+	int length;
+	int dist;           // label of the edge from the parent
+	int first_child;    // -1 if none
+	int next_sibling;   // -1 if none
+} bk_node;
+
+typedef struct {
+	bk_node *nodes;
+	long size;
+	long capa;
+	char *buf;
+	long buf_len;
+	long buf_capa;
+	VALUE words;        // frozen copies of the words, indexed like nodes
+} bk_tree;
+
+typedef struct {
+	long dist;
+	long index;
+} bk_match;
+
+static bk_tree* get_bk_tree_from_self(VALUE self) {
+	bk_tree *tree;
+	Data_Get_Struct(self, bk_tree, tree);
+	return tree;
+}
+
+static void bk_tree_mark(void *ptr) {
+	if (ptr) {
+		bk_tree *tree = ptr;
+		rb_gc_mark(tree->words);
+	}
+}
+
+static void bk_tree_free(void *ptr) {
+	if (ptr) {
+		bk_tree *tree = ptr;
+		xfree(tree->nodes);
+		xfree(tree->buf);
+		xfree(tree);
+	}
+}
+
+static VALUE bk_tree_alloc(VALUE klass) {
+	bk_tree *tree = ALLOC(bk_tree);
+	tree->nodes = NULL;
+	tree->size = tree->capa = 0;
+	tree->buf = NULL;
+	tree->buf_len = tree->buf_capa = 0;
+	tree->words = rb_ary_new();
+	return Data_Wrap_Struct(klass, bk_tree_mark, bk_tree_free, tree);
+}
+
+static long bk_distance(const lev_pattern *p, const bk_tree *tree, const bk_node *node, uint64_t *work) {
+	return lev_pattern_distance(p, tree->buf + node->offset, node->length, -1, work);
+}
+
+static long add_node(bk_tree *tree, VALUE word, long dist) {
+	long len = RSTRING_LEN(word);
+	bk_node *node;
+	if (tree->size == tree->capa) {
+		tree->capa = tree->capa ? tree->capa * 2 : 64;
+		REALLOC_N(tree->nodes, bk_node, tree->capa);
+	}
+	if (tree->buf_len + len > tree->buf_capa) {
+		while (tree->buf_len + len > tree->buf_capa)
+			tree->buf_capa = tree->buf_capa ? tree->buf_capa * 2 : 1024;
+		REALLOC_N(tree->buf, char, tree->buf_capa);
+	}
+	memcpy(tree->buf + tree->buf_len, RSTRING_PTR(word), len);
+	node = &tree->nodes[tree->size];
+	node->offset = tree->buf_len;
+	node->length = (int) len;
+	node->dist = (int) dist;
+	node->first_child = -1;
+	node->next_sibling = -1;
+	tree->buf_len += len;
+	rb_ary_push(tree->words, rb_str_new_frozen(word));
+	return tree->size++;
+}
+
+/*
+ * call-seq:
+ *     push(word) -> true or false
+ *
+ * Adds word to the tree. Returns false if it was already present.
+ */
+static VALUE bk_tree_push(VALUE self, VALUE word) {
+	bk_tree *tree = get_bk_tree_from_self(self);
+	VALUE peq_v = 0, work_v = 0;
+	lev_pattern pattern;
+	uint64_t *work;
+	long current = 0, d, child, added;
+
+	StringValue(word);
+	if (RSTRING_LEN(word) > INT_MAX) rb_raise(rb_eArgError, "word is too long");
+	if (tree->size == 0) {
+		add_node(tree, word, 0);
+		return Qtrue;
+	}
+
+	lev_pattern_init(&pattern, RSTRING_PTR(word), RSTRING_LEN(word),
+		ALLOCV(peq_v, lev_pattern_peq_size(RSTRING_LEN(word))));
+	work = ALLOCV_N(uint64_t, work_v, 2 * pattern.blocks);
+	for (;;) {
+		d = bk_distance(&pattern, tree, &tree->nodes[current], work);
+		if (d == 0) {
+			ALLOCV_END(work_v);
+			ALLOCV_END(peq_v);
+			return Qfalse;
+		}
+		for (child = tree->nodes[current].first_child; child >= 0; child = tree->nodes[child].next_sibling) {
+			if (tree->nodes[child].dist == d) break;
+		}
+		if (child < 0) break;
+		current = child;
+	}
+	ALLOCV_END(work_v);
+	ALLOCV_END(peq_v);
+
+	added = add_node(tree, word, d);
+	tree->nodes[added].next_sibling = tree->nodes[current].first_child;
+	tree->nodes[current].first_child = (int) added;
+	return Qtrue;
+}
+
+static VALUE bk_tree_push_each(RB_BLOCK_CALL_FUNC_ARGLIST(word, self)) {
+	return bk_tree_push(self, word);
+}
+
+/*
+ * call-seq:
+ *     Containers::CBKTree.new(words = [])
+ *
+ * Builds a tree from any enumerable of strings.
+ */
+static VALUE bk_tree_init(int argc, VALUE *argv, VALUE self) {
+	VALUE words;
+	rb_scan_args(argc, argv, "01", &words);
+	if (!NIL_P(words)) {
+		rb_block_call(words, rb_intern("each"), 0, NULL, bk_tree_push_each, self);
+	}
+	return self;
+}
+
+static int bk_match_cmp(const void *a, const void *b) {
+	const bk_match *x = a, *y = b;
+	if (x->dist != y->dist) return x->dist < y->dist ? -1 : 1;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+ * call-seq:
+ *     search(term, max_dist) -> [[distance, word], ...]
+ *
+ * Returns every word within max_dist edits of term, closest first. Words at the same
+ * distance are returned in insertion order.
+ *
+ * Complexity: typically a small fraction of the tree for small max_dist
+ */
+static VALUE bk_tree_search(VALUE self, VALUE term, VALUE rb_max) {
+	bk_tree *tree = get_bk_tree_from_self(self);
+	VALUE peq_v = 0, work_v = 0, result;
+	lev_pattern pattern;
+	uint64_t *work;
+	long max, d, child, i;
+	long *stack = NULL, stack_size = 0, stack_capa = 0;
+	bk_match *matches = NULL;
+	long num_matches = 0, matches_capa = 0;
+
+	StringValue(term);
+	max = NUM2LONG(rb_max);
+	if (max < 0) rb_raise(rb_eArgError, "max_dist must not be negative");
+	result = rb_ary_new();
+	if (tree->size == 0) return result;
+
+	lev_pattern_init(&pattern, RSTRING_PTR(term), RSTRING_LEN(term),
+		ALLOCV(peq_v, lev_pattern_peq_size(RSTRING_LEN(term))));
+	work = ALLOCV_N(uint64_t, work_v, 2 * pattern.blocks);
+
+	stack_capa = 64;
+	stack = ALLOC_N(long, stack_capa);
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		bk_node *node = &tree->nodes[stack[--stack_size]];
+		d = bk_distance(&pattern, tree, node, work);
+		if (d <= max) {
+			if (num_matches == matches_capa) {
+				matches_capa = matches_capa ? matches_capa * 2 : 16;
+				REALLOC_N(matches, bk_match, matches_capa);
+			}
+			matches[num_matches].dist = d;
+			matches[num_matches].index = node - tree->nodes;
+			num_matches++;
+		}
+		for (child = node->first_child; child >= 0; child = tree->nodes[child].next_sibling) {
+			long edge = tree->nodes[child].dist;
+			if (edge < d - max || edge > d + max) continue;
+			if (stack_size == stack_capa) {
+				stack_capa *= 2;
+				REALLOC_N(stack, long, stack_capa);
+			}
+			stack[stack_size++] = child;
+		}
+	}
+	xfree(stack);
+	ALLOCV_END(work_v);
+	ALLOCV_END(peq_v);
+
+	if (num_matches > 0) qsort(matches, num_matches, sizeof(bk_match), bk_match_cmp);
+	for (i = 0; i < num_matches; i++) {
+		rb_ary_push(result, rb_assoc_new(LONG2FIX(matches[i].dist), rb_ary_entry(tree->words, matches[i].index)));
+	}
+	xfree(matches);
+	return result;
+}
+
+static VALUE bk_tree_has_key(VALUE self, VALUE term) {
+	return RARRAY_LEN(bk_tree_search(self, term, INT2FIX(0))) > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE bk_tree_size(VALUE self) {
+	bk_tree *tree = get_bk_tree_from_self(self);
+	return LONG2NUM(tree->size);
+}
+
+static VALUE bk_tree_is_empty(VALUE self) {
+	bk_tree *tree = get_bk_tree_from_self(self);
+	return tree->size == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE bk_tree_each(VALUE self) {
+	bk_tree *tree = get_bk_tree_from_self(self);
+	long i;
+	for (i = 0; i < RARRAY_LEN(tree->words); i++) {
+		rb_yield(rb_ary_entry(tree->words, i));
+	}
+	return self;
+}
+
+static VALUE cBKTree;
+static VALUE mContainers;
+
+void Init_CBKTree() {
+	mContainers = rb_define_module("Containers");
+	cBKTree = rb_define_class_under(mContainers, "CBKTree", rb_cObject);
+	rb_define_alloc_func(cBKTree, bk_tree_alloc);
+	rb_define_method(cBKTree, "initialize", bk_tree_init, -1);
+	rb_define_method(cBKTree, "push", bk_tree_push, 1);
+	rb_define_method(cBKTree, "search", bk_tree_search, 2);
+	rb_define_method(cBKTree, "has_key?", bk_tree_has_key, 1);
+	rb_define_alias(cBKTree, "include?", "has_key?");
+	rb_define_method(cBKTree, "size", bk_tree_size, 0);
+	rb_define_method(cBKTree, "empty?", bk_tree_is_empty, 0);
+	rb_define_method(cBKTree, "each", bk_tree_each, 0);
+	rb_include_module(cBKTree, rb_eval_string("Enumerable"));
+}
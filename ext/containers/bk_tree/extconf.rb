@@ -0,0 +1,6 @@
+require 'mkmf'
+extension_name = "CBKTree"
+# Share the bit-parallel Levenshtein kernel with the CString extension
+$INCFLAGS << " -I$(srcdir)/../../algorithms/string"
+dir_config(extension_name)
+create_makefile(extension_name)
@@ -0,0 +1,4 @@
+require 'mkmf'
+extension_name = "CHeap"
+dir_config(extension_name)
+create_makefile(extension_name)
@@ -0,0 +1,485 @@
+#include "heap.h"
+
+/*
+ * An indexed 4-ary heap over a flat array of (key, entry id) nodes; see heap.h for how
+ * items are found again for has_key?, delete and change_key.
+ *
+ * MinHeaps and MaxHeaps compare Fixnum and Float keys natively; other keys, and heaps
+ * with a comparison block, go through <=> or the block.
+ */
+
+#define HEAP_ARITY 4
+
+enum heap_order {
+	HEAP_MIN,
+	HEAP_MAX,
+	HEAP_BLOCK
+};
+
+typedef struct {
+	heap_node *nodes;
+	long size;
+	long capa;
+	heap_entries table;
+	enum heap_order order;
+	VALUE compare_fn;
+} cheap;
+
+static VALUE mContainers;
+static VALUE cHeap;
+static ID id_cmp, id_call, id_min, id_max;
+
+void heap_entries_init(heap_entries *table) {
+	table->entries = NULL;
+	table->capa = 0;
+	table->free_entry = -1;
+	table->index = Qnil;
+}
+
+void heap_entries_destroy(heap_entries *table) {
+	xfree(table->entries);
+}
+
+long heap_entries_add(heap_entries *table, VALUE key, VALUE value) {
+	long id;
+	if (table->free_entry < 0) {
+		long capa = table->capa ? 2 * table->capa : 16;
+		REALLOC_N(table->entries, heap_entry, capa);
+		for (id = capa - 1; id >= table->capa; id--) {
+			table->entries[id].pos = -1;
+			table->entries[id].next_same = table->free_entry;
+			table->free_entry = id;
+		}
+		table->capa = capa;
+	}
+	id = table->free_entry;
+	table->free_entry = table->entries[id].next_same;
+	table->entries[id].value = value;
+	table->entries[id].next_same = -1;
+	table->entries[id].prev_same = -1;
+	if (!NIL_P(table->index)) heap_index_link(table, key, id);
+	return id;
+}
+
+// Frees the entry without touching the index
+void heap_entries_release(heap_entries *table, long id) {
+	table->entries[id].pos = -1;
+	table->entries[id].value = Qnil;
+	table->entries[id].next_same = table->free_entry;
+	table->free_entry = id;
+}
+
+void heap_index_link(heap_entries *table, VALUE key, long id) {
+	VALUE head = rb_hash_lookup2(table->index, key, Qundef);
+	heap_entry *entry = &table->entries[id];
+	if (head == Qundef) {
+		entry->prev_same = entry->next_same = -1;
+		rb_hash_aset(table->index, key, LONG2FIX(id));
+	} else {
+		long h = FIX2LONG(head);
+		entry->prev_same = h;
+		entry->next_same = table->entries[h].next_same;
+		if (entry->next_same >= 0) table->entries[entry->next_same].prev_same = id;
+		table->entries[h].next_same = id;
+	}
+}
+
+static void heap_index_unlink(heap_entries *table, VALUE key, long id) {
+	heap_entry *entry = &table->entries[id];
+	if (NIL_P(table->index)) return;
+	if (entry->prev_same >= 0) {
+		table->entries[entry->prev_same].next_same = entry->next_same;
+		if (entry->next_same >= 0) table->entries[entry->next_same].prev_same = entry->prev_same;
+	} else if (entry->next_same >= 0) {
+		table->entries[entry->next_same].prev_same = -1;
+		rb_hash_aset(table->index, key, LONG2FIX(entry->next_same));
+	} else {
+		rb_hash_delete(table->index, key);
+	}
+}
+
+void heap_entries_remove(heap_entries *table, VALUE key, long id) {
+	heap_index_unlink(table, key, id);
+	heap_entries_release(table, id);
+}
+
+void heap_entries_rekey(heap_entries *table, VALUE key, VALUE new_key, long id) {
+	if (NIL_P(table->index)) return;
+	heap_index_unlink(table, key, id);
+	heap_index_link(table, new_key, id);
+}
+
+// Id of an entry with key, or -1; the index must have been built
+long heap_index_lookup(heap_entries *table, VALUE key) {
+	VALUE id = rb_hash_lookup2(table->index, key, Qundef);
+	return id == Qundef ? -1 : FIX2LONG(id);
+}
+
+static cheap* get_heap_from_self(VALUE self) {
+	cheap *heap;
+	Data_Get_Struct(self, cheap, heap);
+	return heap;
+}
+
+static void heap_mark(void *ptr) {
+	if (ptr) {
+		cheap *heap = ptr;
+		long i;
+		for (i = 0; i < heap->size; i++) {
+			rb_gc_mark(heap->nodes[i].key);
+			rb_gc_mark(heap->table.entries[heap->nodes[i].id].value);
+		}
+		rb_gc_mark(heap->compare_fn);
+		rb_gc_mark(heap->table.index);
+	}
+}
+
+static void heap_free(void *ptr) {
+	if (ptr) {
+		cheap *heap = ptr;
+		xfree(heap->nodes);
+		heap_entries_destroy(&heap->table);
+		xfree(heap);
+	}
+}
+
+static VALUE heap_alloc(VALUE klass) {
+	cheap *heap = ALLOC(cheap);
+	heap->nodes = NULL;
+	heap->size = 0;
+	heap->capa = 0;
+	heap_entries_init(&heap->table);
+	heap->order = HEAP_MIN;
+	heap->compare_fn = Qnil;
+	return Data_Wrap_Struct(klass, heap_mark, heap_free, heap);
+}
+
+// True if key a should come out of the heap before key b
+static int heap_before(cheap *heap, VALUE a, VALUE b) {
+	VALUE cmp;
+	switch (heap->order) {
+		case HEAP_MIN:
+		case HEAP_MAX:
+			if (FIXNUM_P(a) && FIXNUM_P(b)) {
+				return heap->order == HEAP_MIN ? (long) a < (long) b : (long) a > (long) b;
+			}
+			if (RB_FLOAT_TYPE_P(a) && RB_FLOAT_TYPE_P(b)) {
+				double x = RFLOAT_VALUE(a), y = RFLOAT_VALUE(b);
+				return heap->order == HEAP_MIN ? x < y : x > y;
+			}
+			cmp = rb_funcall(a, id_cmp, 1, b);
+			return cmp == INT2FIX(heap->order == HEAP_MIN ? -1 : 1);
+		default:
+			return RTEST(rb_funcall(heap->compare_fn, id_call, 2, a, b));
+	}
+}
+
+static inline void heap_place(cheap *heap, long pos, heap_node node) {
+	heap->nodes[pos] = node;
+	heap->table.entries[node.id].pos = pos;
+}
+
+// Swaps instead of moving a hole along, so that an exception from the comparison block
+// leaves a valid (if unordered) heap behind
+static void heap_swap(cheap *heap, long i, long j) {
+	heap_node tmp = heap->nodes[i];
+	heap_place(heap, i, heap->nodes[j]);
+	heap_place(heap, j, tmp);
+}
+
+static long heap_sift_up(cheap *heap, long pos) {
+	while (pos > 0) {
+		long parent = (pos - 1) / HEAP_ARITY;
+		if (!heap_before(heap, heap->nodes[pos].key, heap->nodes[parent].key)) break;
+		heap_swap(heap, pos, parent);
+		pos = parent;
+	}
+	return pos;
+}
+
+static void heap_sift_down(cheap *heap, long pos) {
+	for (;;) {
+		long first = HEAP_ARITY * pos + 1, best = pos, child;
+		for (child = first; child < first + HEAP_ARITY && child < heap->size; child++) {
+			if (heap_before(heap, heap->nodes[child].key, heap->nodes[best].key)) best = child;
+		}
+		if (best == pos) return;
+		heap_swap(heap, pos, best);
+		pos = best;
+	}
+}
+
+static void heap_heapify(cheap *heap) {
+	long i;
+	for (i = (heap->size - 2) / HEAP_ARITY; i >= 0; i--) heap_sift_down(heap, i);
+}
+
+// Id of an entry with key, or -1
+static long heap_find(cheap *heap, VALUE key) {
+	long i;
+	if (NIL_P(heap->table.index)) {
+		heap->table.index = rb_hash_new();
+		for (i = 0; i < heap->size; i++) heap_index_link(&heap->table, heap->nodes[i].key, heap->nodes[i].id);
+	}
+	return heap_index_lookup(&heap->table, key);
+}
+
+// Appends without restoring the heap property
+static void heap_append(cheap *heap, VALUE key, VALUE value) {
+	heap_node node;
+	if (heap->size == heap->capa) {
+		heap->capa = heap->capa ? 2 * heap->capa : 16;
+		REALLOC_N(heap->nodes, heap_node, heap->capa);
+	}
+	node.key = key;
+	node.id = heap_entries_add(&heap->table, key, value);
+	heap_place(heap, heap->size++, node);
+}
+
+// Takes the item at pos out of the heap and returns its value
+static VALUE heap_remove_at(cheap *heap, long pos) {
+	heap_node node = heap->nodes[pos];
+	VALUE value = heap->table.entries[node.id].value;
+
+	heap_entries_remove(&heap->table, node.key, node.id);
+	heap->size--;
+	if (pos != heap->size) {
+		heap_place(heap, pos, heap->nodes[heap->size]);
+		if (heap_sift_up(heap, pos) == pos) heap_sift_down(heap, pos);
+	}
+	return value;
+}
+
+/*
+ * call-seq:
+ *     CHeap.new(optional_array, order = :min) { |x, y| optional_comparison_fn } -> new_heap
+ *
+ * Creates a heap, heapifying the optional array in O(n) with each element as both key and
+ * value. Without a block the heap is ordered by <=>, smallest key first for :min or
+ * largest first for :max; a block returning true if x should come out before y overrides
+ * the order.
+ */
+static VALUE heap_init(int argc, VALUE *argv, VALUE self) {
+	cheap *heap = get_heap_from_self(self);
+	VALUE ary, order, block;
+	long i;
+
+	rb_scan_args(argc, argv, "02&", &ary, &order, &block);
+	if (!NIL_P(block)) {
+		heap->order = HEAP_BLOCK;
+		heap->compare_fn = block;
+	} else if (NIL_P(order) || SYM2ID(order) == id_min) {
+		heap->order = HEAP_MIN;
+	} else if (SYM2ID(order) == id_max) {
+		heap->order = HEAP_MAX;
+	} else {
+		rb_raise(rb_eArgError, "order must be :min or :max");
+	}
+	if (NIL_P(ary)) return self;
+	ary = rb_Array(ary);
+	for (i = 0; i < RARRAY_LEN(ary); i++) {
+		VALUE v = RARRAY_AREF(ary, i);
+		if (!RTEST(v)) rb_raise(rb_eArgError, "Heap keys must not be nil or false.");
+		heap_append(heap, v, v);
+	}
+	heap_heapify(heap);
+	return self;
+}
+
+/*
+ * call-seq:
+ *     push(key, value) -> value
+ *     push(value) -> value
+ *
+ * Inserts an item with a given key into the heap. If only one parameter is given, the
+ * key is set to the value.
+ *
+ * Complexity: O(log n)
+ */
+static VALUE heap_push(int argc, VALUE *argv, VALUE self) {
+	cheap *heap = get_heap_from_self(self);
+	VALUE key, value;
+
+	rb_scan_args(argc, argv, "11", &key, &value);
+	if (argc == 1) value = key;
+	if (!RTEST(key)) rb_raise(rb_eArgError, "Heap keys must not be nil or false.");
+	heap_append(heap, key, value);
+	heap_sift_up(heap, heap->size - 1);
+	return value;
+}
+
+static VALUE heap_size(VALUE self) {
+	return LONG2NUM(get_heap_from_self(self)->size);
+}
+
+static VALUE heap_is_empty(VALUE self) {
+	return get_heap_from_self(self)->size == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *     next -> value
+ *     next -> nil
+ *
+ * Returns the value of the next item in heap order, but does not remove it.
+ *
+ * Complexity: O(1)
+ */
+static VALUE heap_next(VALUE self) {
+	cheap *heap = get_heap_from_self(self);
+	return heap->size ? heap->table.entries[heap->nodes[0].id].value : Qnil;
+}
+
+/*
+ * call-seq:
+ *     next_key -> key
+ *     next_key -> nil
+ *
+ * Returns the key associated with the next item in heap order, but does not remove it.
+ *
+ * Complexity: O(1)
+ */
+static VALUE heap_next_key(VALUE self) {
+	cheap *heap = get_heap_from_self(self);
+	return heap->size ? heap->nodes[0].key : Qnil;
+}
+
+/*
+ * call-seq:
+ *     pop -> value
+ *     pop -> nil
+ *
+ * Returns the value of the next item in heap order and removes it from the heap.
+ *
+ * Complexity: O(log n)
+ */
+static VALUE heap_pop(VALUE self) {
+	cheap *heap = get_heap_from_self(self);
+	return heap->size ? heap_remove_at(heap, 0) : Qnil;
+}
+
+static VALUE heap_clear(VALUE self) {
+	cheap *heap = get_heap_from_self(self);
+	long i;
+	for (i = 0; i < heap->size; i++) heap_entries_release(&heap->table, heap->nodes[i].id);
+	heap->size = 0;
+	heap->table.index = Qnil;
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *     has_key?(key) -> true or false
+ *
+ * Returns true if heap contains the key.
+ *
+ * Complexity: O(1)
+ */
+static VALUE heap_has_key(VALUE self, VALUE key) {
+	return heap_find(get_heap_from_self(self), key) >= 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *     delete(key) -> value
+ *     delete(key) -> nil
+ *
+ * Deletes the item with associated key and returns its value, or nil if the key is not
+ * found. In the case of duplicate keys, an arbitrary one is deleted.
+ *
+ * Complexity: O(log n)
+ */
+static VALUE heap_delete(VALUE self, VALUE key) {
+	cheap *heap = get_heap_from_self(self);
+	long id = heap_find(heap, key);
+	return id < 0 ? Qnil : heap_remove_at(heap, heap->table.entries[id].pos);
+}
+
+/*
+ * call-seq:
+ *     change_key(key, new_key) -> [new_key, value]
+ *     change_key(key, new_key) -> nil
+ *
+ * Changes the key of an item from key to new_key, which must not come out of the heap
+ * later than key, or an exception is raised. Returns the new key and value, or nil if the
+ * key is not found. In the case of duplicate keys, an arbitrary one is changed.
+ *
+ * Complexity: O(log n)
+ */
+static VALUE heap_change_key(int argc, VALUE *argv, VALUE self) {
+	cheap *heap = get_heap_from_self(self);
+	VALUE key, new_key, del;
+	long id, pos;
+
+	rb_scan_args(argc, argv, "21", &key, &new_key, &del);
+	id = heap_find(heap, key);
+	if (id < 0) return Qnil;
+	if (RTEST(del)) return rb_ary_new3(2, new_key, heap_remove_at(heap, heap->table.entries[id].pos));
+	if (rb_equal(key, new_key)) return Qnil;
+	if (!heap_before(heap, new_key, key)) rb_raise(rb_eRuntimeError, "Changing this key would not maintain heap property!");
+	// The comparison may have run Ruby code that changed the heap
+	id = heap_find(heap, key);
+	if (id < 0) return Qnil;
+
+	pos = heap->table.entries[id].pos;
+	heap_entries_rekey(&heap->table, key, new_key, id);
+	heap->nodes[pos].key = new_key;
+	heap_sift_up(heap, pos);
+	return rb_ary_new3(2, new_key, heap->table.entries[id].value);
+}
+
+/*
+ * call-seq:
+ *     merge!(otherheap) -> merged_heap
+ *
+ * Adds copies of all the items in the other heap, which is left unchanged.
+ *
+ * Complexity: O(m log(n + m)) for a small other heap, O(n + m) for a large one
+ */
+static VALUE heap_merge(VALUE self, VALUE other) {
+	cheap *heap = get_heap_from_self(self), *other_heap;
+	long i, m, old_size = heap->size;
+
+	if (!rb_obj_is_kind_of(other, cHeap)) rb_raise(rb_eArgError, "Trying to merge a heap with something not a heap");
+	other_heap = get_heap_from_self(other);
+	m = other_heap->size;
+	for (i = 0; i < m; i++) {
+		heap_node node = other_heap->nodes[i];
+		heap_append(heap, node.key, other_heap->table.entries[node.id].value);
+	}
+	// Re-heapifying everything beats m sift-ups once m is a fair share of the heap
+	if (m > old_size / 4) {
+		heap_heapify(heap);
+	} else {
+		for (i = old_size; i < heap->size; i++) heap_sift_up(heap, i);
+	}
+	RB_GC_GUARD(other);
+	return self;
+}
+
+void Init_CHeap() {
+	id_cmp = rb_intern("<=>");
+	id_call = rb_intern("call");
+	id_min = rb_intern("min");
+	id_max = rb_intern("max");
+
+	mContainers = rb_define_module("Containers");
+	cHeap = rb_define_class_under(mContainers, "CHeap", rb_cObject);
+	rb_define_alloc_func(cHeap, heap_alloc);
+	rb_define_method(cHeap, "initialize", heap_init, -1);
+	rb_define_method(cHeap, "push", heap_push, -1);
+	rb_define_alias(cHeap, "<<", "push");
+	rb_define_method(cHeap, "size", heap_size, 0);
+	rb_define_alias(cHeap, "length", "size");
+	rb_define_method(cHeap, "empty?", heap_is_empty, 0);
+	rb_define_method(cHeap, "next", heap_next, 0);
+	rb_define_method(cHeap, "next_key", heap_next_key, 0);
+	rb_define_method(cHeap, "pop", heap_pop, 0);
+	rb_define_alias(cHeap, "next!", "pop");
+	rb_define_method(cHeap, "clear", heap_clear, 0);
+	rb_define_method(cHeap, "has_key?", heap_has_key, 1);
+	rb_define_method(cHeap, "delete", heap_delete, 1);
+	rb_define_method(cHeap, "change_key", heap_change_key, -1);
+	rb_define_method(cHeap, "merge!", heap_merge, 1);
+	Init_radix_heap(mContainers);
+}
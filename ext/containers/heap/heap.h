@@ -0,0 +1,47 @@
+#ifndef CONTAINERS_HEAP_H
+#define CONTAINERS_HEAP_H
+
+#include "ruby.h"
+
+/*
+ * Item bookkeeping shared by CHeap and RadixHeap.
+ *
+ * Every item lives in an entry slot whose id never changes while the item is in the heap;
+ * the heap array (or bucket) holds the item's key together with its entry id, and the
+ * entry remembers where in there the item is. has_key?, delete and change_key find items
+ * through a Hash from key to entry id, which is only built the first time one of them is
+ * called, so plain push/pop workloads never pay for it. Entries with equal keys are
+ * chained together.
+ */
+
+typedef struct {
+	VALUE key;
+	long id;
+} heap_node;
+
+typedef struct {
+	VALUE value;
+	long pos;         // position of the item's node, or -1 if the entry is free
+	long next_same;   // next entry with an equal key, or the next free entry
+	long prev_same;
+} heap_entry;
+
+typedef struct {
+	heap_entry *entries;
+	long capa;
+	long free_entry;
+	VALUE index;      // key => id of an entry with that key, or nil until first needed
+} heap_entries;
+
+void heap_entries_init(heap_entries *table);
+void heap_entries_destroy(heap_entries *table);
+long heap_entries_add(heap_entries *table, VALUE key, VALUE value);
+void heap_entries_release(heap_entries *table, long id);
+void heap_entries_remove(heap_entries *table, VALUE key, long id);
+void heap_entries_rekey(heap_entries *table, VALUE key, VALUE new_key, long id);
+void heap_index_link(heap_entries *table, VALUE key, long id);
+long heap_index_lookup(heap_entries *table, VALUE key);
+
+void Init_radix_heap(VALUE mContainers);
+
+#endif
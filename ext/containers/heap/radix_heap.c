@@ -0,0 +1,392 @@
+#include "heap.h"
+
+/*
+ * A radix heap: a min-priority queue for non-negative Integer keys that never go below
+ * the last key popped, as in Dijkstra's algorithm.
+ *
+ * Bucket 0 holds the items whose key equals the last popped key, and bucket b > 0 those
+ * whose key first differs from it in bit b - 1. Pushes and decreases just append to a
+ * bucket. When bucket 0 runs dry, the lowest non-empty bucket is emptied into the ones
+ * below it around its smallest key, which becomes the new last key. Every item moves
+ * down at most 64 times, whatever the number of items, so no operation ever compares two
+ * keys in a heap.
+ */
+
+#define RADIX_BUCKETS 65
+
+typedef struct {
+	heap_node *nodes;
+	long len;
+	long capa;
+} radix_bucket;
+
+typedef struct {
+	radix_bucket buckets[RADIX_BUCKETS];
+	long size;
+	uint64_t last;
+	heap_entries table;
+} radix_heap;
+
+static VALUE cRadixHeap;
+
+static radix_heap* get_radix_heap_from_self(VALUE self) {
+	radix_heap *heap;
+	Data_Get_Struct(self, radix_heap, heap);
+	return heap;
+}
+
+static void radix_heap_mark(void *ptr) {
+	if (ptr) {
+		radix_heap *heap = ptr;
+		int b;
+		long i;
+		for (b = 0; b < RADIX_BUCKETS; b++) {
+			for (i = 0; i < heap->buckets[b].len; i++) {
+				rb_gc_mark(heap->table.entries[heap->buckets[b].nodes[i].id].value);
+			}
+		}
+		rb_gc_mark(heap->table.index);
+	}
+}
+
+static void radix_heap_free(void *ptr) {
+	if (ptr) {
+		radix_heap *heap = ptr;
+		int b;
+		for (b = 0; b < RADIX_BUCKETS; b++) xfree(heap->buckets[b].nodes);
+		heap_entries_destroy(&heap->table);
+		xfree(heap);
+	}
+}
+
+static VALUE radix_heap_alloc(VALUE klass) {
+	radix_heap *heap = ALLOC(radix_heap);
+	int b;
+	for (b = 0; b < RADIX_BUCKETS; b++) {
+		heap->buckets[b].nodes = NULL;
+		heap->buckets[b].len = 0;
+		heap->buckets[b].capa = 0;
+	}
+	heap->size = 0;
+	heap->last = 0;
+	heap_entries_init(&heap->table);
+	return Data_Wrap_Struct(klass, radix_heap_mark, radix_heap_free, heap);
+}
+
+static uint64_t radix_key(VALUE key) {
+	if (!FIXNUM_P(key) || FIX2LONG(key) < 0) {
+		rb_raise(rb_eArgError, "RadixHeap keys must be non-negative Integers (Fixnums)");
+	}
+	return (uint64_t) FIX2LONG(key);
+}
+
+static int radix_bucket_of(radix_heap *heap, uint64_t key) {
+	uint64_t diff = key ^ heap->last;
+#ifdef __GNUC__
+	return diff ? 64 - __builtin_clzll(diff) : 0;
+#else
+	int b = 0;
+	while (diff) {
+		diff >>= 1;
+		b++;
+	}
+	return b;
+#endif
+}
+
+static void radix_bucket_append(radix_heap *heap, int b, heap_node node) {
+	radix_bucket *bucket = &heap->buckets[b];
+	if (bucket->len == bucket->capa) {
+		bucket->capa = bucket->capa ? 2 * bucket->capa : 8;
+		REALLOC_N(bucket->nodes, heap_node, bucket->capa);
+	}
+	heap->table.entries[node.id].pos = bucket->len;
+	bucket->nodes[bucket->len++] = node;
+}
+
+// Takes the node at pos out of bucket b, moving the bucket's last node into its place
+static heap_node radix_bucket_take(radix_heap *heap, int b, long pos) {
+	radix_bucket *bucket = &heap->buckets[b];
+	heap_node node = bucket->nodes[pos];
+	if (pos != --bucket->len) {
+		bucket->nodes[pos] = bucket->nodes[bucket->len];
+		heap->table.entries[bucket->nodes[pos].id].pos = pos;
+	}
+	return node;
+}
+
+// Makes bucket 0 non-empty, unless the heap is
+static void radix_heap_refill(radix_heap *heap) {
+	radix_bucket *bucket;
+	uint64_t min;
+	long i;
+	int b = 1;
+
+	if (heap->size == 0 || heap->buckets[0].len > 0) return;
+	while (heap->buckets[b].len == 0) b++;
+	bucket = &heap->buckets[b];
+	min = FIX2LONG(bucket->nodes[0].key);
+	for (i = 1; i < bucket->len; i++) {
+		uint64_t key = FIX2LONG(bucket->nodes[i].key);
+		if (key < min) min = key;
+	}
+	// Every key in bucket b now first differs from last below bit b - 1
+	heap->last = min;
+	for (i = 0; i < bucket->len; i++) {
+		heap_node node = bucket->nodes[i];
+		radix_bucket_append(heap, radix_bucket_of(heap, FIX2LONG(node.key)), node);
+	}
+	bucket->len = 0;
+}
+
+// An item with the smallest key, without moving anything: last must stay the last key
+// popped, or pushes after a peek could be refused
+static heap_node* radix_heap_peek(radix_heap *heap) {
+	radix_bucket *bucket;
+	heap_node *min;
+	long i;
+	int b = 0;
+
+	while (heap->buckets[b].len == 0) b++;
+	bucket = &heap->buckets[b];
+	min = &bucket->nodes[bucket->len - 1];
+	if (b == 0) return min;
+	// Ties go to the highest position, which is the one refilling moves into bucket 0 last
+	for (i = bucket->len - 2; i >= 0; i--) {
+		if (FIX2LONG(bucket->nodes[i].key) < FIX2LONG(min->key)) min = &bucket->nodes[i];
+	}
+	return min;
+}
+
+static void radix_heap_insert(radix_heap *heap, VALUE key, VALUE value) {
+	uint64_t k = radix_key(key);
+	heap_node node;
+	if (k < heap->last) {
+		rb_raise(rb_eArgError, "key %lu is smaller than the last key popped, %lu", (unsigned long) k, (unsigned long) heap->last);
+	}
+	node.key = key;
+	node.id = heap_entries_add(&heap->table, key, value);
+	radix_bucket_append(heap, radix_bucket_of(heap, k), node);
+	heap->size++;
+}
+
+// Id of an entry with key, or -1
+static long radix_heap_find(radix_heap *heap, VALUE key) {
+	int b;
+	long i;
+	if (NIL_P(heap->table.index)) {
+		heap->table.index = rb_hash_new();
+		for (b = 0; b < RADIX_BUCKETS; b++) {
+			for (i = 0; i < heap->buckets[b].len; i++) {
+				heap_index_link(&heap->table, heap->buckets[b].nodes[i].key, heap->buckets[b].nodes[i].id);
+			}
+		}
+	}
+	return heap_index_lookup(&heap->table, key);
+}
+
+// Takes the item with entry id out of the heap and returns its value
+static VALUE radix_heap_remove(radix_heap *heap, VALUE key, long id) {
+	int b = radix_bucket_of(heap, FIX2LONG(key));
+	heap_node node = radix_bucket_take(heap, b, heap->table.entries[id].pos);
+	VALUE value = heap->table.entries[id].value;
+	heap_entries_remove(&heap->table, node.key, node.id);
+	heap->size--;
+	return value;
+}
+
+/*
+ * call-seq:
+ *     RadixHeap.new(optional_array) -> new_heap
+ *
+ * Creates a radix heap, pushing the non-negative Integers of the optional array with each
+ * element as both key and value.
+ */
+static VALUE radix_heap_init(int argc, VALUE *argv, VALUE self) {
+	radix_heap *heap = get_radix_heap_from_self(self);
+	VALUE ary;
+	long i;
+
+	rb_scan_args(argc, argv, "01", &ary);
+	if (NIL_P(ary)) return self;
+	ary = rb_Array(ary);
+	for (i = 0; i < RARRAY_LEN(ary); i++) radix_heap_insert(heap, RARRAY_AREF(ary, i), RARRAY_AREF(ary, i));
+	return self;
+}
+
+/*
+ * call-seq:
+ *     push(key, value) -> value
+ *     push(key) -> key
+ *
+ * Inserts an item with a non-negative Integer key, which must not be smaller than the
+ * last key popped, into the heap.
+ *
+ * Complexity: O(1)
+ */
+static VALUE radix_heap_push(int argc, VALUE *argv, VALUE self) {
+	VALUE key, value;
+	rb_scan_args(argc, argv, "11", &key, &value);
+	if (argc == 1) value = key;
+	radix_heap_insert(get_radix_heap_from_self(self), key, value);
+	return value;
+}
+
+static VALUE radix_heap_size(VALUE self) {
+	return LONG2NUM(get_radix_heap_from_self(self)->size);
+}
+
+static VALUE radix_heap_is_empty(VALUE self) {
+	return get_radix_heap_from_self(self)->size == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *     next -> value
+ *     next -> nil
+ *
+ * Returns the value of the item pop would return, but does not remove it.
+ *
+ * Complexity: O(1) if the smallest key equals the last key popped, otherwise linear in
+ * the number of items sharing its bucket
+ */
+static VALUE radix_heap_next(VALUE self) {
+	radix_heap *heap = get_radix_heap_from_self(self);
+	return heap->size ? heap->table.entries[radix_heap_peek(heap)->id].value : Qnil;
+}
+
+/*
+ * call-seq:
+ *     next_key -> key
+ *     next_key -> nil
+ *
+ * Returns the smallest key in the heap.
+ *
+ * Complexity: as for next
+ */
+static VALUE radix_heap_next_key(VALUE self) {
+	radix_heap *heap = get_radix_heap_from_self(self);
+	return heap->size ? radix_heap_peek(heap)->key : Qnil;
+}
+
+/*
+ * call-seq:
+ *     pop -> value
+ *     pop -> nil
+ *
+ * Returns the value of an item with the smallest key and removes it from the heap. Keys
+ * pushed from now on must not be smaller than its key.
+ *
+ * Complexity: amortized O(lg C), where C is the largest key pushed minus the last key
+ * popped; never more than 64 bucket moves per item
+ */
+static VALUE radix_heap_pop(VALUE self) {
+	radix_heap *heap = get_radix_heap_from_self(self);
+	radix_bucket *bucket = &heap->buckets[0];
+	heap_node node;
+
+	radix_heap_refill(heap);
+	if (heap->size == 0) return Qnil;
+	node = bucket->nodes[bucket->len - 1];
+	return radix_heap_remove(heap, node.key, node.id);
+}
+
+/*
+ * call-seq:
+ *     last_key -> key
+ *
+ * Returns the last key popped (0 before the first pop), the smallest key push accepts.
+ */
+static VALUE radix_heap_last_key(VALUE self) {
+	return ULONG2NUM(get_radix_heap_from_self(self)->last);
+}
+
+/*
+ * call-seq:
+ *     clear -> nil
+ *
+ * Removes all items, and forgets the last key popped.
+ */
+static VALUE radix_heap_clear(VALUE self) {
+	radix_heap *heap = get_radix_heap_from_self(self);
+	int b;
+	long i;
+	for (b = 0; b < RADIX_BUCKETS; b++) {
+		for (i = 0; i < heap->buckets[b].len; i++) heap_entries_release(&heap->table, heap->buckets[b].nodes[i].id);
+		heap->buckets[b].len = 0;
+	}
+	heap->size = 0;
+	heap->last = 0;
+	heap->table.index = Qnil;
+	return Qnil;
+}
+
+static VALUE radix_heap_has_key(VALUE self, VALUE key) {
+	return radix_heap_find(get_radix_heap_from_self(self), key) >= 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *     delete(key) -> value
+ *     delete(key) -> nil
+ *
+ * Deletes an item with the key and returns its value, or nil if the key is not found.
+ *
+ * Complexity: O(1)
+ */
+static VALUE radix_heap_delete(VALUE self, VALUE key) {
+	radix_heap *heap = get_radix_heap_from_self(self);
+	long id = radix_heap_find(heap, key);
+	return id < 0 ? Qnil : radix_heap_remove(heap, key, id);
+}
+
+/*
+ * call-seq:
+ *     change_key(key, new_key) -> [new_key, value]
+ *     change_key(key, new_key) -> nil
+ *
+ * Decreases the key of an item from key to new_key, which must be no greater than key
+ * and no smaller than the last key popped, or an exception is raised. Returns the new key
+ * and value, or nil if the key is not found. In the case of duplicate keys, an arbitrary
+ * one is changed.
+ *
+ * Complexity: O(1)
+ */
+static VALUE radix_heap_change_key(VALUE self, VALUE key, VALUE new_key) {
+	radix_heap *heap = get_radix_heap_from_self(self);
+	uint64_t k = radix_key(new_key);
+	heap_node node;
+	long id = radix_heap_find(heap, key);
+
+	if (id < 0 || key == new_key) return Qnil;
+	if (k > (uint64_t) FIX2LONG(key)) rb_raise(rb_eRuntimeError, "Changing this key would not maintain heap property!");
+	if (k < heap->last) {
+		rb_raise(rb_eArgError, "key %lu is smaller than the last key popped, %lu", (unsigned long) k, (unsigned long) heap->last);
+	}
+	node = radix_bucket_take(heap, radix_bucket_of(heap, FIX2LONG(key)), heap->table.entries[id].pos);
+	heap_entries_rekey(&heap->table, key, new_key, id);
+	node.key = new_key;
+	radix_bucket_append(heap, radix_bucket_of(heap, k), node);
+	return rb_ary_new3(2, new_key, heap->table.entries[id].value);
+}
+
+void Init_radix_heap(VALUE mContainers) {
+	cRadixHeap = rb_define_class_under(mContainers, "RadixHeap", rb_cObject);
+	rb_define_alloc_func(cRadixHeap, radix_heap_alloc);
+	rb_define_method(cRadixHeap, "initialize", radix_heap_init, -1);
+	rb_define_method(cRadixHeap, "push", radix_heap_push, -1);
+	rb_define_alias(cRadixHeap, "<<", "push");
+	rb_define_method(cRadixHeap, "size", radix_heap_size, 0);
+	rb_define_alias(cRadixHeap, "length", "size");
+	rb_define_method(cRadixHeap, "empty?", radix_heap_is_empty, 0);
+	rb_define_method(cRadixHeap, "next", radix_heap_next, 0);
+	rb_define_method(cRadixHeap, "next_key", radix_heap_next_key, 0);
+	rb_define_method(cRadixHeap, "pop", radix_heap_pop, 0);
+	rb_define_alias(cRadixHeap, "next!", "pop");
+	rb_define_method(cRadixHeap, "last_key", radix_heap_last_key, 0);
+	rb_define_method(cRadixHeap, "clear", radix_heap_clear, 0);
+	rb_define_method(cRadixHeap, "has_key?", radix_heap_has_key, 1);
+	rb_define_method(cRadixHeap, "delete", radix_heap_delete, 1);
+	rb_define_method(cRadixHeap, "change_key", radix_heap_change_key, 2);
+	rb_define_alias(cRadixHeap, "decrease_key", "change_key");
+}
@@ -0,0 +1,7 @@
+require 'mkmf'
+extension_name = "CKDTree"
+have_header("pthread.h")
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+dir_config(extension_name)
+create_makefile(extension_name)
@@ -0,0 +1,987 @@
+#include "ruby.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <unistd.h>
+
+/*
+ * A kd-tree over points of any dimension.
+ *
+ * The points live in a forest of static trees, or blocks, where block b holds at most 2^b
+ * of them (Bentley and Saxe's logarithmic method). A block has no nodes: its points are
+ * stored in tree order in one array of doubles, and the subtree over positions [lo, hi)
+ * splits at its middle position on axis depth % dim, with the left half below it and the
+ * right half above it on that axis. Ranges of KD_LEAF_SIZE points or fewer are leaves that
+ * are scanned in order. Building selects each median in linear time, so a block of n points
+ * takes O(n log n).
+ *
+ * Inserting a point merges it with every block below the first empty one into that one,
+ * which is O(log^2 n) amortized. Deleting a point leaves a tombstone that searches step
+ * over, and a block is rebuilt from its live points once half of it is dead, so dead points
+ * never make up more than half the forest.
+ *
+ * Every point has an entry, numbered in insertion order, that holds its id and where it is
+ * in the forest. Entry numbers break ties between distances. They are renumbered, keeping
+ * their order, once deleted entries outnumber live ones.
+ *
+ * Nearest neighbour searches keep the best k candidates of all blocks in one max-heap, so
+ * the current k-th distance bounds which subtrees are worth visiting. find_nearest_many
+ * answers a batch of them on native threads without the GVL, a block of queries at a time,
+ * writing each heap into its slot of a shared result buffer.
+ */
+
+#define KD_LEAF_SIZE 8
+#define KD_MAX_BLOCKS 64
+#define KD_MAX_THREADS 256
+// Most queries per release of the GVL in find_nearest_many
+#define KD_BATCH_SIZE 16384
+// Most neighbours a batch holds, which bounds its result buffer unless k alone is larger
+#define KD_BATCH_RESULTS (1L << 20)
+// Fewest queries worth a thread of their own
+#define KD_MIN_QUERIES 256
+
+typedef struct {
+	long size;          // positions, dead ones included
+	long dead;
+	double *coords;     // size * dim, in tree order
+	long *entry;        // entry of each position, or -1 once deleted
+} kd_block;
+
+typedef struct {
+	int dim;
+	int integral;           // every coordinate is an Integer, so distances can be too
+	long live;              // points in the tree
+	long num_entries;
+	long entries_capa;
+	signed char *entry_block;   // block of each entry, or -1 if it was deleted
+	long *entry_pos;            // position of each entry in its block
+	kd_block blocks[KD_MAX_BLOCKS];
+	VALUE ids;              // by entry; nil for deleted entries
+	VALUE index;            // id => entry, or nil until the tree is first modified
+	long busy;              // running batches, which read the tree without the GVL
+} kd_tree;
+
+typedef struct {
+	double *dist;
+	long *entry;
+	long size;
+	long k;
+} kd_heap;
+
+typedef struct {
+	double dist;
+	long entry;
+} kd_match;
+
+typedef struct {
+	VALUE buf;          // a String holding the matches, so nothing leaks if Ruby raises
+	kd_match *matches;
+	long size;
+	long capa;
+} kd_matches;
+
+typedef struct {
+	const kd_tree *tree;
+	double *targets;        // num_queries * dim
+	long num_queries;
+	long k;
+	double *dist;           // k per query
+	long *entry;
+	long *found;            // number of results of each query
+	long num_threads;
+	volatile int cancel;
+} kd_batch_job;
+
+typedef struct {
+	kd_batch_job *job;
+	long index;
+} kd_batch_worker;
+
+static kd_tree* get_kd_tree_from_self(VALUE self) {
+	kd_tree *tree;
+	Data_Get_Struct(self, kd_tree, tree);
+	return tree;
+}
+
+static void kd_tree_mark(void *ptr) {
+	if (ptr) {
+		kd_tree *tree = ptr;
+		rb_gc_mark(tree->ids);
+		rb_gc_mark(tree->index);
+	}
+}
+
+static void kd_block_clear(kd_block *blk) {
+	xfree(blk->coords);
+	xfree(blk->entry);
+	blk->coords = NULL;
+	blk->entry = NULL;
+	blk->size = blk->dead = 0;
+}
+
+static void kd_tree_free(void *ptr) {
+	if (ptr) {
+		kd_tree *tree = ptr;
+		int b;
+		for (b = 0; b < KD_MAX_BLOCKS; b++) kd_block_clear(&tree->blocks[b]);
+		xfree(tree->entry_block);
+		xfree(tree->entry_pos);
+		xfree(tree);
+	}
+}
+
+static VALUE kd_tree_alloc(VALUE klass) {
+	kd_tree *tree = ALLOC(kd_tree);
+	memset(tree, 0, sizeof(kd_tree));
+	tree->integral = 1;
+	tree->ids = rb_ary_new();
+	tree->index = Qnil;
+	return Data_Wrap_Struct(klass, kd_tree_mark, kd_tree_free, tree);
+}
+
+static inline double kd_distance2(const double *a, const double *b, int dim) {
+	double sum = 0;
+	int i;
+	for (i = 0; i < dim; i++) {
+		double d = a[i] - b[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+// Orders candidates by distance, then by entry, which is insertion order
+static inline int kd_heap_worse(double d1, long e1, double d2, long e2) {
+	return d1 > d2 || (d1 == d2 && e1 > e2);
+}
+
+static void kd_heap_offer(kd_heap *h, double d, long entry) {
+	long i, child;
+	if (h->size < h->k) {
+		for (i = h->size++; i > 0; i = (i - 1) / 2) {
+			long parent = (i - 1) / 2;
+			if (!kd_heap_worse(d, entry, h->dist[parent], h->entry[parent])) break;
+			h->dist[i] = h->dist[parent];
+			h->entry[i] = h->entry[parent];
+		}
+		h->dist[i] = d;
+		h->entry[i] = entry;
+		return;
+	}
+	if (!kd_heap_worse(h->dist[0], h->entry[0], d, entry)) return;
+	for (i = 0; (child = 2 * i + 1) < h->size; i = child) {
+		if (child + 1 < h->size && kd_heap_worse(h->dist[child + 1], h->entry[child + 1], h->dist[child], h->entry[child])) child++;
+		if (!kd_heap_worse(h->dist[child], h->entry[child], d, entry)) break;
+		h->dist[i] = h->dist[child];
+		h->entry[i] = h->entry[child];
+	}
+	h->dist[i] = d;
+	h->entry[i] = entry;
+}
+
+// Sorts the heap's candidates closest first, in place
+static void kd_heap_sort(kd_heap *h) {
+	long size = h->size;
+	while (h->size > 1) {
+		double d = h->dist[h->size - 1];
+		long entry = h->entry[h->size - 1], i, child;
+		h->dist[h->size - 1] = h->dist[0];
+		h->entry[h->size - 1] = h->entry[0];
+		h->size--;
+		for (i = 0; (child = 2 * i + 1) < h->size; i = child) {
+			if (child + 1 < h->size && kd_heap_worse(h->dist[child + 1], h->entry[child + 1], h->dist[child], h->entry[child])) child++;
+			if (!kd_heap_worse(h->dist[child], h->entry[child], d, entry)) break;
+			h->dist[i] = h->dist[child];
+			h->entry[i] = h->entry[child];
+		}
+		h->dist[i] = d;
+		h->entry[i] = entry;
+	}
+	h->size = size;
+}
+
+static void kd_nearest(const kd_block *blk, int dim, const double *target, long lo, long hi, int axis, kd_heap *h) {
+	while (hi - lo > KD_LEAF_SIZE) {
+		long mid = lo + (hi - lo) / 2;
+		const double *p = blk->coords + mid * dim;
+		double diff = target[axis] - p[axis];
+		int next = axis + 1 == dim ? 0 : axis + 1;
+		if (blk->entry[mid] >= 0) kd_heap_offer(h, kd_distance2(p, target, dim), blk->entry[mid]);
+		if (diff < 0) {
+			kd_nearest(blk, dim, target, lo, mid, next, h);
+			lo = mid + 1;
+		} else {
+			kd_nearest(blk, dim, target, mid + 1, hi, next, h);
+			hi = mid;
+		}
+		// Ties on the splitting axis may sit on either side
+		if (h->size == h->k && diff * diff > h->dist[0]) return;
+		axis = next;
+	}
+	for (; lo < hi; lo++) {
+		if (blk->entry[lo] >= 0) kd_heap_offer(h, kd_distance2(blk->coords + lo * dim, target, dim), blk->entry[lo]);
+	}
+}
+
+static void kd_nearest_all(const kd_tree *tree, const double *target, kd_heap *h) {
+	int b;
+	for (b = KD_MAX_BLOCKS - 1; b >= 0; b--) {
+		if (tree->blocks[b].size > 0) kd_nearest(&tree->blocks[b], tree->dim, target, 0, tree->blocks[b].size, 0, h);
+	}
+}
+
+static void kd_matches_push(kd_matches *m, double dist, long entry) {
+	if (m->size == m->capa) {
+		m->capa = m->capa ? m->capa * 2 : 64;
+		rb_str_resize(m->buf, m->capa * sizeof(kd_match));
+		m->matches = (kd_match *) RSTRING_PTR(m->buf);
+	}
+	m->matches[m->size].dist = dist;
+	m->matches[m->size].entry = entry;
+	m->size++;
+}
+
+// Every point within squared distance r2 of target; counted only if m is NULL
+static long kd_radius(const kd_block *blk, int dim, const double *target, double r2, long lo, long hi, int axis, kd_matches *m) {
+	long count = 0;
+	while (hi - lo > KD_LEAF_SIZE) {
+		long mid = lo + (hi - lo) / 2;
+		const double *p = blk->coords + mid * dim;
+		double diff = target[axis] - p[axis], d = kd_distance2(p, target, dim);
+		int next = axis + 1 == dim ? 0 : axis + 1;
+		if (d <= r2 && blk->entry[mid] >= 0) {
+			count++;
+			if (m) kd_matches_push(m, d, blk->entry[mid]);
+		}
+		if (diff * diff <= r2) {
+			count += kd_radius(blk, dim, target, r2, lo, mid, next, m);
+			lo = mid + 1;
+		} else if (diff < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+		axis = next;
+	}
+	for (; lo < hi; lo++) {
+		double d = kd_distance2(blk->coords + lo * dim, target, dim);
+		if (d <= r2 && blk->entry[lo] >= 0) {
+			count++;
+			if (m) kd_matches_push(m, d, blk->entry[lo]);
+		}
+	}
+	return count;
+}
+
+static inline int kd_in_box(const double *p, const double *min, const double *max, int dim) {
+	int i;
+	for (i = 0; i < dim; i++) {
+		if (p[i] < min[i] || p[i] > max[i]) return 0;
+	}
+	return 1;
+}
+
+static void kd_box(const kd_block *blk, int dim, const double *min, const double *max, long lo, long hi, int axis, kd_matches *m) {
+	while (hi - lo > KD_LEAF_SIZE) {
+		long mid = lo + (hi - lo) / 2;
+		const double *p = blk->coords + mid * dim;
+		int next = axis + 1 == dim ? 0 : axis + 1;
+		if (blk->entry[mid] >= 0 && kd_in_box(p, min, max, dim)) kd_matches_push(m, 0, blk->entry[mid]);
+		if (min[axis] <= p[axis] && max[axis] >= p[axis]) {
+			kd_box(blk, dim, min, max, lo, mid, next, m);
+			lo = mid + 1;
+		} else if (max[axis] < p[axis]) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+		axis = next;
+	}
+	for (; lo < hi; lo++) {
+		if (blk->entry[lo] >= 0 && kd_in_box(blk->coords + lo * dim, min, max, dim)) kd_matches_push(m, 0, blk->entry[lo]);
+	}
+}
+
+static int kd_match_cmp(const void *a, const void *b) {
+	const kd_match *x = a, *y = b;
+	if (x->dist != y->dist) return x->dist < y->dist ? -1 : 1;
+	return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+// Rearranges perm[lo, hi) so that perm[k] holds the point that sorts there on axis, with none
+// above it to its left and none below it to its right
+static void kd_select(long *perm, long lo, long hi, long k, const double *coords, int dim, int axis) {
+	while (hi - lo > 1) {
+		long i = lo, j = hi - 1, mid = lo + (hi - lo) / 2, t;
+		double a = coords[perm[lo] * dim + axis], b = coords[perm[mid] * dim + axis], c = coords[perm[hi - 1] * dim + axis];
+		double pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+		while (i <= j) {
+			while (coords[perm[i] * dim + axis] < pivot) i++;
+			while (coords[perm[j] * dim + axis] > pivot) j--;
+			if (i <= j) {
+				t = perm[i];
+				perm[i] = perm[j];
+				perm[j] = t;
+				i++;
+				j--;
+			}
+		}
+		if (k <= j) hi = j + 1;
+		else if (k >= i) lo = i;
+		else return;
+	}
+}
+
+static void kd_build(long *perm, long lo, long hi, int axis, const double *coords, int dim) {
+	while (hi - lo > KD_LEAF_SIZE) {
+		long mid = lo + (hi - lo) / 2;
+		int next = axis + 1 == dim ? 0 : axis + 1;
+		kd_select(perm, lo, hi, mid, coords, dim, axis);
+		kd_build(perm, lo, mid, next, coords, dim);
+		lo = mid + 1;
+		axis = next;
+	}
+}
+
+// Builds block b, which must be empty, from n points and their entries
+static void kd_block_build(kd_tree *tree, int b, const double *coords, const long *entries, long n) {
+	kd_block *blk = &tree->blocks[b];
+	VALUE perm_v = 0;
+	long *perm, i;
+	int dim = tree->dim;
+
+	if (n == 0) return;
+	perm = ALLOCV_N(long, perm_v, n);
+	for (i = 0; i < n; i++) perm[i] = i;
+	kd_build(perm, 0, n, 0, coords, dim);
+	blk->coords = ALLOC_N(double, n * dim);
+	blk->entry = ALLOC_N(long, n);
+	for (i = 0; i < n; i++) {
+		long e = entries[perm[i]];
+		memcpy(blk->coords + i * dim, coords + perm[i] * dim, dim * sizeof(double));
+		blk->entry[i] = e;
+		tree->entry_block[e] = (signed char) b;
+		tree->entry_pos[e] = i;
+	}
+	blk->size = n;
+	blk->dead = 0;
+	ALLOCV_END(perm_v);
+}
+
+// Copies the live points of block b to the end of coords and entries, then empties it
+static long kd_block_drain(kd_tree *tree, int b, double *coords, long *entries, long n) {
+	kd_block *blk = &tree->blocks[b];
+	long i;
+	for (i = 0; i < blk->size; i++) {
+		if (blk->entry[i] < 0) continue;
+		memcpy(coords + n * tree->dim, blk->coords + i * tree->dim, tree->dim * sizeof(double));
+		entries[n++] = blk->entry[i];
+	}
+	kd_block_clear(blk);
+	return n;
+}
+
+// Places entry at point, merging it with every block below the first empty one
+static void kd_insert_entry(kd_tree *tree, long entry, const double *point) {
+	VALUE coords_v = 0, entries_v = 0;
+	double *coords;
+	long *entries, n = 1;
+	int b, j;
+
+	for (j = 0; j < KD_MAX_BLOCKS && tree->blocks[j].size > 0; j++) n += tree->blocks[j].size - tree->blocks[j].dead;
+	coords = ALLOCV_N(double, coords_v, n * tree->dim);
+	entries = ALLOCV_N(long, entries_v, n);
+	memcpy(coords, point, tree->dim * sizeof(double));
+	entries[0] = entry;
+	n = 1;
+	for (b = 0; b < j; b++) n = kd_block_drain(tree, b, coords, entries, n);
+	kd_block_build(tree, j, coords, entries, n);
+	ALLOCV_END(entries_v);
+	ALLOCV_END(coords_v);
+}
+
+// Leaves a tombstone where entry was, and rebuilds its block once half of it is dead
+static void kd_remove_entry(kd_tree *tree, long entry) {
+	int b = tree->entry_block[entry];
+	kd_block *blk = &tree->blocks[b];
+	blk->entry[tree->entry_pos[entry]] = -1;
+	blk->dead++;
+	tree->entry_block[entry] = -1;
+	if (blk->dead * 2 > blk->size) {
+		VALUE coords_v = 0, entries_v = 0;
+		long live = blk->size - blk->dead;
+		double *coords = ALLOCV_N(double, coords_v, (live ? live : 1) * tree->dim);
+		long *entries = ALLOCV_N(long, entries_v, live ? live : 1);
+		live = kd_block_drain(tree, b, coords, entries, 0);
+		kd_block_build(tree, b, coords, entries, live);
+		ALLOCV_END(entries_v);
+		ALLOCV_END(coords_v);
+	}
+}
+
+static void kd_reserve_entries(kd_tree *tree, long n) {
+	if (n <= tree->entries_capa) return;
+	tree->entries_capa = n > 2 * tree->entries_capa ? n : 2 * tree->entries_capa;
+	REALLOC_N(tree->entry_block, signed char, tree->entries_capa);
+	REALLOC_N(tree->entry_pos, long, tree->entries_capa);
+}
+
+// Renumbers the live entries from 0, keeping their order
+static void kd_compact_entries(kd_tree *tree) {
+	VALUE map_v = 0;
+	long *map = ALLOCV_N(long, map_v, tree->num_entries), e, n = 0, i;
+	int b;
+	for (e = 0; e < tree->num_entries; e++) {
+		if (tree->entry_block[e] < 0) continue;
+		map[e] = n;
+		tree->entry_block[n] = tree->entry_block[e];
+		tree->entry_pos[n] = tree->entry_pos[e];
+		rb_ary_store(tree->ids, n, RARRAY_AREF(tree->ids, e));
+		rb_hash_aset(tree->index, RARRAY_AREF(tree->ids, n), LONG2NUM(n));
+		n++;
+	}
+	for (b = 0; b < KD_MAX_BLOCKS; b++) {
+		kd_block *blk = &tree->blocks[b];
+		for (i = 0; i < blk->size; i++) {
+			if (blk->entry[i] >= 0) blk->entry[i] = map[blk->entry[i]];
+		}
+	}
+	rb_ary_resize(tree->ids, n);
+	tree->num_entries = n;
+	ALLOCV_END(map_v);
+}
+
+static VALUE kd_coords(VALUE coords) {
+	VALUE ary = rb_check_array_type(coords);
+	if (NIL_P(ary)) rb_raise(rb_eArgError, "coordinates must be an Array");
+	return ary;
+}
+
+// Reads coords into out, returning whether all of them are Integers
+static int kd_read_coords(VALUE coords, int dim, double *out) {
+	int i, integral = 1;
+	if (RARRAY_LEN(coords) != dim) {
+		rb_raise(rb_eArgError, "expected %d coordinates, got %ld", dim, RARRAY_LEN(coords));
+	}
+	for (i = 0; i < dim; i++) {
+		VALUE c = RARRAY_AREF(coords, i);
+		if (!FIXNUM_P(c)) integral = 0;
+		out[i] = NUM2DBL(c);
+		if (isnan(out[i])) rb_raise(rb_eArgError, "coordinates must not be NaN");
+	}
+	return integral;
+}
+
+/*
+ * call-seq:
+ *     Containers::CKDTree.new(points) -> kd_tree
+ *
+ * Builds a tree from a Hash of id => [coord, coord, ...] pairs. Every point must have as many
+ * coordinates as the first.
+ *
+ * Complexity: O(n log n)
+ */
+static VALUE kd_tree_init(VALUE self, VALUE points) {
+	kd_tree *tree = get_kd_tree_from_self(self);
+	VALUE pairs, entries_v = 0, coords_v = 0;
+	double *coords;
+	long *entries, n, i;
+	int dim, b;
+
+	if (!RB_TYPE_P(points, T_HASH)) rb_raise(rb_eRuntimeError, "must pass in a hash");
+	if (tree->num_entries > 0) rb_raise(rb_eRuntimeError, "KDTree is already initialized");
+	pairs = rb_funcall(points, rb_intern("to_a"), 0);
+	n = RARRAY_LEN(pairs);
+	if (n == 0) return self;
+	dim = (int) RARRAY_LEN(kd_coords(RARRAY_AREF(RARRAY_AREF(pairs, 0), 1)));
+	if (dim == 0) rb_raise(rb_eArgError, "points must have at least one coordinate");
+
+	coords = ALLOCV_N(double, coords_v, n * dim);
+	entries = ALLOCV_N(long, entries_v, n);
+	for (i = 0; i < n; i++) {
+		if (!kd_read_coords(kd_coords(RARRAY_AREF(RARRAY_AREF(pairs, i), 1)), dim, coords + i * dim)) tree->integral = 0;
+		entries[i] = i;
+	}
+	kd_reserve_entries(tree, n);
+	tree->ids = rb_ary_new_capa(n);
+	for (i = 0; i < n; i++) rb_ary_push(tree->ids, RARRAY_AREF(RARRAY_AREF(pairs, i), 0));
+	tree->dim = dim;
+	for (b = 0; (1L << b) < n; b++);
+	kd_block_build(tree, b, coords, entries, n);
+	tree->num_entries = tree->live = n;
+	ALLOCV_END(entries_v);
+	ALLOCV_END(coords_v);
+	RB_GC_GUARD(pairs);
+	return self;
+}
+
+// Raises unless the tree may be modified, and returns its id => entry index
+static VALUE kd_modifiable_index(kd_tree *tree) {
+	long e;
+	if (tree->busy) rb_raise(rb_eRuntimeError, "can't modify KDTree during find_nearest_many");
+	if (NIL_P(tree->index)) {
+		tree->index = rb_hash_new();
+		for (e = 0; e < tree->num_entries; e++) {
+			if (tree->entry_block[e] >= 0) rb_hash_aset(tree->index, RARRAY_AREF(tree->ids, e), LONG2NUM(e));
+		}
+	}
+	return tree->index;
+}
+
+static VALUE kd_tree_move(kd_tree *tree, VALUE id, VALUE coords, int add) {
+	VALUE index = kd_modifiable_index(tree), entry, point_v = 0;
+	double *point;
+	int integral, dim = tree->dim;
+	long e;
+
+	coords = kd_coords(coords);
+	entry = rb_hash_lookup2(index, id, Qnil);
+	if (NIL_P(entry) && !add) return Qfalse;
+	// The first point added to an empty tree decides its dimensions
+	if (dim == 0) {
+		if (RARRAY_LEN(coords) == 0) rb_raise(rb_eArgError, "points must have at least one coordinate");
+		if (RARRAY_LEN(coords) > INT_MAX) rb_raise(rb_eArgError, "too many coordinates");
+		dim = (int) RARRAY_LEN(coords);
+	}
+	point = ALLOCV_N(double, point_v, dim);
+	integral = kd_read_coords(coords, dim, point);
+	tree->dim = dim;
+	if (NIL_P(entry)) {
+		kd_reserve_entries(tree, tree->num_entries + 1);
+		e = tree->num_entries++;
+		tree->entry_block[e] = -1;
+		rb_ary_push(tree->ids, id);
+		rb_hash_aset(index, id, LONG2NUM(e));
+		tree->live++;
+	} else {
+		e = NUM2LONG(entry);
+		kd_remove_entry(tree, e);
+	}
+	kd_insert_entry(tree, e, point);
+	if (!integral) tree->integral = 0;
+	ALLOCV_END(point_v);
+	return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     insert(id, coords) -> self
+ *
+ * Adds a point to the tree, or moves it to coords if id is already there. A moved point
+ * keeps its place in the order that breaks ties between distances.
+ *
+ * Complexity: O(log^2 n) amortized
+ */
+static VALUE kd_tree_insert(VALUE self, VALUE id, VALUE coords) {
+	kd_tree_move(get_kd_tree_from_self(self), id, coords, 1);
+	return self;
+}
+
+/*
+ * call-seq:
+ *     update(id, coords) -> true or false
+ *
+ * Moves the point id to coords. Returns false, and changes nothing, if there is no such
+ * point.
+ *
+ * Complexity: O(log^2 n) amortized
+ */
+static VALUE kd_tree_update(VALUE self, VALUE id, VALUE coords) {
+	return kd_tree_move(get_kd_tree_from_self(self), id, coords, 0);
+}
+
+/*
+ * call-seq:
+ *     delete(id) -> true or false
+ *
+ * Removes the point id from the tree. Returns false if there is no such point.
+ *
+ * Complexity: O(log n) amortized
+ */
+static VALUE kd_tree_delete(VALUE self, VALUE id) {
+	kd_tree *tree = get_kd_tree_from_self(self);
+	VALUE entry = rb_hash_delete(kd_modifiable_index(tree), id);
+	long e;
+	if (NIL_P(entry)) return Qfalse;
+	e = NUM2LONG(entry);
+	kd_remove_entry(tree, e);
+	rb_ary_store(tree->ids, e, Qnil);
+	tree->live--;
+	if (tree->num_entries > 2 * tree->live + 1024) kd_compact_entries(tree);
+	return Qtrue;
+}
+
+// Reads target into point, returning whether distances to it can be Integers
+static int kd_target(const kd_tree *tree, VALUE target, double *point) {
+	return kd_read_coords(kd_coords(target), tree->dim, point) && tree->integral;
+}
+
+static VALUE kd_distance_value(double d, int integral) {
+	if (integral && d <= 9007199254740992.0) return LL2NUM((LONG_LONG) d);
+	return DBL2NUM(d);
+}
+
+/*
+ * call-seq:
+ *     find_nearest(target, k) -> [[distance, id], ...]
+ *
+ * Returns the k points closest to target as [squared distance, id] pairs, closest first.
+ * Points at the same distance come in the order they were added. Distances are Integers
+ * when the coordinates of every point ever added and of target are.
+ *
+ * Complexity: O(k log k + log^2 n) expected for evenly spread points
+ */
+static VALUE kd_tree_find_nearest(VALUE self, VALUE target, VALUE rb_k) {
+	kd_tree *tree = get_kd_tree_from_self(self);
+	VALUE result, buf_v = 0, target_v = 0;
+	double *point;
+	long k = NUM2LONG(rb_k), i;
+	int integral;
+	kd_heap heap;
+
+	if (tree->live == 0) return rb_ary_new();
+	point = ALLOCV_N(double, target_v, tree->dim);
+	integral = kd_target(tree, target, point);
+	if (k > tree->live) k = tree->live;
+	if (k <= 0) return rb_ary_new();
+
+	heap.dist = ALLOCV(buf_v, k * (sizeof(double) + sizeof(long)));
+	heap.entry = (long *) (heap.dist + k);
+	heap.size = 0;
+	heap.k = k;
+	kd_nearest_all(tree, point, &heap);
+
+	kd_heap_sort(&heap);
+	result = rb_ary_new_capa(heap.size);
+	for (i = 0; i < heap.size; i++) {
+		rb_ary_push(result, rb_assoc_new(kd_distance_value(heap.dist[i], integral), RARRAY_AREF(tree->ids, heap.entry[i])));
+	}
+	ALLOCV_END(buf_v);
+	ALLOCV_END(target_v);
+	return result;
+}
+
+static double kd_radius2(VALUE rb_radius) {
+	double r = NUM2DBL(rb_radius);
+	if (!(r >= 0)) rb_raise(rb_eArgError, "radius must not be negative");
+	return r * r;
+}
+
+static void kd_matches_init(kd_matches *m) {
+	m->buf = rb_str_buf_new(0);
+	m->matches = NULL;
+	m->size = m->capa = 0;
+}
+
+/*
+ * call-seq:
+ *     within_radius(target, radius) -> [[distance, id], ...]
+ *
+ * Returns every point within radius of target as [squared distance, id] pairs, closest
+ * first, in the same form as find_nearest.
+ *
+ * Complexity: O(n^(1-1/d) + k log k) worst case for k points found
+ */
+static VALUE kd_tree_within_radius(VALUE self, VALUE target, VALUE rb_radius) {
+	kd_tree *tree = get_kd_tree_from_self(self);
+	VALUE result, target_v = 0;
+	double r2 = kd_radius2(rb_radius), *point;
+	kd_matches m;
+	long i;
+	int integral, b;
+
+	result = rb_ary_new();
+	if (tree->live == 0) return result;
+	point = ALLOCV_N(double, target_v, tree->dim);
+	integral = kd_target(tree, target, point);
+	kd_matches_init(&m);
+	for (b = 0; b < KD_MAX_BLOCKS; b++) {
+		kd_block *blk = &tree->blocks[b];
+		if (blk->size > 0) kd_radius(blk, tree->dim, point, r2, 0, blk->size, 0, &m);
+	}
+	if (m.size > 0) qsort(m.matches, m.size, sizeof(kd_match), kd_match_cmp);
+	for (i = 0; i < m.size; i++) {
+		rb_ary_push(result, rb_assoc_new(kd_distance_value(m.matches[i].dist, integral), RARRAY_AREF(tree->ids, m.matches[i].entry)));
+	}
+	ALLOCV_END(target_v);
+	RB_GC_GUARD(m.buf);
+	return result;
+}
+
+/*
+ * call-seq:
+ *     count_within(target, radius) -> integer
+ *
+ * Returns the number of points within radius of target, without building the list.
+ */
+static VALUE kd_tree_count_within(VALUE self, VALUE target, VALUE rb_radius) {
+	kd_tree *tree = get_kd_tree_from_self(self);
+	VALUE target_v = 0;
+	double r2 = kd_radius2(rb_radius), *point;
+	long count = 0;
+	int b;
+
+	if (tree->live == 0) return INT2FIX(0);
+	point = ALLOCV_N(double, target_v, tree->dim);
+	kd_target(tree, target, point);
+	for (b = 0; b < KD_MAX_BLOCKS; b++) {
+		kd_block *blk = &tree->blocks[b];
+		if (blk->size > 0) count += kd_radius(blk, tree->dim, point, r2, 0, blk->size, 0, NULL);
+	}
+	ALLOCV_END(target_v);
+	return LONG2NUM(count);
+}
+
+/*
+ * call-seq:
+ *     in_box(min, max) -> [id, ...]
+ *
+ * Returns the ids of every point with min[i] <= coords[i] <= max[i] on each axis, in the
+ * order the points were added.
+ */
+static VALUE kd_tree_in_box(VALUE self, VALUE rb_min, VALUE rb_max) {
+	kd_tree *tree = get_kd_tree_from_self(self);
+	VALUE result, min_v = 0, max_v = 0;
+	double *min, *max;
+	kd_matches m;
+	long i;
+	int b;
+
+	result = rb_ary_new();
+	if (tree->live == 0) return result;
+	min = ALLOCV_N(double, min_v, tree->dim);
+	max = ALLOCV_N(double, max_v, tree->dim);
+	kd_target(tree, rb_min, min);
+	kd_target(tree, rb_max, max);
+	kd_matches_init(&m);
+	for (b = 0; b < KD_MAX_BLOCKS; b++) {
+		kd_block *blk = &tree->blocks[b];
+		if (blk->size > 0) kd_box(blk, tree->dim, min, max, 0, blk->size, 0, &m);
+	}
+	if (m.size > 0) qsort(m.matches, m.size, sizeof(kd_match), kd_match_cmp);
+	for (i = 0; i < m.size; i++) rb_ary_push(result, RARRAY_AREF(tree->ids, m.matches[i].entry));
+	ALLOCV_END(max_v);
+	ALLOCV_END(min_v);
+	RB_GC_GUARD(m.buf);
+	return result;
+}
+
+static void* kd_batch_worker_run(void *arg) {
+	kd_batch_worker *w = arg;
+	kd_batch_job *job = w->job;
+	long q, from = job->num_queries * w->index / job->num_threads, to = job->num_queries * (w->index + 1) / job->num_threads;
+	kd_heap heap;
+	heap.k = job->k;
+	for (q = from; q < to && !job->cancel; q++) {
+		heap.dist = job->dist + q * job->k;
+		heap.entry = job->entry + q * job->k;
+		heap.size = 0;
+		kd_nearest_all(job->tree, job->targets + q * job->tree->dim, &heap);
+		kd_heap_sort(&heap);
+		job->found[q] = heap.size;
+	}
+	return NULL;
+}
+
+static void* kd_batch_run(void *arg) {
+	kd_batch_job *job = arg;
+	kd_batch_worker workers[KD_MAX_THREADS];
+	long t;
+#ifdef HAVE_PTHREAD_H
+	pthread_t threads[KD_MAX_THREADS];
+	char started[KD_MAX_THREADS];
+#endif
+	for (t = 0; t < job->num_threads; t++) {
+		workers[t].job = job;
+		workers[t].index = t;
+	}
+#ifdef HAVE_PTHREAD_H
+	for (t = 1; t < job->num_threads; t++) {
+		started[t] = pthread_create(&threads[t], NULL, kd_batch_worker_run, &workers[t]) == 0;
+	}
+	kd_batch_worker_run(&workers[0]);
+	for (t = 1; t < job->num_threads; t++) {
+		if (started[t]) pthread_join(threads[t], NULL);
+		else kd_batch_worker_run(&workers[t]);
+	}
+#else
+	for (t = 0; t < job->num_threads; t++) kd_batch_worker_run(&workers[t]);
+#endif
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void kd_batch_cancel(void *arg) {
+	kd_batch_job *job = arg;
+	job->cancel = 1;
+}
+#endif
+
+static long kd_default_thread_count(void) {
+	long cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+#endif
+	return cpus;
+}
+
+typedef struct {
+	kd_tree *tree;
+	VALUE targets;
+	VALUE result;
+	long k;
+	long max_threads;
+} kd_batch_args;
+
+static VALUE kd_batch_each(VALUE arg) {
+	kd_batch_args *args = (kd_batch_args *) arg;
+	kd_tree *tree = args->tree;
+	VALUE targets = args->targets, targets_v = 0, out_v = 0, integral_v = 0;
+	long k = args->k, batch, from, i, j;
+	const long slot_size = sizeof(double) + sizeof(long);
+	char *integral;
+	kd_batch_job job;
+
+	// A batch holds no more targets than there are, and no more than KD_BATCH_RESULTS
+	// neighbours unless a single query needs more
+	batch = RARRAY_LEN(targets);
+	if (batch > KD_BATCH_SIZE) batch = KD_BATCH_SIZE;
+	if (batch > KD_BATCH_RESULTS / k) batch = KD_BATCH_RESULTS / k;
+	if (batch < 1) batch = 1;
+	if (k > (LONG_MAX / batch - (long) sizeof(long)) / slot_size) rb_raise(rb_eNoMemError, "k is too large");
+
+	job.tree = tree;
+	job.k = k;
+	job.targets = ALLOCV_N(double, targets_v, batch * tree->dim);
+	job.dist = ALLOCV(out_v, batch * (k * slot_size + sizeof(long)));
+	job.entry = (long *) (job.dist + batch * k);
+	job.found = job.entry + batch * k;
+	integral = ALLOCV_N(char, integral_v, batch);
+	for (from = 0; from < RARRAY_LEN(targets); from += batch) {
+		// Other Ruby threads may have changed targets while the GVL was released
+		long count = RARRAY_LEN(targets) - from;
+		if (count > batch) count = batch;
+		for (i = 0; i < count; i++) {
+			integral[i] = (char) kd_target(tree, RARRAY_AREF(targets, from + i), job.targets + i * tree->dim);
+		}
+		job.num_queries = count;
+		job.num_threads = count / KD_MIN_QUERIES + 1;
+		if (job.num_threads > args->max_threads) job.num_threads = args->max_threads;
+		do {
+			job.cancel = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+			rb_thread_call_without_gvl(kd_batch_run, &job, kd_batch_cancel, &job);
+#else
+			kd_batch_run(&job);
+#endif
+			// Raises if the interrupt was meant to stop us; otherwise run the block again
+			if (job.cancel) rb_thread_check_ints();
+		} while (job.cancel);
+		for (i = 0; i < count; i++) {
+			VALUE nearest = rb_ary_new_capa(job.found[i]);
+			for (j = 0; j < job.found[i]; j++) {
+				long slot = i * k + j;
+				rb_ary_push(nearest, rb_assoc_new(kd_distance_value(job.dist[slot], integral[i]), RARRAY_AREF(tree->ids, job.entry[slot])));
+			}
+			rb_ary_push(args->result, nearest);
+		}
+	}
+	ALLOCV_END(integral_v);
+	ALLOCV_END(out_v);
+	ALLOCV_END(targets_v);
+	return args->result;
+}
+
+static VALUE kd_batch_done(VALUE arg) {
+	((kd_batch_args *) arg)->tree->busy--;
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *     find_nearest_many(targets, k, threads: nil) -> [[[distance, id], ...], ...]
+ *
+ * Returns find_nearest(target, k) for every target in the Array targets. The searches run on
+ * native threads without the GVL, in blocks of a few thousand targets; threads defaults to
+ * the number of online processors, scaled down for small batches. The tree cannot be
+ * modified until they are done.
+ *
+ * Complexity: as find_nearest, per target, divided among the threads
+ */
+static VALUE kd_tree_find_nearest_many(int argc, VALUE *argv, VALUE self) {
+	kd_tree *tree = get_kd_tree_from_self(self);
+	VALUE targets, rb_k, opts;
+	VALUE kwargs[1] = { Qundef };
+	ID kwarg_ids[1];
+	kd_batch_args args;
+	long i;
+
+	rb_scan_args(argc, argv, "2:", &targets, &rb_k, &opts);
+	kwarg_ids[0] = rb_intern("threads");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 1, kwargs);
+	if (kwargs[0] != Qundef && !NIL_P(kwargs[0])) {
+		args.max_threads = NUM2LONG(kwargs[0]);
+		if (args.max_threads < 1) rb_raise(rb_eArgError, "threads must be positive");
+	} else {
+		args.max_threads = kd_default_thread_count();
+	}
+	if (args.max_threads > KD_MAX_THREADS) args.max_threads = KD_MAX_THREADS;
+	Check_Type(targets, T_ARRAY);
+	args.tree = tree;
+	args.targets = targets;
+	args.k = NUM2LONG(rb_k);
+	args.result = rb_ary_new_capa(RARRAY_LEN(targets));
+	if (tree->live == 0 || args.k <= 0) {
+		for (i = 0; i < RARRAY_LEN(targets); i++) rb_ary_push(args.result, rb_ary_new());
+		return args.result;
+	}
+	if (args.k > tree->live) args.k = tree->live;
+	tree->busy++;
+	return rb_ensure(kd_batch_each, (VALUE) &args, kd_batch_done, (VALUE) &args);
+}
+
+/*
+ * call-seq:
+ *     size -> integer
+ *
+ * Returns the number of points in the tree.
+ */
+static VALUE kd_tree_size(VALUE self) {
+	return LONG2NUM(get_kd_tree_from_self(self)->live);
+}
+
+/*
+ * call-seq:
+ *     dimensions -> integer
+ *
+ * Returns the number of coordinates of each point, or 0 for a tree that never had any.
+ */
+static VALUE kd_tree_dimensions(VALUE self) {
+	return INT2NUM(get_kd_tree_from_self(self)->dim);
+}
+
+static VALUE mContainers;
+static VALUE cKDTree;
+
+void Init_CKDTree() {
+	mContainers = rb_define_module("Containers");
+	cKDTree = rb_define_class_under(mContainers, "CKDTree", rb_cObject);
+	rb_define_alloc_func(cKDTree, kd_tree_alloc);
+	rb_define_method(cKDTree, "initialize", kd_tree_init, 1);
+	rb_define_method(cKDTree, "insert", kd_tree_insert, 2);
+	rb_define_method(cKDTree, "update", kd_tree_update, 2);
+	rb_define_method(cKDTree, "delete", kd_tree_delete, 1);
+	rb_define_method(cKDTree, "find_nearest", kd_tree_find_nearest, 2);
+	rb_define_method(cKDTree, "find_nearest_many", kd_tree_find_nearest_many, -1);
+	rb_define_method(cKDTree, "within_radius", kd_tree_within_radius, 2);
+	rb_define_method(cKDTree, "count_within", kd_tree_count_within, 2);
+	rb_define_method(cKDTree, "in_box", kd_tree_in_box, 2);
+	rb_define_method(cKDTree, "size", kd_tree_size, 0);
+	rb_define_method(cKDTree, "dimensions", kd_tree_dimensions, 0);
+}
@@ -1,4 +1,8 @@
 require 'mkmf'
 extension_name = "CRBTreeMap"
 dir_config(extension_name)
+have_func("mmap", "sys/mman.h")
+have_header("ruby/atomic.h")
+have_const("RUBY_TYPED_FROZEN_SHAREABLE", "ruby.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
 create_makefile(extension_name)
@@ -0,0 +1,322 @@
+#ifndef CONTAINERS_MAP_FILE_H
+#define CONTAINERS_MAP_FILE_H
+
+#include "ruby.h"
+#include "ruby/encoding.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The format written by dump on CRBTreeMap and CSplayTreeMap, and read back by their load and
+ * by Containers::MappedTreeMap.
+ *
+ * A header holding the number of pairs is followed by the pairs in key order, packed into
+ * blocks that each start with their length as 4 bytes; an empty block ends them. After that
+ * come the file offsets of all pairs, 8 bytes each, so that a mapped file can be searched
+ * without reading it, and an end marker. Blocks let load read an IO in large pieces without
+ * reading past the end of the dump.
+ *
+ * A pair is its key followed by its value. Each is a tag byte and then, for Fixnums and Floats,
+ * their 8 bytes; for Strings in UTF-8, US-ASCII or binary, their length as a varint and their
+ * bytes; and for anything else, the length and bytes of its Marshal dump. nil, true and false
+ * are the tag alone. Numbers are stored in the byte order of the machine, which the header
+ * records.
+ *
+ * Define MAP_FILE_RECORDS_ONLY to leave out the reader and the writer.
+ */
+
+#define MAP_FILE_MAGIC "CTREEMAP"
+#define MAP_FILE_END "CTREEEND"
+#define MAP_FILE_VERSION 1
+#define MAP_FILE_BYTE_ORDER 0x01020304
+#define MAP_FILE_BLOCK_SIZE (1 << 16)
+
+typedef struct {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	int64_t count;
+} map_file_header;
+
+enum {
+	MAP_FILE_NIL,
+	MAP_FILE_TRUE,
+	MAP_FILE_FALSE,
+	MAP_FILE_FIXNUM,
+	MAP_FILE_FLOAT,
+	MAP_FILE_BINARY,
+	MAP_FILE_UTF8,
+	MAP_FILE_US_ASCII,
+	MAP_FILE_MARSHAL
+};
+
+static int map_file_tag_encindex(int tag) {
+	if (tag == MAP_FILE_UTF8) return rb_utf8_encindex();
+	if (tag == MAP_FILE_US_ASCII) return rb_usascii_encindex();
+	return rb_ascii8bit_encindex();
+}
+
+// Reads a varint at *p, which must end before end. Returns 0 if it does not.
+static int map_file_get_length(const char **p, const char *end, uint64_t *len) {
+	const unsigned char *q = (const unsigned char *) *p;
+	int shift;
+	*len = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((const char *) q >= end) return 0;
+		*len |= (uint64_t) (*q & 0x7f) << shift;
+		if (!(*q++ & 0x80)) {
+			*p = (const char *) q;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Returns the end of the object at p, or NULL if it does not end before end. For Strings and
+// Marshal dumps, *bytes and *len are set to their contents.
+static const char* map_file_object_end(const char *p, const char *end, int *tag, const char **bytes, uint64_t *len) {
+	if (p >= end) return NULL;
+	*tag = (unsigned char) *p++;
+	switch (*tag) {
+		case MAP_FILE_NIL:
+		case MAP_FILE_TRUE:
+		case MAP_FILE_FALSE:
+			return p;
+		case MAP_FILE_FIXNUM:
+		case MAP_FILE_FLOAT:
+			return end - p < 8 ? NULL : p + 8;
+		case MAP_FILE_BINARY:
+		case MAP_FILE_UTF8:
+		case MAP_FILE_US_ASCII:
+		case MAP_FILE_MARSHAL:
+			if (!map_file_get_length(&p, end, len) || *len > (uint64_t) (end - p)) return NULL;
+			*bytes = p;
+			return p + *len;
+		default:
+			return NULL;
+	}
+}
+
+static int64_t map_file_get_int64(const char *p) {
+	int64_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+// Decodes the object at *p, which must end before end, and moves *p past it. Returns 0 if the
+// object is malformed.
+static int map_file_get_object(const char **p, const char *end, VALUE *obj) {
+	const char *bytes = NULL;
+	uint64_t len = 0;
+	double d;
+	int tag;
+	VALUE dump;
+	const char *next = map_file_object_end(*p, end, &tag, &bytes, &len);
+
+	if (!next) return 0;
+	switch (tag) {
+		case MAP_FILE_NIL: *obj = Qnil; break;
+		case MAP_FILE_TRUE: *obj = Qtrue; break;
+		case MAP_FILE_FALSE: *obj = Qfalse; break;
+		case MAP_FILE_FIXNUM: *obj = LONG2NUM((long) map_file_get_int64(*p + 1)); break;
+		case MAP_FILE_FLOAT:
+			memcpy(&d, *p + 1, sizeof(d));
+			*obj = DBL2NUM(d);
+			break;
+		case MAP_FILE_MARSHAL:
+			dump = rb_str_new(bytes, (long) len);
+			*obj = rb_marshal_load(dump);
+			RB_GC_GUARD(dump);
+			break;
+		default: *obj = rb_enc_str_new(bytes, (long) len, rb_enc_from_index(map_file_tag_encindex(tag))); break;
+	}
+	*p = next;
+	return 1;
+}
+
+#ifndef MAP_FILE_RECORDS_ONLY
+
+static int map_file_string_tag(VALUE obj) {
+	int index;
+	if (rb_obj_class(obj) != rb_cString || rb_ivar_count(obj) > 0) return -1;
+	index = ENCODING_GET(obj);
+	if (index == rb_utf8_encindex()) return MAP_FILE_UTF8;
+	if (index == rb_usascii_encindex()) return MAP_FILE_US_ASCII;
+	if (index == rb_ascii8bit_encindex()) return MAP_FILE_BINARY;
+	return -1;
+}
+
+static void map_file_put_length(VALUE buf, uint64_t len) {
+	char bytes[10];
+	int n = 0;
+	do {
+		bytes[n] = (char) (len & 0x7f);
+		len >>= 7;
+		if (len) bytes[n] |= (char) 0x80;
+		n++;
+	} while (len);
+	rb_str_cat(buf, bytes, n);
+}
+
+static void map_file_put_object(VALUE buf, VALUE obj) {
+	int string_tag = RB_TYPE_P(obj, T_STRING) ? map_file_string_tag(obj) : -1;
+	char tag;
+	if (NIL_P(obj) || obj == Qtrue || obj == Qfalse) {
+		tag = NIL_P(obj) ? MAP_FILE_NIL : (obj == Qtrue ? MAP_FILE_TRUE : MAP_FILE_FALSE);
+		rb_str_cat(buf, &tag, 1);
+	} else if (FIXNUM_P(obj)) {
+		int64_t x = (int64_t) FIX2LONG(obj);
+		tag = MAP_FILE_FIXNUM;
+		rb_str_cat(buf, &tag, 1);
+		rb_str_cat(buf, (const char *) &x, sizeof(x));
+	} else if (RB_FLOAT_TYPE_P(obj)) {
+		double d = RFLOAT_VALUE(obj);
+		tag = MAP_FILE_FLOAT;
+		rb_str_cat(buf, &tag, 1);
+		rb_str_cat(buf, (const char *) &d, sizeof(d));
+	} else if (string_tag >= 0) {
+		tag = (char) string_tag;
+		rb_str_cat(buf, &tag, 1);
+		map_file_put_length(buf, (uint64_t) RSTRING_LEN(obj));
+		rb_str_cat(buf, RSTRING_PTR(obj), RSTRING_LEN(obj));
+	} else {
+		VALUE dump = rb_marshal_dump(obj, Qnil);
+		tag = MAP_FILE_MARSHAL;
+		rb_str_cat(buf, &tag, 1);
+		map_file_put_length(buf, (uint64_t) RSTRING_LEN(dump));
+		rb_str_buf_append(buf, dump);
+	}
+}
+
+typedef struct {
+	VALUE io;
+	VALUE block;      // the block being filled, after room for its length
+	VALUE offsets;    // file offset of every pair written
+	int64_t written;  // bytes handed to io so far
+	int64_t count;    // pairs promised in the header
+} map_file_writer;
+
+// Starts a dump of count pairs to io
+static void map_file_writer_init(map_file_writer *w, VALUE io, int64_t count) {
+	map_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+	header.byte_order = MAP_FILE_BYTE_ORDER;
+	header.version = MAP_FILE_VERSION;
+	header.count = count;
+	w->io = io;
+	w->count = count;
+	w->offsets = rb_str_buf_new(count * (long) sizeof(int64_t));
+	w->block = rb_str_buf_new(MAP_FILE_BLOCK_SIZE + 256);
+	rb_io_write(io, rb_str_new((const char *) &header, sizeof(header)));
+	w->written = sizeof(header);
+	rb_str_resize(w->block, 4);
+}
+
+static void map_file_writer_flush(map_file_writer *w) {
+	long len = RSTRING_LEN(w->block) - 4;
+	uint32_t block_len;
+	if (len > (long) UINT32_MAX) rb_raise(rb_eArgError, "pair too large to dump");
+	block_len = (uint32_t) len;
+	memcpy(RSTRING_PTR(w->block), &block_len, 4);
+	rb_io_write(w->io, w->block);
+	w->written += RSTRING_LEN(w->block);
+	w->block = rb_str_buf_new(MAP_FILE_BLOCK_SIZE + 256);
+	rb_str_resize(w->block, 4);
+}
+
+static void map_file_writer_push(map_file_writer *w, VALUE key, VALUE value) {
+	int64_t offset = w->written + RSTRING_LEN(w->block);
+	rb_str_cat(w->offsets, (const char *) &offset, sizeof(offset));
+	map_file_put_object(w->block, key);
+	map_file_put_object(w->block, value);
+	if (RSTRING_LEN(w->block) >= MAP_FILE_BLOCK_SIZE) map_file_writer_flush(w);
+	RB_GC_GUARD(w->offsets);
+}
+
+static void map_file_writer_finish(map_file_writer *w) {
+	if (RSTRING_LEN(w->offsets) != w->count * (long) sizeof(int64_t)) {
+		rb_raise(rb_eRuntimeError, "map modified during dump");
+	}
+	if (RSTRING_LEN(w->block) > 4) map_file_writer_flush(w);
+	map_file_writer_flush(w);
+	rb_io_write(w->io, w->offsets);
+	rb_io_write(w->io, rb_str_new(MAP_FILE_END, 8));
+}
+
+typedef struct {
+	VALUE io;
+	VALUE block;
+	const char *p, *end;
+	int done;
+} map_file_reader;
+
+// Reads exactly len bytes from io
+static VALUE map_file_read(VALUE io, long len) {
+	VALUE bytes = rb_funcall(io, rb_intern("read"), 1, LONG2NUM(len));
+	if (!RB_TYPE_P(bytes, T_STRING) || RSTRING_LEN(bytes) != len) {
+		rb_raise(rb_eArgError, "truncated tree map dump");
+	}
+	return bytes;
+}
+
+// Reads the header of a dump from io and returns the number of pairs in it
+static int64_t map_file_reader_init(map_file_reader *r, VALUE io) {
+	VALUE bytes = map_file_read(io, sizeof(map_file_header));
+	map_file_header header;
+	memcpy(&header, RSTRING_PTR(bytes), sizeof(header));
+	if (memcmp(header.magic, MAP_FILE_MAGIC, sizeof(header.magic)) != 0) {
+		rb_raise(rb_eArgError, "not a tree map dump");
+	}
+	if (header.byte_order != MAP_FILE_BYTE_ORDER) {
+		rb_raise(rb_eArgError, "tree map was dumped on a machine with a different byte order");
+	}
+	if (header.version != MAP_FILE_VERSION) {
+		rb_raise(rb_eArgError, "unsupported tree map dump version %u", (unsigned) header.version);
+	}
+	if (header.count < 0) rb_raise(rb_eArgError, "corrupt tree map dump");
+	r->io = io;
+	r->block = Qnil;
+	r->p = r->end = NULL;
+	r->done = 0;
+	return header.count;
+}
+
+// Reads the next pair. Returns 0 after the last one.
+static int map_file_reader_next(map_file_reader *r, VALUE *key, VALUE *value) {
+	if (r->done) return 0;
+	if (r->p == r->end) {
+		uint32_t len;
+		memcpy(&len, RSTRING_PTR(map_file_read(r->io, 4)), 4);
+		if (len == 0) {
+			r->done = 1;
+			return 0;
+		}
+		r->block = map_file_read(r->io, (long) len);
+		r->p = RSTRING_PTR(r->block);
+		r->end = r->p + len;
+	}
+	if (!map_file_get_object(&r->p, r->end, key) || !map_file_get_object(&r->p, r->end, value)) {
+		rb_raise(rb_eArgError, "corrupt tree map dump");
+	}
+	// Decoding allocates, and r->p points into the block
+	RB_GC_GUARD(r->block);
+	return 1;
+}
+
+// Reads the rest of a dump of count pairs, so that io is left just past it
+static void map_file_reader_finish(map_file_reader *r, int64_t count) {
+	int64_t left = count * (int64_t) sizeof(int64_t);
+	VALUE end;
+	while (left > 0) {
+		long chunk = left < MAP_FILE_BLOCK_SIZE ? (long) left : MAP_FILE_BLOCK_SIZE;
+		map_file_read(r->io, chunk);
+		left -= chunk;
+	}
+	end = map_file_read(r->io, 8);
+	if (memcmp(RSTRING_PTR(end), MAP_FILE_END, 8) != 0) rb_raise(rb_eArgError, "corrupt tree map dump");
+}
+
+#endif
+
+#endif
@@ -0,0 +1,270 @@
+#include "ruby.h"
+#include "ruby/encoding.h"
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define MAP_FILE_RECORDS_ONLY
+#include "map_file.h"
+
+/*
+ * A read-only map over a file written by the dump method of CRBTreeMap or CSplayTreeMap.
+ *
+ * The file is mapped into memory and never turned into nodes: lookups binary search the table
+ * of pair offsets at its end and decode only the keys they pass on the way, and only the value
+ * they return. Fixnum and String keys are compared straight against the bytes in the file.
+ */
+
+typedef struct {
+	char *map;
+	size_t map_len;
+	const char *records_end;  // where the pairs end and the offset table starts
+	long count;
+} mapped_tree_map;
+
+int rbtree_compare_function(VALUE a, VALUE b);
+
+static void mapped_tree_map_free(void *ptr) {
+	if (ptr) {
+		mapped_tree_map *m = ptr;
+		if (m->map) {
+#ifdef HAVE_MMAP
+			munmap(m->map, m->map_len);
+#else
+			xfree(m->map);
+#endif
+		}
+		xfree(m);
+	}
+}
+
+static mapped_tree_map* get_mapped_tree_map_from_self(VALUE self) {
+	mapped_tree_map *m;
+	Data_Get_Struct(self, mapped_tree_map, m);
+	return m;
+}
+
+static void mapped_tree_map_corrupt(void) {
+	rb_raise(rb_eArgError, "mapped tree map is corrupt");
+}
+
+static const char* mapped_tree_map_pair(const mapped_tree_map *m, long i) {
+	int64_t offset = map_file_get_int64(m->records_end + i * sizeof(int64_t));
+	if (offset < (int64_t) sizeof(map_file_header) || offset >= m->records_end - m->map) {
+		mapped_tree_map_corrupt();
+	}
+	return m->map + offset;
+}
+
+static VALUE mapped_tree_map_object(const mapped_tree_map *m, const char *p) {
+	VALUE obj;
+	if (!map_file_get_object(&p, m->records_end, &obj)) mapped_tree_map_corrupt();
+	return obj;
+}
+
+// Compares key with the key of pair i, and points *value at the pair's value
+static int mapped_tree_map_compare(const mapped_tree_map *m, VALUE key, long i, const char **value) {
+	const char *p = mapped_tree_map_pair(m, i), *bytes = NULL;
+	uint64_t len = 0;
+	int tag;
+
+	*value = map_file_object_end(p, m->records_end, &tag, &bytes, &len);
+	if (!*value) mapped_tree_map_corrupt();
+	if (tag == MAP_FILE_FIXNUM && FIXNUM_P(key)) {
+		long x = FIX2LONG(key), y = (long) map_file_get_int64(p + 1);
+		if (x == y) return 0;
+		return x < y ? -1 : 1;
+	}
+	if ((tag == MAP_FILE_BINARY || tag == MAP_FILE_UTF8 || tag == MAP_FILE_US_ASCII) &&
+			RB_TYPE_P(key, T_STRING) && ENCODING_GET(key) == map_file_tag_encindex(tag)) {
+		uint64_t key_len = (uint64_t) RSTRING_LEN(key);
+		int cmp = memcmp(RSTRING_PTR(key), bytes, key_len < len ? key_len : len);
+		if (cmp) return cmp < 0 ? -1 : 1;
+		if (key_len == len) return 0;
+		return key_len < len ? -1 : 1;
+	}
+	return rbtree_compare_function(key, mapped_tree_map_object(m, p));
+}
+
+// Returns where the value of key starts, or NULL if the map does not have key
+static const char* mapped_tree_map_find(const mapped_tree_map *m, VALUE key) {
+	long lo = 0, hi = m->count;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		const char *value;
+		int cmp = mapped_tree_map_compare(m, key, mid, &value);
+		if (cmp == 0) return value;
+		if (cmp < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	return NULL;
+}
+
+static char* mapped_tree_map_file(VALUE path, size_t *len) {
+#ifdef HAVE_MMAP
+	struct stat st;
+	void *map;
+	int fd = open(RSTRING_PTR(path), O_RDONLY);
+	if (fd < 0) rb_sys_fail_str(path);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		rb_sys_fail_str(path);
+	}
+	*len = (size_t) st.st_size;
+	if (*len < sizeof(map_file_header)) {
+		close(fd);
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is not a tree map dump", path);
+	}
+	map = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) rb_sys_fail_str(path);
+	return map;
+#else
+	VALUE data = rb_funcall(rb_cFile, rb_intern("binread"), 1, path);
+	char *map;
+	*len = RSTRING_LEN(data);
+	if (*len < sizeof(map_file_header)) rb_raise(rb_eArgError, "%"PRIsVALUE" is not a tree map dump", path);
+	map = xmalloc(*len);
+	memcpy(map, RSTRING_PTR(data), *len);
+	return map;
+#endif
+}
+
+/*
+ * call-seq:
+ *     Containers::MappedTreeMap.open(path) -> map
+ *
+ * Returns a frozen map backed by a file that holds one tree map dump. The file is mapped into
+ * memory rather than read, so opening takes the same time whatever the size of the map, and
+ * processes that open the same file share its pages.
+ *
+ * Complexity: O(1)
+ *
+ *   File.open("states.map", "wb") { |f| map.dump(f) }
+ *   states = Containers::MappedTreeMap.open("states.map")
+ *   states["MA"] #=> "Massachusetts"
+ */
+static VALUE mapped_tree_map_s_open(VALUE klass, VALUE path) {
+	mapped_tree_map *m = ALLOC(mapped_tree_map);
+	VALUE self;
+	map_file_header header;
+	uint64_t table_len;
+
+	m->map = NULL;
+	m->map_len = 0;
+	m->records_end = NULL;
+	m->count = 0;
+	self = Data_Wrap_Struct(klass, NULL, mapped_tree_map_free, m);
+	FilePathValue(path);
+	m->map = mapped_tree_map_file(path, &m->map_len);
+	memcpy(&header, m->map, sizeof(header));
+	if (memcmp(header.magic, MAP_FILE_MAGIC, sizeof(header.magic)) != 0) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is not a tree map dump", path);
+	}
+	if (header.byte_order != MAP_FILE_BYTE_ORDER) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" was dumped on a machine with a different byte order", path);
+	}
+	if (header.version != MAP_FILE_VERSION) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" has unsupported version %u", path, (unsigned) header.version);
+	}
+	if (header.count < 0 || (uint64_t) header.count > m->map_len / sizeof(int64_t)) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is corrupt", path);
+	}
+	table_len = (uint64_t) header.count * sizeof(int64_t);
+	if (sizeof(map_file_header) + 4 + table_len + 8 > m->map_len ||
+			memcmp(m->map + m->map_len - 8, MAP_FILE_END, 8) != 0) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is truncated or is more than one dump", path);
+	}
+	m->records_end = m->map + m->map_len - 8 - table_len;
+	m->count = (long) header.count;
+	return rb_obj_freeze(self);
+}
+
+/*
+ * call-seq:
+ *     get(key) -> value
+ *     [key] -> value
+ *
+ * Returns the value of key, or nil if the map does not have it.
+ *
+ * Complexity: O(log n)
+ */
+static VALUE mapped_tree_map_get(VALUE self, VALUE key) {
+	mapped_tree_map *m = get_mapped_tree_map_from_self(self);
+	const char *value = mapped_tree_map_find(m, key);
+	return value ? mapped_tree_map_object(m, value) : Qnil;
+}
+
+/*
+ * call-seq:
+ *     has_key?(key) -> true or false
+ *
+ * Returns true if the map has key. The value is not decoded.
+ *
+ * Complexity: O(log n)
+ */
+static VALUE mapped_tree_map_has_key(VALUE self, VALUE key) {
+	mapped_tree_map *m = get_mapped_tree_map_from_self(self);
+	return mapped_tree_map_find(m, key) ? Qtrue : Qfalse;
+}
+
+static VALUE mapped_tree_map_size(VALUE self) {
+	return LONG2NUM(get_mapped_tree_map_from_self(self)->count);
+}
+
+static VALUE mapped_tree_map_is_empty(VALUE self) {
+	return get_mapped_tree_map_from_self(self)->count == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE mapped_tree_map_min_key(VALUE self) {
+	mapped_tree_map *m = get_mapped_tree_map_from_self(self);
+	if (m->count == 0) return Qnil;
+	return mapped_tree_map_object(m, mapped_tree_map_pair(m, 0));
+}
+
+static VALUE mapped_tree_map_max_key(VALUE self) {
+	mapped_tree_map *m = get_mapped_tree_map_from_self(self);
+	if (m->count == 0) return Qnil;
+	return mapped_tree_map_object(m, mapped_tree_map_pair(m, m->count - 1));
+}
+
+/*
+ * call-seq:
+ *     each { |key, value| ... } -> self
+ *
+ * Calls the block with every pair in key order.
+ *
+ * Complexity: O(n)
+ */
+static VALUE mapped_tree_map_each(VALUE self) {
+	mapped_tree_map *m = get_mapped_tree_map_from_self(self);
+	long i;
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, mapped_tree_map_size);
+	for (i = 0; i < m->count; i++) {
+		const char *p = mapped_tree_map_pair(m, i);
+		VALUE key, value;
+		if (!map_file_get_object(&p, m->records_end, &key) || !map_file_get_object(&p, m->records_end, &value)) {
+			mapped_tree_map_corrupt();
+		}
+		rb_yield(rb_ary_new3(2, key, value));
+	}
+	return self;
+}
+
+void Init_mapped_tree_map(VALUE mContainers) {
+	VALUE cMappedTreeMap = rb_define_class_under(mContainers, "MappedTreeMap", rb_cObject);
+	rb_undef_alloc_func(cMappedTreeMap);
+	rb_define_singleton_method(cMappedTreeMap, "open", mapped_tree_map_s_open, 1);
+	rb_define_method(cMappedTreeMap, "get", mapped_tree_map_get, 1);
+	rb_define_alias(cMappedTreeMap, "[]", "get");
+	rb_define_method(cMappedTreeMap, "has_key?", mapped_tree_map_has_key, 1);
+	rb_define_method(cMappedTreeMap, "size", mapped_tree_map_size, 0);
+	rb_define_method(cMappedTreeMap, "empty?", mapped_tree_map_is_empty, 0);
+	rb_define_method(cMappedTreeMap, "min_key", mapped_tree_map_min_key, 0);
+	rb_define_method(cMappedTreeMap, "max_key", mapped_tree_map_max_key, 0);
+	rb_define_method(cMappedTreeMap, "each", mapped_tree_map_each, 0);
+	rb_include_module(cMappedTreeMap, rb_mEnumerable);
+}
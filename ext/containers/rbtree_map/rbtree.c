@@ -1,4 +1,8 @@
 #include "ruby.h"
+#ifdef HAVE_RUBY_ATOMIC_H
+#include "ruby/atomic.h"
+#endif
+#include "map_file.h"
 
 #define RED 1
 #define BLACK 0
@@ -6,9 +10,23 @@
 #define FALSE 0
 #define TRUE 1
 
+// Snapshots can be freed by the GC of another Ractor, so links and snapshots are counted atomically
+#ifdef HAVE_RUBY_ATOMIC_H
+#define ATOMIC_INC(var) RUBY_ATOMIC_INC(var)
+#define ATOMIC_DEC(var) RUBY_ATOMIC_DEC(var)
+#define ATOMIC_FETCH_DEC(var) RUBY_ATOMIC_FETCH_SUB(var, 1)
+#else
+typedef unsigned int rb_atomic_t;
+#define ATOMIC_INC(var) ((var)++)
+#define ATOMIC_DEC(var) ((var)--)
+#define ATOMIC_FETCH_DEC(var) ((var)--)
+#endif
+
 typedef struct struct_rbtree_node {
 	int color;
+	rb_atomic_t refcount;  // links to the node from parents, maps and snapshots
 	VALUE key;
+	VALUE sort_key;        // what the node is compared by: key, or what key_by made of it
 	VALUE value;
 	struct struct_rbtree_node *left;
 	struct struct_rbtree_node *right;
@@ -19,26 +37,75 @@ typedef struct struct_rbtree_node {
 typedef struct {
 	unsigned int black_height;
 	int (*compare_function)(VALUE key1, VALUE key2);
+	VALUE key_by;           // nil, or what projects keys before they are compared
 	rbtree_node *root;
+	rbtree_node **pending;  // nodes read by load that are not linked into the tree yet
+	long num_pending;
+	int shared;             // whether nodes may be shared with a snapshot or another map
+	int counted;            // whether counted in live_snapshots: a snapshot, or a map combined with another
+	rbtree_node *pinned;    // the tree as it was before the write under way, see pin
 } rbtree;
 
-typedef struct struct_ll_node {
-	rbtree_node *node;
-	struct struct_ll_node *next;
-} ll_node;
+#define RBTREE_MAX_DEPTH 128
+
+typedef struct {
+	long rank;    // keys in the tree that are smaller
+	int equal;    // whether the tree has the key
+} rbtree_rank;
 
-static void recursively_free_nodes(rbtree_node *node) {
-	if(node) {
-		recursively_free_nodes(node->left);
-		recursively_free_nodes(node->right);
+// Where a write to key goes. It is found by comparing keys, or, with rank set, by the rank that a
+// search found before the write started.
+typedef struct {
+	rbtree *tree;
+	VALUE key;
+	VALUE sort_key;
+	const rbtree_rank *rank;
+} rbtree_target;
+
+// While there are none, no node is shared
+static rb_atomic_t live_snapshots = 0;
+
+static rbtree_node* retain(rbtree_node *node) {
+	if (node) ATOMIC_INC(node->refcount);
+	return node;
+}
+
+// Drops a link to node, and frees the nodes that nothing links to any more
+static void release(rbtree_node *node) {
+	while (node && ATOMIC_FETCH_DEC(node->refcount) == 1) {
+		rbtree_node *right = node->right;
+		release(node->left);
 		xfree(node);
+		node = right;
 	}
-	return;
 }
 
+/*
+ * Copy-on-write: a node that more than one link leads to is shared with a snapshot and must never
+ * change. Anything that changes a node first replaces the link to it with own(node), which is the
+ * node itself when that link is the only one, or else a copy that takes over the node's children.
+ * A write thus copies the nodes on its way down and leaves the rest of the tree shared.
+ */
+static rbtree_node* copy_node(rbtree_node *node) {
+	rbtree_node *copy = ALLOC(rbtree_node);
+	*copy = *node;
+	copy->refcount = 1;
+	retain(copy->left);
+	retain(copy->right);
+	release(node);
+	return copy;
+}
+
+static inline rbtree_node* own(rbtree_node *node) {
+	if (!node || node->refcount == 1) return node;
+	return copy_node(node);
+}
+
+static const rb_data_type_t rbtree_type;
+
 static rbtree* get_tree_from_self(VALUE self) {
 	rbtree *tree;
-	Data_Get_Struct(self, rbtree, tree);
+	TypedData_Get_Struct(self, rbtree, &rbtree_type, tree);
 	return tree;
 }
 
@@ -50,6 +117,8 @@ static int isred(rbtree_node *node) {
 }
 
 static void colorflip(rbtree_node *node) {
+	node->left = own(node->left);
+	node->right = own(node->right);
 	node->color = !node->color;
 	node->left->color = !node->left->color;
 	node->right->color = !node->right->color;
@@ -79,7 +148,7 @@ static rbtree_node* set_num_nodes(rbtree_node *h) {
 }
 
 static rbtree_node* rotate_left(rbtree_node *h) {
-	rbtree_node *x = h->right;
+	rbtree_node *x = own(h->right);
 	h->right = x->left;
 	x->left = set_num_nodes(h);
 	x->color = x->left->color;
@@ -88,7 +157,7 @@ static rbtree_node* rotate_left(rbtree_node *h) {
 }
 
 static rbtree_node* rotate_right(rbtree_node *h) {
-	rbtree_node *x = h->left;
+	rbtree_node *x = own(h->left);
 	h->left = x->right;
 	x->right = set_num_nodes(h);
 	x->color = x->right->color;
@@ -132,17 +201,44 @@ static rbtree* create_rbtree(int (*compare_function)(VALUE, VALUE)) {
 	rbtree *tree = ALLOC(rbtree);
 	tree->black_height = 0;
 	tree->compare_function = compare_function;
+	tree->key_by = Qnil;
 	tree->root = NULL;
+	tree->pending = NULL;
+	tree->num_pending = 0;
+	tree->shared = FALSE;
+	tree->counted = FALSE;
+	tree->pinned = NULL;
 	return tree;
 }
 
-static rbtree_node* insert(rbtree *tree, rbtree_node *node, VALUE key, VALUE value) {
+static int is_shared(rbtree *tree) {
+	if (tree->shared && live_snapshots == 0) tree->shared = FALSE;
+	return tree->shared;
+}
+
+// The offset of node's right subtree, which is only needed to steer by rank
+static long right_offset(const rbtree_target *t, rbtree_node *node, long offset) {
+	return t->rank ? offset + size(node->left) + 1 : 0;
+}
+
+static int target_compare(const rbtree_target *t, rbtree_node *node, long offset) {
+	long rank;
+	if (!t->rank) return t->tree->compare_function(t->sort_key, node->sort_key);
+	rank = offset + size(node->left);
+	if (t->rank->rank == rank) return t->rank->equal ? 0 : -1;
+	return t->rank->rank < rank ? -1 : 1;
+}
+
+// offset is the number of keys in the tree that sort before node's subtree
+static rbtree_node* insert(rbtree_target *t, rbtree_node *node, long offset, VALUE value) {
 	int cmp;
 	
 	// This slot is empty, so we insert our new node
 	if(!node) {
 		rbtree_node *new_node = ALLOC(rbtree_node);
-		new_node->key		= key;
+		new_node->refcount	= 1;
+		new_node->key		= t->key;
+		new_node->sort_key	= t->sort_key;
 		new_node->value		= value;
 		new_node->color		= RED;
 		new_node->height	= 1;
@@ -153,10 +249,11 @@ static rbtree_node* insert(rbtree *tree, rbtree_node *node, VALUE key, VALUE val
 	}
 	
 	// Insert left or right, recursively
-	cmp = tree->compare_function(key, node->key);
+	node = own(node);
+	cmp = target_compare(t, node, offset);
 	if		(cmp == 0)	{ node->value = value; }
-	else if (cmp == -1) { node->left	= insert(tree, node->left, key, value); }
-	else				{ node->right = insert(tree, node->right, key, value); }
+	else if (cmp == -1) { node->left	= insert(t, node->left, offset, value); }
+	else				{ node->right = insert(t, node->right, right_offset(t, node, offset), value); }
 	
 	// Fix our tree to keep left-lean
 	if (isred(node->right)) { node = rotate_left(node); }
@@ -167,34 +264,35 @@ static rbtree_node* insert(rbtree *tree, rbtree_node *node, VALUE key, VALUE val
 	return set_num_nodes(node);
 }
 
-static VALUE get(rbtree *tree, rbtree_node *node, VALUE key) {
+static VALUE get(rbtree *tree, rbtree_node *node, VALUE sort_key) {
 	int cmp;
 	if (!node) {
 		return Qnil;
 	}
 	
-	cmp = tree->compare_function(key, node->key);
+	cmp = tree->compare_function(sort_key, node->sort_key);
 	if		(cmp == 0)	{ return node->value; }
-	else if (cmp == -1) { return get(tree, node->left, key); }
-	else				{ return get(tree, node->right, key); }
+	else if (cmp == -1) { return get(tree, node->left, sort_key); }
+	else				{ return get(tree, node->right, sort_key); }
 	
 }
 
-static VALUE min_key(rbtree_node *node) {
+static rbtree_node* min_node(rbtree_node *node) {
 	while (node->left)
 		node = node->left;
 		
-	return node->key;
+	return node;
 }
 
-static VALUE max_key(rbtree_node *node) {
+static rbtree_node* max_node(rbtree_node *node) {
 	while (node->right)
 		node = node->right;
 	
-	return node->key;
+	return node;
 }
 
 static rbtree_node* delete_min(rbtree_node *h, VALUE *deleted_value) {
+	h = own(h);
 	if ( !h->left ) {
 		if(deleted_value)
 			*deleted_value = h->value;
@@ -210,7 +308,24 @@ static rbtree_node* delete_min(rbtree_node *h, VALUE *deleted_value) {
 	return fixup(h);
 }
 
+// Like delete_min, but hands the node back instead of freeing it
+static rbtree_node* detach_min(rbtree_node *h, rbtree_node **min) {
+	h = own(h);
+	if ( !h->left ) {
+		*min = h;
+		return NULL;
+	}
+	
+	if ( !isred(h->left) && !isred(h->left->left) )
+		h = move_red_left(h);
+
+	h->left = detach_min(h->left, min);
+
+	return fixup(h);
+}
+
 static rbtree_node* delete_max(rbtree_node *h, VALUE *deleted_value) {
+	h = own(h);
 	if ( isred(h->left) )
 		h = rotate_right(h);
 
@@ -228,21 +343,22 @@ static rbtree_node* delete_max(rbtree_node *h, VALUE *deleted_value) {
 	return fixup(h);
 }
 
-static rbtree_node* delete(rbtree *tree, rbtree_node *node, VALUE key, VALUE *deleted_value) {
+static rbtree_node* delete(rbtree_target *t, rbtree_node *node, long offset, VALUE *deleted_value) {
 	int cmp;
-	VALUE minimum_key;
-	cmp = tree->compare_function(key, node->key);
+	rbtree_node *minimum;
+	node = own(node);
+	cmp = target_compare(t, node, offset);
 	if (cmp == -1) {
 		if ( !isred(node->left) && !isred(node->left->left) )
 			node = move_red_left(node);
 		
-		node->left = delete(tree, node->left, key, deleted_value);
+		node->left = delete(t, node->left, offset, deleted_value);
 	}
 	else {
 		if ( isred(node->left) )
 			node = rotate_right(node);
 		
-		cmp = tree->compare_function(key, node->key);
+		cmp = target_compare(t, node, offset);
 		if ( (cmp == 0) && !node->right ) {
 			*deleted_value = node->value;
 			xfree(node);
@@ -252,21 +368,236 @@ static rbtree_node* delete(rbtree *tree, rbtree_node *node, VALUE key, VALUE *de
 		if ( !isred(node->right) && !isred(node->right->left) )
 			node = move_red_right(node);
 		
-		cmp = tree->compare_function(key, node->key);
+		cmp = target_compare(t, node, offset);
 		if (cmp == 0) {
 			*deleted_value = node->value;
-			minimum_key = min_key(node->right);
-			node->value = get(tree, node->right, minimum_key);
-			node->key = minimum_key;
-			node->right = delete_min(node->right, NULL);
+			node->right = detach_min(node->right, &minimum);
+			node->key = minimum->key;
+			node->sort_key = minimum->sort_key;
+			node->value = minimum->value;
+			xfree(minimum);
 		}
 		else {
-			node->right = delete(tree, node->right, key, deleted_value);
+			node->right = delete(t, node->right, right_offset(t, node, offset), deleted_value);
 		}
 	}
 	return fixup(node);
 }
 
+// The number of black nodes on every path down from node
+static int black_height(rbtree_node *node) {
+	int h = 0;
+	for (; node; node = node->left) {
+		if (!isred(node)) h++;
+	}
+	return h;
+}
+
+/*
+ * Joining: join(l, m, r) links the trees l and r, whose keys all sort before and after m's, under
+ * the node m. m goes in red wherever the taller tree's spine reaches the black height of the other
+ * tree, and the way back up rebalances just as insert does, so it takes O(1 + |hl - hr|).
+ */
+
+static rbtree_node* join_right(rbtree_node *l, rbtree_node *m, rbtree_node *r, int hl, int hr) {
+	if (hl == hr) {
+		m->left = l;
+		m->right = r;
+		m->color = RED;
+		return set_num_nodes(m);
+	}
+	// Right links are black, so each step down loses one black node
+	l = own(l);
+	l->right = join_right(l->right, m, r, hl - 1, hr);
+	return fixup(l);
+}
+
+static rbtree_node* join_left(rbtree_node *l, rbtree_node *m, rbtree_node *r, int hl, int hr) {
+	if (hl == hr && !isred(r)) {
+		m->left = l;
+		m->right = r;
+		m->color = RED;
+		return set_num_nodes(m);
+	}
+	r = own(r);
+	r->left = join_left(l, m, r->left, hl, isred(r) ? hr : hr - 1);
+	return fixup(r);
+}
+
+// Makes root black, as the root of a whole tree must be
+static rbtree_node* blacken(rbtree_node *root) {
+	if (isred(root)) {
+		root = own(root);
+		root->color = BLACK;
+	}
+	return root;
+}
+
+// The root that comes back may be red
+static rbtree_node* join(rbtree_node *l, rbtree_node *m, rbtree_node *r) {
+	int hl, hr;
+	l = blacken(l);
+	r = blacken(r);
+	hl = black_height(l);
+	hr = black_height(r);
+	if (hl >= hr) return join_right(l, m, r, hl, hr);
+	return join_left(l, m, r, hl, hr);
+}
+
+// Joins l and r without a node between them
+static rbtree_node* join2(rbtree_node *l, rbtree_node *r) {
+	rbtree_node *m;
+	if (!l) return r;
+	if (!r) return l;
+	r = detach_min(blacken(r), &m);
+	return join(l, m, r);
+}
+
+// Splits t into its first k nodes and the rest. If mid is not NULL, the node of rank k is taken
+// out of the rest and handed back in *mid. Takes O(log n), with no comparisons.
+static void split_rank(rbtree_node *t, long k, rbtree_node **l, rbtree_node **mid, rbtree_node **r) {
+	rbtree_node *piece, *left, *right;
+	long left_size;
+	if (!t) {
+		*l = *r = NULL;
+		return;
+	}
+	t = own(t);
+	left = t->left;
+	right = t->right;
+	left_size = size(left);
+	if (k == left_size) {
+		*l = left;
+		if (mid) {
+			*mid = t;
+			*r = right;
+		} else {
+			*r = join(NULL, t, right);
+		}
+	} else if (k < left_size) {
+		split_rank(left, k, l, mid, &piece);
+		*r = join(piece, t, right);
+	} else {
+		split_rank(right, k - left_size - 1, &piece, mid, r);
+		*l = join(left, t, piece);
+	}
+}
+
+/*
+ * Finds the rank of each of the n sorted keys in the tree. Each search starts from where the one
+ * before it ended and only climbs as far as the nearest ancestor whose range holds the new key,
+ * so the n searches together take O(n log(size / n)) comparisons rather than O(n log size).
+ *
+ * This is where all the comparisons of split and of the set operations happen, before any node is
+ * moved: <=> may run Ruby code, which may start the GC or raise.
+ */
+static void rbtree_ranks(rbtree *tree, rbtree_node *root, const VALUE *keys, long n, rbtree_rank *ranks) {
+	rbtree_node *path[RBTREE_MAX_DEPTH];
+	long before[RBTREE_MAX_DEPTH];  // keys in the tree that sort before path[i]'s subtree
+	int bound[RBTREE_MAX_DEPTH];    // the nearest ancestor of path[i] that the path goes left at
+	int depth = 0, cmp, b;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		rbtree_node *node = root;
+		long rank = 0;
+		int node_bound = -1;
+
+		if (depth > 0) {
+			int j = depth - 1;
+			while ((b = bound[j]) >= 0 && tree->compare_function(keys[i], path[b]->sort_key) >= 0)
+				j = b;
+			node = path[j];
+			rank = before[j];
+			node_bound = bound[j];
+			depth = j;
+		}
+		ranks[i].equal = 0;
+		while (node) {
+			path[depth] = node;
+			before[depth] = rank;
+			bound[depth] = node_bound;
+			cmp = tree->compare_function(keys[i], node->sort_key);
+			if (cmp == 0) {
+				rank += size(node->left);
+				ranks[i].equal = 1;
+				depth++;
+				break;
+			}
+			if (cmp < 0) {
+				node_bound = depth;
+				node = node->left;
+			} else {
+				rank += size(node->left) + 1;
+				node = node->right;
+			}
+			depth++;
+		}
+		ranks[i].rank = rank;
+	}
+}
+
+enum { RBTREE_UNION, RBTREE_INTERSECTION, RBTREE_DIFFERENCE };
+
+typedef struct {
+	int op;
+	int receiver_is_small;  // whether the smaller tree belongs to the receiver
+	const rbtree_rank *ranks;
+	VALUE *conflicts;       // key, sort key, the receiver's value and the other value for each key
+	long num_conflicts;     // in both, if a block was given
+} rbtree_combination;
+
+/*
+ * Combines small, whose nodes are those of the smaller tree from rank first on, with big, the nodes
+ * of the bigger tree from rank offset on. The root of small splits big by its precomputed rank, the
+ * halves are combined recursively, and the results are joined back together, so for trees of m
+ * and n nodes this is O(m log(n / m + 1)). Nothing is compared, and nothing is allocated but the
+ * copies of nodes that are shared with a snapshot.
+ */
+static rbtree_node* combine(rbtree_combination *c, rbtree_node *small, long first, rbtree_node *big, long offset) {
+	rbtree_node *big_left, *big_right, *match = NULL, *left, *right, *small_left, *small_right;
+	const rbtree_rank *rank;
+	int keep_small = c->op == RBTREE_UNION || (c->op == RBTREE_DIFFERENCE && c->receiver_is_small);
+	int keep_big = c->op == RBTREE_UNION || (c->op == RBTREE_DIFFERENCE && !c->receiver_is_small);
+	long index;
+
+	if (!small || !big) {
+		if (small && !keep_small) release(small);
+		if (big && !keep_big) release(big);
+		return small ? (keep_small ? small : NULL) : (keep_big ? big : NULL);
+	}
+	small = own(small);
+	small_left = small->left;
+	small_right = small->right;
+	index = first + size(small_left);
+	rank = &c->ranks[index];
+	split_rank(big, rank->rank - offset, &big_left, rank->equal ? &match : NULL, &big_right);
+	left = combine(c, small_left, first, big_left, offset);
+	right = combine(c, small_right, index + 1, big_right, rank->rank + rank->equal);
+
+	if (match) {
+		rbtree_node *mine = c->receiver_is_small ? small : match, *theirs = c->receiver_is_small ? match : small;
+		if (c->op == RBTREE_DIFFERENCE) {
+			xfree(small);
+			xfree(match);
+			return join2(left, right);
+		}
+		if (c->conflicts) {
+			c->conflicts[4 * c->num_conflicts] = mine->key;
+			c->conflicts[4 * c->num_conflicts + 1] = mine->sort_key;
+			c->conflicts[4 * c->num_conflicts + 2] = mine->value;
+			c->conflicts[4 * c->num_conflicts + 3] = theirs->value;
+			c->num_conflicts++;
+		}
+		mine->value = theirs->value;
+		xfree(theirs);
+		return join(left, mine, right);
+	}
+	if (keep_small) return join(left, small, right);
+	xfree(small);
+	return join2(left, right);
+}
+
 static rbtree* rbtree_each_node(rbtree *tree, rbtree_node *node, void (*each)(rbtree *tree_, rbtree_node *node_, void* args), void* arguments) {
 	if (!node)
 		return NULL;
@@ -287,9 +618,11 @@ static rbtree* rbt_each(rbtree *tree, void (*each)(rbtree *tree, rbtree_node *no
 
 // Methods to be called in Ruby
 
-static VALUE id_compare_operator;
+static VALUE id_compare_operator, id_call, id_asc, id_desc;
 
-static int rbtree_compare_function(VALUE a, VALUE b) {
+static int rbtree_compare_arrays(VALUE a, VALUE b);
+
+int rbtree_compare_function(VALUE a, VALUE b) {
 	if (a == b) return 0;
 	if (FIXNUM_P(a) && FIXNUM_P(b)) {
 		long x = FIX2LONG(a), y = FIX2LONG(b);
@@ -301,46 +634,112 @@ static int rbtree_compare_function(VALUE a, VALUE b) {
             TYPE(b) == T_STRING && rb_obj_is_kind_of(b, rb_cString)) {
 		return rb_str_cmp(a, b);
 	}
-	return FIX2INT(rb_funcall((VALUE) a, id_compare_operator, 1, (VALUE) b));
+	if (RB_TYPE_P(a, T_ARRAY) && RB_TYPE_P(b, T_ARRAY)) {
+		return rbtree_compare_arrays(a, b);
+	}
+	return rb_cmpint(rb_funcall((VALUE) a, id_compare_operator, 1, (VALUE) b), a, b);
+}
+
+// Compares composite keys element by element as Array#<=> does, but without calling <=> for the
+// Fixnums and Strings they are usually made of. Nested Arrays are left to Array#<=>, which guards
+// against arrays that contain themselves.
+static int rbtree_compare_arrays(VALUE a, VALUE b) {
+	long i;
+	for (i = 0; i < RARRAY_LEN(a) && i < RARRAY_LEN(b); i++) {
+		VALUE x = RARRAY_AREF(a, i), y = RARRAY_AREF(b, i);
+		int cmp;
+		if (RB_TYPE_P(x, T_ARRAY)) cmp = rb_cmpint(rb_funcall(x, id_compare_operator, 1, y), x, y);
+		else cmp = rbtree_compare_function(x, y);
+		if (cmp != 0) return cmp;
+	}
+	if (RARRAY_LEN(a) == RARRAY_LEN(b)) return 0;
+	return RARRAY_LEN(a) < RARRAY_LEN(b) ? -1 : 1;
+}
+
+static int rbtree_compare_descending(VALUE a, VALUE b) {
+	return -rbtree_compare_function(a, b);
+}
+
+static void set_order(rbtree *tree, VALUE order) {
+	if (order == Qundef || NIL_P(order) || order == ID2SYM(id_asc)) {
+		tree->compare_function = &rbtree_compare_function;
+	} else if (order == ID2SYM(id_desc)) {
+		tree->compare_function = &rbtree_compare_descending;
+	} else {
+		rb_raise(rb_eArgError, "order must be :asc or :desc");
+	}
 }
 
-static VALUE rbtree_init(VALUE self)
+// Gives to the order of from, for the maps that come out of it
+static void copy_order(rbtree *to, const rbtree *from) {
+	to->compare_function = from->compare_function;
+	to->key_by = from->key_by;
+}
+
+// What the nodes of key are compared by. key_by runs here, once for each push, lookup or delete,
+// and never while nodes are being moved.
+static VALUE project(rbtree *tree, VALUE key) {
+	return NIL_P(tree->key_by) ? key : rb_funcall(tree->key_by, id_call, 1, key);
+}
+
+/*
+ * call-seq:
+ *     CRBTreeMap.new(order: :asc, key_by: nil) -> map
+ *
+ * Creates an empty map. Keys are kept in ascending order of <=>, or in descending order with
+ * order: :desc, which min_key, max_key, each and the other ordered methods then follow. Fixnums,
+ * Strings and Arrays of them are compared without calling <=>, so composite keys such as
+ * [last_name, first_name] or [year, month, day] are as fast as plain ones.
+ *
+ * key_by is anything with a call method, which maps each key to what it is ordered by, such as
+ * a Struct to an Array of its fields. It is called once when a key goes in and the result is kept
+ * in the node, so lookups and rebalancing compare the kept values and never call it again. The
+ * keys themselves are what each, min_key and max_key return, and two keys that key_by maps to the
+ * same value are the same key. The results must not change while they are in the map.
+ *
+ *   by_date = Containers::CRBTreeMap.new(key_by: ->(d) { [d.year, d.month, d.day] })
+ *   newest_first = Containers::CRBTreeMap.new(order: :desc)
+ */
+static VALUE rbtree_init(int argc, VALUE *argv, VALUE self)
 {
+	rbtree *tree = get_tree_from_self(self);
+	VALUE opts;
+	VALUE kwargs[2] = { Qundef, Qundef };
+	ID kwarg_ids[2];
+
+	rb_scan_args(argc, argv, "0:", &opts);
+	kwarg_ids[0] = rb_intern("order");
+	kwarg_ids[1] = rb_intern("key_by");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 2, kwargs);
+	set_order(tree, kwargs[0]);
+	if (kwargs[1] != Qundef && !NIL_P(kwargs[1])) {
+		if (!rb_respond_to(kwargs[1], id_call)) rb_raise(rb_eArgError, "key_by must respond to call");
+		tree->key_by = kwargs[1];
+	}
 	return self;
 }
 
+// Marking must not allocate, so this recurses; the tree is never deeper than twice its black
+// height
+static void rbtree_mark_nodes(rbtree_node *node) {
+	while (node) {
+		rb_gc_mark(node->key);
+		if (node->sort_key != node->key) rb_gc_mark(node->sort_key);
+		rb_gc_mark(node->value);
+		rbtree_mark_nodes(node->left);
+		node = node->right;
+	}
+}
+
 static void rbtree_mark(void *ptr) {
-	ll_node *current, *new, *last, *old;
+	long i;
 	if (ptr) {
 		rbtree *tree = ptr;
-		
-		if (tree->root) {
-			current = ALLOC(ll_node);
-			last = current;
-			current->node = tree->root;
-			current->next = NULL;
-
-			while(current) {
-				rb_gc_mark(current->node->key);
-				rb_gc_mark(current->node->value);
-				if (current->node->left) {
-					new = ALLOC(ll_node);
-					new->node = current->node->left;
-					new->next = NULL;
-					last->next = new;
-					last = new;
-				} 
-				if (current->node->right) {
-					new = ALLOC(ll_node);
-					new->node = current->node->right;
-					new->next = NULL;
-					last->next = new;
-					last = new;
-				}
-				old = current;
-				current = current->next;
-				xfree(old);
-			}
+		rb_gc_mark(tree->key_by);
+		rbtree_mark_nodes(tree->pinned ? tree->pinned : tree->root);
+		for (i = 0; i < tree->num_pending; i++) {
+			rb_gc_mark(tree->pending[i]->key);
+			rb_gc_mark(tree->pending[i]->value);
 		}
 	}
 }
@@ -348,25 +747,81 @@ static void rbtree_mark(void *ptr) {
 static void rbtree_free(void *ptr) {
 	if (ptr) {
 		rbtree *tree = ptr;
-		recursively_free_nodes(tree->root);
+		long i;
+		release(tree->root);
+		if (tree->counted) ATOMIC_DEC(live_snapshots);
+		for (i = 0; i < tree->num_pending; i++) xfree(tree->pending[i]);
+		xfree(tree->pending);
 		xfree(tree);
 	}
 }
 
+#ifdef HAVE_CONST_RUBY_TYPED_FROZEN_SHAREABLE
+#define RBTREE_TYPED_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE)
+#else
+#define RBTREE_TYPED_FLAGS RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+
+static const rb_data_type_t rbtree_type = {
+	"Containers::CRBTreeMap",
+	{rbtree_mark, rbtree_free, NULL,},
+	NULL, NULL, RBTREE_TYPED_FLAGS
+};
+
 static VALUE rbtree_alloc(VALUE klass) {
 	rbtree *tree = create_rbtree(&rbtree_compare_function);
-	return Data_Wrap_Struct(klass, rbtree_mark, rbtree_free, tree);
+	return TypedData_Wrap_Struct(klass, &rbtree_type, tree);
+}
+
+/*
+ * Writing to a tree that shares nodes with a snapshot allocates the copies, and the GC this may
+ * start can come while the tree is half rebalanced, with nodes that no link leads to. So the tree
+ * is pinned first: the extra link to the root makes every node the write reaches look shared, the
+ * original tree is left whole, and the GC marks that instead until unpin lets it go.
+ */
+static void pin(rbtree *tree, int shared) {
+	if (shared) tree->pinned = retain(tree->root);
+}
+
+static void unpin(rbtree *tree) {
+	rbtree_node *pinned = tree->pinned;
+	tree->pinned = NULL;
+	release(pinned);
+}
+
+// Sets up a write to key. On a tree that shares nodes all comparisons are made here, before the
+// tree is pinned, and the write is then steered by rank.
+static rbtree_target* begin_write(rbtree *tree, VALUE key, VALUE sort_key, rbtree_target *t, rbtree_rank *rank) {
+	t->tree = tree;
+	t->key = key;
+	t->sort_key = sort_key;
+	t->rank = NULL;
+	if (is_shared(tree)) {
+		rbtree_ranks(tree, tree->root, &sort_key, 1, rank);
+		t->rank = rank;
+		pin(tree, TRUE);
+	}
+	return t;
+}
+
+static void put(rbtree *tree, VALUE key, VALUE sort_key, VALUE value) {
+	rbtree_target t;
+	rbtree_rank rank;
+	tree->root = insert(begin_write(tree, key, sort_key, &t, &rank), tree->root, 0, value);
+	unpin(tree);
 }
 
 static VALUE rbtree_push(VALUE self, VALUE key, VALUE value) {
 	rbtree *tree = get_tree_from_self(self);
-	tree->root = insert(tree, tree->root, key, value);
+	rb_check_frozen(self);
+	put(tree, key, project(tree, key), value);
 	return value;
 }
 
 static VALUE rbtree_get(VALUE self, VALUE key) {
 	rbtree *tree = get_tree_from_self(self);
-	return get(tree, tree->root, key);
+	if (!tree->root) return Qnil;
+	return get(tree, tree->root, project(tree, key));
 }
 
 static VALUE rbtree_size(VALUE self) {
@@ -387,7 +842,7 @@ static VALUE rbtree_height(VALUE self) {
 static VALUE rbtree_has_key(VALUE self, VALUE key) {
 	rbtree *tree = get_tree_from_self(self);
 	if(!tree->root) { return Qfalse; }
-	if(get(tree, tree->root, key) == Qnil)
+	if(get(tree, tree->root, project(tree, key)) == Qnil)
 		return Qfalse;
 	
 	return Qtrue;
@@ -398,7 +853,7 @@ static VALUE rbtree_min_key(VALUE self) {
 	if(!tree->root)
 		return Qnil;
 	
-	return min_key(tree->root);
+	return min_node(tree->root)->key;
 }
 
 static VALUE rbtree_max_key(VALUE self) {
@@ -406,16 +861,25 @@ static VALUE rbtree_max_key(VALUE self) {
 	if(!tree->root)
 		return Qnil;
 	
-	return max_key(tree->root);
+	return max_node(tree->root)->key;
 }
 
 static VALUE rbtree_delete(VALUE self, VALUE key) {
 	VALUE deleted_value;
 	rbtree *tree = get_tree_from_self(self);
+	rbtree_target t;
+	rbtree_rank rank;
+	rb_check_frozen(self);
 	if(!tree->root)
 		return Qnil;
 	
-	tree->root = delete(tree, tree->root, key, &deleted_value);
+	begin_write(tree, key, project(tree, key), &t, &rank);
+	if (t.rank && !rank.equal) {
+		unpin(tree);
+		return Qnil;
+	}
+	tree->root = delete(&t, tree->root, 0, &deleted_value);
+	unpin(tree);
 	if(tree->root)
 		tree->root->color = BLACK;
 	
@@ -429,10 +893,13 @@ static VALUE rbtree_delete(VALUE self, VALUE key) {
 static VALUE rbtree_delete_min(VALUE self) {
 	VALUE deleted_value;
 	rbtree *tree = get_tree_from_self(self);
+	rb_check_frozen(self);
 	if(!tree->root)
 		return Qnil;
 	
+	pin(tree, is_shared(tree));
 	tree->root = delete_min(tree->root, &deleted_value);
+	unpin(tree);
 	if(tree->root)
 		tree->root->color = BLACK;
 	
@@ -446,10 +913,13 @@ static VALUE rbtree_delete_min(VALUE self) {
 static VALUE rbtree_delete_max(VALUE self) {
 	VALUE deleted_value;
 	rbtree *tree = get_tree_from_self(self);
+	rb_check_frozen(self);
 	if(!tree->root)
 		return Qnil;
 	
+	pin(tree, is_shared(tree));
 	tree->root = delete_max(tree->root, &deleted_value);
+	unpin(tree);
 	if(tree->root)
 		tree->root->color = BLACK;
 	
@@ -470,16 +940,410 @@ static VALUE rbtree_each(VALUE self) {
 	return self;
 }
 
+/*
+ * call-seq:
+ *     snapshot -> map
+ *
+ * Returns a frozen map with the pairs this map has now, which later writes to this map do not
+ * change. The snapshot shares every node with the map: a write copies the nodes on its path, so
+ * it allocates O(log n) new nodes rather than the whole tree, and leaves the shared ones alone.
+ * Readers can therefore iterate a snapshot without a lock while writes go on. When its keys and
+ * values are shareable too, so is the snapshot, and it can be passed to other Ractors.
+ *
+ * The snapshot of a frozen map is the map itself.
+ *
+ * Complexity: O(1)
+ *
+ *   view = map.snapshot
+ *   map["MA"] = "Massachusetts"
+ *   view.has_key?("MA") #=> false
+ */
+static VALUE rbtree_snapshot(VALUE self) {
+	rbtree *tree = get_tree_from_self(self), *copy;
+	VALUE snapshot;
+
+	if (OBJ_FROZEN(self)) return self;
+	snapshot = rbtree_alloc(rb_obj_class(self));
+	copy = get_tree_from_self(snapshot);
+	copy_order(copy, tree);
+	copy->counted = TRUE;
+	ATOMIC_INC(live_snapshots);
+	copy->root = retain(tree->root);
+	copy->shared = tree->shared = TRUE;
+	return rb_obj_freeze(snapshot);
+}
+
+// Writes the pairs in ascending key order, which for a descending map means from the right
+static void rbtree_dump_nodes(map_file_writer *w, rbtree_node *node, int descending) {
+	while (node) {
+		rbtree_dump_nodes(w, descending ? node->right : node->left, descending);
+		map_file_writer_push(w, node->key, node->value);
+		node = descending ? node->left : node->right;
+	}
+}
+
+/*
+ * call-seq:
+ *     dump(io) -> self
+ *
+ * Writes the map to io, which only needs a write method, so that it can be read back with
+ * Containers::RBTreeMap.load or searched in place with Containers::MappedTreeMap. The pairs are
+ * written in ascending key order, even from a map with order: :desc; Fixnums, Floats and Strings
+ * are stored directly and everything else with Marshal. A map with key_by raises ArgumentError, as
+ * its keys are not in an order that the file could be searched by.
+ *
+ * Complexity: O(n)
+ *
+ *   File.open("states.map", "wb") { |f| map.dump(f) }
+ */
+static VALUE rbtree_dump(VALUE self, VALUE io) {
+	rbtree *tree = get_tree_from_self(self);
+	map_file_writer w;
+	if (!NIL_P(tree->key_by)) rb_raise(rb_eArgError, "can't dump a map ordered by key_by");
+	map_file_writer_init(&w, io, size(tree->root));
+	rbtree_dump_nodes(&w, tree->root, tree->compare_function == &rbtree_compare_descending);
+	map_file_writer_finish(&w);
+	return self;
+}
+
+// The most keys a 2-3 tree of the given black height holds, 3^h - 1, or LONG_MAX if that is more
+static long rbtree_max_keys(int black_height) {
+	long n = 0;
+	int i;
+	for (i = 0; i < black_height; i++) {
+		if (n > (LONG_MAX - 2) / 3) return LONG_MAX;
+		n = 3 * n + 2;
+	}
+	return n;
+}
+
+// Links the n sorted nodes into a tree of the given black height, which needs
+// 2^h - 1 <= n <= 3^h - 1. Nodes are 2-nodes unless their subtrees could not hold the keys,
+// and then 3-nodes, whose red half is their left child.
+static rbtree_node* rbtree_build(rbtree_node **nodes, long n, int black_height) {
+	long max_child, a, b;
+	rbtree_node *root, *red;
+	if (n == 0) return NULL;
+	max_child = rbtree_max_keys(black_height - 1);
+	if (n - 1 - max_child <= max_child) {
+		a = n / 2;
+		root = nodes[a];
+		root->left = rbtree_build(nodes, a, black_height - 1);
+		root->right = rbtree_build(nodes + a + 1, n - a - 1, black_height - 1);
+	} else {
+		a = n / 3;
+		b = (n - 1) / 3;
+		red = nodes[a];
+		red->color = RED;
+		red->left = rbtree_build(nodes, a, black_height - 1);
+		red->right = rbtree_build(nodes + a + 1, b, black_height - 1);
+		set_num_nodes(red);
+		root = nodes[a + b + 1];
+		root->left = red;
+		root->right = rbtree_build(nodes + a + b + 2, n - a - b - 2, black_height - 1);
+	}
+	root->color = BLACK;
+	return set_num_nodes(root);
+}
+
+/*
+ * call-seq:
+ *     Containers::RBTreeMap.load(io, order: :asc) -> map
+ *
+ * Returns a new map with the pairs that dump wrote to io, and leaves io just past them. As the
+ * pairs come sorted, the tree is built directly rather than by inserting them one at a time.
+ * Keys that are not in order raise ArgumentError. With order: :desc the map keeps its keys in
+ * descending order, as one made with new(order: :desc) does.
+ *
+ * Complexity: O(n)
+ *
+ *   map = File.open("states.map", "rb") { |f| Containers::RBTreeMap.load(f) }
+ */
+static VALUE rbtree_s_load(int argc, VALUE *argv, VALUE klass) {
+	VALUE self = rbtree_alloc(klass);
+	rbtree *tree = get_tree_from_self(self);
+	map_file_reader r;
+	int64_t count;
+	long capa = 0, i;
+	int black_height = 0;
+	VALUE io, opts, key, value;
+	VALUE kwargs[1] = { Qundef };
+	ID kwarg_ids[1];
+
+	rb_scan_args(argc, argv, "1:", &io, &opts);
+	kwarg_ids[0] = rb_intern("order");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 1, kwargs);
+	set_order(tree, kwargs[0]);
+	count = map_file_reader_init(&r, io);
+	if (count > INT_MAX) rb_raise(rb_eArgError, "too many pairs for a red-black tree map");
+	while (map_file_reader_next(&r, &key, &value)) {
+		rbtree_node *node;
+		if (tree->num_pending == count) rb_raise(rb_eArgError, "corrupt tree map dump");
+		if (tree->num_pending > 0 && rbtree_compare_function(tree->pending[tree->num_pending - 1]->key, key) >= 0) {
+			rb_raise(rb_eArgError, "tree map dump is not in key order");
+		}
+		if (tree->num_pending == capa) {
+			capa = capa ? 2 * capa : 64;
+			REALLOC_N(tree->pending, rbtree_node*, capa);
+		}
+		node = ALLOC(rbtree_node);
+		node->refcount = 1;
+		node->key = node->sort_key = key;
+		node->value = value;
+		node->left = node->right = NULL;
+		tree->pending[tree->num_pending++] = node;
+	}
+	if (tree->num_pending != count) rb_raise(rb_eArgError, "corrupt tree map dump");
+	map_file_reader_finish(&r, count);
+	if (tree->compare_function == &rbtree_compare_descending) {
+		for (i = 0; i < tree->num_pending / 2; i++) {
+			rbtree_node *node = tree->pending[i];
+			tree->pending[i] = tree->pending[tree->num_pending - 1 - i];
+			tree->pending[tree->num_pending - 1 - i] = node;
+		}
+	}
+
+	// The tallest tree the keys fill, which can then always hold them
+	while ((2L << black_height) - 1 <= tree->num_pending) black_height++;
+	tree->root = rbtree_build(tree->pending, tree->num_pending, black_height);
+	tree->black_height = black_height;
+	xfree(tree->pending);
+	tree->pending = NULL;
+	tree->num_pending = 0;
+	return self;
+}
+
 static VALUE cRBTree;
 static VALUE mContainers;
 
+void Init_mapped_tree_map(VALUE mContainers);
+
+// For the methods that combine other with self
+static rbtree* get_other_tree(VALUE self, VALUE other) {
+	rbtree *tree = get_tree_from_self(self), *other_tree;
+	if (!rb_obj_is_kind_of(other, cRBTree)) {
+		rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected %"PRIsVALUE")", rb_obj_class(other), cRBTree);
+	}
+	if (other == self) rb_raise(rb_eArgError, "can't combine a map with itself");
+	other_tree = get_tree_from_self(other);
+	if (other_tree->compare_function != tree->compare_function || other_tree->key_by != tree->key_by) {
+		rb_raise(rb_eArgError, "can't combine maps that order their keys differently");
+	}
+	return other_tree;
+}
+
+/*
+ * call-seq:
+ *     split(key) -> [lo, hi]
+ *
+ * Moves the pairs with keys below key into a new map lo and the rest into a new map hi, which
+ * leaves this map empty. The tree is cut along the path to key and the pieces on each side are
+ * joined back up, without visiting any other node.
+ *
+ * Complexity: O(log n)
+ *
+ *   map = Containers::RBTreeMap.new
+ *   (1..5).each { |i| map[i] = i.to_s }
+ *   lo, hi = map.split(3)
+ *   lo.to_a #=> [[1, "1"], [2, "2"]]
+ *   hi.to_a #=> [[3, "3"], [4, "4"], [5, "5"]]
+ */
+static VALUE rbtree_split(VALUE self, VALUE key) {
+	rbtree *tree = get_tree_from_self(self), *lo_tree, *hi_tree;
+	VALUE lo, hi;
+	rbtree_node *l, *r;
+	rbtree_rank rank;
+
+	rb_check_frozen(self);
+	lo = rbtree_alloc(rb_obj_class(self));
+	hi = rbtree_alloc(rb_obj_class(self));
+	lo_tree = get_tree_from_self(lo);
+	hi_tree = get_tree_from_self(hi);
+	copy_order(lo_tree, tree);
+	copy_order(hi_tree, tree);
+	key = project(tree, key);
+	rbtree_ranks(tree, tree->root, &key, 1, &rank);
+	pin(tree, is_shared(tree));
+	split_rank(tree->root, rank.rank, &l, NULL, &r);
+	tree->root = NULL;
+	lo_tree->root = blacken(l);
+	hi_tree->root = blacken(r);
+	lo_tree->shared = hi_tree->shared = tree->shared;
+	unpin(tree);
+	return rb_assoc_new(lo, hi);
+}
+
+/*
+ * call-seq:
+ *     join(other) -> self
+ *
+ * Moves all pairs of other into this map, which leaves other empty. All keys of one map must sort
+ * before all keys of the other, or ArgumentError is raised; the two trees are then linked at the
+ * height where they meet.
+ *
+ * Complexity: O(log n)
+ *
+ *   lo, hi = map.split(3)
+ *   lo.join(hi) # lo has every pair again
+ */
+static VALUE rbtree_join(VALUE self, VALUE other) {
+	rbtree *tree = get_tree_from_self(self), *other_tree = get_other_tree(self, other);
+	int shared = is_shared(tree) || is_shared(other_tree), lower;
+
+	rb_check_frozen(self);
+	rb_check_frozen(other);
+	if (!other_tree->root) return self;
+	if (!tree->root) {
+		lower = TRUE;
+	} else if (tree->compare_function(max_node(tree->root)->sort_key, min_node(other_tree->root)->sort_key) < 0) {
+		lower = TRUE;
+	} else if (tree->compare_function(max_node(other_tree->root)->sort_key, min_node(tree->root)->sort_key) < 0) {
+		lower = FALSE;
+	} else {
+		rb_raise(rb_eArgError, "the keys of the maps overlap");
+	}
+	pin(tree, shared);
+	pin(other_tree, shared);
+	if (lower) tree->root = join2(tree->root, other_tree->root);
+	else tree->root = join2(other_tree->root, tree->root);
+	tree->root = blacken(tree->root);
+	other_tree->root = NULL;
+	tree->shared = shared;
+	unpin(tree);
+	unpin(other_tree);
+	return self;
+}
+
+static void rbtree_collect_keys(rbtree_node *node, VALUE *keys, long *n) {
+	while (node) {
+		rbtree_collect_keys(node->left, keys, n);
+		keys[(*n)++] = node->sort_key;
+		node = node->right;
+	}
+}
+
+/*
+ * Runs union, intersection or difference into a new map; see combine. Neither map changes:
+ * combine is given a link of its own to each root, so every node it reaches is shared and gets
+ * copied, just as with a snapshot, and both trees stay whole for the GC to mark until it is done.
+ * The nodes the result keeps stay shared with the maps they came from, so the result is counted
+ * in live_snapshots, and all three are marked shared.
+ */
+static VALUE rbtree_combine_maps(VALUE self, VALUE other, int op) {
+	rbtree *tree = get_tree_from_self(self), *other_tree = get_other_tree(self, other), *result_tree;
+	VALUE keys_v = 0, ranks_v = 0, conflicts_v = 0, *keys, result, conflicts;
+	rbtree_node *small, *big;
+	rbtree_combination c;
+	long n = 0, i;
+
+	c.op = op;
+	c.receiver_is_small = size(tree->root) <= size(other_tree->root);
+	small = c.receiver_is_small ? tree->root : other_tree->root;
+	big = c.receiver_is_small ? other_tree->root : tree->root;
+	keys = ALLOCV_N(VALUE, keys_v, size(small));
+	rbtree_collect_keys(small, keys, &n);
+	c.ranks = ALLOCV_N(rbtree_rank, ranks_v, n);
+	rbtree_ranks(tree, big, keys, n, (rbtree_rank *) c.ranks);
+	c.conflicts = NULL;
+	c.num_conflicts = 0;
+	if (op != RBTREE_DIFFERENCE && rb_block_given_p()) c.conflicts = ALLOCV_N(VALUE, conflicts_v, 4 * n);
+
+	result = rbtree_alloc(rb_obj_class(self));
+	result_tree = get_tree_from_self(result);
+	copy_order(result_tree, tree);
+	result_tree->counted = TRUE;
+	ATOMIC_INC(live_snapshots);
+	result_tree->root = blacken(combine(&c, retain(small), 0, retain(big), 0));
+	result_tree->shared = TRUE;
+	if (!OBJ_FROZEN(self)) tree->shared = TRUE;
+	if (!OBJ_FROZEN(other)) other_tree->shared = TRUE;
+	RB_GC_GUARD(self);
+	RB_GC_GUARD(other);
+	ALLOCV_END(keys_v);
+	ALLOCV_END(ranks_v);
+
+	if (!c.conflicts) return result;
+
+	// The result is whole before any block runs. The block may change either map, so the
+	// conflicts move into an Array that keeps their keys and values alive.
+	conflicts = rb_ary_new_from_values(4 * c.num_conflicts, c.conflicts);
+	ALLOCV_END(conflicts_v);
+	for (i = 0; i < c.num_conflicts; i++) {
+		VALUE key = RARRAY_AREF(conflicts, 4 * i), value;
+		value = rb_yield_values(3, key, RARRAY_AREF(conflicts, 4 * i + 2), RARRAY_AREF(conflicts, 4 * i + 3));
+		put(result_tree, key, RARRAY_AREF(conflicts, 4 * i + 1), value);
+	}
+	RB_GC_GUARD(conflicts);
+	return result;
+}
+
+/*
+ * call-seq:
+ *     union(other) -> map
+ *     union(other) { |key, mine, theirs| ... } -> map
+ *
+ * Returns a new map with the pairs of this map and other. For a key that both maps have, the
+ * value is other's, or the result of the block if one is given. Neither map changes.
+ *
+ * Each node of the smaller map splits the larger one at its key, and the pieces are joined back
+ * together, so merging m pairs into n is much cheaper than m pushes when m is small, and never
+ * worse than O(m + n). The result shares its nodes with both maps, as a snapshot does, and they
+ * are copied only when a write reaches them.
+ *
+ * Complexity: O(m log(n / m + 1)) for maps of m <= n pairs
+ *
+ *   a = Containers::RBTreeMap.new
+ *   b = Containers::RBTreeMap.new
+ *   a[1] = 1; a[2] = 2
+ *   b[2] = 20; b[3] = 30
+ *   a.union(b) { |key, mine, theirs| mine + theirs }.to_a #=> [[1, 1], [2, 22], [3, 30]]
+ *   a.to_a #=> [[1, 1], [2, 2]]
+ */
+static VALUE rbtree_union(VALUE self, VALUE other) {
+	return rbtree_combine_maps(self, other, RBTREE_UNION);
+}
+
+/*
+ * call-seq:
+ *     intersection(other) -> map
+ *     intersection(other) { |key, mine, theirs| ... } -> map
+ *
+ * Returns a new map with the keys that both maps have. The values are other's, or the result of
+ * the block if one is given. Neither map changes.
+ *
+ * Complexity: O(m log(n / m + 1)) for maps of m <= n pairs
+ */
+static VALUE rbtree_intersection(VALUE self, VALUE other) {
+	return rbtree_combine_maps(self, other, RBTREE_INTERSECTION);
+}
+
+/*
+ * call-seq:
+ *     difference(other) -> map
+ *
+ * Returns a new map with the pairs of this map whose keys other does not have. Neither map
+ * changes.
+ *
+ * Complexity: O(m log(n / m + 1)) for maps of m <= n pairs
+ */
+static VALUE rbtree_difference(VALUE self, VALUE other) {
+	return rbtree_combine_maps(self, other, RBTREE_DIFFERENCE);
+}
+
 void Init_CRBTreeMap() {
 	id_compare_operator = rb_intern("<=>");
+	id_call = rb_intern("call");
+	id_asc = rb_intern("asc");
+	id_desc = rb_intern("desc");
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+	// Snapshots are read from other Ractors, and a map that is not frozen never leaves its own
+	rb_ext_ractor_safe(1);
+#endif
 	
 	mContainers = rb_define_module("Containers");
 	cRBTree = rb_define_class_under(mContainers, "CRBTreeMap", rb_cObject);
 	rb_define_alloc_func(cRBTree, rbtree_alloc);
-	rb_define_method(cRBTree, "initialize", rbtree_init, 0);
+	rb_define_method(cRBTree, "initialize", rbtree_init, -1);
 	rb_define_method(cRBTree, "push", rbtree_push, 2);
 	rb_define_alias(cRBTree, "[]=", "push");
 	rb_define_method(cRBTree, "size", rbtree_size, 0);
@@ -494,5 +1358,14 @@ void Init_CRBTreeMap() {
 	rb_define_alias(cRBTree, "[]", "get");
 	rb_define_method(cRBTree, "has_key?", rbtree_has_key, 1);
 	rb_define_method(cRBTree, "delete", rbtree_delete, 1);
+	rb_define_method(cRBTree, "snapshot", rbtree_snapshot, 0);
+	rb_define_method(cRBTree, "split", rbtree_split, 1);
+	rb_define_method(cRBTree, "join", rbtree_join, 1);
+	rb_define_method(cRBTree, "union", rbtree_union, 1);
+	rb_define_method(cRBTree, "intersection", rbtree_intersection, 1);
+	rb_define_method(cRBTree, "difference", rbtree_difference, 1);
+	rb_define_method(cRBTree, "dump", rbtree_dump, 1);
+	rb_define_singleton_method(cRBTree, "load", rbtree_s_load, -1);
 	rb_include_module(cRBTree, rb_eval_string("Enumerable"));
+	Init_mapped_tree_map(mContainers);
 }
@@ -1,4 +1,5 @@
 #include "ruby.h"
+#include "../rbtree_map/map_file.h"
 
 #define node_size(x) (((x)==NULL) ? 0 : ((x)->size))
 
@@ -8,6 +9,7 @@
 
 typedef struct struct_splaytree_node {
 	VALUE key;
+	VALUE sort_key;  // what the node is compared by: key, or what key_by made of it
 	VALUE value;
 	int size;
 	struct struct_splaytree_node *left;
@@ -16,21 +18,27 @@ typedef struct struct_splaytree_node {
 
 typedef struct {
 	int (*compare_function)(VALUE key1, VALUE key2);
+	VALUE key_by;              // nil, or what projects keys before they are compared
 	splaytree_node *root;
+	splaytree_node **pending;  // nodes read by load that are not linked into the tree yet
+	long num_pending;
 } splaytree;
 
-typedef struct struct_ll_node {
-	splaytree_node *node;
-	struct struct_ll_node *next;
-} ll_node;
-
+// Rotates left children up until there are none, so that a tree of any depth is freed without
+// recursion
 static void recursively_free_nodes(splaytree_node *node) {
-	if(node) {
-		recursively_free_nodes(node->left);
-		recursively_free_nodes(node->right);
-		xfree(node);
+	splaytree_node *next;
+	while (node) {
+		if (node->left) {
+			next = node->left;
+			node->left = next->right;
+			next->right = node;
+		} else {
+			next = node->right;
+			xfree(node);
+		}
+		node = next;
 	}
-	return;
 }
 
 static splaytree* get_tree_from_self(VALUE self) {
@@ -39,7 +47,7 @@ static splaytree* get_tree_from_self(VALUE self) {
 	return tree;
 }
 
-static splaytree_node* splay(splaytree *tree, splaytree_node *n, VALUE key) {
+static splaytree_node* splay(splaytree *tree, splaytree_node *n, VALUE sort_key) {
 	int cmp, cmp2, root_size, l_size, r_size;
 	splaytree_node N;
 	splaytree_node *l, *r, *y;
@@ -52,10 +60,10 @@ static splaytree_node* splay(splaytree *tree, splaytree_node *n, VALUE key) {
 	l_size = r_size = 0;
 	
 	while(1) {
-		cmp = tree->compare_function(key, n->key);
+		cmp = tree->compare_function(sort_key, n->sort_key);
 		if (cmp == -1) {
 			if (!n->left) break;
-			cmp2 = tree->compare_function(key, n->left->key);
+			cmp2 = tree->compare_function(sort_key, n->left->sort_key);
 			if (cmp2 == -1) {
 				y = n->left;
 				n->left = y->right;
@@ -70,7 +78,7 @@ static splaytree_node* splay(splaytree *tree, splaytree_node *n, VALUE key) {
 			r_size += 1 + node_size(r->right);
 		} else if (cmp == 1) {
 			if (!n->right) break;
-			cmp2 = tree->compare_function(key, n->right->key);
+			cmp2 = tree->compare_function(sort_key, n->right->sort_key);
 			if (cmp2 == 1) {
 				y = n->right;
 				n->right = y->left;
@@ -124,36 +132,42 @@ static int height(splaytree_node *h) {
 static splaytree* create_splaytree(int (*compare_function)(VALUE, VALUE)) {
 	splaytree *tree = ALLOC(splaytree);
 	tree->compare_function = compare_function;
+	tree->key_by = Qnil;
 	tree->root = NULL;
+	tree->pending = NULL;
+	tree->num_pending = 0;
 	return tree;
 }
 
-static splaytree_node* create_node(VALUE key, VALUE value) {
+static splaytree_node* create_node(VALUE key, VALUE sort_key, VALUE value) {
 	splaytree_node *new_node = ALLOC(splaytree_node);
 	new_node->key		= key;
+	new_node->sort_key	= sort_key;
 	new_node->value		= value;
 	new_node->left		= NULL;
 	new_node->right		= NULL;
 	return new_node;
 }
 
-static splaytree_node* insert(splaytree *tree, splaytree_node *n, VALUE key, VALUE value) {
+static splaytree_node* insert(splaytree *tree, splaytree_node *n, VALUE key, VALUE sort_key, VALUE value) {
 	int cmp;
 	splaytree_node *new_node;
 	
 	if (n) {
-		n = splay(tree, n, key);
-		cmp = tree->compare_function(key, n->key);
+		// The old root is somewhere below the new one now, so point the tree at the new root
+		// before comparing, which may run the GC
+		n = tree->root = splay(tree, n, sort_key);
+		cmp = tree->compare_function(sort_key, n->sort_key);
 		if (cmp == 0) {
 			n->value = value;
 			return n;
 		}
 	}
-	new_node = create_node(key, value);
+	new_node = create_node(key, sort_key, value);
 	if (!n) {
 		new_node->left = new_node->right = NULL;
 	} else {
-		cmp = tree->compare_function(key, n->key);
+		cmp = tree->compare_function(sort_key, n->sort_key);
 		if (cmp < 0) {
 			new_node->left = n->left;
 			new_node->right = n;
@@ -170,33 +184,33 @@ static splaytree_node* insert(splaytree *tree, splaytree_node *n, VALUE key, VAL
 	return new_node;
 }
 
-static VALUE get(splaytree *tree, VALUE key) {
+static VALUE get(splaytree *tree, VALUE sort_key) {
 	int cmp;
 	
 	if (!tree->root)
 		return Qnil;
 		
-	tree->root = splay(tree, tree->root, key);
-	cmp = tree->compare_function(key, tree->root->key);
+	tree->root = splay(tree, tree->root, sort_key);
+	cmp = tree->compare_function(sort_key, tree->root->sort_key);
 	if (cmp == 0) {
 		return tree->root->value;
 	}
 	return Qnil;
 }
 
-static splaytree_node* delete(splaytree *tree, splaytree_node *n, VALUE key, VALUE *deleted) {
+static splaytree_node* delete(splaytree *tree, splaytree_node *n, VALUE sort_key, VALUE *deleted) {
 	int cmp, tsize;
 	splaytree_node *x;
 	
 	tsize = n->size;
-	n = splay(tree, n, key);
-	cmp = tree->compare_function(key, n->key);
+	n = tree->root = splay(tree, n, sort_key);
+	cmp = tree->compare_function(sort_key, n->sort_key);
 	if (cmp == 0) {
 		*deleted = n->value;
 		if (!n->left) {
 			x = n->right;
 		} else {
-			x = splay(tree, n->left, key);
+			x = splay(tree, n->left, sort_key);
 			x->right = n->right;
 		}
 		xfree(n);
@@ -230,7 +244,9 @@ static splaytree* splay_each(splaytree *tree, void (*each)(splaytree *tree, spla
 
 // Methods to be called in Ruby
 
-static VALUE id_compare_operator;
+static VALUE id_compare_operator, id_call, id_asc, id_desc;
+
+static int splaytree_compare_arrays(VALUE a, VALUE b);
 
 static int splaytree_compare_function(VALUE a, VALUE b) {
 	if (a == b) return 0;
@@ -244,46 +260,109 @@ static int splaytree_compare_function(VALUE a, VALUE b) {
             TYPE(b) == T_STRING && rb_obj_is_kind_of(b, rb_cString)) {
 		return rb_str_cmp(a, b);
 	}
-	return FIX2INT(rb_funcall((VALUE) a, id_compare_operator, 1, (VALUE) b));
+	if (RB_TYPE_P(a, T_ARRAY) && RB_TYPE_P(b, T_ARRAY)) {
+		return splaytree_compare_arrays(a, b);
+	}
+	return rb_cmpint(rb_funcall((VALUE) a, id_compare_operator, 1, (VALUE) b), a, b);
+}
+
+// Compares composite keys element by element as Array#<=> does, without calling <=> for Fixnum
+// and String elements. Nested Arrays are left to Array#<=>, which handles recursive arrays.
+static int splaytree_compare_arrays(VALUE a, VALUE b) {
+	long i;
+	for (i = 0; i < RARRAY_LEN(a) && i < RARRAY_LEN(b); i++) {
+		VALUE x = RARRAY_AREF(a, i), y = RARRAY_AREF(b, i);
+		int cmp;
+		if (RB_TYPE_P(x, T_ARRAY)) cmp = rb_cmpint(rb_funcall(x, id_compare_operator, 1, y), x, y);
+		else cmp = splaytree_compare_function(x, y);
+		if (cmp != 0) return cmp;
+	}
+	if (RARRAY_LEN(a) == RARRAY_LEN(b)) return 0;
+	return RARRAY_LEN(a) < RARRAY_LEN(b) ? -1 : 1;
+}
+
+static int splaytree_compare_descending(VALUE a, VALUE b) {
+	return -splaytree_compare_function(a, b);
+}
+
+static void set_order(splaytree *tree, VALUE order) {
+	if (order == Qundef || NIL_P(order) || order == ID2SYM(id_asc)) {
+		tree->compare_function = &splaytree_compare_function;
+	} else if (order == ID2SYM(id_desc)) {
+		tree->compare_function = &splaytree_compare_descending;
+	} else {
+		rb_raise(rb_eArgError, "order must be :asc or :desc");
+	}
 }
 
-static VALUE splaytree_init(VALUE self)
+// What the nodes of key are compared by; key_by is called once per push, lookup or delete
+static VALUE project(splaytree *tree, VALUE key) {
+	return NIL_P(tree->key_by) ? key : rb_funcall(tree->key_by, id_call, 1, key);
+}
+
+/*
+ * call-seq:
+ *     CSplayTreeMap.new(order: :asc, key_by: nil) -> map
+ *
+ * Creates an empty map, ordered by <=> ascending or, with order: :desc, descending. Fixnums,
+ * Strings and Arrays of them are compared without calling <=>.
+ *
+ * key_by maps each key to what it is ordered by, such as a Struct to an Array of its fields. It
+ * is called once when a key goes in, and the result is kept in the node for every later
+ * comparison. Keys that key_by maps to the same value are the same key.
+ *
+ *   by_name = Containers::CSplayTreeMap.new(key_by: ->(p) { [p.last_name, p.first_name] })
+ */
+static VALUE splaytree_init(int argc, VALUE *argv, VALUE self)
 {
+	splaytree *tree = get_tree_from_self(self);
+	VALUE opts;
+	VALUE kwargs[2] = { Qundef, Qundef };
+	ID kwarg_ids[2];
+
+	rb_scan_args(argc, argv, "0:", &opts);
+	kwarg_ids[0] = rb_intern("order");
+	kwarg_ids[1] = rb_intern("key_by");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 2, kwargs);
+	set_order(tree, kwargs[0]);
+	if (kwargs[1] != Qundef && !NIL_P(kwargs[1])) {
+		if (!rb_respond_to(kwargs[1], id_call)) rb_raise(rb_eArgError, "key_by must respond to call");
+		tree->key_by = kwargs[1];
+	}
 	return self;
 }
 
 static void splaytree_mark(void *ptr) {
-	ll_node *current, *new, *last, *old;
+	splaytree_node *node, *pred;
+	long i;
 	if (ptr) {
 		splaytree *tree = ptr;
+		rb_gc_mark(tree->key_by);
 		
-		if (tree->root) {
-			current = ALLOC(ll_node);
-			last = current;
-			current->node = tree->root;
-			current->next = NULL;
-
-			while(current) {
-				rb_gc_mark(current->node->key);
-				rb_gc_mark(current->node->value);
-				if (current->node->left) {
-					new = ALLOC(ll_node);
-					new->node = current->node->left;
-					new->next = NULL;
-					last->next = new;
-					last = new;
-				} 
-				if (current->node->right) {
-					new = ALLOC(ll_node);
-					new->node = current->node->right;
-					new->next = NULL;
-					last->next = new;
-					last = new;
+		// A splay tree can be as deep as it is large, and marking must not allocate, so this is
+		// a Morris traversal: each node's predecessor is pointed back at it on the way down the
+		// left side, and the link is removed again on the way back up.
+		node = tree->root;
+		while (node) {
+			if (node->left) {
+				pred = node->left;
+				while (pred->right && pred->right != node)
+					pred = pred->right;
+				if (!pred->right) {
+					pred->right = node;
+					node = node->left;
+					continue;
 				}
-				old = current;
-				current = current->next;
-				xfree(old);
+				pred->right = NULL;
 			}
+			rb_gc_mark(node->key);
+			if (node->sort_key != node->key) rb_gc_mark(node->sort_key);
+			rb_gc_mark(node->value);
+			node = node->right;
+		}
+		for (i = 0; i < tree->num_pending; i++) {
+			rb_gc_mark(tree->pending[i]->key);
+			rb_gc_mark(tree->pending[i]->value);
 		}
 	}
 }
@@ -291,7 +370,10 @@ static void splaytree_mark(void *ptr) {
 static void splaytree_free(void *ptr) {
 	if (ptr) {
 		splaytree *tree = ptr;
+		long i;
 		recursively_free_nodes(tree->root);
+		for (i = 0; i < tree->num_pending; i++) xfree(tree->pending[i]);
+		xfree(tree->pending);
 		xfree(tree);
 	}
 }
@@ -303,13 +385,14 @@ static VALUE splaytree_alloc(VALUE klass) {
 
 static VALUE splaytree_push(VALUE self, VALUE key, VALUE value) {
 	splaytree *tree = get_tree_from_self(self);
-	tree->root = insert(tree, tree->root, key, value);
+	tree->root = insert(tree, tree->root, key, project(tree, key), value);
 	return value;
 }
 
 static VALUE splaytree_get(VALUE self, VALUE key) {
 	splaytree *tree = get_tree_from_self(self);
-	return get(tree, key);
+	if (!tree->root) return Qnil;
+	return get(tree, project(tree, key));
 }
 
 static VALUE splaytree_size(VALUE self) {
@@ -331,7 +414,7 @@ static VALUE splaytree_height(VALUE self) {
 static VALUE splaytree_has_key(VALUE self, VALUE key) {
 	splaytree *tree = get_tree_from_self(self);
 	if(!tree->root) { return Qfalse; }
-	if(get(tree, key) == Qnil)
+	if(get(tree, project(tree, key)) == Qnil)
 		return Qfalse;
 	
 	return Qtrue;
@@ -371,7 +454,7 @@ static VALUE splaytree_delete(VALUE self, VALUE key) {
 	if(!tree->root)
 		return Qnil;
 	
-	tree->root = delete(tree, tree->root, key, &deleted);
+	tree->root = delete(tree, tree->root, project(tree, key), &deleted);
 	return deleted;
 }
 
@@ -392,16 +475,130 @@ static VALUE splaytree_each(VALUE self) {
 	return self;
 }
 
+/*
+ * call-seq:
+ *     dump(io) -> self
+ *
+ * Writes the map to io, which only needs a write method, so that it can be read back with
+ * Containers::SplayTreeMap.load or searched in place with Containers::MappedTreeMap. The pairs
+ * are written in ascending key order, even from a map with order: :desc; Fixnums, Floats and
+ * Strings are stored directly and everything else with Marshal. The file is the same as the one
+ * Containers::RBTreeMap writes. A map with key_by raises ArgumentError.
+ *
+ * Complexity: O(n)
+ *
+ *   File.open("states.map", "wb") { |f| map.dump(f) }
+ */
+static VALUE splaytree_dump(VALUE self, VALUE io) {
+	splaytree *tree = get_tree_from_self(self);
+	splaytree_node *node = tree->root;
+	// The tree may be as deep as it is large, so the walk keeps its own stack
+	VALUE stack = rb_str_new(NULL, 64 * sizeof(splaytree_node *));
+	long depth = 0;
+	int descending = tree->compare_function == &splaytree_compare_descending;
+	map_file_writer w;
+
+	if (!NIL_P(tree->key_by)) rb_raise(rb_eArgError, "can't dump a map ordered by key_by");
+	map_file_writer_init(&w, io, node_size(tree->root));
+	while (node || depth > 0) {
+		if (node) {
+			if ((depth + 1) * (long) sizeof(splaytree_node *) > RSTRING_LEN(stack)) {
+				rb_str_resize(stack, 2 * RSTRING_LEN(stack));
+			}
+			((splaytree_node **) RSTRING_PTR(stack))[depth++] = node;
+			node = descending ? node->right : node->left;
+		} else {
+			node = ((splaytree_node **) RSTRING_PTR(stack))[--depth];
+			map_file_writer_push(&w, node->key, node->value);
+			node = descending ? node->left : node->right;
+		}
+	}
+	map_file_writer_finish(&w);
+	RB_GC_GUARD(stack);
+	return self;
+}
+
+static splaytree_node* splaytree_build(splaytree_node **nodes, long n) {
+	long mid = n / 2;
+	if (n == 0) return NULL;
+	nodes[mid]->left = splaytree_build(nodes, mid);
+	nodes[mid]->right = splaytree_build(nodes + mid + 1, n - mid - 1);
+	nodes[mid]->size = (int) n;
+	return nodes[mid];
+}
+
+/*
+ * call-seq:
+ *     Containers::SplayTreeMap.load(io, order: :asc) -> map
+ *
+ * Returns a new map with the pairs that dump wrote to io, and leaves io just past them. As the
+ * pairs come sorted, they are linked straight into a balanced tree. Keys that are not in order
+ * raise ArgumentError. With order: :desc the map keeps its keys in descending order.
+ *
+ * Complexity: O(n)
+ *
+ *   map = File.open("states.map", "rb") { |f| Containers::SplayTreeMap.load(f) }
+ */
+static VALUE splaytree_s_load(int argc, VALUE *argv, VALUE klass) {
+	VALUE self = splaytree_alloc(klass);
+	splaytree *tree = get_tree_from_self(self);
+	map_file_reader r;
+	int64_t count;
+	long capa = 0, i;
+	VALUE io, opts, key, value;
+	VALUE kwargs[1] = { Qundef };
+	ID kwarg_ids[1];
+
+	rb_scan_args(argc, argv, "1:", &io, &opts);
+	kwarg_ids[0] = rb_intern("order");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 1, kwargs);
+	set_order(tree, kwargs[0]);
+	count = map_file_reader_init(&r, io);
+
+	if (count > INT_MAX) rb_raise(rb_eArgError, "too many pairs for a splay tree map");
+	while (map_file_reader_next(&r, &key, &value)) {
+		splaytree_node *node;
+		if (tree->num_pending == count) rb_raise(rb_eArgError, "corrupt tree map dump");
+		if (tree->num_pending > 0 && splaytree_compare_function(tree->pending[tree->num_pending - 1]->key, key) >= 0) {
+			rb_raise(rb_eArgError, "tree map dump is not in key order");
+		}
+		if (tree->num_pending == capa) {
+			capa = capa ? 2 * capa : 64;
+			REALLOC_N(tree->pending, splaytree_node*, capa);
+		}
+		node = create_node(key, key, value);
+		tree->pending[tree->num_pending++] = node;
+	}
+	if (tree->num_pending != count) rb_raise(rb_eArgError, "corrupt tree map dump");
+	map_file_reader_finish(&r, count);
+	if (tree->compare_function == &splaytree_compare_descending) {
+		for (i = 0; i < tree->num_pending / 2; i++) {
+			splaytree_node *node = tree->pending[i];
+			tree->pending[i] = tree->pending[tree->num_pending - 1 - i];
+			tree->pending[tree->num_pending - 1 - i] = node;
+		}
+	}
+
+	tree->root = splaytree_build(tree->pending, tree->num_pending);
+	xfree(tree->pending);
+	tree->pending = NULL;
+	tree->num_pending = 0;
+	return self;
+}
+
 static VALUE CSplayTree;
 static VALUE mContainers;
 
 void Init_CSplayTreeMap() {
 	id_compare_operator = rb_intern("<=>");
+	id_call = rb_intern("call");
+	id_asc = rb_intern("asc");
+	id_desc = rb_intern("desc");
 	
 	mContainers = rb_define_module("Containers");
 	CSplayTree = rb_define_class_under(mContainers, "CSplayTreeMap", rb_cObject);
 	rb_define_alloc_func(CSplayTree, splaytree_alloc);
-	rb_define_method(CSplayTree, "initialize", splaytree_init, 0);
+	rb_define_method(CSplayTree, "initialize", splaytree_init, -1);
 	rb_define_method(CSplayTree, "push", splaytree_push, 2);
 	rb_define_method(CSplayTree, "clear", splaytree_clear, 0);
 	rb_define_alias(CSplayTree, "[]=", "push");
@@ -415,5 +612,7 @@ void Init_CSplayTreeMap() {
 	rb_define_alias(CSplayTree, "[]", "get");
 	rb_define_method(CSplayTree, "has_key?", splaytree_has_key, 1);
 	rb_define_method(CSplayTree, "delete", splaytree_delete, 1);
+	rb_define_method(CSplayTree, "dump", splaytree_dump, 1);
+	rb_define_singleton_method(CSplayTree, "load", splaytree_s_load, -1);
 	rb_include_module(CSplayTree, rb_eval_string("Enumerable"));
 }
@@ -0,0 +1,7 @@
+require 'mkmf'
+extension_name = "CSuffixArray"
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_func("mmap", "sys/mman.h")
+dir_config(extension_name)
+create_makefile(extension_name)
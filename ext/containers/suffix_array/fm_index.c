@@ -0,0 +1,734 @@
+#include "ruby.h"
+#include "ruby/encoding.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * An FM-index: a compressed full-text index that replaces the text.
+ *
+ * The index holds the Burrows-Wheeler transform of the text in a Huffman-shaped wavelet tree,
+ * which takes about as many bits per byte as the zero-order entropy of the text plus an eighth
+ * for rank directories. Backward search counts the occurrences of a pattern with two rank
+ * queries per pattern byte. Locating them walks LF steps back to the nearest suffix whose
+ * row was sampled, and extracting text walks back from the nearest sampled position after it;
+ * sample_rate trades the memory for those samples against these walks. Sampling rows rather
+ * than positions means a row's own number tells whether it was sampled, with no bitvector.
+ *
+ * Everything lives in one flat image: a header, the wavelet tree bits and their superblock
+ * counts, the suffix position of every sample_rate-th row, and the row of every
+ * sample_rate-th position. save writes the image as it is, and load maps it back in.
+ */
+
+#define FM_MAGIC "FMINDEX\0"
+#define FM_VERSION 2
+#define FM_BYTE_ORDER 0x01020304
+#define FM_DEFAULT_SAMPLE_RATE 64
+// Bits per superblock; each superblock stores the number of ones before it
+#define FM_SUPER_BITS 512
+
+#define SAIS_BUILD_ONLY
+#define SAIS_NAME fm_sais_32
+#define SAIS_INDEX int32_t
+#include "sais.h"
+
+#define SAIS_NAME fm_sais_64
+#define SAIS_INDEX int64_t
+#include "sais.h"
+#undef SAIS_BUILD_ONLY
+
+typedef struct {
+	uint64_t words;     // first word of the node's bits in the words section
+	uint64_t supers;    // first of its superblock counts
+	uint64_t len;       // in bits
+	int32_t child[2];   // an internal node, or -1 - byte for a leaf
+} fm_node;
+
+typedef struct {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	uint64_t n;                 // text length
+	uint64_t sentinel_row;      // the row of the whole text, whose BWT symbol is the sentinel
+	uint64_t sample_rate;
+	uint64_t wide;              // samples take 64 bits
+	uint64_t num_nodes;
+	uint64_t words_offset;      // byte offsets into the image
+	uint64_t supers_offset;
+	uint64_t samples_offset;    // suffix position of every sample_rate-th row
+	uint64_t isa_offset;        // row of every sample_rate-th position
+	uint64_t size;
+	uint64_t counts[257];       // rows of suffixes starting below each byte, the sentinel's included
+	uint64_t codes[256];        // Huffman code of each byte, first bit lowest
+	uint8_t code_lens[256];     // 0 for bytes that do not occur
+	char encoding[32];
+	fm_node nodes[255];
+} fm_header;
+
+typedef struct {
+	const fm_header *header;    // start of the image
+	const uint64_t *words;
+	const uint64_t *supers;
+	const void *samples;
+	const void *isa;
+	void *map;                  // NULL when the image was built in memory
+	size_t map_len;
+} fm_index;
+
+typedef struct {
+	const unsigned char *text;
+	long n;
+	long sample_rate;
+	void *sa;
+	fm_header *image;
+	volatile int cancel;
+	int result;
+} fm_build_job;
+
+static VALUE mContainers;
+static VALUE cFMIndex;
+
+static fm_index* get_fm_index_from_self(VALUE self) {
+	fm_index *fm;
+	Data_Get_Struct(self, fm_index, fm);
+	return fm;
+}
+
+static void fm_index_free(void *ptr) {
+	if (ptr) {
+		fm_index *fm = ptr;
+#ifdef HAVE_MMAP
+		if (fm->map) munmap(fm->map, fm->map_len);
+		else free((void *) fm->header);
+#else
+		free((void *) fm->header);
+#endif
+		xfree(fm);
+	}
+}
+
+static VALUE fm_index_alloc(VALUE klass) {
+	fm_index *fm = ALLOC(fm_index);
+	memset(fm, 0, sizeof(fm_index));
+	return Data_Wrap_Struct(klass, NULL, fm_index_free, fm);
+}
+
+static fm_index* fm_index_ready(VALUE self) {
+	fm_index *fm = get_fm_index_from_self(self);
+	if (!fm->header) rb_raise(rb_eRuntimeError, "FMIndex is not initialized");
+	return fm;
+}
+
+static void fm_index_attach(fm_index *fm, const fm_header *header) {
+	const char *base = (const char *) header;
+	fm->header = header;
+	fm->words = (const uint64_t *) (base + header->words_offset);
+	fm->supers = (const uint64_t *) (base + header->supers_offset);
+	fm->samples = base + header->samples_offset;
+	fm->isa = base + header->isa_offset;
+}
+
+// Bitvectors
+
+static inline int fm_popcount(uint64_t x) {
+	return __builtin_popcountll(x);
+}
+
+// Ones in bits [0, i)
+static inline uint64_t fm_rank1(const uint64_t *words, const uint64_t *supers, uint64_t i) {
+	uint64_t r = supers[i / FM_SUPER_BITS], w;
+	for (w = (i / FM_SUPER_BITS) * (FM_SUPER_BITS / 64); w < i / 64; w++) r += fm_popcount(words[w]);
+	if (i % 64) r += fm_popcount(words[i / 64] & ((1ULL << (i % 64)) - 1));
+	return r;
+}
+
+static inline int fm_bit(const uint64_t *words, uint64_t i) {
+	return (int) ((words[i / 64] >> (i % 64)) & 1);
+}
+
+static inline uint64_t fm_words_for(uint64_t bits) {
+	return (bits + 63) / 64;
+}
+
+static inline uint64_t fm_supers_for(uint64_t bits) {
+	return bits / FM_SUPER_BITS + 1;
+}
+
+static void fm_fill_supers(const uint64_t *words, uint64_t *supers, uint64_t bits) {
+	uint64_t w, sum = 0, num_words = fm_words_for(bits);
+	supers[0] = 0;
+	for (w = 0; w < num_words; w++) {
+		sum += fm_popcount(words[w]);
+		if ((w + 1) % (FM_SUPER_BITS / 64) == 0) supers[(w + 1) / (FM_SUPER_BITS / 64)] = sum;
+	}
+}
+
+// The wavelet tree, which holds the BWT without the sentinel's row
+
+// Occurrences of byte c in BWT rows [0, row)
+static uint64_t fm_rank(const fm_index *fm, int c, uint64_t row) {
+	const fm_header *h = fm->header;
+	uint64_t i = row - (row > h->sentinel_row), code = h->codes[c];
+	int node = 0, d;
+	for (d = 0; d < h->code_lens[c]; d++) {
+		const fm_node *nd = &h->nodes[node];
+		int b = (int) ((code >> d) & 1);
+		uint64_t ones = fm_rank1(fm->words + nd->words, fm->supers + nd->supers, i);
+		i = b ? ones : i - ones;
+		node = nd->child[b];
+	}
+	return i;
+}
+
+// The BWT symbol of row, which must not be the sentinel's, and the row that LF maps it to:
+// that of the suffix one position earlier
+static uint64_t fm_lf(const fm_index *fm, uint64_t row, int *symbol) {
+	const fm_header *h = fm->header;
+	uint64_t i = row - (row > h->sentinel_row);
+	int node = 0;
+	for (;;) {
+		const fm_node *nd = &h->nodes[node];
+		const uint64_t *words = fm->words + nd->words;
+		int b = fm_bit(words, i);
+		uint64_t ones = fm_rank1(words, fm->supers + nd->supers, i);
+		i = b ? ones : i - ones;
+		node = nd->child[b];
+		if (node < 0) break;
+	}
+	*symbol = -1 - node;
+	return h->counts[*symbol] + i;
+}
+
+// Rows [*first, *last) of the suffixes that start with pattern
+static void fm_backward_search(const fm_index *fm, const unsigned char *pattern, long m, uint64_t *first, uint64_t *last) {
+	const fm_header *h = fm->header;
+	uint64_t sp = 0, ep = h->n + 1;
+	long k;
+	for (k = m - 1; k >= 0 && sp < ep; k--) {
+		int c = pattern[k];
+		if (h->code_lens[c] == 0) {
+			sp = ep = 0;
+			break;
+		}
+		sp = h->counts[c] + fm_rank(fm, c, sp);
+		ep = h->counts[c] + fm_rank(fm, c, ep);
+	}
+	*first = sp;
+	*last = sp < ep ? ep : sp;
+}
+
+static uint64_t fm_isa_at(const fm_index *fm, uint64_t i) {
+	return fm->header->wide ? ((const uint64_t *) fm->isa)[i] : ((const uint32_t *) fm->isa)[i];
+}
+
+static uint64_t fm_sample_at(const fm_index *fm, uint64_t i) {
+	return fm->header->wide ? ((const uint64_t *) fm->samples)[i] : ((const uint32_t *) fm->samples)[i];
+}
+
+// Building
+
+// Huffman codes for the byte frequencies, as a tree with the root at node 0
+static void fm_huffman(fm_header *h, const uint64_t *freq) {
+	uint64_t weight[511];
+	int parent[511], child[511][2], alive[511], num = 0, i, j, c, distinct = 0;
+	int order[255], num_internal = 0, head;
+
+	for (c = 0; c < 256; c++) {
+		h->code_lens[c] = 0;
+		h->codes[c] = 0;
+		if (freq[c]) distinct++;
+	}
+	// A tree needs two leaves; a byte that does not occur makes up the numbers
+	for (c = 0; c < 256; c++) {
+		if (freq[c] || distinct < 2) {
+			if (!freq[c]) distinct++;
+			weight[num] = freq[c];
+			child[num][0] = child[num][1] = -1 - c;
+			alive[num] = 1;
+			parent[num] = -1;
+			num++;
+		}
+	}
+	for (;;) {
+		int a = -1, b = -1;
+		for (i = 0; i < num; i++) {
+			if (!alive[i]) continue;
+			if (a < 0 || weight[i] < weight[a]) {
+				b = a;
+				a = i;
+			} else if (b < 0 || weight[i] < weight[b]) {
+				b = i;
+			}
+		}
+		if (b < 0) break;
+		weight[num] = weight[a] + weight[b];
+		child[num][0] = a;
+		child[num][1] = b;
+		alive[num] = 1;
+		parent[num] = -1;
+		alive[a] = alive[b] = 0;
+		parent[a] = parent[b] = num;
+		num++;
+	}
+
+	// Number the internal nodes breadth first from the root, the last one made
+	order[num_internal++] = num - 1;
+	for (head = 0; head < num_internal; head++) {
+		for (j = 0; j < 2; j++) {
+			int k = child[order[head]][j];
+			if (child[k][0] != child[k][1]) order[num_internal++] = k;
+		}
+	}
+	h->num_nodes = num_internal;
+	for (head = 0; head < num_internal; head++) {
+		int k = order[head];
+		h->nodes[head].len = weight[k];
+		for (j = 0; j < 2; j++) {
+			int kid = child[k][j], idx;
+			if (child[kid][0] == child[kid][1]) {
+				h->nodes[head].child[j] = child[kid][0];
+				continue;
+			}
+			for (idx = 0; order[idx] != kid; idx++);
+			h->nodes[head].child[j] = idx;
+		}
+	}
+	// Codes are read off the path from each leaf up to the root
+	for (i = 0; i < num; i++) {
+		int len = 0, k = i;
+		uint64_t code = 0;
+		if (child[i][0] != child[i][1]) continue;
+		c = -1 - child[i][0];
+		while (parent[k] >= 0) {
+			code = (code << 1) | (uint64_t) (child[parent[k]][1] == k);
+			len++;
+			k = parent[k];
+		}
+		h->codes[c] = code;
+		h->code_lens[c] = (uint8_t) len;
+	}
+}
+
+static inline uint64_t fm_align(uint64_t offset) {
+	return (offset + 7) & ~(uint64_t) 7;
+}
+
+static inline uint64_t fm_sa_at(const fm_build_job *job, uint64_t i) {
+	return job->n + 1 > INT32_MAX ? (uint64_t) ((int64_t *) job->sa)[i] : (uint64_t) ((int32_t *) job->sa)[i];
+}
+
+static int fm_build(fm_build_job *job) {
+	uint64_t n = job->n, rate = job->sample_rate, freq[256] = {0}, row, offset, total_words = 0, total_supers = 0;
+	uint64_t num_samples = n / rate + 1, num_isa = (n + rate - 1) / rate, cursor[255], sum;
+	fm_header header, *h;
+	uint64_t *words, *supers;
+	void *samples, *isa;
+	int c, k, wide = n + 1 > UINT32_MAX;
+	char *base;
+
+	if (n + 1 > INT32_MAX) job->result = fm_sais_64(job->text, (int64_t) n, NULL, 0, job->sa, &job->cancel);
+	else job->result = fm_sais_32(job->text, (int32_t) n, NULL, 0, job->sa, &job->cancel);
+	if (job->result) return job->result;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FM_MAGIC, sizeof(header.magic));
+	header.byte_order = FM_BYTE_ORDER;
+	header.version = FM_VERSION;
+	header.n = n;
+	header.sample_rate = rate;
+	header.wide = wide;
+	for (row = 0; row < n; row++) freq[job->text[row]]++;
+	fm_huffman(&header, freq);
+	sum = 1;
+	for (c = 0; c < 256; c++) {
+		header.counts[c] = sum;
+		sum += freq[c];
+	}
+	header.counts[256] = sum;
+	for (k = 0; k < (int) header.num_nodes; k++) {
+		header.nodes[k].words = total_words;
+		header.nodes[k].supers = total_supers;
+		total_words += fm_words_for(header.nodes[k].len);
+		total_supers += fm_supers_for(header.nodes[k].len);
+	}
+
+	offset = fm_align(sizeof(fm_header));
+	header.words_offset = offset;
+	offset = fm_align(offset + total_words * 8);
+	header.supers_offset = offset;
+	offset = fm_align(offset + total_supers * 8);
+	header.samples_offset = offset;
+	offset = fm_align(offset + num_samples * (wide ? 8 : 4));
+	header.isa_offset = offset;
+	offset = fm_align(offset + num_isa * (wide ? 8 : 4));
+	header.size = offset;
+
+	base = calloc(1, header.size);
+	if (!base) return -1;
+	h = (fm_header *) base;
+	*h = header;
+	words = (uint64_t *) (base + h->words_offset);
+	supers = (uint64_t *) (base + h->supers_offset);
+	samples = base + h->samples_offset;
+	isa = base + h->isa_offset;
+
+	// Each row's BWT symbol adds one bit to every node on the path of its code
+	for (k = 0; k < (int) h->num_nodes; k++) cursor[k] = 0;
+	for (row = 0; row <= n; row++) {
+		uint64_t pos = fm_sa_at(job, row), code;
+		int node = 0, d;
+		if (row % rate == 0) {
+			if (wide) ((uint64_t *) samples)[row / rate] = pos;
+			else ((uint32_t *) samples)[row / rate] = (uint32_t) pos;
+		}
+		if (pos % rate == 0 && pos < n) {
+			if (wide) ((uint64_t *) isa)[pos / rate] = row;
+			else ((uint32_t *) isa)[pos / rate] = (uint32_t) row;
+		}
+		if (pos == 0) {
+			h->sentinel_row = row;
+			continue;
+		}
+		c = job->text[pos - 1];
+		code = h->codes[c];
+		for (d = 0; d < h->code_lens[c]; d++) {
+			int b = (int) ((code >> d) & 1);
+			uint64_t bit = cursor[node]++;
+			if (b) words[h->nodes[node].words + bit / 64] |= 1ULL << (bit % 64);
+			node = h->nodes[node].child[b];
+		}
+		if (job->cancel) {
+			free(base);
+			return 1;
+		}
+	}
+	for (k = 0; k < (int) h->num_nodes; k++) {
+		fm_fill_supers(words + h->nodes[k].words, supers + h->nodes[k].supers, h->nodes[k].len);
+	}
+	job->image = h;
+	return 0;
+}
+
+static void* fm_build_run(void *arg) {
+	fm_build_job *job = arg;
+	job->result = fm_build(job);
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void fm_build_cancel(void *arg) {
+	fm_build_job *job = arg;
+	job->cancel = 1;
+}
+#endif
+
+/*
+ * call-seq:
+ *     FMIndex.new(string, sample_rate: 64) -> fm_index
+ *
+ * Builds an FM-index of the bytes of string, which is not kept. The suffix position of one
+ * in sample_rate rows is stored, and the row of one in sample_rate positions, so locate and
+ * extract take up to sample_rate extra steps per result. Each sample takes 4 bytes, or 8 for
+ * strings of 4 GB and more, so together they take 8 / sample_rate bytes per byte of text.
+ * Building needs the suffix array of the whole string for a while, and runs without the GVL.
+ *
+ * Complexity: O(n log sigma)
+ */
+static VALUE fm_index_init(int argc, VALUE *argv, VALUE self) {
+	fm_index *fm = get_fm_index_from_self(self);
+	VALUE string, opts, sa_v = 0;
+	VALUE kwargs[1] = { Qundef };
+	ID kwarg_ids[1];
+	fm_build_job job;
+	long rate = FM_DEFAULT_SAMPLE_RATE;
+
+	rb_scan_args(argc, argv, "1:", &string, &opts);
+	kwarg_ids[0] = rb_intern("sample_rate");
+	if (!NIL_P(opts)) rb_get_kwargs(opts, kwarg_ids, 0, 1, kwargs);
+	if (kwargs[0] != Qundef && !NIL_P(kwargs[0])) {
+		rate = NUM2LONG(kwargs[0]);
+		if (rate < 1) rb_raise(rb_eArgError, "sample_rate must be positive");
+	}
+	if (fm->header) rb_raise(rb_eRuntimeError, "FMIndex is already initialized");
+	string = rb_str_new_frozen(rb_obj_as_string(string));
+	if (RSTRING_LEN(string) == 0) rb_raise(rb_eArgError, "FMIndex needs to be initialized with a non-empty string");
+
+	job.text = (const unsigned char *) RSTRING_PTR(string);
+	job.n = RSTRING_LEN(string);
+	job.sample_rate = rate;
+	job.sa = ALLOCV(sa_v, (job.n + 1) * (job.n + 1 > INT32_MAX ? sizeof(int64_t) : sizeof(int32_t)));
+	job.image = NULL;
+	do {
+		job.cancel = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(fm_build_run, &job, fm_build_cancel, &job);
+#else
+		fm_build_run(&job);
+#endif
+		// Raises if the interrupt was meant to stop us; otherwise start over
+		if (job.result == 1) rb_thread_check_ints();
+	} while (job.result == 1);
+	ALLOCV_END(sa_v);
+	if (job.result < 0) rb_memerror();
+	strncpy(job.image->encoding, rb_enc_name(rb_enc_get(string)), sizeof(job.image->encoding) - 1);
+	fm_index_attach(fm, job.image);
+	RB_GC_GUARD(string);
+	return self;
+}
+
+static rb_encoding* fm_encoding(const fm_index *fm) {
+	rb_encoding *enc = rb_enc_find(fm->header->encoding);
+	return enc ? enc : rb_ascii8bit_encoding();
+}
+
+/*
+ * call-seq:
+ *     count(pattern) -> integer
+ *
+ * Returns the number of times pattern occurs in the text, overlapping occurrences included.
+ *
+ * Complexity: O(m log sigma)
+ */
+static VALUE fm_index_count(VALUE self, VALUE pattern) {
+	fm_index *fm = fm_index_ready(self);
+	uint64_t first, last;
+	pattern = rb_obj_as_string(pattern);
+	if (RSTRING_LEN(pattern) == 0) return INT2FIX(0);
+	fm_backward_search(fm, (const unsigned char *) RSTRING_PTR(pattern), RSTRING_LEN(pattern), &first, &last);
+	return ULL2NUM(last - first);
+}
+
+/*
+ * call-seq:
+ *     has_substring?(substring) -> true or false
+ *
+ * Returns true if the substring occurs in the text, false otherwise.
+ */
+static VALUE fm_index_has_substring(VALUE self, VALUE substring) {
+	VALUE count = fm_index_count(self, substring);
+	return count == INT2FIX(0) ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *     locate(pattern) -> [offset, ...]
+ *
+ * Returns the byte offsets of every occurrence of pattern in the text, in ascending order.
+ *
+ * Complexity: O(m log sigma + k sample_rate log sigma) for k occurrences
+ */
+static VALUE fm_index_locate(VALUE self, VALUE pattern) {
+	fm_index *fm = fm_index_ready(self);
+	uint64_t first, last, row, rate = fm->header->sample_rate;
+	VALUE offsets;
+	pattern = rb_obj_as_string(pattern);
+	if (RSTRING_LEN(pattern) == 0) return rb_ary_new();
+	fm_backward_search(fm, (const unsigned char *) RSTRING_PTR(pattern), RSTRING_LEN(pattern), &first, &last);
+	offsets = rb_ary_new_capa((long) (last - first));
+	for (row = first; row < last; row++) {
+		uint64_t r = row, steps = 0, pos;
+		int symbol;
+		// The sentinel's row holds the whole text, and LF cannot step back from it
+		while (r % rate != 0 && r != fm->header->sentinel_row) {
+			r = fm_lf(fm, r, &symbol);
+			steps++;
+		}
+		pos = r % rate == 0 ? fm_sample_at(fm, r / rate) : 0;
+		rb_ary_push(offsets, ULL2NUM(pos + steps));
+	}
+	return rb_ary_sort_bang(offsets);
+}
+
+/*
+ * call-seq:
+ *     extract(offset, length) -> string or nil
+ *
+ * Returns length bytes of the text from offset, like String#byteslice: nil if offset lies
+ * outside the text, and fewer bytes if the text ends first.
+ *
+ * Complexity: O((length + sample_rate) log sigma)
+ */
+static VALUE fm_index_extract(VALUE self, VALUE rb_offset, VALUE rb_length) {
+	fm_index *fm = fm_index_ready(self);
+	const fm_header *h = fm->header;
+	long offset = NUM2LONG(rb_offset), length = NUM2LONG(rb_length);
+	uint64_t end, pos, row, rate = h->sample_rate;
+	VALUE result;
+	char *out;
+
+	if (offset < 0) offset += (long) h->n;
+	if (offset < 0 || (uint64_t) offset > h->n || length < 0) return Qnil;
+	end = (uint64_t) offset + (uint64_t) length;
+	if (end > h->n) end = h->n;
+	result = rb_enc_str_new(NULL, (long) (end - offset), fm_encoding(fm));
+	out = RSTRING_PTR(result);
+	if (end == (uint64_t) offset) return result;
+	// Start at the first sampled position at or after end; the empty suffix is row 0
+	pos = (end + rate - 1) / rate * rate;
+	if (pos >= h->n) {
+		pos = h->n;
+		row = 0;
+	} else {
+		row = fm_isa_at(fm, pos / rate);
+	}
+	while (pos > (uint64_t) offset) {
+		int symbol;
+		row = fm_lf(fm, row, &symbol);
+		pos--;
+		if (pos < end) out[pos - offset] = (char) symbol;
+	}
+	return result;
+}
+
+/*
+ * call-seq:
+ *     size -> integer
+ *
+ * Returns the length of the text in bytes.
+ */
+static VALUE fm_index_size(VALUE self) {
+	return ULL2NUM(fm_index_ready(self)->header->n);
+}
+
+/*
+ * call-seq:
+ *     bytesize -> integer
+ *
+ * Returns the size of the index in bytes, which is also the size of a saved file.
+ */
+static VALUE fm_index_bytesize(VALUE self) {
+	return ULL2NUM(fm_index_ready(self)->header->size);
+}
+
+/*
+ * call-seq:
+ *     sample_rate -> integer
+ *
+ * Returns the distance between sampled rows, and between sampled positions.
+ */
+static VALUE fm_index_sample_rate(VALUE self) {
+	return ULL2NUM(fm_index_ready(self)->header->sample_rate);
+}
+
+/*
+ * call-seq:
+ *     save(path) -> self
+ *
+ * Writes the index to path so that Containers::FMIndex.load can map it into memory. The file
+ * is written next to path and renamed over it.
+ */
+static VALUE fm_index_save(VALUE self, VALUE path) {
+	fm_index *fm = fm_index_ready(self);
+	VALUE image, tmp;
+	FilePathValue(path);
+	// Written straight from the index, without a copy
+	image = rb_str_new_static((const char *) fm->header, (long) fm->header->size);
+	tmp = rb_str_plus(path, rb_sprintf(".%d.tmp", (int) getpid()));
+	rb_funcall(rb_cFile, rb_intern("binwrite"), 2, tmp, image);
+	rb_funcall(rb_cFile, rb_intern("rename"), 2, tmp, path);
+	RB_GC_GUARD(self);
+	return self;
+}
+
+static void fm_check(int ok, VALUE path) {
+	if (!ok) rb_raise(rb_eArgError, "%"PRIsVALUE" is not a valid FMIndex file", path);
+}
+
+/*
+ * call-seq:
+ *     Containers::FMIndex.load(path) -> fm_index
+ *
+ * Returns the index saved to path. The file is mapped into memory rather than read, so
+ * loading takes the same time whatever its size, and processes that load the same file share
+ * its pages.
+ */
+static VALUE fm_index_s_load(VALUE klass, VALUE path) {
+	VALUE self = fm_index_alloc(klass);
+	fm_index *fm = get_fm_index_from_self(self);
+	const fm_header *h;
+	uint64_t k, size;
+	void *image;
+
+	FilePathValue(path);
+#ifdef HAVE_MMAP
+	{
+		struct stat st;
+		int fd = open(RSTRING_PTR(path), O_RDONLY);
+		if (fd < 0) rb_sys_fail_str(path);
+		if (fstat(fd, &st) < 0) {
+			close(fd);
+			rb_sys_fail_str(path);
+		}
+		size = (uint64_t) st.st_size;
+		if (size < sizeof(fm_header)) {
+			close(fd);
+			fm_check(0, path);
+		}
+		image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (image == MAP_FAILED) rb_sys_fail_str(path);
+		fm->map = image;
+		fm->map_len = size;
+	}
+#else
+	{
+		VALUE data = rb_funcall(rb_cFile, rb_intern("binread"), 1, path);
+		size = RSTRING_LEN(data);
+		fm_check(size >= sizeof(fm_header), path);
+		image = malloc(size);
+		if (!image) rb_memerror();
+		memcpy(image, RSTRING_PTR(data), size);
+	}
+#endif
+	h = image;
+	fm->header = h;
+	fm_check(memcmp(h->magic, FM_MAGIC, sizeof(h->magic)) == 0, path);
+	if (h->byte_order != FM_BYTE_ORDER) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" was saved on a machine with a different byte order", path);
+	}
+	fm_check(h->version == FM_VERSION && h->size == size && h->sample_rate > 0, path);
+	fm_check(h->num_nodes >= 1 && h->num_nodes <= 255 && h->sentinel_row <= h->n, path);
+	fm_check(memchr(h->encoding, 0, sizeof(h->encoding)) != NULL, path);
+	fm_check(h->words_offset <= h->supers_offset && h->supers_offset <= h->samples_offset &&
+		h->samples_offset <= h->isa_offset && h->isa_offset <= size, path);
+	// Every section must be as long as the text and sample_rate make it
+	fm_check(h->n < size * 8 && h->wide == (h->n + 1 > UINT32_MAX), path);
+	fm_check(h->n / h->sample_rate + 1 <= (h->isa_offset - h->samples_offset) / (h->wide ? 8 : 4), path);
+	fm_check(h->n / h->sample_rate + (h->n % h->sample_rate != 0) <= (size - h->isa_offset) / (h->wide ? 8 : 4), path);
+	for (k = 0; k < h->num_nodes; k++) {
+		int j;
+		for (j = 0; j < 2; j++) {
+			int32_t child = h->nodes[k].child[j];
+			fm_check(child < (int32_t) h->num_nodes && child >= -256 && child != 0, path);
+		}
+		fm_check(h->nodes[k].words + fm_words_for(h->nodes[k].len) <= (h->supers_offset - h->words_offset) / 8, path);
+		fm_check(h->nodes[k].supers + fm_supers_for(h->nodes[k].len) <= (h->samples_offset - h->supers_offset) / 8, path);
+	}
+	fm_index_attach(fm, h);
+	return self;
+}
+
+void Init_fm_index(VALUE mod) {
+	mContainers = mod;
+	cFMIndex = rb_define_class_under(mContainers, "FMIndex", rb_cObject);
+	rb_define_alloc_func(cFMIndex, fm_index_alloc);
+	rb_define_method(cFMIndex, "initialize", fm_index_init, -1);
+	rb_define_method(cFMIndex, "count", fm_index_count, 1);
+	rb_define_method(cFMIndex, "has_substring?", fm_index_has_substring, 1);
+	rb_define_alias(cFMIndex, "[]", "has_substring?");
+	rb_define_method(cFMIndex, "locate", fm_index_locate, 1);
+	rb_define_method(cFMIndex, "extract", fm_index_extract, 2);
+	rb_define_method(cFMIndex, "size", fm_index_size, 0);
+	rb_define_method(cFMIndex, "bytesize", fm_index_bytesize, 0);
+	rb_define_method(cFMIndex, "sample_rate", fm_index_sample_rate, 0);
+	rb_define_method(cFMIndex, "save", fm_index_save, 1);
+	rb_define_singleton_method(cFMIndex, "load", fm_index_s_load, 1);
+}
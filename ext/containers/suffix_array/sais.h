@@ -0,0 +1,254 @@
+/*
+ * SA-IS suffix array construction (Nong, Zhang and Chan), as a template.
+ *
+ * Define SAIS_NAME and SAIS_INDEX, a signed integer type that holds the length of the text
+ * plus two, before including this file; it defines
+ *
+ *     int SAIS_NAME(const unsigned char *a, SAIS_INDEX na, const unsigned char *b, SAIS_INDEX nb,
+ *                   SAIS_INDEX *sa, volatile int *cancel)
+ *
+ * which fills sa with the suffix array of a[0, na) followed by a sentinel that sorts below
+ * every byte, so sa[0] is always na and sa has na + 1 entries. If b is not NULL, the text is
+ * a, a separator, then b[0, nb) and the sentinel, which is na + nb + 2 suffixes; the separator
+ * sorts below every byte too, so no common prefix runs across it. It returns 0 when done, -1
+ * if memory ran out, and 1 if *cancel was set while it ran. SAIS_FN(kasai) computes the LCP
+ * array of the same text and SAIS_FN(lcp_lr) the LCP values a binary search needs, unless
+ * SAIS_BUILD_ONLY is defined. None of them calls Ruby, so they can run without the GVL.
+ *
+ * The suffixes are classified as S (smaller than the suffix after them) or L. The leftmost S
+ * suffixes of each S run (LMS) are sorted first: placing them unsorted at the ends of their
+ * buckets and inducing L and then S suffixes from them sorts the LMS substrings, which are
+ * named and, unless all names differ, sorted recursively as a string of half the length at
+ * most. The sorted LMS suffixes then induce the order of all others in two more passes.
+ * Working memory is a type bitmap and a bucket array per level, on top of sa itself.
+ */
+
+#define SAIS_CAT2(a, b) a##_##b
+#define SAIS_CAT(a, b) SAIS_CAT2(a, b)
+#define SAIS_FN(suffix) SAIS_CAT(SAIS_NAME, suffix)
+
+#ifndef SAIS_GET
+#define SAIS_GET(t, i) (((t)[(i) >> 3] >> ((i) & 7)) & 1)
+#define SAIS_SET(t, i, b) ((t)[(i) >> 3] = (unsigned char) (((t)[(i) >> 3] & ~(1 << ((i) & 7))) | ((b) << ((i) & 7))))
+#define SAIS_LMS(t, i) ((i) > 0 && SAIS_GET(t, i) && !SAIS_GET(t, (i) - 1))
+// At the top level, bytes are shifted past the sentinel (0) and the separator (1)
+#define SAIS_TOP_K 257
+#endif
+
+// The top level text, as described above, or the names of a reduced string, which ends in
+// its own sentinel
+typedef struct {
+	const unsigned char *bytes;
+	const unsigned char *other;
+	SAIS_INDEX split;   // where other starts, after a separator, or the sentinel if there is none
+	const SAIS_INDEX *names;
+	SAIS_INDEX n;
+} SAIS_FN(text);
+
+static inline SAIS_INDEX SAIS_FN(chr)(const SAIS_FN(text) *s, SAIS_INDEX i) {
+	if (!s->bytes) return s->names[i];
+	if (i < s->split) return (SAIS_INDEX) s->bytes[i] + 2;
+	if (i == s->n - 1) return 0;
+	if (i == s->split) return 1;
+	return (SAIS_INDEX) s->other[i - s->split - 1] + 2;
+}
+
+static void SAIS_FN(top)(SAIS_FN(text) *s, const unsigned char *a, SAIS_INDEX na, const unsigned char *b, SAIS_INDEX nb) {
+	s->bytes = a;
+	s->other = b;
+	s->split = na;
+	s->names = NULL;
+	s->n = b ? na + nb + 2 : na + 1;
+}
+
+// Start (or with end set, one past the end) of each character's bucket
+static void SAIS_FN(buckets)(const SAIS_FN(text) *s, SAIS_INDEX *bkt, SAIS_INDEX k, int end) {
+	SAIS_INDEX i, sum = 0;
+	for (i = 0; i <= k; i++) bkt[i] = 0;
+	for (i = 0; i < s->n; i++) bkt[SAIS_FN(chr)(s, i)]++;
+	for (i = 0; i <= k; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
+
+// Induces the L suffixes left to right from those in sa, then the S suffixes right to left
+static void SAIS_FN(induce)(const SAIS_FN(text) *s, const unsigned char *t, SAIS_INDEX *sa, SAIS_INDEX *bkt, SAIS_INDEX k) {
+	SAIS_INDEX i, j, n = s->n;
+	SAIS_FN(buckets)(s, bkt, k, 0);
+	for (i = 0; i < n; i++) {
+		j = sa[i] - 1;
+		if (j >= 0 && !SAIS_GET(t, j)) sa[bkt[SAIS_FN(chr)(s, j)]++] = j;
+	}
+	SAIS_FN(buckets)(s, bkt, k, 1);
+	for (i = n - 1; i >= 0; i--) {
+		j = sa[i] - 1;
+		if (j >= 0 && SAIS_GET(t, j)) sa[--bkt[SAIS_FN(chr)(s, j)]] = j;
+	}
+}
+
+// Sorts the suffixes of s, whose characters are all at most k
+static int SAIS_FN(level)(const SAIS_FN(text) *s, SAIS_INDEX *sa, SAIS_INDEX k, volatile int *cancel) {
+	SAIS_INDEX n = s->n, i, j, n1 = 0, name = 0, prev = -1;
+	SAIS_INDEX *bkt, *s1;
+	SAIS_FN(text) reduced;
+	unsigned char *t;
+	int r;
+
+	if (*cancel) return 1;
+	t = calloc(n / 8 + 1, 1);
+	bkt = malloc(sizeof(SAIS_INDEX) * (k + 1));
+	if (!t || !bkt) {
+		free(t);
+		free(bkt);
+		return -1;
+	}
+	// The sentinel is S and the character before it L
+	SAIS_SET(t, n - 1, 1);
+	for (i = n - 3; i >= 0; i--) {
+		SAIS_INDEX a = SAIS_FN(chr)(s, i), b = SAIS_FN(chr)(s, i + 1);
+		SAIS_SET(t, i, a < b || (a == b && SAIS_GET(t, i + 1)));
+	}
+
+	// Sort the LMS substrings
+	SAIS_FN(buckets)(s, bkt, k, 1);
+	for (i = 0; i < n; i++) sa[i] = -1;
+	for (i = 1; i < n; i++) {
+		if (SAIS_LMS(t, i)) sa[--bkt[SAIS_FN(chr)(s, i)]] = i;
+	}
+	SAIS_FN(induce)(s, t, sa, bkt, k);
+	free(bkt);
+	if (*cancel) {
+		free(t);
+		return 1;
+	}
+
+	// Name them in order, equal substrings alike; the names go to sa[n1 + pos / 2], which
+	// keeps them in text order as no two LMS positions are adjacent
+	for (i = 0; i < n; i++) {
+		if (SAIS_LMS(t, sa[i])) sa[n1++] = sa[i];
+	}
+	for (i = n1; i < n; i++) sa[i] = -1;
+	for (i = 0; i < n1; i++) {
+		SAIS_INDEX pos = sa[i], d;
+		int diff = 0;
+		for (d = 0; d < n; d++) {
+			if (prev == -1 || SAIS_FN(chr)(s, pos + d) != SAIS_FN(chr)(s, prev + d) || SAIS_GET(t, pos + d) != SAIS_GET(t, prev + d)) {
+				diff = 1;
+				break;
+			}
+			if (d > 0 && (SAIS_LMS(t, pos + d) || SAIS_LMS(t, prev + d))) break;
+		}
+		if (diff) {
+			name++;
+			prev = pos;
+		}
+		sa[n1 + pos / 2] = name - 1;
+	}
+	for (i = n - 1, j = n - 1; i >= n1; i--) {
+		if (sa[i] >= 0) sa[j--] = sa[i];
+	}
+
+	// Sort the LMS suffixes by sorting the string of names, unless the names already do
+	s1 = sa + n - n1;
+	if (name < n1) {
+		reduced.bytes = reduced.other = NULL;
+		reduced.split = 0;
+		reduced.names = s1;
+		reduced.n = n1;
+		r = SAIS_FN(level)(&reduced, sa, name - 1, cancel);
+		if (r) {
+			free(t);
+			return r;
+		}
+	} else {
+		for (i = 0; i < n1; i++) sa[s1[i]] = i;
+	}
+
+	// Induce everything from the sorted LMS suffixes
+	bkt = malloc(sizeof(SAIS_INDEX) * (k + 1));
+	if (!bkt) {
+		free(t);
+		return -1;
+	}
+	SAIS_FN(buckets)(s, bkt, k, 1);
+	for (i = 1, j = 0; i < n; i++) {
+		if (SAIS_LMS(t, i)) s1[j++] = i;
+	}
+	for (i = 0; i < n1; i++) sa[i] = s1[sa[i]];
+	for (i = n1; i < n; i++) sa[i] = -1;
+	for (i = n1 - 1; i >= 0; i--) {
+		j = sa[i];
+		sa[i] = -1;
+		sa[--bkt[SAIS_FN(chr)(s, j)]] = j;
+	}
+	SAIS_FN(induce)(s, t, sa, bkt, k);
+	free(bkt);
+	free(t);
+	return *cancel ? 1 : 0;
+}
+
+static int SAIS_NAME(const unsigned char *a, SAIS_INDEX na, const unsigned char *b, SAIS_INDEX nb, SAIS_INDEX *sa, volatile int *cancel) {
+	SAIS_FN(text) s;
+	SAIS_FN(top)(&s, a, na, b, nb);
+	return SAIS_FN(level)(&s, sa, SAIS_TOP_K, cancel);
+}
+
+#ifndef SAIS_BUILD_ONLY
+// Kasai et al.: lcp[k] is the length of the common prefix of the suffixes at ranks k - 1 and
+// k, and lcp[0] is 0. Takes the same text as SAIS_NAME and its suffix array; rank is scratch
+// space as large as sa. Walking the suffixes in text order, each prefix is at most one
+// shorter than the one before, so the whole array takes O(n) comparisons.
+static void SAIS_FN(kasai)(const unsigned char *a, SAIS_INDEX na, const unsigned char *b, SAIS_INDEX nb, const SAIS_INDEX *sa, SAIS_INDEX *rank, SAIS_INDEX *lcp) {
+	SAIS_FN(text) s;
+	SAIS_INDEX i, h = 0;
+	SAIS_FN(top)(&s, a, na, b, nb);
+	for (i = 0; i < s.n; i++) rank[sa[i]] = i;
+	lcp[0] = 0;
+	for (i = 0; i < s.n; i++) {
+		if (rank[i] == 0) {
+			h = 0;
+			continue;
+		}
+		// The sentinel and the separator occur once, so the loop stops before either end
+		while (SAIS_FN(chr)(&s, i + h) == SAIS_FN(chr)(&s, sa[rank[i] - 1] + h)) h++;
+		lcp[rank[i]] = h;
+		if (h > 0) h--;
+	}
+}
+
+// For a binary search over the ranks strictly between l and r, whose midpoints are taken as
+// l + (r - l) / 2, sets llcp[mid] to the LCP of the suffixes at ranks l and mid and rlcp[mid]
+// to that of mid and r. Rank last + 1 stands for a suffix above all others. Returns the LCP
+// of l and r.
+static SAIS_INDEX SAIS_FN(lcp_lr)(const SAIS_INDEX *lcp, SAIS_INDEX *llcp, SAIS_INDEX *rlcp, SAIS_INDEX l, SAIS_INDEX r, SAIS_INDEX last) {
+	SAIS_INDEX mid, left, right;
+	if (r - l == 1) return r <= last ? lcp[r] : 0;
+	mid = l + (r - l) / 2;
+	left = llcp[mid] = SAIS_FN(lcp_lr)(lcp, llcp, rlcp, l, mid, last);
+	right = rlcp[mid] = SAIS_FN(lcp_lr)(lcp, llcp, rlcp, mid, r, last);
+	return left < right ? left : right;
+}
+
+// The longest common prefix of a suffix of a and a suffix of b, given the suffix array and
+// LCP array of a, a separator and b. It is the LCP of some pair of neighbouring suffixes that
+// start on different sides of the separator. Sets *pos to where it starts in a.
+static SAIS_INDEX SAIS_FN(longest_common)(SAIS_INDEX na, SAIS_INDEX nb, const SAIS_INDEX *sa, const SAIS_INDEX *lcp, SAIS_INDEX *pos) {
+	SAIS_INDEX k, best = 0, n = na + nb + 2;
+	*pos = 0;
+	for (k = 2; k < n; k++) {
+		SAIS_INDEX x = sa[k - 1], y = sa[k];
+		if (lcp[k] > best && (x < na) != (y < na)) {
+			best = lcp[k];
+			*pos = x < na ? x : y;
+		}
+	}
+	return best;
+}
+#endif
+
+#undef SAIS_FN
+#undef SAIS_CAT
+#undef SAIS_CAT2
+#undef SAIS_NAME
+#undef SAIS_INDEX
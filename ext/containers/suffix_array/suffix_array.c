@@ -0,0 +1,479 @@
+#include "ruby.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+
+/*
+ * A suffix array over the bytes of a string.
+ *
+ * The array is the start offset of every suffix in sorted order, built in linear time with
+ * SA-IS. It is all that is stored besides a frozen copy of the string: four bytes per text
+ * byte, or eight for strings of 2GB and more. Searches binary search the offsets, comparing
+ * with memcmp against the text.
+ *
+ * The first search that needs more than a yes or no builds the LCP array with Kasai's
+ * algorithm and from it, for every midpoint of the binary search, the LCP of the suffix there
+ * with those at both ends of its interval (Manber and Myers). With those, a search never
+ * compares a byte of the pattern against the text twice and takes O(m + log n). The two
+ * arrays double the memory used; the LCP array itself is only kept long enough to find the
+ * longest repeat.
+ */
+
+#define SAIS_NAME sais_32
+#define SAIS_INDEX int32_t
+#include "sais.h"
+
+#define SAIS_NAME sais_64
+#define SAIS_INDEX int64_t
+#include "sais.h"
+
+typedef struct {
+	VALUE string;       // frozen copy of the text
+	const char *text;
+	long n;
+	void *sa;           // n + 1 offsets, int32_t or int64_t; sa[0] is the empty suffix
+	void *llcp;         // by midpoint rank, or NULL until the first search that needs them
+	void *rlcp;         // allocated with llcp
+	long repeat_pos;    // longest repeated substring
+	long repeat_len;
+	int wide;
+} suffix_array;
+
+enum sa_task {
+	SA_BUILD,           // the suffix array
+	SA_SEARCH_INDEX,    // llcp, rlcp and the longest repeat
+	SA_COMMON           // the longest substring shared with other
+};
+
+typedef struct {
+	enum sa_task task;
+	suffix_array *s;
+	const unsigned char *other;
+	long other_len;
+	void *sa;           // scratch, each as wide as needed
+	void *rank;
+	void *lcp;
+	void *llcp;
+	void *rlcp;
+	long best_pos;
+	long best_len;
+	volatile int cancel;
+	int result;
+} sa_job;
+
+static VALUE mContainers;
+static VALUE cSuffixArray;
+
+void Init_fm_index(VALUE mContainers);
+
+static suffix_array* get_suffix_array_from_self(VALUE self) {
+	suffix_array *s;
+	Data_Get_Struct(self, suffix_array, s);
+	return s;
+}
+
+static void suffix_array_mark(void *ptr) {
+	if (ptr) {
+		suffix_array *s = ptr;
+		rb_gc_mark(s->string);
+	}
+}
+
+static void suffix_array_free(void *ptr) {
+	if (ptr) {
+		suffix_array *s = ptr;
+		xfree(s->sa);
+		xfree(s->llcp);
+		xfree(s);
+	}
+}
+
+static VALUE suffix_array_alloc(VALUE klass) {
+	suffix_array *s = ALLOC(suffix_array);
+	s->string = Qnil;
+	s->text = NULL;
+	s->n = 0;
+	s->sa = NULL;
+	s->llcp = s->rlcp = NULL;
+	s->repeat_pos = s->repeat_len = 0;
+	s->wide = 0;
+	return Data_Wrap_Struct(klass, suffix_array_mark, suffix_array_free, s);
+}
+
+static inline long sa_get(const void *array, int wide, long i) {
+	return wide ? (long) ((const int64_t *) array)[i] : (long) ((const int32_t *) array)[i];
+}
+
+// Start of the suffix at rank i, counting from 1 as rank 0 is the empty suffix
+static inline long sa_at(const suffix_array *s, long i) {
+	return sa_get(s->sa, s->wide, i);
+}
+
+static void sa_search_index_32(sa_job *job) {
+	suffix_array *s = job->s;
+	int32_t *lcp = job->lcp, n = (int32_t) s->n, k;
+	sais_32_kasai((const unsigned char *) s->text, n, NULL, 0, s->sa, job->rank, lcp);
+	sais_32_lcp_lr(lcp, job->llcp, job->rlcp, 0, n + 1, n);
+	for (k = 1; k <= n; k++) {
+		if (lcp[k] > job->best_len) {
+			job->best_len = lcp[k];
+			job->best_pos = ((int32_t *) s->sa)[k];
+		}
+	}
+}
+
+static void sa_search_index_64(sa_job *job) {
+	suffix_array *s = job->s;
+	int64_t *lcp = job->lcp, n = (int64_t) s->n, k;
+	sais_64_kasai((const unsigned char *) s->text, n, NULL, 0, s->sa, job->rank, lcp);
+	sais_64_lcp_lr(lcp, job->llcp, job->rlcp, 0, n + 1, n);
+	for (k = 1; k <= n; k++) {
+		if (lcp[k] > job->best_len) {
+			job->best_len = (long) lcp[k];
+			job->best_pos = (long) ((int64_t *) s->sa)[k];
+		}
+	}
+}
+
+static void* sa_job_run(void *arg) {
+	sa_job *job = arg;
+	suffix_array *s = job->s;
+	const unsigned char *text = (const unsigned char *) s->text;
+	job->result = 0;
+	switch (job->task) {
+		case SA_BUILD:
+			if (s->wide) job->result = sais_64(text, (int64_t) s->n, NULL, 0, s->sa, &job->cancel);
+			else job->result = sais_32(text, (int32_t) s->n, NULL, 0, s->sa, &job->cancel);
+			break;
+		case SA_SEARCH_INDEX:
+			if (s->wide) sa_search_index_64(job);
+			else sa_search_index_32(job);
+			break;
+		case SA_COMMON:
+			if (job->other_len + s->n + 2 > INT32_MAX) {
+				int64_t pos;
+				job->result = sais_64(text, s->n, job->other, job->other_len, job->sa, &job->cancel);
+				if (job->result) break;
+				sais_64_kasai(text, s->n, job->other, job->other_len, job->sa, job->rank, job->lcp);
+				job->best_len = (long) sais_64_longest_common(s->n, job->other_len, job->sa, job->lcp, &pos);
+				job->best_pos = (long) pos;
+			} else {
+				int32_t pos;
+				job->result = sais_32(text, (int32_t) s->n, job->other, (int32_t) job->other_len, job->sa, &job->cancel);
+				if (job->result) break;
+				sais_32_kasai(text, (int32_t) s->n, job->other, (int32_t) job->other_len, job->sa, job->rank, job->lcp);
+				job->best_len = sais_32_longest_common((int32_t) s->n, (int32_t) job->other_len, job->sa, job->lcp, &pos);
+				job->best_pos = pos;
+			}
+			break;
+	}
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void sa_job_cancel(void *arg) {
+	sa_job *job = arg;
+	job->cancel = 1;
+}
+#endif
+
+// Runs job without the GVL. Only SA-IS stops early for an interrupt: it is started over if
+// the interrupt turns out not to stop the thread. Jobs that finish leave interrupts to be
+// handled once the caller returns to Ruby.
+static void sa_job_perform(sa_job *job) {
+	do {
+		job->cancel = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(sa_job_run, job, sa_job_cancel, job);
+#else
+		sa_job_run(job);
+#endif
+		if (job->result == 1) rb_thread_check_ints();
+	} while (job->result == 1);
+	if (job->result < 0) rb_memerror();
+}
+
+static void sa_ensure_search_index(suffix_array *s) {
+	VALUE rank_v = 0, lcp_v = 0;
+	size_t size = (s->n + 1) * (s->wide ? sizeof(int64_t) : sizeof(int32_t));
+	sa_job job;
+	if (s->llcp) return;
+	job.task = SA_SEARCH_INDEX;
+	job.s = s;
+	job.rank = ALLOCV(rank_v, size);
+	job.lcp = ALLOCV(lcp_v, size);
+	job.llcp = xmalloc(2 * size);
+	job.rlcp = (char *) job.llcp + size;
+	job.best_pos = job.best_len = 0;
+	sa_job_perform(&job);
+	ALLOCV_END(lcp_v);
+	ALLOCV_END(rank_v);
+	// Another thread may have got here first while the GVL was released
+	if (s->llcp) {
+		xfree(job.llcp);
+		return;
+	}
+	s->llcp = job.llcp;
+	s->rlcp = job.rlcp;
+	s->repeat_pos = job.best_pos;
+	s->repeat_len = job.best_len;
+}
+
+/*
+ * call-seq:
+ *     CSuffixArray.new(string) -> suffix_array
+ *
+ * Creates a new SuffixArray with a given string. Object of any class implementing a #to_s
+ * method can be passed in, such as integers. Construction runs without the GVL.
+ *
+ * Complexity: O(n)
+ */
+static VALUE suffix_array_init(VALUE self, VALUE string) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	sa_job job;
+
+	string = rb_str_new_frozen(rb_obj_as_string(string));
+	if (RSTRING_LEN(string) == 0) rb_raise(rb_eArgError, "SuffixArray needs to be initialized with a non-empty string");
+	xfree(s->sa);
+	xfree(s->llcp);
+	s->sa = s->llcp = s->rlcp = NULL;
+	s->string = string;
+	s->text = RSTRING_PTR(string);
+	s->n = RSTRING_LEN(string);
+	s->wide = s->n >= INT32_MAX;
+	s->sa = xmalloc((s->n + 1) * (s->wide ? sizeof(int64_t) : sizeof(int32_t)));
+
+	job.task = SA_BUILD;
+	job.s = s;
+	sa_job_perform(&job);
+	return self;
+}
+
+// Compares the suffix at start with pattern, which counts as equal if it is a prefix
+static inline int sa_compare(const suffix_array *s, long start, const char *pattern, long m) {
+	long len = s->n - start;
+	int c = memcmp(s->text + start, pattern, len < m ? len : m);
+	if (c == 0 && len < m) return -1;
+	return c;
+}
+
+// Rank of the first suffix that is not less than pattern
+static long sa_lower_bound(const suffix_array *s, const char *pattern, long m) {
+	long lo = 1, hi = s->n + 1;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if (sa_compare(s, sa_at(s, mid), pattern, m) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// With the search index: the first rank whose suffix is not below pattern or, with upper set,
+// the first whose suffix is above it and does not start with it. lp and rp are the LCPs of
+// the pattern with the suffixes at l and r, and whichever is longer, together with the LCP
+// of that end with mid, tells where mid stands or how many bytes need no comparing.
+static long sa_search(const suffix_array *s, const char *pattern, long m, int upper) {
+	long l = 0, r = s->n + 1, lp = 0, rp = 0;
+	while (r - l > 1) {
+		long mid = l + (r - l) / 2, k, start;
+		if (lp >= rp) {
+			long x = sa_get(s->llcp, s->wide, mid);
+			if (x > lp || (x == lp && lp == m)) {
+				l = mid;
+				continue;
+			}
+			if (x < lp) {
+				r = mid;
+				rp = x;
+				continue;
+			}
+			k = lp;
+		} else {
+			long x = sa_get(s->rlcp, s->wide, mid);
+			if (x > rp || (x == rp && rp == m)) {
+				r = mid;
+				continue;
+			}
+			if (x < rp) {
+				l = mid;
+				lp = x;
+				continue;
+			}
+			k = rp;
+		}
+		start = sa_at(s, mid);
+		while (k < m && start + k < s->n && s->text[start + k] == pattern[k]) k++;
+		if (k == m) {
+			if (upper) l = mid, lp = m;
+			else r = mid, rp = m;
+		} else if (start + k == s->n || (unsigned char) s->text[start + k] < (unsigned char) pattern[k]) {
+			l = mid;
+			lp = k;
+		} else {
+			r = mid;
+			rp = k;
+		}
+	}
+	return r;
+}
+
+// Ranks [*first, *last) of the suffixes that start with pattern
+static void sa_range(suffix_array *s, VALUE pattern, long *first, long *last) {
+	long m = RSTRING_LEN(pattern);
+	*first = *last = 1;
+	if (m == 0) return;
+	sa_ensure_search_index(s);
+	*first = sa_search(s, RSTRING_PTR(pattern), m, 0);
+	*last = sa_search(s, RSTRING_PTR(pattern), m, 1);
+}
+
+/*
+ * call-seq:
+ *     has_substring?(substring) -> true or false
+ *
+ * Returns true if the substring occurs in the string, false otherwise.
+ *
+ * Complexity: O(m log n), or O(m + log n) once count or locate have been called
+ */
+static VALUE suffix_array_has_substring(VALUE self, VALUE substring) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	long m, rank;
+	substring = rb_obj_as_string(substring);
+	m = RSTRING_LEN(substring);
+	if (m == 0 || !s->sa) return Qfalse;
+	if (s->llcp) rank = sa_search(s, RSTRING_PTR(substring), m, 0);
+	else rank = sa_lower_bound(s, RSTRING_PTR(substring), m);
+	return rank <= s->n && sa_compare(s, sa_at(s, rank), RSTRING_PTR(substring), m) == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *     count(pattern) -> integer
+ *
+ * Returns the number of times pattern occurs in the string, overlapping occurrences included.
+ * The first call builds the search index.
+ *
+ * Complexity: O(m + log n)
+ */
+static VALUE suffix_array_count(VALUE self, VALUE pattern) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	long first, last;
+	pattern = rb_obj_as_string(pattern);
+	sa_range(s, pattern, &first, &last);
+	return LONG2NUM(last - first);
+}
+
+/*
+ * call-seq:
+ *     locate(pattern) -> [offset, ...]
+ *
+ * Returns the byte offsets of every occurrence of pattern in the string, in ascending order.
+ * The first call builds the search index.
+ *
+ * Complexity: O(m + log n + k log k) for k occurrences
+ */
+static VALUE suffix_array_locate(VALUE self, VALUE pattern) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	long first, last, i;
+	VALUE offsets;
+	pattern = rb_obj_as_string(pattern);
+	sa_range(s, pattern, &first, &last);
+	offsets = rb_ary_new_capa(last - first);
+	for (i = first; i < last; i++) rb_ary_push(offsets, LONG2NUM(sa_at(s, i)));
+	return rb_ary_sort_bang(offsets);
+}
+
+/*
+ * call-seq:
+ *     longest_repeated_substring -> string
+ *
+ * Returns the longest run of bytes that occurs at least twice in the string, possibly
+ * overlapping itself, or "" if no byte repeats. Of several, the one found first in suffix
+ * order is returned. The result is an ASCII-8BIT string, as it may end in the middle of a
+ * character. The first call builds the search index.
+ *
+ * Complexity: O(1) once the index is built
+ */
+static VALUE suffix_array_longest_repeated_substring(VALUE self) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	sa_ensure_search_index(s);
+	return rb_str_new(RSTRING_PTR(s->string) + s->repeat_pos, s->repeat_len);
+}
+
+/*
+ * call-seq:
+ *     longest_common_substring(other) -> string
+ *
+ * Returns the longest run of bytes of the string that also occurs in other, or "" if they
+ * share no byte. Like longest_repeated_substring, the result is an ASCII-8BIT string. Builds
+ * a suffix array and LCP array of both strings together, without the GVL.
+ *
+ * Complexity: O(n + m)
+ */
+static VALUE suffix_array_longest_common_substring(VALUE self, VALUE other) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	VALUE sa_v = 0, rank_v = 0, lcp_v = 0;
+	size_t size;
+	sa_job job;
+
+	other = rb_str_new_frozen(rb_obj_as_string(other));
+	if (RSTRING_LEN(other) == 0 || !s->sa) return rb_str_new(0, 0);
+	job.task = SA_COMMON;
+	job.s = s;
+	job.other = (const unsigned char *) RSTRING_PTR(other);
+	job.other_len = RSTRING_LEN(other);
+	size = (s->n + job.other_len + 2) * (s->n + job.other_len + 2 > INT32_MAX ? sizeof(int64_t) : sizeof(int32_t));
+	job.sa = ALLOCV(sa_v, size);
+	job.rank = ALLOCV(rank_v, size);
+	job.lcp = ALLOCV(lcp_v, size);
+	job.best_pos = job.best_len = 0;
+	sa_job_perform(&job);
+	ALLOCV_END(lcp_v);
+	ALLOCV_END(rank_v);
+	ALLOCV_END(sa_v);
+	RB_GC_GUARD(other);
+	return rb_str_new(RSTRING_PTR(s->string) + job.best_pos, job.best_len);
+}
+
+/*
+ * call-seq:
+ *     size -> integer
+ *
+ * Returns the number of suffixes, which is the length of the string in bytes.
+ */
+static VALUE suffix_array_size(VALUE self) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	return LONG2NUM(s->n);
+}
+
+/*
+ * call-seq:
+ *     to_a -> [offset, ...]
+ *
+ * Returns the byte offsets of the suffixes of the string in sorted order.
+ */
+static VALUE suffix_array_to_a(VALUE self) {
+	suffix_array *s = get_suffix_array_from_self(self);
+	VALUE ary = rb_ary_new_capa(s->n);
+	long i;
+	for (i = 1; i <= s->n; i++) rb_ary_push(ary, LONG2NUM(sa_at(s, i)));
+	return ary;
+}
+
+void Init_CSuffixArray() {
+	mContainers = rb_define_module("Containers");
+	cSuffixArray = rb_define_class_under(mContainers, "CSuffixArray", rb_cObject);
+	rb_define_alloc_func(cSuffixArray, suffix_array_alloc);
+	rb_define_method(cSuffixArray, "initialize", suffix_array_init, 1);
+	rb_define_method(cSuffixArray, "has_substring?", suffix_array_has_substring, 1);
+	rb_define_alias(cSuffixArray, "[]", "has_substring?");
+	rb_define_method(cSuffixArray, "count", suffix_array_count, 1);
+	rb_define_method(cSuffixArray, "locate", suffix_array_locate, 1);
+	rb_define_method(cSuffixArray, "longest_repeated_substring", suffix_array_longest_repeated_substring, 0);
+	rb_define_method(cSuffixArray, "longest_common_substring", suffix_array_longest_common_substring, 1);
+	rb_define_method(cSuffixArray, "size", suffix_array_size, 0);
+	rb_define_method(cSuffixArray, "to_a", suffix_array_to_a, 0);
+	Init_fm_index(mContainers);
+}
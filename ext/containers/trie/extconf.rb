@@ -0,0 +1,5 @@
+require 'mkmf'
+extension_name = "CTrie"
+dir_config(extension_name)
+have_func("mmap", "sys/mman.h")
+create_makefile(extension_name)
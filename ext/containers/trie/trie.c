@@ -0,0 +1,1147 @@
+#include "ruby.h"
+#include "ruby/encoding.h"
+#include <math.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * A path-compressed radix tree over the bytes of the keys.
+ *
+ * Nodes live in one flat array and are referred to by index, with node 0 the root. Each
+ * node's edge label is a slice of a single append-only byte pool; splitting an edge only
+ * re-slices the label, so every key byte is stored once. Children are kept sorted by the
+ * first byte of their label, which makes every walk visit keys in String order.
+ *
+ * Every node also knows its parent, how many keys its subtree holds, and the score of its own
+ * key and the highest score below it, where a key's score is its value when that is an
+ * Integer or Float. The counts answer count_prefix without a walk; the maximum scores let
+ * top_k_with_prefix skip every subtree that cannot beat what it has found already.
+ *
+ * wildcard and fuzzy_search work on characters: the length of each character in the tree
+ * is read off its lead byte, in the encoding of the pattern.
+ */
+
+typedef struct {
+	long label;         // offset of the edge label in the pool
+	long label_len;
+	int *children;      // sorted by the first byte of their labels
+	int num_children;
+	int children_capa;
+	int parent;         // -1 for the root
+	long count;         // keys in the subtree
+	double score;       // of the node's own key, or -INFINITY
+	double max_score;   // at least the highest score in the subtree
+	VALUE value;
+	int has_value;
+} trie_node;
+
+/*
+ * The on-disk form written by freeze_to: a header, the nodes in breadth-first order so that
+ * each node's children are consecutive, the edge labels, and the Marshal dumps of the values.
+ * open maps the file and runs lookups straight against it.
+ */
+
+#define TRIE_FILE_MAGIC "CTRIE\0\0\0"
+#define TRIE_FILE_VERSION 2
+#define TRIE_FILE_BYTE_ORDER 0x01020304
+
+typedef struct {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	int64_t num_nodes;
+	int64_t pool_len;
+	int64_t values_len;
+	int64_t max_key_len;
+	char encoding[32];  // name of the keys' encoding
+} trie_file_header;
+
+typedef struct {
+	int64_t label;
+	int64_t value;      // offset of the value's dump, or -1
+	int64_t count;
+	double score;
+	double max_score;   // exact, unlike in the growable trie
+	int32_t label_len;
+	int32_t num_children;
+	int32_t first_child;
+	int32_t value_len;
+	int32_t parent;
+	int32_t unused;
+} trie_frozen_node;
+
+typedef struct {
+	trie_node *nodes;
+	int num_nodes;
+	int nodes_capa;
+	unsigned char *pool;
+	long pool_len;
+	long pool_capa;
+	long max_key_len;
+	rb_encoding *enc;   // of the last key pushed, which keys found by prefix are given
+	// Set when the trie was opened from a file; pool then points into the mapping as well
+	const trie_frozen_node *frozen;
+	long num_frozen;
+	const char *values;
+	void *map;
+	size_t map_len;
+} trie;
+
+static VALUE mContainers;
+static VALUE cTrie;
+
+static trie* get_trie_from_self(VALUE self) {
+	trie *t;
+	Data_Get_Struct(self, trie, t);
+	return t;
+}
+
+static void trie_mark(void *ptr) {
+	if (ptr) {
+		trie *t = ptr;
+		int i;
+		for (i = 0; i < t->num_nodes; i++) {
+			if (t->nodes[i].has_value) rb_gc_mark(t->nodes[i].value);
+		}
+	}
+}
+
+static void trie_unmap(void *map, size_t len) {
+#ifdef HAVE_MMAP
+	munmap(map, len);
+#else
+	xfree(map);
+#endif
+}
+
+static void trie_free(void *ptr) {
+	if (ptr) {
+		trie *t = ptr;
+		int i;
+		for (i = 0; i < t->num_nodes; i++) xfree(t->nodes[i].children);
+		xfree(t->nodes);
+		if (t->map) trie_unmap(t->map, t->map_len);
+		else xfree(t->pool);
+		xfree(t);
+	}
+}
+
+static int trie_new_node(trie *t, int parent, long label, long label_len) {
+	trie_node *node;
+	if (t->num_nodes == t->nodes_capa) {
+		t->nodes_capa = t->nodes_capa ? 2 * t->nodes_capa : 16;
+		REALLOC_N(t->nodes, trie_node, t->nodes_capa);
+	}
+	node = &t->nodes[t->num_nodes];
+	node->label = label;
+	node->label_len = label_len;
+	node->children = NULL;
+	node->num_children = 0;
+	node->children_capa = 0;
+	node->parent = parent;
+	node->count = 0;
+	node->score = -INFINITY;
+	node->max_score = -INFINITY;
+	node->value = Qnil;
+	node->has_value = 0;
+	return t->num_nodes++;
+}
+
+static trie* trie_new(void) {
+	trie *t = ALLOC(trie);
+	t->nodes = NULL;
+	t->num_nodes = 0;
+	t->nodes_capa = 0;
+	t->pool = NULL;
+	t->pool_len = 0;
+	t->pool_capa = 0;
+	t->max_key_len = 0;
+	t->enc = rb_utf8_encoding();
+	t->frozen = NULL;
+	t->num_frozen = 0;
+	t->values = NULL;
+	t->map = NULL;
+	t->map_len = 0;
+	return t;
+}
+
+static VALUE trie_alloc(VALUE klass) {
+	trie *t = trie_new();
+	trie_new_node(t, -1, 0, 0);
+	return Data_Wrap_Struct(klass, trie_mark, trie_free, t);
+}
+
+// Node accessors that read either the growable nodes or those of an opened file
+
+static inline const unsigned char* trie_label(trie *t, int id) {
+	return t->pool + (t->frozen ? t->frozen[id].label : t->nodes[id].label);
+}
+
+static inline long trie_label_len(trie *t, int id) {
+	return t->frozen ? t->frozen[id].label_len : t->nodes[id].label_len;
+}
+
+static inline int trie_num_children(trie *t, int id) {
+	return t->frozen ? t->frozen[id].num_children : t->nodes[id].num_children;
+}
+
+static inline int trie_child(trie *t, int id, int c) {
+	return t->frozen ? t->frozen[id].first_child + c : t->nodes[id].children[c];
+}
+
+static inline int trie_parent(trie *t, int id) {
+	return t->frozen ? t->frozen[id].parent : t->nodes[id].parent;
+}
+
+static inline long trie_count(trie *t, int id) {
+	return t->frozen ? t->frozen[id].count : t->nodes[id].count;
+}
+
+static inline double trie_score(trie *t, int id) {
+	return t->frozen ? t->frozen[id].score : t->nodes[id].score;
+}
+
+static inline double trie_max_score(trie *t, int id) {
+	return t->frozen ? t->frozen[id].max_score : t->nodes[id].max_score;
+}
+
+static inline int trie_has_value(trie *t, int id) {
+	return t->frozen ? t->frozen[id].value >= 0 : t->nodes[id].has_value;
+}
+
+// Decodes the dumps of nil, true, false and Fixnums directly instead of calling Marshal.load
+static int trie_load_immediate(const unsigned char *p, long len, VALUE *value) {
+	long x, i, n;
+	signed char c;
+	if (len < 3 || p[0] != 4 || p[1] != 8) return 0;
+	switch (p[2]) {
+		case '0': *value = Qnil; return len == 3;
+		case 'T': *value = Qtrue; return len == 3;
+		case 'F': *value = Qfalse; return len == 3;
+		case 'i': break;
+		default: return 0;
+	}
+	if (len < 4) return 0;
+	c = (signed char) p[3];
+	n = c < 0 ? -c : c;
+	if (c == 0) x = 0;
+	else if (c >= 5) x = c - 5;
+	else if (c <= -5) x = c + 5;
+	else {
+		if (len != 4 + n) return 0;
+		x = c > 0 ? 0 : -1;
+		for (i = 0; i < n; i++) {
+			x &= ~(0xffL << (8 * i));
+			x |= (long) p[4 + i] << (8 * i);
+		}
+		*value = LONG2FIX(x);
+		return 1;
+	}
+	*value = LONG2FIX(x);
+	return len == 4;
+}
+
+static VALUE trie_value(trie *t, int id) {
+	if (t->frozen) {
+		const trie_frozen_node *node = &t->frozen[id];
+		const char *dump = t->values + node->value;
+		VALUE value, str;
+		if (trie_load_immediate((const unsigned char *) dump, node->value_len, &value)) return value;
+		str = rb_str_new(dump, node->value_len);
+		value = rb_marshal_load(str);
+		RB_GC_GUARD(str);
+		return value;
+	}
+	return t->nodes[id].value;
+}
+
+static inline unsigned char trie_first_byte(trie *t, int id) {
+	return trie_label(t, id)[0];
+}
+
+// Position in node's children of the child whose label starts with byte, or where it
+// would be inserted, negated and minus one
+static int trie_find_child(trie *t, int id, unsigned char byte) {
+	int lo = 0, hi = trie_num_children(t, id);
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		unsigned char b = trie_first_byte(t, trie_child(t, id, mid));
+		if (b == byte) return mid;
+		if (b < byte) lo = mid + 1;
+		else hi = mid;
+	}
+	return -lo - 1;
+}
+
+static void trie_insert_child(trie *t, int id, int at, int child) {
+	trie_node *node = &t->nodes[id];
+	if (node->num_children == node->children_capa) {
+		node->children_capa = node->children_capa ? 2 * node->children_capa : 2;
+		REALLOC_N(node->children, int, node->children_capa);
+	}
+	memmove(node->children + at + 1, node->children + at, sizeof(int) * (node->num_children - at));
+	node->children[at] = child;
+	node->num_children++;
+}
+
+static long trie_pool_append(trie *t, const char *bytes, long len) {
+	long offset = t->pool_len;
+	if (t->pool_len + len > t->pool_capa) {
+		t->pool_capa = t->pool_capa ? 2 * t->pool_capa : 256;
+		if (t->pool_capa < t->pool_len + len) t->pool_capa = t->pool_len + len;
+		REALLOC_N(t->pool, unsigned char, t->pool_capa);
+	}
+	memcpy(t->pool + offset, bytes, len);
+	t->pool_len += len;
+	return offset;
+}
+
+// The node a whole key ends at, or -1
+static int trie_lookup(trie *t, const char *key, long len) {
+	int id = 0;
+	long i = 0;
+	while (i < len) {
+		int at = trie_find_child(t, id, (unsigned char) key[i]);
+		long label_len;
+		if (at < 0) return -1;
+		id = trie_child(t, id, at);
+		label_len = trie_label_len(t, id);
+		if (label_len > len - i || memcmp(trie_label(t, id), key + i, label_len) != 0) return -1;
+		i += label_len;
+	}
+	return id;
+}
+
+// The score of a key with this value: Integers and Floats rank, anything else does not
+static double trie_value_score(VALUE value) {
+	double score;
+	if (FIXNUM_P(value)) return (double) FIX2LONG(value);
+	if (RB_FLOAT_TYPE_P(value)) score = RFLOAT_VALUE(value);
+	else if (RB_TYPE_P(value, T_BIGNUM)) score = rb_big2dbl(value);
+	else return -INFINITY;
+	return isnan(score) ? -INFINITY : score;
+}
+
+static VALUE trie_key(VALUE key) {
+	return rb_obj_as_string(key);
+}
+
+/*
+ * call-seq:
+ *     push(key, value) -> value
+ *
+ * Adds a key, value pair to the Trie, and returns the value if successful. The to_s method
+ * is called on the key to turn it into a string.
+ *
+ * Complexity: O(m)
+ */
+static VALUE trie_push(VALUE self, VALUE key, VALUE value) {
+	trie *t = get_trie_from_self(self);
+	const char *bytes;
+	long len, i = 0;
+	int id = 0, x;
+	double score;
+
+	rb_check_frozen(self);
+	key = trie_key(key);
+	bytes = RSTRING_PTR(key);
+	len = RSTRING_LEN(key);
+	if (len == 0) return Qnil;
+	if (len > t->max_key_len) t->max_key_len = len;
+	t->enc = rb_enc_get(key);
+
+	while (i < len) {
+		int at = trie_find_child(t, id, (unsigned char) bytes[i]), child;
+		long m = 0, label, label_len;
+		if (at < 0) {
+			int leaf = trie_new_node(t, id, trie_pool_append(t, bytes + i, len - i), len - i);
+			trie_insert_child(t, id, -at - 1, leaf);
+			id = leaf;
+			break;
+		}
+		child = t->nodes[id].children[at];
+		label = t->nodes[child].label;
+		label_len = t->nodes[child].label_len;
+		while (m < label_len && i + m < len && t->pool[label + m] == (unsigned char) bytes[i + m]) m++;
+		if (m < label_len) {
+			// Split the edge: a new node takes the common part and the old child the rest
+			int mid = trie_new_node(t, id, label, m);
+			trie_insert_child(t, mid, 0, child);
+			t->nodes[mid].count = t->nodes[child].count;
+			t->nodes[mid].max_score = t->nodes[child].max_score;
+			t->nodes[child].parent = mid;
+			t->nodes[child].label += m;
+			t->nodes[child].label_len -= m;
+			t->nodes[id].children[at] = mid;
+			child = mid;
+		}
+		id = child;
+		i += m;
+	}
+	if (!t->nodes[id].has_value) {
+		for (x = id; x >= 0; x = t->nodes[x].parent) t->nodes[x].count++;
+	}
+	t->nodes[id].value = value;
+	t->nodes[id].has_value = 1;
+	// Lowering a score leaves the old maximum above it, which still bounds the subtree
+	score = t->nodes[id].score = trie_value_score(value);
+	for (x = id; x >= 0 && t->nodes[x].max_score < score; x = t->nodes[x].parent) t->nodes[x].max_score = score;
+	RB_GC_GUARD(key);
+	return value;
+}
+
+/*
+ * call-seq:
+ *     get(key) -> value
+ *     get(key) -> nil
+ *
+ * Returns the value of the desired key, or nil if the key doesn't exist.
+ *
+ * Complexity: O(m) worst case
+ */
+static VALUE trie_get(VALUE self, VALUE key) {
+	trie *t = get_trie_from_self(self);
+	int id;
+	key = trie_key(key);
+	if (RSTRING_LEN(key) == 0) return Qnil;
+	id = trie_lookup(t, RSTRING_PTR(key), RSTRING_LEN(key));
+	return id >= 0 && trie_has_value(t, id) ? trie_value(t, id) : Qnil;
+}
+
+/*
+ * call-seq:
+ *     has_key?(key) -> true or false
+ *
+ * Returns true if the key is contained in the Trie.
+ *
+ * Complexity: O(m) worst case
+ */
+static VALUE trie_has_key(VALUE self, VALUE key) {
+	trie *t = get_trie_from_self(self);
+	int id;
+	key = trie_key(key);
+	if (RSTRING_LEN(key) == 0) return Qfalse;
+	id = trie_lookup(t, RSTRING_PTR(key), RSTRING_LEN(key));
+	return id >= 0 && trie_has_value(t, id) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *     longest_prefix(string) -> key
+ *
+ * Returns the longest key that is a prefix of the parameter string. If no match is found,
+ * the blank string "" is returned.
+ *
+ * Complexity: O(m) worst case
+ */
+static VALUE trie_longest_prefix(VALUE self, VALUE string) {
+	trie *t = get_trie_from_self(self);
+	const char *bytes;
+	long len, i = 0, best = 0;
+	int id = 0;
+
+	string = trie_key(string);
+	bytes = RSTRING_PTR(string);
+	len = RSTRING_LEN(string);
+	if (len == 0) return Qnil;
+	while (i < len) {
+		int at = trie_find_child(t, id, (unsigned char) bytes[i]);
+		long label_len;
+		if (at < 0) break;
+		id = trie_child(t, id, at);
+		label_len = trie_label_len(t, id);
+		if (label_len > len - i || memcmp(trie_label(t, id), bytes + i, label_len) != 0) break;
+		i += label_len;
+		if (trie_has_value(t, id)) best = i;
+	}
+	return rb_str_subseq(string, 0, best);
+}
+
+#define TRIE_MAX_CHAR_LEN 8
+
+// Number of bytes in the character that starts with lead
+static int trie_char_len(rb_encoding *enc, unsigned char lead) {
+	char c = (char) lead;
+	int r = rb_enc_precise_mbclen(&c, &c + 1, enc), len;
+	len = MBCLEN_NEEDMORE_P(r) ? 1 + MBCLEN_NEEDMORE_LEN(r) : 1;
+	return len < TRIE_MAX_CHAR_LEN ? len : TRIE_MAX_CHAR_LEN;
+}
+
+typedef struct {
+	trie *t;
+	rb_encoding *enc;
+	const char *pattern;
+	long pattern_len;
+	VALUE path;         // bytes from the root to the current position
+	VALUE results;
+	// fuzzy_search only
+	long *pattern_chars; // byte offset of each pattern character, and the end
+	long num_chars;
+	long *rows;          // edit distance row for each depth, width apart; see trie_fuzzy_at
+	long width;
+	int banded;
+	long max_dist;
+	char *chars;         // the character being read at each depth, TRIE_MAX_CHAR_LEN apart
+	long capa;           // depths that rows and chars have room for, grown as the walk goes deeper
+	long max_capa;       // depths the walk can reach at all
+	VALUE rows_v, chars_v;
+} trie_walk;
+
+static void trie_walk_push(trie_walk *w, unsigned char byte) {
+	char c = (char) byte;
+	rb_str_cat(w->path, &c, 1);
+}
+
+static void trie_walk_pop(trie_walk *w, long n) {
+	rb_str_set_len(w->path, RSTRING_LEN(w->path) - n);
+}
+
+static VALUE trie_walk_key(trie_walk *w) {
+	return rb_enc_str_new(RSTRING_PTR(w->path), RSTRING_LEN(w->path), w->enc);
+}
+
+/*
+ * Matches the pattern from pi on against the keys below (id, pos), need bytes into a character
+ * that a wildcard matched. Bytes along an edge label are read in a loop, so the walk only
+ * recurses where the tree branches.
+ */
+static void trie_wildcard_walk(trie_walk *w, int id, long pos, long pi, int need) {
+	trie *t = w->t;
+	long pushed = 0;
+	int c;
+	for (;;) {
+		int starts_char = 0;
+		if (need > 0) {
+			need--;
+		} else if (pi == w->pattern_len) {
+			if (pos == trie_label_len(t, id) && trie_has_value(t, id)) rb_ary_push(w->results, trie_walk_key(w));
+			break;
+		} else if (w->pattern[pi] == '*' || w->pattern[pi] == '.') {
+			pi++;
+			starts_char = 1;
+		} else {
+			// A literal character: follow its bytes exactly
+			int len = rb_enc_mbclen(w->pattern + pi, w->pattern + w->pattern_len, w->enc), k;
+			for (k = 0; k < len; k++) {
+				unsigned char byte = (unsigned char) w->pattern[pi + k];
+				if (pos < trie_label_len(t, id)) {
+					if (trie_label(t, id)[pos] != byte) break;
+					pos++;
+				} else {
+					int at = trie_find_child(t, id, byte);
+					if (at < 0) break;
+					id = trie_child(t, id, at);
+					pos = 1;
+				}
+				trie_walk_push(w, byte);
+				pushed++;
+			}
+			if (k < len) break;
+			pi += len;
+			continue;
+		}
+		// Any byte will do
+		if (pos < trie_label_len(t, id)) {
+			unsigned char byte = trie_label(t, id)[pos++];
+			trie_walk_push(w, byte);
+			pushed++;
+			if (starts_char) need = trie_char_len(w->enc, byte) - 1;
+			continue;
+		}
+		for (c = 0; c < trie_num_children(t, id); c++) {
+			int child = trie_child(t, id, c);
+			unsigned char byte = trie_first_byte(t, child);
+			trie_walk_push(w, byte);
+			trie_wildcard_walk(w, child, 1, pi, starts_char ? trie_char_len(w->enc, byte) - 1 : need);
+			trie_walk_pop(w, 1);
+		}
+		break;
+	}
+	trie_walk_pop(w, pushed);
+}
+
+/*
+ * call-seq:
+ *     wildcard(string) -> [key, ...]
+ *
+ * Returns a sorted array containing strings that match the parameter string. The wildcard
+ * characters that match any character are '*' and '.' If no match is found, an empty array
+ * is returned.
+ *
+ * Complexity: O(n) worst case
+ */
+static VALUE trie_wildcard(VALUE self, VALUE string) {
+	trie_walk w;
+	string = trie_key(string);
+	if (RSTRING_LEN(string) == 0) return Qnil;
+	w.t = get_trie_from_self(self);
+	w.enc = rb_enc_get(string);
+	w.pattern = RSTRING_PTR(string);
+	w.pattern_len = RSTRING_LEN(string);
+	w.path = rb_str_buf_new(64);
+	w.results = rb_ary_new();
+	trie_wildcard_walk(&w, 0, 0, 0, 0);
+	RB_GC_GUARD(string);
+	return w.results;
+}
+
+/*
+ * Entry j of the edit distance row at depth. An entry more than max_dist away from the diagonal
+ * is more than max_dist itself, so a row only stores the band of 2 * max_dist + 1 entries around
+ * it, or the whole row if that is shorter; everything outside reads as max_dist + 1.
+ */
+static inline long trie_fuzzy_at(const trie_walk *w, const long *row, long depth, long j) {
+	if (j < 0 || j > w->num_chars || j - depth > w->max_dist || depth - j > w->max_dist) return w->max_dist + 1;
+	return row[w->banded ? j - depth + w->max_dist : j];
+}
+
+// Extends the row at depth by the character just read, reports the key if one ends there, and
+// returns the smallest entry of the new row
+static long trie_fuzzy_char(trie_walk *w, int id, long pos, long depth, int len) {
+	long m = w->num_chars, k = w->max_dist, d = depth + 1, j, lo, hi, min = k + 1;
+	long *row = w->rows + depth * w->width, *next = row + w->width;
+	const char *chr = w->chars + depth * TRIE_MAX_CHAR_LEN;
+
+	lo = d - k > 0 ? d - k : 0;
+	hi = m - d > k ? d + k : m;
+	for (j = lo; j <= hi; j++) {
+		long best = trie_fuzzy_at(w, row, depth, j) + 1;
+		if (j > 0) {
+			long start = w->pattern_chars[j - 1], clen = w->pattern_chars[j] - start;
+			long cost = (clen == len && memcmp(w->pattern + start, chr, len) == 0) ? 0 : 1;
+			long v = trie_fuzzy_at(w, row, depth, j - 1) + cost;
+			if (v < best) best = v;
+			v = trie_fuzzy_at(w, next, d, j - 1) + 1;
+			if (v < best) best = v;
+		}
+		if (best > k) best = k + 1;
+		next[w->banded ? j - d + k : j] = best;
+		if (best < min) min = best;
+	}
+	if (pos == trie_label_len(w->t, id) && trie_has_value(w->t, id) && trie_fuzzy_at(w, next, d, m) <= k) {
+		rb_ary_push(w->results, rb_assoc_new(LONG2FIX(trie_fuzzy_at(w, next, d, m)), trie_walk_key(w)));
+	}
+	return min;
+}
+
+// Makes room for the character at depth and for the row it leads to
+static void trie_fuzzy_reserve(trie_walk *w, long depth) {
+	long capa = w->capa;
+	VALUE rows_v = w->rows_v, chars_v = w->chars_v;
+	long *rows;
+	char *chars;
+	if (depth + 2 <= capa) return;
+	while (capa < depth + 2) capa *= 2;
+	if (capa > w->max_capa) capa = w->max_capa;
+	// Not ALLOCV, which may use the stack of this function
+	rows = rb_alloc_tmp_buffer(&w->rows_v, sizeof(long) * capa * w->width);
+	chars = rb_alloc_tmp_buffer(&w->chars_v, capa * TRIE_MAX_CHAR_LEN);
+	memcpy(rows, w->rows, sizeof(long) * w->capa * w->width);
+	memcpy(chars, w->chars, w->capa * TRIE_MAX_CHAR_LEN);
+	ALLOCV_END(rows_v);
+	ALLOCV_END(chars_v);
+	w->rows = rows;
+	w->chars = chars;
+	w->capa = capa;
+}
+
+/*
+ * Walks the keys below (id, pos), whose characters from depth on are still to be matched, with
+ * have of the len bytes of the character at depth read already. Like the wildcard walk, it reads
+ * along edge labels in a loop and recurses only where the tree branches.
+ */
+static void trie_fuzzy_walk(trie_walk *w, int id, long pos, long depth, int have, int len) {
+	trie *t = w->t;
+	long pushed = 0;
+	int c;
+	trie_fuzzy_reserve(w, depth);
+	for (;;) {
+		char *chr = w->chars + depth * TRIE_MAX_CHAR_LEN;
+		if (have == len) {
+			if (trie_fuzzy_char(w, id, pos, depth, len) > w->max_dist) break;
+			depth++;
+			have = 0;
+			len = 1;
+			trie_fuzzy_reserve(w, depth);
+			continue;
+		}
+		if (pos < trie_label_len(t, id)) {
+			unsigned char byte = trie_label(t, id)[pos++];
+			if (have == 0) len = trie_char_len(w->enc, byte);
+			chr[have++] = (char) byte;
+			trie_walk_push(w, byte);
+			pushed++;
+			continue;
+		}
+		for (c = 0; c < trie_num_children(t, id); c++) {
+			int child = trie_child(t, id, c);
+			unsigned char byte = trie_first_byte(t, child);
+			// A sibling's walk may have moved the buffers
+			w->chars[depth * TRIE_MAX_CHAR_LEN + have] = (char) byte;
+			trie_walk_push(w, byte);
+			trie_fuzzy_walk(w, child, 1, depth, have + 1, have == 0 ? trie_char_len(w->enc, byte) : len);
+			trie_walk_pop(w, 1);
+		}
+		break;
+	}
+	trie_walk_pop(w, pushed);
+}
+
+/*
+ * call-seq:
+ *     fuzzy_search(string, max_dist) -> [[distance, key], ...]
+ *
+ * Returns a sorted array of [distance, key] pairs for every key within max_dist edits
+ * (Levenshtein distance) of the parameter string. Each character in the tree extends its
+ * parent's row of the edit distance matrix, and a branch is abandoned as soon as every
+ * entry in its row exceeds max_dist.
+ *
+ * Complexity: proportional to the number of trie nodes within max_dist of a prefix of string
+ */
+static VALUE trie_fuzzy_search(VALUE self, VALUE string, VALUE rb_max_dist) {
+	trie_walk w;
+	VALUE offsets_v = 0;
+	long i, m = 0;
+
+	string = trie_key(string);
+	w.max_dist = NUM2LONG(rb_max_dist);
+	if (w.max_dist < 0) rb_raise(rb_eArgError, "max_dist must not be negative");
+	w.t = get_trie_from_self(self);
+	w.enc = rb_enc_get(string);
+	w.pattern = RSTRING_PTR(string);
+	w.pattern_len = RSTRING_LEN(string);
+	w.path = rb_str_buf_new(64);
+	w.results = rb_ary_new();
+
+	w.pattern_chars = ALLOCV_N(long, offsets_v, w.pattern_len + 1);
+	for (i = 0; i < w.pattern_len; i += rb_enc_mbclen(w.pattern + i, w.pattern + w.pattern_len, w.enc)) {
+		w.pattern_chars[m++] = i;
+	}
+	w.pattern_chars[m] = w.pattern_len;
+	w.num_chars = m;
+	// A key has no more characters than bytes, and the walk never reads a character past depth
+	// m + max_dist, where every entry of the row exceeds max_dist. Most walks stop far sooner,
+	// so the buffers start small and grow up to that.
+	w.max_capa = w.t->max_key_len;
+	if (w.max_dist < w.max_capa - m) w.max_capa = m + w.max_dist;
+	w.max_capa += 2;
+	w.capa = w.max_capa < 16 ? w.max_capa : 16;
+	w.rows_v = w.chars_v = 0;
+	w.banded = w.max_dist < m / 2;
+	w.width = w.banded ? 2 * w.max_dist + 1 : m + 1;
+	w.rows = ALLOCV_N(long, w.rows_v, w.capa * w.width);
+	w.chars = ALLOCV_N(char, w.chars_v, w.capa * TRIE_MAX_CHAR_LEN);
+	for (i = 0; i <= m && i <= w.max_dist; i++) w.rows[w.banded ? i + w.max_dist : i] = i;
+	trie_fuzzy_walk(&w, 0, 0, 0, 0, 1);
+
+	ALLOCV_END(w.chars_v);
+	ALLOCV_END(w.rows_v);
+	ALLOCV_END(offsets_v);
+	RB_GC_GUARD(string);
+	return rb_ary_sort_bang(w.results);
+}
+
+// Follows prefix down from the root. The keys that start with it are then the ones below
+// *node, whose edge label the prefix ends *pos bytes into. Returns 0 if there are none.
+static int trie_find_prefix(trie *t, const char *bytes, long len, int *node, long *pos) {
+	int id = 0;
+	long p = 0, i;
+	for (i = 0; i < len; i++) {
+		unsigned char byte = (unsigned char) bytes[i];
+		if (p < trie_label_len(t, id)) {
+			if (trie_label(t, id)[p] != byte) return 0;
+			p++;
+		} else {
+			int at = trie_find_child(t, id, byte);
+			if (at < 0) return 0;
+			id = trie_child(t, id, at);
+			p = 1;
+		}
+	}
+	*node = id;
+	*pos = p;
+	return 1;
+}
+
+// The key that ends at node id, read upwards through the parents
+static VALUE trie_node_key(trie *t, int id, rb_encoding *enc) {
+	long len = 0;
+	int x;
+	char *p;
+	VALUE key;
+	for (x = id; x > 0; x = trie_parent(t, x)) len += trie_label_len(t, x);
+	key = rb_enc_str_new(NULL, len, enc);
+	p = RSTRING_PTR(key) + len;
+	for (x = id; x > 0; x = trie_parent(t, x)) {
+		long label_len = trie_label_len(t, x);
+		p -= label_len;
+		memcpy(p, trie_label(t, x), label_len);
+	}
+	return key;
+}
+
+/*
+ * call-seq:
+ *     count_prefix(prefix) -> integer
+ *
+ * Returns the number of keys that start with prefix.
+ *
+ * Complexity: O(m)
+ */
+static VALUE trie_count_prefix(VALUE self, VALUE prefix) {
+	trie *t = get_trie_from_self(self);
+	int id;
+	long pos;
+	prefix = trie_key(prefix);
+	if (!trie_find_prefix(t, RSTRING_PTR(prefix), RSTRING_LEN(prefix), &id, &pos)) return INT2FIX(0);
+	return LONG2NUM(trie_count(t, id));
+}
+
+static VALUE trie_prefix_enum_size(VALUE self, VALUE args, VALUE eobj) {
+	return trie_count_prefix(self, RARRAY_AREF(args, 0));
+}
+
+static void trie_each_walk(trie_walk *w, int id) {
+	trie *t = w->t;
+	int c;
+	if (trie_has_value(t, id)) rb_yield_values(2, trie_walk_key(w), trie_value(t, id));
+	// The block may push keys, so the children are counted afresh on every step
+	for (c = 0; c < trie_num_children(t, id); c++) {
+		int child = trie_child(t, id, c);
+		long len = trie_label_len(t, child);
+		rb_str_cat(w->path, (const char *) trie_label(t, child), len);
+		trie_each_walk(w, child);
+		trie_walk_pop(w, len);
+	}
+}
+
+/*
+ * call-seq:
+ *     each_with_prefix(prefix) { |key, value| ... } -> trie
+ *     each_with_prefix(prefix) -> enumerator
+ *
+ * Calls the block with every key that starts with prefix and its value, in key order. The
+ * keys are found as the walk goes, so stopping early only pays for the keys seen.
+ *
+ * Complexity: O(m + k) for k keys
+ */
+static VALUE trie_each_with_prefix(VALUE self, VALUE prefix) {
+	trie_walk w;
+	int id;
+	long pos;
+
+	RETURN_SIZED_ENUMERATOR(self, 1, &prefix, trie_prefix_enum_size);
+	prefix = trie_key(prefix);
+	w.t = get_trie_from_self(self);
+	w.enc = w.t->enc;
+	if (!trie_find_prefix(w.t, RSTRING_PTR(prefix), RSTRING_LEN(prefix), &id, &pos)) return self;
+	w.path = rb_str_buf_new(RSTRING_LEN(prefix) + 64);
+	rb_str_cat(w.path, RSTRING_PTR(prefix), RSTRING_LEN(prefix));
+	rb_str_cat(w.path, (const char *) trie_label(w.t, id) + pos, trie_label_len(w.t, id) - pos);
+	trie_each_walk(&w, id);
+	RB_GC_GUARD(prefix);
+	return self;
+}
+
+// A candidate for top_k_with_prefix: a key with its score, or a subtree with its best score
+typedef struct {
+	double score;
+	int id;
+	int is_key;
+} trie_rank;
+
+typedef struct {
+	VALUE buffer;       // a String, so the heap is freed even if building a key raises
+	trie_rank *heap;
+	long size;
+} trie_ranking;
+
+// Best score first; on equal scores subtrees are opened before keys are taken, so that the
+// keys of one score can be returned in key order
+static inline int trie_rank_before(const trie_rank *a, const trie_rank *b) {
+	if (a->score != b->score) return a->score > b->score;
+	return a->is_key < b->is_key;
+}
+
+static void trie_ranking_push(trie_ranking *r, double score, int id, int is_key) {
+	long i = r->size++;
+	trie_rank rank;
+	if ((long) (r->size * sizeof(trie_rank)) > RSTRING_LEN(r->buffer)) {
+		rb_str_resize(r->buffer, 2 * r->size * sizeof(trie_rank));
+		r->heap = (trie_rank *) RSTRING_PTR(r->buffer);
+	}
+	rank.score = score;
+	rank.id = id;
+	rank.is_key = is_key;
+	while (i > 0 && trie_rank_before(&rank, &r->heap[(i - 1) / 2])) {
+		r->heap[i] = r->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	r->heap[i] = rank;
+}
+
+static trie_rank trie_ranking_pop(trie_ranking *r) {
+	trie_rank top = r->heap[0], last = r->heap[--r->size];
+	long i = 0;
+	for (;;) {
+		long c = 2 * i + 1;
+		if (c >= r->size) break;
+		if (c + 1 < r->size && trie_rank_before(&r->heap[c + 1], &r->heap[c])) c++;
+		if (!trie_rank_before(&r->heap[c], &last)) break;
+		r->heap[i] = r->heap[c];
+		i = c;
+	}
+	r->heap[i] = last;
+	return top;
+}
+
+/*
+ * call-seq:
+ *     top_k_with_prefix(prefix, k) -> [[key, value], ...]
+ *
+ * Returns the k keys starting with prefix that have the highest values, as [key, value]
+ * pairs from the highest value down, and in key order among equal values. Only keys whose
+ * values are Integers or Floats take part.
+ *
+ * The search goes best first: every node knows the highest score below it, so subtrees that
+ * cannot make the top k are never entered.
+ *
+ * Complexity: O(m + k log k) for a trie with few children per node
+ */
+static VALUE trie_top_k_with_prefix(VALUE self, VALUE prefix, VALUE rb_k) {
+	trie *t = get_trie_from_self(self);
+	long k = NUM2LONG(rb_k), pos;
+	VALUE results = rb_ary_new(), ties;
+	trie_ranking r;
+	int id, c;
+
+	prefix = trie_key(prefix);
+	if (k <= 0 || !trie_find_prefix(t, RSTRING_PTR(prefix), RSTRING_LEN(prefix), &id, &pos)) return results;
+	if (trie_max_score(t, id) == -INFINITY) return results;
+	r.buffer = rb_str_buf_new(64 * sizeof(trie_rank));
+	rb_str_set_len(r.buffer, 64 * sizeof(trie_rank));
+	r.heap = (trie_rank *) RSTRING_PTR(r.buffer);
+	r.size = 0;
+	trie_ranking_push(&r, trie_max_score(t, id), id, 0);
+
+	while (r.size > 0 && RARRAY_LEN(results) < k) {
+		trie_rank top = trie_ranking_pop(&r);
+		long i;
+		if (!top.is_key) {
+			if (trie_score(t, top.id) > -INFINITY) trie_ranking_push(&r, trie_score(t, top.id), top.id, 1);
+			for (c = 0; c < trie_num_children(t, top.id); c++) {
+				int child = trie_child(t, top.id, c);
+				if (trie_max_score(t, child) > -INFINITY) trie_ranking_push(&r, trie_max_score(t, child), child, 0);
+			}
+			continue;
+		}
+		// No subtree can reach this score any more, so every key with it is in the heap
+		ties = rb_ary_new();
+		for (;;) {
+			rb_ary_push(ties, rb_assoc_new(trie_node_key(t, top.id, t->enc), trie_value(t, top.id)));
+			if (r.size == 0 || !r.heap[0].is_key || r.heap[0].score != top.score) break;
+			top = trie_ranking_pop(&r);
+		}
+		rb_ary_sort_bang(ties);
+		for (i = 0; i < RARRAY_LEN(ties) && RARRAY_LEN(results) < k; i++) rb_ary_push(results, RARRAY_AREF(ties, i));
+	}
+	RB_GC_GUARD(r.buffer);
+	RB_GC_GUARD(prefix);
+	return results;
+}
+
+/*
+ * call-seq:
+ *     freeze_to(path) -> self
+ *
+ * Writes the Trie to path in a compact, pointer-free form that Containers::Trie.open can map
+ * straight into memory. Values are stored with Marshal. The file is written next to path and
+ * renamed over it, so processes that have the old file open keep seeing a consistent trie.
+ *
+ * Complexity: O(n)
+ */
+static VALUE trie_freeze_to(VALUE self, VALUE path) {
+	trie *t = get_trie_from_self(self);
+	long n = t->frozen ? t->num_frozen : t->num_nodes, head, tail = 1;
+	VALUE nodes, pool, values, image, tmp, order_v = 0;
+	trie_file_header header;
+	trie_frozen_node *frozen;
+	int *order, *parents;
+
+	FilePathValue(path);
+	nodes = rb_str_buf_new(n * sizeof(trie_frozen_node));
+	pool = rb_str_buf_new(0);
+	values = rb_str_buf_new(0);
+	// Numbering the nodes breadth-first puts each node's children next to each other
+	order = ALLOCV_N(int, order_v, 2 * n);
+	parents = order + n;
+	order[0] = 0;
+	parents[0] = -1;
+	for (head = 0; head < tail; head++) {
+		int id = order[head], c, num_children = trie_num_children(t, id);
+		trie_frozen_node node;
+
+		if (tail + num_children > n) rb_raise(rb_eRuntimeError, "trie modified during freeze_to");
+		node.label = RSTRING_LEN(pool);
+		node.label_len = (int32_t) trie_label_len(t, id);
+		node.num_children = num_children;
+		node.first_child = (int32_t) tail;
+		node.parent = parents[head];
+		node.unused = 0;
+		node.count = trie_count(t, id);
+		node.score = node.max_score = trie_score(t, id);
+		rb_str_cat(pool, (const char *) trie_label(t, id), node.label_len);
+		for (c = 0; c < num_children; c++) {
+			parents[tail] = (int) head;
+			order[tail++] = trie_child(t, id, c);
+		}
+		node.value = -1;
+		node.value_len = 0;
+		if (trie_has_value(t, id)) {
+			node.value = RSTRING_LEN(values);
+			if (t->frozen) {
+				node.value_len = t->frozen[id].value_len;
+				rb_str_cat(values, t->values + t->frozen[id].value, node.value_len);
+			} else {
+				// Dumping runs Ruby code, which may push to the trie; ids stay valid
+				VALUE dump = rb_marshal_dump(t->nodes[id].value, Qnil);
+				if (RSTRING_LEN(dump) > INT32_MAX) rb_raise(rb_eArgError, "value too large to freeze");
+				node.value_len = (int32_t) RSTRING_LEN(dump);
+				rb_str_cat(values, RSTRING_PTR(dump), node.value_len);
+			}
+		}
+		rb_str_cat(nodes, (const char *) &node, sizeof(node));
+	}
+	ALLOCV_END(order_v);
+	// Children come after their parents, so one backwards pass makes the maximum scores exact
+	frozen = (trie_frozen_node *) RSTRING_PTR(nodes);
+	for (head = tail - 1; head > 0; head--) {
+		trie_frozen_node *parent = &frozen[frozen[head].parent];
+		if (parent->max_score < frozen[head].max_score) parent->max_score = frozen[head].max_score;
+	}
+
+	memcpy(header.magic, TRIE_FILE_MAGIC, sizeof(header.magic));
+	header.byte_order = TRIE_FILE_BYTE_ORDER;
+	header.version = TRIE_FILE_VERSION;
+	header.num_nodes = tail;
+	header.pool_len = RSTRING_LEN(pool);
+	header.values_len = RSTRING_LEN(values);
+	header.max_key_len = t->max_key_len;
+	memset(header.encoding, 0, sizeof(header.encoding));
+	strncpy(header.encoding, rb_enc_name(t->enc), sizeof(header.encoding) - 1);
+	image = rb_str_buf_new(sizeof(header) + RSTRING_LEN(nodes) + RSTRING_LEN(pool) + RSTRING_LEN(values));
+	rb_str_cat(image, (const char *) &header, sizeof(header));
+	rb_str_buf_append(image, nodes);
+	rb_str_buf_append(image, pool);
+	rb_str_buf_append(image, values);
+
+	tmp = rb_str_plus(path, rb_sprintf(".%d.tmp", (int) getpid()));
+	rb_funcall(rb_cFile, rb_intern("binwrite"), 2, tmp, image);
+	rb_funcall(rb_cFile, rb_intern("rename"), 2, tmp, path);
+	return self;
+}
+
+static void* trie_map_file(VALUE path, size_t *len) {
+#ifdef HAVE_MMAP
+	struct stat st;
+	void *map;
+	int fd = open(RSTRING_PTR(path), O_RDONLY);
+	if (fd < 0) rb_sys_fail_str(path);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		rb_sys_fail_str(path);
+	}
+	*len = (size_t) st.st_size;
+	if (*len < sizeof(trie_file_header)) {
+		close(fd);
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is not a frozen trie", path);
+	}
+	map = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) rb_sys_fail_str(path);
+	return map;
+#else
+	VALUE data = rb_funcall(rb_cFile, rb_intern("binread"), 1, path);
+	void *map;
+	*len = RSTRING_LEN(data);
+	if (*len < sizeof(trie_file_header)) rb_raise(rb_eArgError, "%"PRIsVALUE" is not a frozen trie", path);
+	map = xmalloc(*len);
+	memcpy(map, RSTRING_PTR(data), *len);
+	return map;
+#endif
+}
+
+/*
+ * call-seq:
+ *     Containers::Trie.open(path) -> trie
+ *
+ * Returns a frozen Trie backed by a file written with freeze_to. The file is mapped into
+ * memory rather than read, so opening takes the same time whatever the size of the trie,
+ * and processes that open the same file share its pages. Lookups unmarshal the value on
+ * every call; files are trusted the way Marshal data is.
+ *
+ * Complexity: O(1)
+ */
+static VALUE trie_s_open(VALUE klass, VALUE path) {
+	trie *t = trie_new();
+	VALUE self = Data_Wrap_Struct(klass, trie_mark, trie_free, t);
+	const trie_file_header *header;
+	const char *base;
+	uint64_t nodes_len;
+
+	FilePathValue(path);
+	t->map = trie_map_file(path, &t->map_len);
+	base = t->map;
+	header = (const trie_file_header *) base;
+	if (memcmp(header->magic, TRIE_FILE_MAGIC, sizeof(header->magic)) != 0) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is not a frozen trie", path);
+	}
+	if (header->byte_order != TRIE_FILE_BYTE_ORDER) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" was frozen on a machine with a different byte order", path);
+	}
+	if (header->version != TRIE_FILE_VERSION) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" has unsupported version %u", path, (unsigned) header->version);
+	}
+	if (header->num_nodes < 1 || header->num_nodes > INT32_MAX || header->pool_len < 0 || header->values_len < 0) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is corrupt", path);
+	}
+	nodes_len = (uint64_t) header->num_nodes * sizeof(trie_frozen_node);
+	if (sizeof(trie_file_header) + nodes_len + (uint64_t) header->pool_len + (uint64_t) header->values_len != t->map_len) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is truncated or corrupt", path);
+	}
+	t->frozen = (const trie_frozen_node *) (base + sizeof(trie_file_header));
+	t->num_frozen = (long) header->num_nodes;
+	t->pool = (unsigned char *) (base + sizeof(trie_file_header) + nodes_len);
+	t->pool_len = (long) header->pool_len;
+	t->values = base + sizeof(trie_file_header) + nodes_len + header->pool_len;
+	t->max_key_len = (long) header->max_key_len;
+	if (memchr(header->encoding, 0, sizeof(header->encoding)) == NULL) {
+		rb_raise(rb_eArgError, "%"PRIsVALUE" is corrupt", path);
+	}
+	t->enc = rb_enc_find(header->encoding);
+	if (!t->enc) t->enc = rb_ascii8bit_encoding();
+	return rb_obj_freeze(self);
+}
+
+void Init_CTrie() {
+	mContainers = rb_define_module("Containers");
+	cTrie = rb_define_class_under(mContainers, "CTrie", rb_cObject);
+	rb_define_alloc_func(cTrie, trie_alloc);
+	rb_define_method(cTrie, "push", trie_push, 2);
+	rb_define_alias(cTrie, "[]=", "push");
+	rb_define_method(cTrie, "get", trie_get, 1);
+	rb_define_alias(cTrie, "[]", "get");
+	rb_define_method(cTrie, "has_key?", trie_has_key, 1);
+	rb_define_method(cTrie, "longest_prefix", trie_longest_prefix, 1);
+	rb_define_method(cTrie, "wildcard", trie_wildcard, 1);
+	rb_define_method(cTrie, "fuzzy_search", trie_fuzzy_search, 2);
+	rb_define_method(cTrie, "each_with_prefix", trie_each_with_prefix, 1);
+	rb_define_method(cTrie, "count_prefix", trie_count_prefix, 1);
+	rb_define_method(cTrie, "top_k_with_prefix", trie_top_k_with_prefix, 2);
+	rb_define_method(cTrie, "freeze_to", trie_freeze_to, 1);
+	rb_define_singleton_method(cTrie, "open", trie_s_open, 1);
+}
@@ -20,20 +20,27 @@
     tree = Containers::RBTreeMap.new
 
   Done so far:
-  * Heaps           - Containers::Heap, Containers::MaxHeap, Containers::MinHeap
+  * Heaps           - Containers::Heap, Containers::MaxHeap, Containers::MinHeap, Containers::CHeap (C extension), Containers::RubyHeap
   * Priority Queue  - Containers::PriorityQueue
+  * Radix Heap      - Containers::RadixHeap (C extension), for monotone Integer priorities
   * Stack           - Containers::Stack
   * Queue           - Containers::Queue
   * Deque           - Containers::Deque, Containers::CDeque (C extension), Containers::RubyDeque
   * Red-Black Trees - Containers::RBTreeMap, Containers::CRBTreeMap (C extension), Containers::RubyRBTreeMap
   * Splay Trees     - Containers::SplayTreeMap
-  * Tries           - Containers::Trie
-  * Suffix Array    - Containers::SuffixArray
-  * kd Tree         - Containers::KDTree
+  * Mapped Tree Map - Containers::MappedTreeMap (C extension), a read-only map over a dumped tree map
+  * Tries           - Containers::Trie, Containers::CTrie (C extension), Containers::RubyTrie
+  * Fuzzy Index     - Containers::FuzzyIndex, Containers::CBKTree (C extension)
+  * Suffix Array    - Containers::SuffixArray, Containers::CSuffixArray (C extension), Containers::RubySuffixArray
+  * FM-Index        - Containers::FMIndex (C extension), a compressed full-text index
+  * kd Tree         - Containers::KDTree, Containers::CKDTree (C extension), Containers::RubyKDTree
 
   * Search algorithms
     - Binary Search         - Algorithms::Search.binary_search
     - Knuth-Morris-Pratt    - Algorithms::Search.kmp_search
+    - Aho-Corasick          - Algorithms::Search::MultiPattern (C extension)
+    - Compiled substring    - Algorithms::Search::Pattern (C extension)
+    - Eytzinger index       - Algorithms::Search::SortedIndex (C extension)
   * Sort algorithms
     - Bubble sort           - Algorithms::Sort.bubble_sort
     - Comb sort             - Algorithms::Sort.comb_sort
@@ -44,8 +51,14 @@
     - Quicksort             - Algorithms::Sort.quicksort
     - Mergesort             - Algorithms::Sort.mergesort
     - Dual-Pivot Quicksort  - Algorithms::Sort.dualpivotquicksort
+    - Native sort kernels   - Algorithms::Sort.native_sort! (C extension)
+    - Parallel sort         - Algorithms::Sort.parallel_sort (C extension)
+    - External merge sort   - Algorithms::Sort.external_sort
+    - Selection             - Algorithms::Sort.nth_element, partial_sort, top_k
+    - Stable sort by key    - Algorithms::Sort.stable_sort_by
   * String algorithms
     - Levenshtein distance  - Algorithms::String.levenshtein_dist
+    - Top-k fuzzy matching  - Algorithms::String.levenshtein_top_k
 =end
 
 module Algorithms; end
@@ -63,4 +76,5 @@ require 'containers/rb_tree_map'
 require 'containers/splay_tree_map'
 require 'containers/suffix_array'
 require 'containers/trie'
+require 'containers/fuzzy_index'
 require 'containers/kd_tree'
@@ -1,7 +1,15 @@
 =begin rdoc
     This module implements search algorithms. Documentation is provided for each algorithm.
     
+    The CSearch C extension adds Algorithms::Search::MultiPattern for scanning text for many
+    patterns at once, Algorithms::Search::Pattern for searching repeatedly for one, and
+    Algorithms::Search::SortedIndex for repeated binary searches over a fixed array of numbers.
 =end
+begin
+  require 'CSearch'
+rescue LoadError
+end
+
 module Algorithms::Search
   # Binary Search: This search finds an item in log(n) time provided that the container is already sorted.
   # The method returns the item if it is found, or nil if it is not. If there are duplicates, the first one
@@ -38,6 +46,9 @@ module Algorithms::Search
   #
   # Complexity: O(n + k), where n is the length of the string and k is the length of the substring.
   #
+  # When the same substring is searched for many times, Algorithms::Search::Pattern (C extension)
+  # compiles it once and scans at close to memory speed.
+  #
   #   Algorithms::Search.kmp_search("ABC ABCDAB ABCDABCDABDE", "ABCDABD") #=> 15
   #   Algorithms::Search.kmp_search("ABC ABCDAB ABCDABCDABDE", "ABCDEF") #=> nil
   def self.kmp_search(string, substring)
@@ -1,10 +1,32 @@
 require 'containers/heap' # for heapsort
+require 'tempfile'
 
 =begin rdoc
     This module implements sorting algorithms. Documentation is provided for each algorithm.
     
+    When the CSort C extension is available, every sort below hands Arrays that hold only
+    Integers (Fixnums), only Floats or only Strings to Algorithms::Sort.native_sort!, which
+    radix sorts numbers and pdqsorts Strings in C. Other containers and element types use
+    the Ruby implementations.
 =end
+begin
+  require 'CSort'
+rescue LoadError
+end
+
 module Algorithms::Sort
+  # Sorts container in place with the CSort extension if it can, returning the container, or
+  # returns nil if the extension is missing or the container is not an Array of only
+  # Fixnums, only Floats or only Strings.
+  def self.native_sort(container)
+    respond_to?(:native_sort!) ? native_sort!(container) : nil
+  end
+
+  # Like native_sort, but leaves container alone and returns a sorted copy.
+  def self.native_sorted(container)
+    container.is_a?(Array) ? native_sort(container.dup) : nil
+  end
+
   # Bubble sort: A very naive sort that keeps swapping elements until the container is sorted.
   # Requirements: Needs to be able to compare elements with <=>, and the [] []= methods should
   # be implemented for the container.
@@ -14,6 +36,7 @@ module Algorithms::Sort
   # 
   #   Algorithms::Sort.bubble_sort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
   def self.bubble_sort(container)
+    return container if native_sort(container)
     loop do
       swapped = false
       (container.size-1).times do |i|
@@ -37,6 +60,7 @@ module Algorithms::Sort
   # 
   #   Algorithms::Sort.comb_sort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
   def self.comb_sort(container)
+    return container if native_sort(container)
     container
     gap = container.size
     loop do
@@ -65,6 +89,7 @@ module Algorithms::Sort
   # 
   #   Algorithms::Sort.selection_sort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
   def self.selection_sort(container)
+    return container if native_sort(container)
     0.upto(container.size-1) do |i|
       min = i
       (i+1).upto(container.size-1) do |j|
@@ -83,6 +108,8 @@ module Algorithms::Sort
   # 
   #   Algorithms::Sort.heapsort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
   def self.heapsort(container)
+    sorted = native_sorted(container)
+    return sorted if sorted
     heap = Containers::Heap.new(container)
     ary = []
     ary << heap.pop until heap.empty?
@@ -98,6 +125,7 @@ module Algorithms::Sort
   # 
   #   Algorithms::Sort.insertion_sort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
   def self.insertion_sort(container)
+    return container if native_sort(container)
     return container if container.size < 2
     (1..container.size-1).each do |i|
       value = container[i]
@@ -120,6 +148,7 @@ module Algorithms::Sort
   # 
   #   Algorithms::Sort.shell_sort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
   def self.shell_sort(container)
+    return container if native_sort(container)
     increment = container.size/2
     while increment > 0 do
       (increment..container.size-1).each do |i|
@@ -178,6 +207,7 @@ module Algorithms::Sort
   # end
   
   def self.quicksort(container)
+    return container if native_sort(container)
     bottom, top = [], []
     top[0] = 0
     bottom[0] = container.size
@@ -220,6 +250,8 @@ module Algorithms::Sort
   # 
   #   Algorithms::Sort.mergesort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
   def self.mergesort(container)
+    sorted = native_sorted(container)
+    return sorted if sorted
     return container if container.size <= 1
     mid   = container.size / 2
     left  = container[0...mid]
@@ -271,6 +303,7 @@ module Algorithms::Sort
   #   Algorithms::Sort.dualpivotquicksort [5, 4, 3, 1, 2] => [1, 2, 3, 4, 5]
 
   def self.dualpivotquicksort(container)
+    return container if native_sort(container)
     return container if container.size <= 1
     dualpivot(container, 0, container.size-1, 3)
   end
@@ -364,5 +397,267 @@ module Algorithms::Sort
   def self.dualpivot_swap(container, i, j)
     container[i],  container[j] = container[j],  container[i]
   end
+
+  # Selection (nth element): Rearranges container so that container[k] holds the element a full sort
+  # would put there, with no greater element before it and no smaller one after it, and returns that
+  # element. An optional block maps elements to the keys they are compared by; it is called once per
+  # element.
+  # Arrays of only Integers (Fixnums) or only Floats are handled by the CSort extension when it is
+  # available, with introselect falling back to median-of-medians pivots.
+  # Requirements: Needs to be able to compare elements (or keys) with <=>, and the [] []= methods
+  # should be implemented for the container.
+  # Time Complexity: О(n) average, О(n) worst-case when native
+  # Space Complexity: О(n) auxiliary
+  # Stable: No
+  #
+  #   Algorithms::Sort.nth_element [5, 4, 3, 1, 2], 1 => 2
+  def self.nth_element(container, k, &key)
+    unless k >= 0 && k < container.size
+      raise IndexError, "index #{k} out of range for #{container.size} elements"
+    end
+    if !key && respond_to?(:native_nth_element!)
+      element = native_nth_element!(container, k)
+      return element unless element.nil?
+    end
+    keys = key ? container.map(&key) : container.to_a.dup
+    order = select_order!(keys, (0...container.size).to_a, k)
+    select_apply_order(container, order)
+    container[k]
+  end
+
+  # Partial sort: Rearranges container so that its first k positions hold its k smallest elements in
+  # order; the order of the rest is unspecified. An optional block maps elements to the keys they are
+  # compared by; it is called once per element. Native for Arrays of only Fixnums or only Floats.
+  # Requirements: Needs to be able to compare elements (or keys) with <=>, and the [] []= methods
+  # should be implemented for the container.
+  # Time Complexity: О(n + k log k) average
+  # Space Complexity: О(n) auxiliary
+  # Stable: No
+  #
+  #   Algorithms::Sort.partial_sort([5, 4, 3, 1, 2], 2).first(2) => [1, 2]
+  def self.partial_sort(container, k, &key)
+    raise ArgumentError, "k must not be negative" if k < 0
+    k = container.size if k > container.size
+    return container if !key && respond_to?(:native_partial_sort!) && native_partial_sort!(container, k)
+    keys = key ? container.map(&key) : container.to_a.dup
+    order = (0...container.size).to_a
+    select_order!(keys, order, k) if k < container.size
+    order[0, k] = order[0, k].sort { |a, b| keys[a] <=> keys[b] }
+    select_apply_order(container, order)
+  end
+
+  # Top k: Returns the k greatest elements of container, greatest first, leaving container alone. An
+  # optional block maps elements to the keys they are compared by. Uses a bounded heap, natively for
+  # Arrays of only Fixnums or only Floats.
+  # Requirements: Needs to be able to compare elements (or keys) with <=>; container should include
+  # the Enumerable module.
+  # Time Complexity: О(n log k)
+  # Space Complexity: О(k) auxiliary
+  # Stable: No
+  #
+  #   Algorithms::Sort.top_k [5, 4, 3, 1, 2], 2 => [5, 4]
+  def self.top_k(container, k, &key)
+    raise ArgumentError, "k must not be negative" if k < 0
+    if !key && respond_to?(:native_top_k)
+      top = native_top_k(container, k)
+      return top if top
+    end
+    key ? container.max_by(k, &key) : container.max(k)
+  end
+
+  # Stable sort by key: Returns a new array of the elements of container ordered by the keys the
+  # block maps them to, keeping elements with equal keys in their original order. Unlike sorting
+  # with a comparator, the block is called exactly once per element, so expensive keys cost n calls
+  # rather than n log n. Without a block the elements are their own keys.
+  # With the CSort extension the keys are merge sorted in C, TimSort style: natural runs are found
+  # and extended, merges skip what is already in place, and all-Integer (Fixnum) or all-Float keys
+  # are compared unboxed.
+  # Requirements: Keys need to be comparable with <=>; container should include the Enumerable
+  # module.
+  # Time Complexity: О(n log n) worst-case, О(n) for presorted input
+  # Space Complexity: О(n) auxiliary
+  # Stable: Yes
+  #
+  #   Algorithms::Sort.stable_sort_by(%w(pear fig banana kiwi)) { |s| s.size } => ["fig", "pear", "kiwi", "banana"]
+  def self.stable_sort_by(container, &key)
+    return native_stable_sort_by(container.to_a, &key) if respond_to?(:native_stable_sort_by)
+    values = container.to_a
+    keys = key ? values.map(&key) : values
+    (0...values.size).sort_by { |i| [keys[i], i] }.map { |i| values[i] }
+  end
+
+  # Quickselect over an index permutation: afterwards keys[order[k]] is in its sorted position.
+  def self.select_order!(keys, order, k)
+    lo, hi = 0, order.size
+    while hi - lo > 1
+      pivot = keys[order[lo + rand(hi - lo)]]
+      lt, i, gt = lo, lo, hi
+      while i < gt
+        cmp = keys[order[i]] <=> pivot
+        raise ArgumentError, "comparison of #{keys[order[i]].class} with #{pivot.class} failed" if cmp.nil?
+        if cmp < 0
+          order[lt], order[i] = order[i], order[lt]
+          lt += 1
+          i += 1
+        elsif cmp > 0
+          gt -= 1
+          order[i], order[gt] = order[gt], order[i]
+        else
+          i += 1
+        end
+      end
+      if k < lt
+        hi = lt
+      elsif k >= gt
+        lo = gt
+      else
+        break
+      end
+    end
+    order
+  end
+
+  def self.select_apply_order(container, order)
+    values = order.map { |i| container[i] }
+    values.each_with_index { |value, i| container[i] = value }
+    container
+  end
+
+  # External merge sort: Sorts the lines of input_io into output_io when they do not fit in memory.
+  # Lines are read until roughly :memory_limit bytes are buffered, sorted, and spilled to a
+  # temporary file as a sorted run. The runs are then merged with a heap, at most :fan_in at a
+  # time, with several passes if there are more runs than that, so peak memory is bounded by
+  # :memory_limit plus one buffered line per open run, whatever the size of the input.
+  #
+  # Lines are compared as Strings without their newline, so a line sorts before any longer line
+  # it is a prefix of, as with Array#sort. The :key proc (or block) is given the line without its
+  # newline too, and is called once per line in each pass. Every line written ends with a newline.
+  #
+  # Options:
+  #   :memory_limit - bytes of lines to buffer per run (default 64 MB)
+  #   :key          - proc mapping a line to its sort key
+  #   :fan_in       - maximum number of runs merged at once (default 64)
+  #   :tmpdir       - directory for the runs (default Dir.tmpdir)
+  #
+  # Requirements: input_io should implement #each_line and output_io #write.
+  # Time Complexity: О(n log n)
+  # Space Complexity: О(memory_limit) memory, О(n) disk
+  # Stable: Yes
+  #
+  #   Algorithms::Sort.external_sort(File.open("in.txt"), File.open("out.txt", "w"), :memory_limit => 1 << 26)
+  def self.external_sort(input_io, output_io, options={}, &block)
+    memory_limit = options[:memory_limit] || 64 * 1024 * 1024
+    key = options[:key] || block
+    fan_in = options[:fan_in] || 64
+    raise ArgumentError, "memory_limit must be positive" unless memory_limit > 0
+    raise ArgumentError, "fan_in must be at least 2" unless fan_in >= 2
+
+    runs = []
+    chunk = []
+    bytes = 0
+    input_io.each_line do |line|
+      line = line.chomp("\n")
+      chunk << line
+      bytes += line.bytesize + 41 # the newline and a rough per-String overhead
+      if bytes >= memory_limit
+        runs << external_sort_spill(chunk, key, options[:tmpdir])
+        chunk = []
+        bytes = 0
+      end
+    end
+
+    if runs.empty?
+      external_sort_chunk(chunk, key).each { |line| output_io.write(line, "\n") }
+      return output_io
+    end
+    runs << external_sort_spill(chunk, key, options[:tmpdir]) unless chunk.empty?
+
+    while runs.size > fan_in
+      runs = runs.each_slice(fan_in).map do |group|
+        run = Tempfile.new("external_sort", *[options[:tmpdir]].compact)
+        external_sort_merge(group, run, key)
+        run.flush
+        run.rewind
+        run
+      end
+    end
+    external_sort_merge(runs, output_io, key)
+    output_io
+  ensure
+    (runs || []).each { |run| run.close! }
+  end
+
+  def self.external_sort_chunk(chunk, key)
+    if key
+      stable_sort_by(chunk, &key)
+    else
+      native_sort(chunk) || chunk.sort_by.with_index { |line, i| [line, i] }
+    end
+  end
+
+  def self.external_sort_spill(chunk, key, tmpdir)
+    run = Tempfile.new("external_sort", *[tmpdir].compact)
+    external_sort_chunk(chunk, key).each { |line| run.write(line, "\n") }
+    run.flush
+    run.rewind
+    run
+  end
+
+  # Merges the sorted runs into output, closing and deleting them. Without a key, the heap is
+  # a CHeap of run indices keyed by their current line when the extension is available:
+  # lines that compare equal are equal, so the order among them does not matter. With a key,
+  # ties must go to the earlier run, and it is a binary heap of run indices ordered by
+  # [key, run index].
+  def self.external_sort_merge(runs, output, key)
+    lines = runs.map { |run| external_sort_read(run) }
+    if !key && defined?(Containers::CHeap)
+      heap = Containers::CHeap.new([], :min)
+      lines.each_with_index { |line, i| heap.push(line, i) if line }
+      until heap.empty?
+        i = heap.pop
+        output.write(lines[i], "\n")
+        heap.push(lines[i], i) if (lines[i] = external_sort_read(runs[i]))
+      end
+      return runs.each { |run| run.close! }
+    end
+
+    keys = key ? lines.map { |line| line && key.call(line) } : lines
+    heap = (0...runs.size).select { |i| lines[i] }
+    before = lambda do |i, j|
+      cmp = keys[i] <=> keys[j]
+      cmp == 0 ? i < j : cmp == -1
+    end
+    (heap.size / 2 - 1).downto(0) { |i| external_sort_sift_down(heap, i, before) }
+    until heap.empty?
+      i = heap[0]
+      output.write(lines[i], "\n")
+      lines[i] = external_sort_read(runs[i])
+      if lines[i]
+        keys[i] = key.call(lines[i]) if key
+      else
+        heap[0] = heap.last
+        heap.pop
+      end
+      external_sort_sift_down(heap, 0, before) unless heap.empty?
+    end
+    runs.each { |run| run.close! }
+  end
+
+  # The next line of a run without its newline, or nil at the end
+  def self.external_sort_read(run)
+    line = run.gets
+    line && line.chomp("\n")
+  end
+
+  def self.external_sort_sift_down(heap, i, before)
+    top = heap[i]
+    while (child = 2 * i + 1) < heap.size
+      child += 1 if child + 1 < heap.size && before.call(heap[child + 1], heap[child])
+      break unless before.call(heap[child], top)
+      heap[i] = heap[child]
+      i = child
+    end
+    heap[i] = top
+  end
 end
 
@@ -0,0 +1,85 @@
+require 'containers/trie'
+
+begin
+  require 'CBKTree'
+rescue LoadError
+end
+
+=begin rdoc
+    A FuzzyIndex answers "which words are within n edits of this term?" over a fixed
+    dictionary without comparing the term against every entry, as a loop over
+    Algorithms::String.levenshtein_dist would.
+
+    Two backends are available:
+
+    * :bk_tree - a Burkhard-Keller tree (Containers::CBKTree, C extension). Distances from
+      the term to visited words prune whole subtrees by the triangle inequality, and each
+      distance is computed with the bit-parallel kernel behind levenshtein_top_k.
+    * :trie - a Levenshtein automaton walked over a Containers::Trie, which abandons a
+      prefix as soon as no completion of it can be within range.
+
+    The BK-tree is the default when the C extension was built; otherwise the trie is used.
+    The BK-tree counts distances in bytes, so changing a two-byte character costs two edits.
+    The trie counts them in characters, whether Containers::Trie is the C or the Ruby trie.
+
+      index = Containers::FuzzyIndex.new(%w(hello help hell jello yellow))
+      index.search("hallo", 1) #=> [[1, "hello"]]
+      index.search("hallo", 2) #=> [[1, "hello"], [2, "hell"], [2, "jello"]]
+=end
+class Containers::FuzzyIndex
+  attr_reader :backend
+
+  # Builds an index from any enumerable of strings. Options:
+  #
+  # :backend - :bk_tree or :trie
+  def initialize(words, options={})
+    @backend = options[:backend] || (defined?(Containers::CBKTree) ? :bk_tree : :trie)
+    case @backend
+    when :bk_tree
+      raise ArgumentError, "the :bk_tree backend needs the CBKTree C extension" unless defined?(Containers::CBKTree)
+      @index = Containers::CBKTree.new
+      words.each { |word| @index.push(word.to_s) }
+      @size = @index.size
+    when :trie
+      @index = Containers::Trie.new
+      @size = 0
+      words.each do |word|
+        word = word.to_s
+        next if @index.has_key?(word)
+        @index.push(word, true)
+        @size += 1
+      end
+    else
+      raise ArgumentError, "unknown backend #{@backend.inspect}"
+    end
+  end
+
+  # Returns a sorted array of [distance, word] pairs for every word within max_dist
+  # edits of term.
+  #
+  #   index = Containers::FuzzyIndex.new(%w(hello help hell))
+  #   index.search("help", 1) #=> [[0, "help"], [1, "hell"]]
+  def search(term, max_dist)
+    if @backend == :bk_tree
+      @index.search(term.to_s, max_dist).sort!
+    else
+      @index.fuzzy_search(term, max_dist)
+    end
+  end
+
+  # Returns true if the exact word is in the index.
+  def has_key?(word)
+    @index.has_key?(word.to_s)
+  end
+  alias_method :include?, :has_key?
+
+  # Returns the number of distinct words in the index.
+  def size
+    @size
+  end
+  alias_method :length, :size
+
+  def empty?
+    @size == 0
+  end
+end
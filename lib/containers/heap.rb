@@ -7,9 +7,12 @@
     Containers::MaxHeap and Containers::MinHeap that return the largest and smallest items on
     each invocation, respectively.
     
-    This library implements a Fibonacci heap, which allows O(1) complexity for most methods.
+    Containers::RubyHeap is a Fibonacci heap, which allows O(1) complexity for most methods.
+    When the CHeap extension is available, Containers::Heap (and with it MaxHeap, MinHeap and
+    PriorityQueue) is Containers::CHeap instead: an indexed 4-ary heap in a flat C array, with
+    O(log n) push, pop, delete and change_key and native comparison of Integer and Float keys.
 =end
-class Containers::Heap
+class Containers::RubyHeap
   
   # call-seq:
   #     size -> int
@@ -21,11 +24,12 @@ class Containers::Heap
   alias_method :length, :size
   
   # call-seq:
-  #     Heap.new(optional_array) { |x, y| optional_comparison_fn } -> new_heap
+  #     Heap.new(optional_array, order = :min) { |x, y| optional_comparison_fn } -> new_heap
   #
   # If an optional array is passed, the entries in the array are inserted into the heap with
-  # equal key and value fields. Also, an optional block can be passed to define the function
-  # that maintains heap property. For example, a min-heap can be created with:
+  # equal key and value fields. The order can be :min or :max; alternatively, an optional block
+  # can be passed to define the function that maintains heap property. For example, a min-heap
+  # can be created with:
   #
   #     minheap = Heap.new { |x, y| (x <=> y) == -1 }
   #     minheap.push(6)
@@ -34,8 +38,9 @@ class Containers::Heap
   #
   # Thus, smaller elements will be parent nodes. The heap defaults to a min-heap if no block
   # is given.
-  def initialize(ary=[], &block)
-    @compare_fn = block || lambda { |x, y| (x <=> y) == -1 }
+  def initialize(ary=[], order=nil, &block)
+    raise ArgumentError, "order must be :min or :max" unless [nil, :min, :max].include?(order)
+    @compare_fn = block || (order == :max ? lambda { |x, y| (x <=> y) == 1 } : lambda { |x, y| (x <=> y) == -1 })
     @next = nil
     @size = 0
     @stored = {}
@@ -58,7 +63,7 @@ class Containers::Heap
   #     heap.pop #=> "Cat"
   #     heap.pop #=> 2
   def push(key, value=key)
-    raise ArgumentError, "Heap keys must not be nil." unless key
+    raise ArgumentError, "Heap keys must not be nil or false." unless key
     node = Node.new(key, value)
     # Add new node to the left of the @next node
     if @next
@@ -160,7 +165,7 @@ class Containers::Heap
   #     heap.size #=> 8
   #     heap.pop #=> 1
   def merge!(otherheap)
-    raise ArgumentError, "Trying to merge a heap with something not a heap" unless otherheap.kind_of? Containers::Heap
+    raise ArgumentError, "Trying to merge a heap with something not a heap" unless otherheap.kind_of? Containers::RubyHeap
     other_root = otherheap.instance_variable_get("@next")
     if other_root
       @stored = @stored.merge(otherheap.instance_variable_get("@stored")) { |key, a, b| (a << b).flatten }
@@ -409,6 +414,13 @@ class Containers::Heap
   
 end
 
+begin
+  require 'CHeap'
+  Containers::Heap = Containers::CHeap
+rescue LoadError # C Version could not be found, try ruby version
+  Containers::Heap = Containers::RubyHeap
+end
+
 # A MaxHeap is a heap where the items are returned in descending order of key value.
 class Containers::MaxHeap < Containers::Heap
   
@@ -416,13 +428,13 @@ class Containers::MaxHeap < Containers::Heap
   #     MaxHeap.new(ary) -> new_heap
   #
   # Creates a new MaxHeap with an optional array parameter of items to insert into the heap.
-  # A MaxHeap is created by calling Heap.new { |x, y| (x <=> y) == 1 }, so this is a convenience class.
+  # A MaxHeap is created by calling Heap.new(ary, :max), so this is a convenience class.
   #
   #     maxheap = MaxHeap.new([1, 2, 3, 4])
   #     maxheap.pop #=> 4
   #     maxheap.pop #=> 3
   def initialize(ary=[])
-    super(ary) { |x, y| (x <=> y) == 1 }
+    super(ary, :max)
   end
   
   # call-seq:
@@ -458,13 +470,13 @@ class Containers::MinHeap < Containers::Heap
   #     MinHeap.new(ary) -> new_heap
   #
   # Creates a new MinHeap with an optional array parameter of items to insert into the heap.
-  # A MinHeap is created by calling Heap.new { |x, y| (x <=> y) == -1 }, so this is a convenience class.
+  # A MinHeap is created by calling Heap.new(ary, :min), so this is a convenience class.
   #
   #     minheap = MinHeap.new([1, 2, 3, 4])
   #     minheap.pop #=> 1
   #     minheap.pop #=> 2
   def initialize(ary=[])
-    super(ary) { |x, y| (x <=> y) == -1 }
+    super(ary, :min)
   end
   
   # call-seq:
@@ -14,30 +14,130 @@
     
     Then, query on the tree:
     
-      puts kd.find_nearest([0, 0], 2) => [[5, 2], [9, 1]]
+      puts kd.find_nearest([0, 0], 2) => [[5, 2], [25, 0]]
       
-    The result is an array of [distance, id] pairs. There seems to be a bug in this version.
+    The result is an array of [distance, id] pairs, where distance is the squared Euclidean
+    distance. Points at the same distance come in the order they were passed in.
       
     Note that the point queried on does not have to exist in the tree. However, if it does exist,
     it will be returned.
 
+    The tree can also find every point within a radius (within_radius, count_within) or inside
+    an axis-aligned box (in_box). find_nearest_many answers a whole batch of nearest neighbour
+    queries at once; the C tree spreads them over native threads that run without the GVL.
+
+    Points can be added, moved and removed with insert, update and delete without rebuilding
+    the whole tree. The C tree keeps a logarithmic forest of static trees, merging small ones
+    as points arrive, and rebuilds a tree once half of its points are deleted.
+
+    Containers::RubyKDTree is a tree of Struct nodes. When the CKDTree extension is available,
+    Containers::KDTree is Containers::CKDTree instead, which keeps all coordinates in one array
+    of doubles laid out in tree order and builds in O(n log n) by median selection.
+
 =end
 
-class Containers::KDTree
-  Node = Struct.new(:id, :coords, :left, :right)
+class Containers::RubyKDTree
+  Node = Struct.new(:id, :coords, :left, :right, :seq, :deleted)
   
   # Points is a hash of id => [coord, coord] pairs.
   def initialize(points)
     raise "must pass in a hash" unless points.kind_of?(Hash)
-    @dimensions = points[ points.keys.first ].size
-    @root = build_tree(points.to_a)
+    @size = points.size
+    @dead = 0
+    @next_seq = points.size
+    @dimensions = @size == 0 ? 0 : points[ points.keys.first ].size
+    @index = {}
+    @root = build_tree(points.each_with_index.map { |(id, coords), seq| [id, coords, seq] })
     @nearest = []
   end
+
+  # Adds a point, or moves it if id is already in the tree. New points are hung below the
+  # existing ones; deleted and moved points are left behind as tombstones. The whole tree is
+  # rebuilt once tombstones outnumber live points or an insertion lands too deep.
+  def insert(id, coords)
+    @dimensions = coords.size if @size == 0 && @dead == 0
+    check_dimensions(coords)
+    old = @index[id]
+    if old
+      old.deleted = true
+      @dead += 1
+    else
+      @size += 1
+    end
+    node = Node.new(id, coords, nil, nil, old ? old.seq : (@next_seq += 1), false)
+    @index[id] = node
+    depth = insert_node(node)
+    rebuild if @dead > @size || depth > 2 * Math.log2(@size + @dead) + 2
+    self
+  end
+
+  # Moves the point id to coords. Returns false, and changes nothing, if there is no such point.
+  def update(id, coords)
+    return false unless @index.has_key?(id)
+    insert(id, coords)
+    true
+  end
+
+  # Removes the point id. Returns false if there is no such point.
+  def delete(id)
+    node = @index.delete(id)
+    return false unless node
+    node.deleted = true
+    @dead += 1
+    @size -= 1
+    rebuild if @dead > @size
+    true
+  end
   
-  # Find k closest points to given coordinates 
+  # Find k closest points to given coordinates, as [squared distance, id] pairs
   def find_nearest(target, k_nearest)
+    return [] if @size == 0 || k_nearest <= 0
+    check_dimensions(target)
     @nearest = []
     nearest(@root, target, k_nearest, 0)
+    @nearest.map { |d, seq, id| [d, id] }
+  end
+
+  # Find k closest points to each of the targets. The Ruby tree answers them one after
+  # another; threads is only used by the C tree.
+  def find_nearest_many(targets, k_nearest, threads: nil)
+    targets.map { |target| find_nearest(target, k_nearest) }
+  end
+
+  # Find every point within radius of target, as [squared distance, id] pairs, closest first
+  def within_radius(target, radius)
+    raise ArgumentError, "radius must not be negative" unless radius >= 0
+    return [] if @size == 0
+    check_dimensions(target)
+    results = []
+    radius_recursive(@root, target, radius * radius, 0, results)
+    results.sort.map { |d, seq, id| [d, id] }
+  end
+
+  # Count the points within radius of target
+  def count_within(target, radius)
+    within_radius(target, radius).size
+  end
+
+  # Find the ids of every point with min[i] <= coords[i] <= max[i] on each axis, in the order
+  # the points were passed in
+  def in_box(min, max)
+    return [] if @size == 0
+    check_dimensions(min)
+    check_dimensions(max)
+    results = []
+    box_recursive(@root, min, max, 0, results)
+    results.sort.map { |seq, id| id }
+  end
+
+  # Returns the number of points in the tree.
+  def size
+    @size
+  end
+
+  # Returns the number of coordinates of each point, or 0 for an empty tree.
+  def dimensions
+    @dimensions
   end
   
   # points is an array
@@ -46,32 +146,70 @@ class Containers::KDTree
     
     axis = depth % @dimensions
     
-    points.sort! { |a, b| a.last[axis] <=> b.last[axis] }
+    points.sort! { |a, b| a[1][axis] <=> b[1][axis] }
     median = points.size / 2
     
-    node = Node.new(points[median].first, points[median].last, nil, nil)
+    node = Node.new(points[median][0], points[median][1], nil, nil, points[median][2], false)
+    @index[node.id] = node
     node.left = build_tree(points[0...median], depth+1)
     node.right = build_tree(points[median+1..-1], depth+1)
     node
   end
   private :build_tree
 
+  def rebuild
+    @index, live = {}, @index.values
+    @dead = 0
+    @root = build_tree(live.map { |node| [node.id, node.coords, node.seq] })
+  end
+  private :rebuild
+
+  # Hangs node below the leaf its coordinates lead to and returns its depth
+  def insert_node(node)
+    return (@root = node) && 0 if @root.nil?
+    parent, depth = @root, 0
+    loop do
+      axis = depth % @dimensions
+      depth += 1
+      if node.coords[axis] < parent.coords[axis]
+        return (parent.left = node) && depth if parent.left.nil?
+        parent = parent.left
+      else
+        return (parent.right = node) && depth if parent.right.nil?
+        parent = parent.right
+      end
+    end
+  end
+  private :insert_node
+
+  def check_dimensions(target)
+    if target.size != @dimensions
+      raise ArgumentError, "expected #{@dimensions} coordinates, got #{target.size}"
+    end
+  end
+  private :check_dimensions
+
   # Euclidian distanced, squared, between a node and target coords
   def distance2(node, target)
     return nil if node.nil? or target.nil?
-    c = (node.coords[0] - target[0])
-    d = (node.coords[1] - target[1])
-    c * c + d * d
+    sum = 0
+    node.coords.each_with_index do |c, i|
+      d = c - target[i]
+      sum += d * d
+    end
+    sum
   end
   private :distance2
 
-  # Update array of nearest elements if necessary
+  # Update array of nearest elements if necessary, keeping it sorted by distance and then by
+  # insertion order
   def check_nearest(nearest, node, target, k_nearest)
-    d = distance2(node, target) 
-    if nearest.size < k_nearest || d < nearest.last[0]
+    return nearest if node.deleted
+    entry = [distance2(node, target), node.seq, node.id]
+    if nearest.size < k_nearest || (entry[0, 2] <=> nearest.last[0, 2]) < 0
       nearest.pop if nearest.size >= k_nearest
-      nearest << [d, node.id]
-      nearest.sort! { |a, b| a[0] <=> b[0] }
+      index = nearest.bsearch_index { |e| (e[0, 2] <=> entry[0, 2]) > 0 }
+      nearest.insert(index || nearest.size, entry)
     end
     nearest
   end
@@ -98,7 +236,7 @@ class Containers::KDTree
   
     # See if we have to check other side
     if further
-      if @nearest.size < k_nearest || (target[axis] - node.coords[axis])**2 < @nearest.last[0]
+      if @nearest.size < k_nearest || (target[axis] - node.coords[axis])**2 <= @nearest.last[0]
         nearest(further, target, k_nearest, depth+1)
       end
     end
@@ -106,5 +244,33 @@ class Containers::KDTree
     @nearest = check_nearest(@nearest, node, target, k_nearest)
   end
   private :nearest
+
+  # Points on the splitting plane can be in either subtree
+  def radius_recursive(node, target, radius2, depth, results)
+    return if node.nil?
+    d = distance2(node, target)
+    results << [d, node.seq, node.id] if d <= radius2 && !node.deleted
+    diff = target[depth % @dimensions] - node.coords[depth % @dimensions]
+    radius_recursive(node.left, target, radius2, depth+1, results) if diff <= 0 || diff * diff <= radius2
+    radius_recursive(node.right, target, radius2, depth+1, results) if diff >= 0 || diff * diff <= radius2
+  end
+  private :radius_recursive
+
+  def box_recursive(node, min, max, depth, results)
+    return if node.nil?
+    inside = node.coords.each_with_index.all? { |c, i| min[i] <= c && c <= max[i] }
+    results << [node.seq, node.id] if inside && !node.deleted
+    axis = depth % @dimensions
+    box_recursive(node.left, min, max, depth+1, results) if min[axis] <= node.coords[axis]
+    box_recursive(node.right, min, max, depth+1, results) if max[axis] >= node.coords[axis]
+  end
+  private :box_recursive
   
 end
+
+begin
+  require 'CKDTree'
+  Containers::KDTree = Containers::CKDTree
+rescue LoadError # C Version could not be found, try ruby version
+  Containers::KDTree = Containers::RubyKDTree
+end
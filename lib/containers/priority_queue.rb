@@ -7,15 +7,32 @@ require 'containers/heap'
     Priority Queues are often used in graph problems, such as Dijkstra's Algorithm for shortest
     path, and the A* search algorithm for shortest path.
     
-    This container is implemented using the Fibonacci heap included in the Collections library.
+    This container is implemented using Containers::Heap, the native indexed heap when the CHeap
+    extension is available and the Fibonacci heap otherwise.
 =end
 class Containers::PriorityQueue
   
-  # Create a new, empty PriorityQueue
-  def initialize(&block)
-    # We default to a priority queue that returns the largest value
-    block ||= lambda { |x, y| (x <=> y) == 1 }
-    @heap = Containers::Heap.new(&block)
+  # Create a new, empty PriorityQueue. By default the highest priority comes out first; a block
+  # can define the order instead, as for Containers::Heap.
+  #
+  # Options:
+  #   :monotone_int - priorities are non-negative Integers, and no priority pushed is ever smaller
+  #                   than the last one popped, as in Dijkstra's algorithm. The lowest priority
+  #                   comes out first, and the queue is a Containers::RadixHeap when the CHeap
+  #                   extension is available (a Containers::MinHeap otherwise).
+  #
+  #   q = Containers::PriorityQueue.new(:monotone_int => true)
+  #   q.push("Delaware", 30)
+  #   q.push("Alaska", 50)
+  #   q.pop #=> "Delaware"
+  def initialize(options={}, &block)
+    if options[:monotone_int]
+      raise ArgumentError, "monotone_int queues can't take an ordering block" if block
+      @heap = defined?(Containers::RadixHeap) ? Containers::RadixHeap.new : Containers::MinHeap.new
+    else
+      # We default to a priority queue that returns the largest value
+      @heap = block ? Containers::Heap.new(&block) : Containers::MaxHeap.new
+    end
   end
   
   # Returns the number of elements in the queue.
@@ -16,16 +16,44 @@ require 'containers/stack'
     
     Most methods have O(log n) complexity.
 
+    A map can be written to any IO with dump and read back with Containers::RBTreeMap.load. The C
+    version builds the tree straight from the sorted pairs instead of inserting them, and its
+    files can also be opened with Containers::MappedTreeMap, which searches them in place.
+
+    union, intersection and difference return a new map and leave both maps as they are. A map can
+    also be cut in two with split and put back together with join, which move the nodes and so leave
+    the other map empty. The C version works on the trees themselves: combining maps of m and n
+    pairs takes O(m log(n / m + 1)), with the result sharing its nodes with both maps as a snapshot
+    does, and split and join take O(log n).
+
+    snapshot returns a frozen map that later writes do not change, which readers can iterate without
+    holding a lock while the map is written to. The C version shares its nodes with the snapshot in
+    O(1) and copies them only as writes reach them; the Ruby version copies the map.
+
+    new(order: :desc) keeps the keys in descending order, which min_key, max_key, each and the other
+    ordered methods then follow. new(key_by: proc) orders the keys by what proc maps them to, such as
+    a Struct by an Array of its fields. The C version calls key_by once as a key goes in and keeps
+    the result in the node, and compares Fixnums, Strings and Arrays of them without calling <=>, so
+    composite keys cost little more than plain ones; the Ruby version calls key_by on every
+    comparison.
+
 =end
 class Containers::RubyRBTreeMap
   include Enumerable
   
   attr_accessor :height_black
   
-  # Create and initialize a new empty TreeMap.
-  def initialize
+  # Create and initialize a new empty TreeMap. order is :asc or :desc, and key_by, if given, maps
+  # each key to what it is ordered by.
+  #
+  #   by_date = Containers::RBTreeMap.new(key_by: ->(d) { [d.year, d.month, d.day] })
+  def initialize(order: :asc, key_by: nil)
+    raise ArgumentError, "order must be :asc or :desc" unless order.nil? || order == :asc || order == :desc
+    raise ArgumentError, "key_by must respond to call" unless key_by.nil? || key_by.respond_to?(:call)
     @root = nil
     @height_black = 0
+    @descending = order == :desc
+    @key_by = key_by
   end
   
   # Insert an item with an associated key into the TreeMap, and returns the item inserted
@@ -197,6 +225,112 @@ class Containers::RubyRBTreeMap
     end
   end
   
+  # Returns a frozen copy of the map that later writes do not change. The snapshot of a frozen map
+  # is the map itself.
+  #
+  # Complexity: O(n log n)
+  #
+  #   view = map.snapshot
+  #   map.push("MA", "Massachusetts")
+  #   view.has_key?("MA") #=> false
+  def snapshot
+    return self if frozen?
+    snapshot = copy
+    snapshot.freeze_nodes
+    snapshot.freeze
+  end
+  
+  # Moves the pairs with keys below key into a new map and the rest into another, and returns
+  # both. This map is left empty.
+  #
+  # Complexity: O(n)
+  #
+  #   lo, hi = map.split("GA")
+  def split(key)
+    lo, hi = new_like, new_like
+    take_pairs.each { |k, v| (compare(k, key) < 0 ? lo : hi).push(k, v) }
+    [lo, hi]
+  end
+  
+  # Moves all pairs of other into this map and leaves other empty. All keys of one map must sort
+  # before all keys of the other, or ArgumentError is raised.
+  #
+  # Complexity: O(m log(n + m))
+  def join(other)
+    check_other(other)
+    raise FrozenError, "can't modify frozen #{self.class}" if frozen? || other.frozen?
+    if !empty? && !other.empty? && compare(max_key, other.min_key) >= 0 && compare(other.max_key, min_key) >= 0
+      raise ArgumentError, "the keys of the maps overlap"
+    end
+    other.take_pairs.each { |k, v| push(k, v) }
+    self
+  end
+  
+  # Returns a new map with the pairs of this map and other. For a key that both maps have, the
+  # value is other's, or the result of the block if one is given. Neither map changes.
+  #
+  # Complexity: O((n + m) log(n + m))
+  #
+  #   a.union(b) { |key, mine, theirs| mine + theirs }
+  def union(other)
+    check_other(other)
+    result = copy
+    other.to_a.each do |k, v|
+      v = yield(k, get(k), v) if block_given? && has_key?(k)
+      result.push(k, v)
+    end
+    result
+  end
+  
+  # Returns a new map with the keys that both maps have. The values are other's, or the result of
+  # the block if one is given. Neither map changes.
+  #
+  # Complexity: O(m log n)
+  def intersection(other)
+    check_other(other)
+    result = new_like
+    other.to_a.each do |k, v|
+      next unless has_key?(k)
+      v = yield(k, get(k), v) if block_given?
+      result.push(k, v)
+    end
+    result
+  end
+  
+  # Returns a new map with the pairs of this map whose keys other does not have. Neither map
+  # changes.
+  #
+  # Complexity: O(n log(n + m))
+  def difference(other)
+    check_other(other)
+    result = new_like
+    each { |k, v| result.push(k, v) unless other.has_key?(k) }
+    result
+  end
+  
+  # Writes the RBTreeMap to io so that it can be read back with load. The Ruby RBTreeMap writes its
+  # pairs with Marshal; the C version writes its own format, which Containers::MappedTreeMap can
+  # also search in place, and the two are not interchangeable. A map with key_by raises
+  # ArgumentError.
+  #
+  # Complexity: O(n)
+  #
+  #   File.open("states.map", "wb") { |f| map.dump(f) }
+  def dump(io)
+    raise ArgumentError, "can't dump a map ordered by key_by" if @key_by
+    Marshal.dump(to_a, io)
+    self
+  end
+  
+  # Returns a new RBTreeMap with the pairs that dump wrote to io, in the given order.
+  #
+  #   map = File.open("states.map", "rb") { |f| Containers::RBTreeMap.load(f) }
+  def self.load(io, order: :asc)
+    map = new(order: order)
+    Marshal.load(io).each { |key, value| map.push(key, value) }
+    map
+  end
+  
   class Node # :nodoc: all
     attr_accessor :color, :key, :value, :left, :right, :size, :height
     def initialize(key, value)
@@ -287,20 +421,71 @@ class Containers::RubyRBTreeMap
     end
   end
 
+  # The order of the map, which the maps made from it share
+  def ordering
+    [@descending, @key_by]
+  end
+  protected :ordering
+  
+  # Empties the map and returns its pairs in order
+  def take_pairs
+    pairs = to_a
+    @root = nil
+    @height_black = 0
+    pairs
+  end
+  protected :take_pairs
+  
+  # Freezes the nodes as well, as writes change them before they reach @root
+  def freeze_nodes(node = @root)
+    return unless node
+    freeze_nodes(node.left)
+    freeze_nodes(node.right)
+    node.freeze
+  end
+  protected :freeze_nodes
+  
+  def check_other(other)
+    raise TypeError, "wrong argument type #{other.class} (expected #{self.class})" unless other.is_a?(self.class)
+    raise ArgumentError, "can't combine a map with itself" if other.equal?(self)
+    raise ArgumentError, "can't combine maps that order their keys differently" unless other.ordering == ordering
+  end
+  private :check_other
+  
+  def new_like
+    self.class.new(order: @descending ? :desc : :asc, key_by: @key_by)
+  end
+  private :new_like
+  
+  def copy
+    copy = new_like
+    each { |key, value| copy.push(key, value) }
+    copy
+  end
+  private :copy
+  
+  def compare(a, b)
+    a, b = @key_by.call(a), @key_by.call(b) if @key_by
+    cmp = a <=> b
+    raise ArgumentError, "comparison of #{a.class} with #{b.class} failed" if cmp.nil?
+    @descending ? -cmp : cmp
+  end
+  private :compare
+  
   def delete_recursive(node, key)
     return nil, nil if node.nil?
-    if (key <=> node.key) == -1
+    if compare(key, node.key) == -1
       node.move_red_left if ( node.left && !isred(node.left) && !isred(node.left.left) )
       node.left, result = delete_recursive(node.left, key)
     else
       node.rotate_right if isred(node.left)
-      if ( ( (key <=> node.key) == 0) && node.right.nil? )
+      if ( (compare(key, node.key) == 0) && node.right.nil? )
         return nil, node.value
       end
       if ( node.right && !isred(node.right) && !isred(node.right.left) )
         node.move_red_right
       end
-      if (key <=> node.key) == 0
+      if compare(key, node.key) == 0
         result = node.value
         node.value = get_recursive(node.right, min_recursive(node.right))
         node.key = min_recursive(node.right)
@@ -342,7 +527,7 @@ class Containers::RubyRBTreeMap
   
   def get_recursive(node, key)
     return nil if node.nil?
-    case key <=> node.key
+    case compare(key, node.key)
     when  0 then return node.value
     when -1 then return get_recursive(node.left, key)
     when  1 then return get_recursive(node.right, key)
@@ -367,7 +552,7 @@ class Containers::RubyRBTreeMap
   def insert(node, key, value)
     return Node.new(key, value) unless node
 
-    case key <=> node.key
+    case compare(key, node.key)
     when  0 then node.value = value
     when -1 then node.left = insert(node.left, key, value)
     when  1 then node.right = insert(node.right, key, value)
@@ -12,14 +12,27 @@ require 'containers/stack'
     Splay trees have amortized O(log n) performance for most methods, but are O(n) worst case. This happens
     when keys are added in sorted order, causing the tree to have a height of the number of items added.
     
+    A map can be written to any IO with dump and read back with Containers::SplayTreeMap.load. The C
+    version loads the sorted pairs straight into a balanced tree, and its files can also be opened
+    with Containers::MappedTreeMap, which searches them in place.
+    
+    new(order: :desc) keeps the keys in descending order, and new(key_by: proc) orders them by what
+    proc maps them to. The C version calls key_by once per key and keeps the result in the node, and
+    compares Fixnums, Strings and Arrays of them without calling <=>.
+    
 =end
 class Containers::RubySplayTreeMap
   include Enumerable
   
   Node = Struct.new(:key, :value, :left, :right)
   
-  # Create and initialize a new empty SplayTreeMap.
-  def initialize
+  # Create and initialize a new empty SplayTreeMap. order is :asc or :desc, and key_by, if given,
+  # maps each key to what it is ordered by.
+  def initialize(order: :asc, key_by: nil)
+    raise ArgumentError, "order must be :asc or :desc" unless order.nil? || order == :asc || order == :desc
+    raise ArgumentError, "key_by must respond to call" unless key_by.nil? || key_by.respond_to?(:call)
+    @descending = order == :desc
+    @key_by = key_by
     @size = 0
     clear
   end
@@ -39,7 +52,7 @@ class Containers::RubySplayTreeMap
     end
     splay(key)
     
-    cmp = (key <=> @root.key)
+    cmp = compare(key, @root.key)
     if cmp == 0
       @root.value = value
       return value
@@ -117,7 +130,7 @@ class Containers::RubySplayTreeMap
     return nil if @root.nil?
     
     splay(key)
-    (@root.key <=> key) == 0 ? @root.value : nil
+    compare(key, @root.key) == 0 ? @root.value : nil
   end
   alias_method :[], :get
   
@@ -171,7 +184,7 @@ class Containers::RubySplayTreeMap
     return nil if @root.nil?
     deleted = nil
     splay(key)
-    if (key <=> @root.key) == 0 # The key exists
+    if compare(key, @root.key) == 0 # The key exists
       deleted = @root.value
       if @root.left.nil?
         @root = @root.right
@@ -206,6 +219,29 @@ class Containers::RubySplayTreeMap
     end
   end
   
+  # Writes the SplayTreeMap to io so that it can be read back with load. The Ruby SplayTreeMap
+  # writes its pairs with Marshal; the C version writes its own format, which
+  # Containers::MappedTreeMap can also search in place, and the two are not interchangeable.
+  # A map with key_by raises ArgumentError.
+  #
+  # Complexity: O(n)
+  #
+  #   File.open("states.map", "wb") { |f| map.dump(f) }
+  def dump(io)
+    raise ArgumentError, "can't dump a map ordered by key_by" if @key_by
+    Marshal.dump(to_a, io)
+    self
+  end
+  
+  # Returns a new SplayTreeMap with the pairs that dump wrote to io, in the given order.
+  #
+  #   map = File.open("states.map", "rb") { |f| Containers::SplayTreeMap.load(f) }
+  def self.load(io, order: :asc)
+    map = new(order: order)
+    Marshal.load(io).each { |key, value| map.push(key, value) }
+    map
+  end
+  
   # Moves a key to the root, updating the structure in each step.
   def splay(key)
     l, r = @header, @header
@@ -213,9 +249,9 @@ class Containers::RubySplayTreeMap
     @header.left, @header.right = nil, nil
     
     loop do
-      if (key <=> t.key) == -1
+      if compare(key, t.key) == -1
         break unless t.left
-        if (key <=> t.left.key) == -1
+        if compare(key, t.left.key) == -1
           y = t.left
           t.left = y.right
           y.right = t
@@ -225,9 +261,9 @@ class Containers::RubySplayTreeMap
         r.left = t
         r = t
         t = t.left
-      elsif (key <=> t.key) == 1
+      elsif compare(key, t.key) == 1
         break unless t.right
-        if (key <=> t.right.key) == 1
+        if compare(key, t.right.key) == 1
           y = t.right
           t.right = y.left
           y.left = t
@@ -249,6 +285,14 @@ class Containers::RubySplayTreeMap
   end
   private :splay
   
+  def compare(a, b)
+    a, b = @key_by.call(a), @key_by.call(b) if @key_by
+    cmp = a <=> b
+    raise ArgumentError, "comparison of #{a.class} with #{b.class} failed" if cmp.nil?
+    @descending ? -cmp : cmp
+  end
+  private :compare
+  
   # Recursively determine height
   def height_recursive(node)
     return 0 if node.nil?
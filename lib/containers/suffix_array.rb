@@ -5,8 +5,23 @@
     that substrings can be found in O(m log n) time, where m is the length of the substring to search for
     and n is the total number of substrings.
 
+    Containers::RubySuffixArray stores every suffix as its own String. When the CSuffixArray
+    extension is available, Containers::SuffixArray is Containers::CSuffixArray instead, which
+    builds the array of suffix offsets in linear time with SA-IS and keeps nothing else but the
+    string, so it can index strings of hundreds of megabytes.
+
+    Both work on the bytes of the string, whatever its encoding: offsets returned by #locate
+    are byte offsets, and #longest_repeated_substring and #longest_common_substring return
+    ASCII-8BIT strings, since a run of repeated bytes may start or end inside a character.
+
+    The same extension provides Containers::FMIndex, which is built from the suffix array but
+    keeps neither it nor the string, and can still count, locate and extract substrings. Its
+    text takes about as many bits per byte as the text's zero-order entropy, plus an eighth,
+    and its samples another 8 / sample_rate bytes per byte; at the default sample_rate of 64,
+    an index of source code or logs is 80 to 90 percent of the size of the text. It can be
+    saved to a file and mapped back into memory with Containers::FMIndex.load.
 =end
-class Containers::SuffixArray
+class Containers::RubySuffixArray
   # Creates a new SuffixArray with a given string. Object of any class implementing a #to_s method can
   # be passed in, such as integers.
   #
@@ -19,7 +34,7 @@ class Containers::SuffixArray
   #   number[1] #=> true
   #   number[13] #=> false 
   def initialize(string)
-    string = string.to_s
+    string = string.to_s.b
     raise ArgumentError, "SuffixArray needs to be initialized with a non-empty string" if string.empty?
     @original_string = string
     @suffixes = []
@@ -49,7 +64,7 @@ class Containers::SuffixArray
   #   s_array.has_substring?("racadabra") #=> true
   #   s_array.has_substring?("nope") #=> false
   def has_substring?(substring)
-    substring = substring.to_s
+    substring = substring.to_s.b
     return false if substring.empty?
     substring_length = substring.length-1
     l, r = 0, @suffixes.size-1
@@ -65,4 +80,83 @@ class Containers::SuffixArray
     return false
   end
   alias_method :[], :has_substring?
+
+  # Returns the number of times pattern occurs in the string, overlapping occurrences included.
+  #
+  #   s_array = Containers::SuffixArray.new("abracadabra")
+  #   s_array.count("abra") #=> 2
+  #   s_array.count("a") #=> 5
+  def count(pattern)
+    locate(pattern).size
+  end
+
+  # Returns the byte offsets of every occurrence of pattern in the string, in ascending order.
+  #
+  #   s_array = Containers::SuffixArray.new("abracadabra")
+  #   s_array.locate("abra") #=> [0, 7]
+  def locate(pattern)
+    pattern = pattern.to_s.b
+    return [] if pattern.empty?
+    i = @suffixes.bsearch_index { |suffix| suffix >= pattern } || @suffixes.size
+    offsets = []
+    while i < @suffixes.size && @suffixes[i].start_with?(pattern)
+      offsets << @original_string.length - @suffixes[i].length
+      i += 1
+    end
+    offsets.sort
+  end
+
+  # Returns the longest run of bytes that occurs at least twice in the string, possibly
+  # overlapping itself, or "" if no byte repeats. The result is an ASCII-8BIT string.
+  #
+  #   s_array = Containers::SuffixArray.new("abracadabra")
+  #   s_array.longest_repeated_substring #=> "abra"
+  def longest_repeated_substring
+    best = "".b
+    1.upto(@suffixes.size-1) do |i|
+      len = common_prefix_length(@suffixes[i-1], @suffixes[i])
+      best = @suffixes[i][0, len] if len > best.length
+    end
+    best
+  end
+
+  # Returns the longest run of bytes of the string that also occurs in other, or "" if they
+  # share no byte. The result is an ASCII-8BIT string.
+  #
+  # Complexity: O(n * m)
+  #
+  #   s_array = Containers::SuffixArray.new("abracadabra")
+  #   s_array.longest_common_substring("cadaver") #=> "cada"
+  def longest_common_substring(other)
+    other = other.to_s.b
+    best_len, best_end = 0, 0
+    row = Array.new(other.length + 1, 0)
+    @original_string.each_char.with_index do |char, i|
+      prev = 0
+      other.each_char.with_index do |other_char, j|
+        diag = prev
+        prev = row[j+1]
+        row[j+1] = char == other_char ? diag + 1 : 0
+        if row[j+1] > best_len
+          best_len, best_end = row[j+1], i + 1
+        end
+      end
+    end
+    @original_string[best_end - best_len, best_len]
+  end
+
+  private
+
+  def common_prefix_length(a, b)
+    len = 0
+    len += 1 while len < a.length && len < b.length && a[len] == b[len]
+    len
+  end
+end
+
+begin
+  require 'CSuffixArray'
+  Containers::SuffixArray = Containers::CSuffixArray
+rescue LoadError # C Version could not be found, try ruby version
+  Containers::SuffixArray = Containers::RubySuffixArray
 end
@@ -6,9 +6,16 @@
     Tries are often used for longest prefix algorithms, wildcard matching, and can be used to
     implement a radix sort.
 
-    This implemention is based on a Ternary Search Tree.
+    Containers::RubyTrie is based on a Ternary Search Tree with one node per character. When the
+    CTrie extension is available, Containers::Trie is Containers::CTrie instead: a path-compressed
+    radix tree over the bytes of the keys, with all nodes in one flat array and all edge labels in
+    one byte pool.
+
+    A trie can be written to a file with freeze_to and loaded again with Containers::Trie.open,
+    which returns a frozen trie. CTrie maps the file into memory instead of reading it, so
+    opening is instant and forked processes share the pages.
 =end
-class Containers::Trie  
+class Containers::RubyTrie
   # Create a new, empty Trie.
   #
   #   t = Containers::Trie.new
@@ -101,6 +108,103 @@ class Containers::Trie
     ary.flatten.compact.sort
   end
 
+  # Returns a sorted array of [distance, key] pairs for every key within max_dist edits
+  # (Levenshtein distance) of the parameter string. The trie is walked like a Levenshtein
+  # automaton: each node extends its parent's row of the edit distance matrix by one
+  # character, and a branch is abandoned as soon as every entry in its row exceeds max_dist.
+  #
+  # Complexity: proportional to the number of trie nodes within max_dist of a prefix of string
+  #
+  #   t = Containers::Trie.new
+  #   t.push("Hello", "World")
+  #   t.push("Hilly", "World")
+  #   t.push("Jello", "World")
+  #   t.fuzzy_search("Hallo", 1) #=> [[1, "Hello"]]
+  #   t.fuzzy_search("Hallo", 2) #=> [[1, "Hello"], [2, "Hilly"], [2, "Jello"]]
+  def fuzzy_search(string, max_dist)
+    string = string.to_s
+    raise ArgumentError, "max_dist must not be negative" if max_dist < 0
+    results = []
+    fuzzy_recursive(@root, string, (0..string.length).to_a, "", max_dist, results)
+    results.sort
+  end
+
+  # Calls the block with every key that starts with prefix and its value, in key order. Returns
+  # an Enumerator if no block is given.
+  #
+  # Complexity: O(m + k) for k keys
+  #
+  #   t = Containers::Trie.new
+  #   t.push("Hello", 1)
+  #   t.push("Help", 2)
+  #   t.push("World", 3)
+  #   t.each_with_prefix("Hel").to_a #=> [["Hello", 1], ["Help", 2]]
+  def each_with_prefix(prefix)
+    return to_enum(:each_with_prefix, prefix) { count_prefix(prefix) } unless block_given?
+    prefix = prefix.to_s
+    if prefix.empty?
+      each_recursive(@root, "") { |key, value| yield key, value }
+    else
+      node = find_node(@root, prefix, 0)
+      if node
+        yield prefix, node.value if node.last?
+        each_recursive(node.mid, prefix) { |key, value| yield key, value }
+      end
+    end
+    self
+  end
+
+  # Returns the number of keys that start with prefix.
+  #
+  #   t = Containers::Trie.new
+  #   t.push("Hello", 1)
+  #   t.push("Help", 2)
+  #   t.count_prefix("Hel") #=> 2
+  def count_prefix(prefix)
+    count = 0
+    each_with_prefix(prefix) { count += 1 }
+    count
+  end
+
+  # Returns the k keys starting with prefix that have the highest values, as [key, value] pairs
+  # from the highest value down, and in key order among equal values. Only keys whose values
+  # are Integers or Floats take part.
+  #
+  #   t = Containers::Trie.new
+  #   t.push("Hello", 10)
+  #   t.push("Help", 30)
+  #   t.push("Helium", 20)
+  #   t.top_k_with_prefix("Hel", 2) #=> [["Help", 30], ["Helium", 20]]
+  def top_k_with_prefix(prefix, k)
+    ranked = []
+    each_with_prefix(prefix) do |key, value|
+      ranked << [key, value] if (value.is_a?(Integer) || value.is_a?(Float)) && !(value.is_a?(Float) && value.nan?)
+    end
+    ranked.sort_by { |key, value| [-value, key] }.first([k, 0].max)
+  end
+
+  # Writes the Trie to path so that it can be loaded again with Containers::Trie.open. The
+  # Ruby trie is stored with Marshal; the C trie writes its own format, and the two kinds of
+  # file are not interchangeable.
+  #
+  #   t = Containers::Trie.new
+  #   t.push("Hello", "World")
+  #   t.freeze_to("hello.trie")
+  #   Containers::Trie.open("hello.trie")["Hello"] #=> "World"
+  def freeze_to(path)
+    tmp = "#{path}.#{Process.pid}.tmp"
+    File.binwrite(tmp, Marshal.dump(@root))
+    File.rename(tmp, path)
+    self
+  end
+
+  # Returns a frozen Trie read from a file written by freeze_to.
+  def self.open(path)
+    trie = new
+    trie.instance_variable_set(:@root, Marshal.load(File.binread(path)))
+    trie.freeze
+  end
+
   class Node # :nodoc: all
     attr_accessor :left, :mid, :right, :char, :value, :end
     
@@ -127,12 +231,53 @@ class Containers::Trie
       arr << wildcard_recursive(node.right, string, index, prefix)
     end
     if (char.chr == "*" || char.chr == "." || char == node.char)
-      arr << "#{prefix}#{node.char.chr}" if node.last?
+      arr << "#{prefix}#{node.char.chr}" if node.last? && index == string.length - 1
       arr << wildcard_recursive(node.mid, string, index+1, prefix + node.char.chr)
     end
     arr
   end
   
+  def fuzzy_recursive(node, string, row, prefix, max_dist, results)
+    return if node.nil?
+    fuzzy_recursive(node.left, string, row, prefix, max_dist, results)
+    fuzzy_recursive(node.right, string, row, prefix, max_dist, results)
+
+    char = node.char.chr
+    new_row = [row[0] + 1]
+    1.upto(string.length) do |j|
+      cost = string[j-1] == char ? 0 : 1
+      new_row << [new_row[j-1] + 1, row[j] + 1, row[j-1] + cost].min
+    end
+    results << [new_row.last, prefix + char] if node.last? && new_row.last <= max_dist
+    if new_row.min <= max_dist
+      fuzzy_recursive(node.mid, string, new_row, prefix + char, max_dist, results)
+    end
+  end
+
+  # The node for the last character of string, whether or not a key ends there
+  def find_node(node, string, index)
+    return nil if node.nil?
+    char = string[index]
+    if (char < node.char)
+      find_node(node.left, string, index)
+    elsif (char > node.char)
+      find_node(node.right, string, index)
+    elsif (index < string.length-1)
+      find_node(node.mid, string, index+1)
+    else
+      node
+    end
+  end
+
+  def each_recursive(node, prefix, &block)
+    return if node.nil?
+    each_recursive(node.left, prefix, &block)
+    key = prefix + node.char
+    yield key, node.value if node.last?
+    each_recursive(node.mid, key, &block)
+    each_recursive(node.right, prefix, &block)
+  end
+
   def prefix_recursive(node, string, index)
     return 0 if node.nil? || index == string.length
     len = 0
@@ -179,4 +324,11 @@ class Containers::Trie
       return node.last? ? [node.char, node.value] : nil
     end
   end
-end
\ No newline at end of file
+end
+
+begin
+  require 'CTrie'
+  Containers::Trie = Containers::CTrie
+rescue LoadError # C Version could not be found, try ruby version
+  Containers::Trie = Containers::RubyTrie
+end
@@ -0,0 +1,69 @@
+$: << File.join(File.expand_path(File.dirname(__FILE__)), '..', 'lib')
+require 'algorithms'
+
+shared_examples "fuzzy index" do
+  it "should find words within the given distance" do
+    expect(@index.search("hallo", 0)).to eql([])
+    expect(@index.search("hallo", 1)).to eql([[1, "hello"]])
+    expect(@index.search("hallo", 2)).to eql([[1, "hello"], [2, "hell"], [2, "jello"]])
+    expect(@index.search("hell", 0)).to eql([[0, "hell"]])
+  end
+
+  it "should ignore duplicate words" do
+    expect(@index.size).to eql(6)
+  end
+
+  it "should has_key? exact words only" do
+    expect(@index.has_key?("yellow")).to be true
+    expect(@index.has_key?("yello")).to be false
+  end
+
+  it "should agree with a brute force scan" do
+    words = Array.new(500) { Array.new(3 + rand(6)) { %w(a b c d)[rand(4)] }.join }
+    index = Containers::FuzzyIndex.new(words, :backend => @backend)
+    10.times do
+      term = Array.new(3 + rand(6)) { %w(a b c d)[rand(4)] }.join
+      expected = words.uniq.map { |w| [Algorithms::String.levenshtein_dist(term, w), w] }.select { |d, w| d <= 2 }.sort
+      expect(index.search(term, 2)).to eql(expected)
+    end
+  end
+end
+
+if defined? Algorithms::String.levenshtein_dist
+  words = %w(hello help hell jello yellow world hello)
+
+  describe "trie fuzzy index" do
+    before(:each) do
+      @backend = :trie
+      @index = Containers::FuzzyIndex.new(words, :backend => @backend)
+    end
+    it_should_behave_like "fuzzy index"
+
+    it "should count distances in characters" do
+      index = Containers::FuzzyIndex.new(["h\u00e9llo", "hello"], :backend => @backend)
+      expect(index.search("hallo", 1)).to eql([[1, "hello"], [1, "h\u00e9llo"]])
+      expect(index.search("h\u00e9llo", 1)).to eql([[0, "h\u00e9llo"], [1, "hello"]])
+    end
+  end
+
+  if defined? Containers::CBKTree
+    describe "bk-tree fuzzy index" do
+      before(:each) do
+        @backend = :bk_tree
+        @index = Containers::FuzzyIndex.new(words, :backend => @backend)
+      end
+      it_should_behave_like "fuzzy index"
+
+      it "should count distances in bytes" do
+        index = Containers::FuzzyIndex.new(["h\u00e9llo", "hello"], :backend => @backend)
+        expect(index.search("hallo", 1)).to eql([[1, "hello"]])
+        expect(index.search("hallo", 2)).to eql([[1, "hello"], [2, "h\u00e9llo"]])
+        expect(index.search("h\u00e9llo", 1)).to eql([[0, "h\u00e9llo"]])
+      end
+
+      it "should default to the bk-tree" do
+        expect(Containers::FuzzyIndex.new(words).backend).to eql(:bk_tree)
+      end
+    end
+  end
+end
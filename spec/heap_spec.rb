@@ -315,3 +315,50 @@ describe Containers::Heap do
   end
   
 end
+
+if defined? Containers::CHeap
+  describe Containers::CHeap do
+    it "should agree with the Ruby heap under random operations" do
+      [:min, :max].each do |order|
+        native, ruby = Containers::CHeap.new([5, 3, 9], order), Containers::RubyHeap.new([5, 3, 9], order)
+        2000.times do
+          key = rand(200)
+          case rand(6)
+          when 0, 1 then expect(native.push(key, key.to_s)).to eql(ruby.push(key, key.to_s))
+          when 2 then expect(native.pop.nil?).to eql(ruby.pop.nil?)
+          when 3 then expect(native.delete(key).nil?).to eql(ruby.delete(key).nil?)
+          when 4 then expect(native.has_key?(key)).to eql(ruby.has_key?(key))
+          else
+            # Which of several items with the same key gets changed is arbitrary, so only the keys must agree
+            new_key = order == :min ? key - rand(50) : key + rand(50)
+            expect((native.change_key(key, new_key) || [])[0]).to eql((ruby.change_key(key, new_key) || [])[0])
+          end
+          expect(native.size).to eql(ruby.size)
+          expect(native.next_key).to eql(ruby.next_key)
+        end
+      end
+    end
+
+    it "should order Floats, mixed numbers and other keys" do
+      heap = Containers::CHeap.new([2.5, 1, -3.0, 2**70, 0.5])
+      expect(Array.new(5) { heap.pop }).to eql([-3.0, 0.5, 1, 2.5, 2**70])
+      heap = Containers::CHeap.new(%w(pear fig banana)) { |x, y| x.size < y.size }
+      expect(Array.new(3) { heap.pop }).to eql(%w(fig pear banana))
+      expect { Containers::CHeap.new([1]).push(nil) }.to raise_error(ArgumentError)
+      expect { Containers::CHeap.new([1]).push(false) }.to raise_error(ArgumentError)
+      expect { Containers::CHeap.new([false]) }.to raise_error(ArgumentError)
+      expect { Containers::CHeap.new([nil]) }.to raise_error(ArgumentError)
+      expect { Containers::MinHeap.new([1]).change_key(1, 2) }.to raise_error(RuntimeError)
+    end
+
+    it "should mark ruby object references" do
+      anon_class = Class.new
+      heap = Containers::CHeap.new
+      100.times { |i| heap.push(i, anon_class.new) }
+      ObjectSpace.garbage_collect
+      count = 0
+      ObjectSpace.each_object(anon_class) { |x| count += 1 }
+      expect(count).to eql(100)
+    end
+  end
+end
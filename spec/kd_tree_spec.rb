@@ -30,5 +30,127 @@ describe Containers::KDTree do
     expected = File.read(File.join(File.dirname(__FILE__), 'kd_expected_out.txt'))
     expect(expected).to eql(out)
   end
-  
+
+  it "should find the nearest points in three dimensions" do
+    points = {}
+    200.times { |i| points[i] = [rand(-10..10), rand(-10..10), rand(-10..10)] }
+    kdtree = Containers::KDTree.new(points)
+    20.times do
+      target = [rand(-12..12), rand(-12..12), rand(-12..12)]
+      expected = points.map { |id, (x, y, z)| [(x - target[0])**2 + (y - target[1])**2 + (z - target[2])**2, id] }.sort.first(5)
+      expect(kdtree.find_nearest(target, 5)).to eql(expected)
+    end
+  end
+
+  it "should return ties in insertion order" do
+    kdtree = Containers::KDTree.new({ :b => [1, 0], :a => [0, 1], :c => [-1, 0], :d => [0, -1], :e => [2, 2] })
+    expect(kdtree.find_nearest([0, 0], 3)).to eql([[1, :b], [1, :a], [1, :c]])
+    expect(kdtree.find_nearest([0, 0], 10).size).to eql(5)
+    expect(kdtree.find_nearest([0, 0], 0)).to eql([])
+  end
+
+  it "should reject targets of the wrong dimension" do
+    kdtree = Containers::KDTree.new({ 0 => [1, 2, 3] })
+    expect { kdtree.find_nearest([1, 2], 1) }.to raise_error(ArgumentError)
+    expect(kdtree.dimensions).to eql(3)
+    expect(kdtree.size).to eql(1)
+  end
+
+  it "should find points within a radius or a box" do
+    kdtree = Containers::KDTree.new( {0 => [4, 3], 1 => [3, 0], 2 => [-1, 2], 3 => [6, 4],
+                                     4 => [3, -5], 5 => [-2, -5] })
+    expect(kdtree.within_radius([0, 0], 3)).to eql([[5, 2], [9, 1]])
+    expect(kdtree.within_radius([0, 0], 0)).to eql([])
+    expect(kdtree.count_within([0, 0], 5)).to eql(3)
+    expect(kdtree.count_within([3, 0], 0)).to eql(1)
+    expect(kdtree.in_box([0, -5], [6, 3])).to eql([0, 1, 4])
+    expect(kdtree.in_box([1, 1], [0, 0])).to eql([])
+    expect { kdtree.within_radius([0, 0], -1) }.to raise_error(ArgumentError)
+  end
+
+  it "should answer a batch of nearest neighbour queries" do
+    points = {}
+    300.times { |i| points[i] = [rand, rand, rand] }
+    kdtree = Containers::KDTree.new(points)
+    targets = Array.new(100) { [rand, rand, rand] }
+    expected = targets.map { |target| kdtree.find_nearest(target, 3) }
+    expect(kdtree.find_nearest_many(targets, 3)).to eql(expected)
+    expect(kdtree.find_nearest_many(targets, 3, threads: 4)).to eql(expected)
+    expect(kdtree.find_nearest_many([], 3)).to eql([])
+  end
+
+  it "should insert, update and delete points" do
+    kdtree = Containers::KDTree.new({})
+    kdtree.insert(:a, [0, 0])
+    kdtree.insert(:b, [5, 5])
+    kdtree.insert(:c, [1, 1])
+    expect(kdtree.size).to eql(3)
+    expect(kdtree.find_nearest([0, 0], 2)).to eql([[0, :a], [2, :c]])
+    expect(kdtree.update(:b, [-1, 0])).to be true
+    expect(kdtree.update(:d, [0, 0])).to be false
+    expect(kdtree.find_nearest([0, 0], 2)).to eql([[0, :a], [1, :b]])
+    expect(kdtree.delete(:a)).to be true
+    expect(kdtree.delete(:a)).to be false
+    expect(kdtree.find_nearest([0, 0], 3)).to eql([[1, :b], [2, :c]])
+    expect(kdtree.size).to eql(2)
+    expect { kdtree.insert(:e, [1, 2, 3]) }.to raise_error(ArgumentError)
+  end
+
+  it "should stay correct through many moves" do
+    points = {}
+    100.times { |i| points[i] = [rand(-20..20), rand(-20..20)] }
+    kdtree = Containers::KDTree.new(points)
+    1000.times do |i|
+      id = rand(150)
+      if rand < 0.2
+        kdtree.delete(id)
+        points.delete(id)
+      else
+        coords = [rand(-20..20), rand(-20..20)]
+        kdtree.insert(id, coords)
+        points[id] = coords
+      end
+    end
+    expect(kdtree.size).to eql(points.size)
+    10.times do
+      target = [rand(-20..20), rand(-20..20)]
+      expected = points.map { |id, (x, y)| [(x - target[0])**2 + (y - target[1])**2, id] }.sort_by(&:first)
+      expect(kdtree.find_nearest(target, 5).map(&:first)).to eql(expected.first(5).map(&:first))
+      expect(kdtree.within_radius(target, 6).map(&:last).sort).to eql(expected.select { |d, id| d <= 36 }.map(&:last).sort)
+    end
+  end
+end
+
+if defined? Containers::CKDTree
+  describe Containers::CKDTree do
+    it "should agree with the Ruby kd-tree" do
+      points = {}
+      500.times { |i| points[i] = [rand, rand, rand, rand] }
+      native, ruby = Containers::CKDTree.new(points), Containers::RubyKDTree.new(points)
+      50.times do
+        target = [rand, rand, rand, rand]
+        expect(native.find_nearest(target, 8).map(&:last)).to eql(ruby.find_nearest(target, 8).map(&:last))
+      end
+    end
+
+    it "should return Float distances for Float coordinates" do
+      kdtree = Containers::CKDTree.new({ 0 => [0.5, 0], 1 => [3, 4] })
+      expect(kdtree.find_nearest([0, 0], 2)).to eql([[0.25, 0], [25.0, 1]])
+      expect(Containers::CKDTree.new({ 0 => [3, 4] }).find_nearest([0.0, 0], 1)).to eql([[25.0, 0]])
+    end
+
+    it "should size batches by the targets and k rather than reserve a full batch" do
+      points = {}
+      200_000.times { |i| points[i] = [i % 500, i / 500] }
+      kdtree = Containers::CKDTree.new(points)
+      nearest = kdtree.find_nearest_many([[250, 200]], 200_000)
+      expect(nearest.size).to eql(1)
+      expect(nearest[0].size).to eql(200_000)
+      expect(nearest[0].first(50)).to eql(kdtree.find_nearest([250, 200], 50))
+      targets = Array.new(2000) { |i| [i % 500, i % 400] }
+      many = kdtree.find_nearest_many(targets, 1000)
+      expect(many.size).to eql(2000)
+      expect(many[1234]).to eql(kdtree.find_nearest(targets[1234], 1000))
+    end
+  end
 end
@@ -73,3 +73,44 @@ describe Containers::PriorityQueue do
     end
   end
 end
+
+describe "Containers::PriorityQueue with :monotone_int" do
+  it "should pop the lowest priorities first and agree with a min heap" do
+    q = Containers::PriorityQueue.new(:monotone_int => true)
+    heap = Containers::MinHeap.new
+    last = 0
+    3000.times do
+      if rand(3) > 0 || q.empty?
+        priority = last + rand(1000)
+        q.push(priority, priority)
+        heap.push(priority, priority)
+      else
+        last = q.pop
+        expect(last).to eql(heap.pop)
+      end
+      expect(q.size).to eql(heap.size)
+    end
+    expect { Containers::PriorityQueue.new(:monotone_int => true) { |x, y| x > y } }.to raise_error(ArgumentError)
+  end
+end
+
+if defined? Containers::RadixHeap
+  describe Containers::RadixHeap do
+    it "should support deletes and decreases above the last popped key" do
+      heap = Containers::RadixHeap.new([9, 4, 1 << 40])
+      heap.push(5, :five)
+      expect(heap.next_key).to eql(4)
+      expect(heap.next).to eql(4)
+      expect(heap.pop).to eql(4)
+      expect(heap.last_key).to eql(4)
+      expect(heap.decrease_key(1 << 40, 7)).to eql([7, 1 << 40])
+      expect(heap.delete(9)).to eql(9)
+      expect(heap.has_key?(9)).to be false
+      expect { heap.push(3) }.to raise_error(ArgumentError)
+      expect { heap.push(-1) }.to raise_error(ArgumentError)
+      expect { heap.change_key(7, 2) }.to raise_error(ArgumentError)
+      expect { heap.change_key(7, 8) }.to raise_error(RuntimeError)
+      expect([heap.pop, heap.pop, heap.pop]).to eql([:five, 1 << 40, nil])
+    end
+  end
+end
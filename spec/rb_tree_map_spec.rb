@@ -1,5 +1,8 @@
 $: << File.join(File.expand_path(File.dirname(__FILE__)), '..', 'lib')
 require 'algorithms'
+require 'fileutils'
+require 'stringio'
+require 'tmpdir'
 
 shared_examples "empty rbtree" do
   it "should let you push stuff in" do
@@ -88,6 +91,38 @@ shared_examples "non-empty rbtree" do
       counter += 1
     end
   end
+
+  it "should dump and load" do
+    @tree[@num_items] = "string"
+    @tree[@num_items + 1] = 1.5
+    @tree[@num_items + 2] = [1, 2]
+    @tree[@num_items + 3] = nil
+    io = StringIO.new("".b)
+    expect(@tree.dump(io).equal?(@tree)).to be true
+    @tree.dump(io)
+    io.rewind
+    2.times do
+      loaded = @tree.class.load(io)
+      expect(loaded.class).to eql(@tree.class)
+      expect(loaded.to_a).to eql(@tree.to_a)
+    end
+    expect(io.eof?).to be true
+  end
+
+  it "should let you change a loaded map" do
+    io = StringIO.new("".b)
+    @tree.dump(io)
+    io.rewind
+    loaded = @tree.class.load(io)
+    expect(loaded.height <= 2 * Math.log2(loaded.size + 1)).to be true
+    @random_array.uniq.each_with_index do |key, i|
+      expect(loaded.delete(key)).to eql(key) if i.even?
+      loaded[key + @num_items] = key
+    end
+    expected = @random_array.uniq.each_with_index.reject { |key, i| i.even? }.map { |key, i| [key, key] }
+    expected += @random_array.uniq.map { |key| [key + @num_items, key] }
+    expect(loaded.to_a).to eql(expected.sort)
+  end
 end
 
 describe "RubyRBTreeMap delete bug fixes" do
@@ -127,6 +162,214 @@ describe "RubyRBTreeMap delete bug fixes" do
   end
 end
 
+shared_examples "combinable rbtree" do
+  def map_of(hash)
+    map = @tree.class.new
+    hash.each { |key, value| map[key] = value }
+    map
+  end
+
+  before(:each) do
+    @a = {}
+    @b = {}
+    srand(42)
+    300.times { @a[rand(1000)] = rand(100) }
+    40.times { @b[rand(1000)] = rand(100) }
+  end
+
+  it "should split at a key and join back" do
+    [-1, 0, 500, 999, 1000].each do |key|
+      map = map_of(@a)
+      lo, hi = map.split(key)
+      expect(map.empty?).to be true
+      expect(lo.to_a).to eql(@a.select { |k, _| k < key }.sort)
+      expect(hi.to_a).to eql(@a.select { |k, _| k >= key }.sort)
+      hi.join(lo)
+      expect(lo.empty?).to be true
+      expect(hi.to_a).to eql(@a.sort)
+      expect(hi.size).to eql(@a.size)
+      hi[key] = 1
+      expect(hi[key]).to eql(1)
+    end
+  end
+
+  it "should refuse to join overlapping maps" do
+    expect { map_of(1 => 1, 5 => 5).join(map_of(3 => 3)) }.to raise_error(ArgumentError)
+    map = map_of(1 => 1)
+    expect { map.join(map) }.to raise_error(ArgumentError)
+  end
+
+  it "should union with the other values winning" do
+    [[@a, @b], [@b, @a]].each do |x, y|
+      map, other = map_of(x), map_of(y)
+      union = map.union(other)
+      expect(union.to_a).to eql(x.merge(y).sort)
+      expect(union.size).to eql(x.merge(y).size)
+      expect(union.height <= 2 * Math.log2(union.size + 1)).to be true
+    end
+  end
+
+  it "should resolve union conflicts with the block" do
+    map = map_of(@a).union(map_of(@b)) { |key, mine, theirs| [key, mine, theirs] }
+    expect(map.to_a).to eql(@a.merge(@b) { |key, mine, theirs| [key, mine, theirs] }.sort)
+  end
+
+  it "should intersect" do
+    both = @a.select { |key, _| @b.has_key?(key) }
+    expect(map_of(@a).intersection(map_of(@b)).to_a).to eql(both.map { |key, _| [key, @b[key]] }.sort)
+    map = map_of(@b).intersection(map_of(@a)) { |key, mine, theirs| mine - theirs }
+    expect(map.to_a).to eql(both.map { |key, value| [key, @b[key] - value] }.sort)
+  end
+
+  it "should take the difference" do
+    expect(map_of(@a).difference(map_of(@b)).to_a).to eql(@a.reject { |key, _| @b.has_key?(key) }.sort)
+    expect(map_of(@b).difference(map_of(@a)).to_a).to eql(@b.reject { |key, _| @a.has_key?(key) }.sort)
+    expect(map_of(@a).difference(map_of({})).to_a).to eql(@a.sort)
+  end
+
+  it "should return new maps and leave both maps alone when combining" do
+    map, other = map_of(@a), map_of(@b)
+    union = map.union(other)
+    both = map.intersection(other) { |key, mine, theirs| mine + theirs }
+    rest = map.difference(other)
+    expect(union.equal?(map) || union.equal?(other)).to be false
+    expect(map.to_a).to eql(@a.sort)
+    expect(other.to_a).to eql(@b.sort)
+    expect(both.to_a).to eql(@a.select { |key, _| @b.has_key?(key) }.map { |key, value| [key, value + @b[key]] }.sort)
+    @b.each_key { |key| union[key] = -1 }
+    map.delete(@a.keys.first)
+    other.delete(@b.keys.first)
+    other[1000] = 1000
+    expect(union.to_a).to eql(@a.merge(@b.transform_values { -1 }).sort)
+    expect(rest.to_a).to eql(@a.reject { |key, _| @b.has_key?(key) }.sort)
+    expect(map.to_a).to eql(@a.reject { |key, _| key == @a.keys.first }.sort)
+    expect(other.to_a).to eql(@b.merge(1000 => 1000).reject { |key, _| key == @b.keys.first }.sort)
+  end
+
+  it "should combine frozen maps" do
+    map, other = map_of(@a), map_of(@b)
+    expect(map.snapshot.union(other.snapshot).to_a).to eql(@a.merge(@b).sort)
+    expect(map.snapshot.difference(other).to_a).to eql(@a.reject { |key, _| @b.has_key?(key) }.sort)
+  end
+end
+
+shared_examples "snapshotting rbtree" do
+  before(:each) do
+    100.times { |i| @tree[i] = i.to_s }
+    @pairs = @tree.to_a
+    @snapshot = @tree.snapshot
+  end
+
+  it "should not change when the map is written to" do
+    expect(@snapshot.frozen?).to be true
+    @tree[5] = "five"
+    @tree[500] = "500"
+    @tree.delete(7)
+    @tree.delete_min
+    @tree.delete_max
+    expect(@snapshot.to_a).to eql(@pairs)
+    expect(@snapshot.size).to eql(100)
+    expect(@snapshot[5]).to eql("5")
+    expect(@tree[5]).to eql("five")
+    expect(@tree.has_key?(7)).to be false
+    expect(@tree.size).to eql(98)
+  end
+
+  it "should not change when the map is split, joined or combined" do
+    lo, hi = @tree.split(50)
+    lo[-1] = "-1"
+    hi.join(lo)
+    other = @tree.class.new
+    other[3] = "three"
+    later = hi.snapshot
+    hi = hi.union(other).union(other.snapshot)
+    expect(@snapshot.to_a).to eql(@pairs)
+    expect(later.size).to eql(101)
+    expect(later[3]).to eql("3")
+    expect(hi[3]).to eql("three")
+    expect(hi.size).to eql(101)
+  end
+
+  it "should refuse writes" do
+    expect { @snapshot[1] = "one" }.to raise_error(FrozenError)
+    expect { @snapshot.delete(1) }.to raise_error(FrozenError)
+    expect { @snapshot.split(1) }.to raise_error(FrozenError)
+    expect { @tree.join(@snapshot) }.to raise_error(FrozenError)
+    expect(@snapshot.to_a).to eql(@pairs)
+    expect(@tree.to_a).to eql(@pairs)
+    expect(@snapshot.snapshot.equal?(@snapshot)).to be true
+  end
+end
+
+shared_examples "ordered rbtree" do
+  before(:each) do
+    @keys = (1..50).to_a.shuffle(random: Random.new(7))
+    @point = Struct.new(:x, :y)
+  end
+
+  it "should keep keys in descending order" do
+    map = @tree.class.new(order: :desc)
+    @keys.each { |key| map[key] = key.to_s }
+    expect(map.map { |key, _| key }).to eql((1..50).to_a.reverse)
+    expect(map.min_key).to eql(50)
+    expect(map.max_key).to eql(1)
+    expect(map.delete_min).to eql("50")
+    expect(map.delete(10)).to eql("10")
+    lo, hi = map.split(20)
+    expect(lo.map { |key, _| key }).to eql((21..49).to_a.reverse)
+    expect(hi.map { |key, _| key }).to eql((1..20).to_a.reverse - [10])
+    lo.join(hi)
+    expect(lo.size).to eql(48)
+  end
+
+  it "should order Array keys element by element" do
+    keys = [[2, "a"], [1, "b"], [1, "a", 0], [1, "a"], [1], [0, "z"]]
+    map = @tree.class.new
+    keys.each { |key| map[key] = key }
+    expect(map.map { |key, _| key }).to eql(keys.sort)
+    expect(map[[1, "a"]]).to eql([1, "a"])
+    expect(map.has_key?([1, "c"])).to be false
+    expect { map[[1, nil]] = 1 }.to raise_error(ArgumentError)
+  end
+
+  it "should order keys by key_by" do
+    map = @tree.class.new(key_by: ->(point) { [point.y, point.x] })
+    points = @keys.map { |i| @point.new(i, i % 5) }
+    points.each { |point| map[point] = point.x }
+    expect(map.map { |_, x| x }).to eql(points.sort_by { |point| [point.y, point.x] }.map(&:x))
+    expect(map.min_key).to eql(@point.new(5, 0))
+    expect(map[@point.new(7, 2)]).to eql(7)
+    expect(map.delete(@point.new(7, 2))).to eql(7)
+    expect(map.has_key?(@point.new(7, 2))).to be false
+    expect(map.size).to eql(49)
+  end
+
+  it "should only combine maps in the same order" do
+    asc, desc = @tree.class.new, @tree.class.new(order: :desc)
+    asc[1] = 1
+    desc[2] = 2
+    expect { asc.union(desc) }.to raise_error(ArgumentError)
+    expect { desc.join(@tree.class.new(order: :desc, key_by: ->(key) { key })) }.to raise_error(ArgumentError)
+  end
+
+  it "should dump a descending map in ascending order" do
+    map = @tree.class.new(order: :desc)
+    @keys.each { |key| map[key] = key }
+    io = StringIO.new
+    map.dump(io)
+    io.rewind
+    expect(@tree.class.load(io, order: :desc).to_a).to eql(map.to_a)
+    io.rewind
+    expect(@tree.class.load(io).to_a).to eql(map.to_a.reverse)
+    expect { @tree.class.new(key_by: ->(key) { key }).dump(StringIO.new) }.to raise_error(ArgumentError)
+  end
+
+  it "should reject unknown orders" do
+    expect { @tree.class.new(order: :up) }.to raise_error(ArgumentError)
+    expect { @tree.class.new(key_by: 1) }.to raise_error(ArgumentError)
+  end
+end
+
 describe "empty rbtreemap" do
   before(:each) do
     @tree = Containers::RubyRBTreeMap.new
@@ -139,6 +382,9 @@ describe "full rbtreemap" do
     @tree = Containers::RubyRBTreeMap.new
   end
   it_should_behave_like "non-empty rbtree"
+  it_should_behave_like "combinable rbtree"
+  it_should_behave_like "snapshotting rbtree"
+  it_should_behave_like "ordered rbtree"
 end
 
 begin
@@ -155,6 +401,88 @@ begin
       @tree = Containers::CRBTreeMap.new
     end
     it_should_behave_like "non-empty rbtree"
+    it_should_behave_like "combinable rbtree"
+    it_should_behave_like "snapshotting rbtree"
+    it_should_behave_like "ordered rbtree"
+
+    it "should call key_by once for each key it keeps" do
+      calls = 0
+      map = Containers::CRBTreeMap.new(key_by: ->(key) { calls += 1; -key })
+      (1..50).to_a.shuffle.each { |key| map[key] = key }
+      expect(map.min_key).to eql(50)
+      expect(calls).to eql(50)
+    end
+
+    # In a process of its own, as once a Ractor has run, ObjectSpace.each_object no longer sees
+    # the objects that later specs count
+    it "should share snapshots with other Ractors" do
+      script = <<-RUBY
+        require 'algorithms'
+        map = Containers::CRBTreeMap.new
+        100.times { |i| map[i] = i }
+        snapshot = map.snapshot
+        reader = Ractor.new(snapshot) { |view| view.inject(0) { |sum, (key, value)| sum + value } }
+        100.times { |i| map.delete(i) }
+        print Ractor.shareable?(snapshot), " ", reader.take
+      RUBY
+      env = { "RUBYLIB" => $LOAD_PATH.join(File::PATH_SEPARATOR) }
+      output = IO.popen(env, [RbConfig.ruby, "-W0", "-e", script], &:read)
+      expect(output).to eql("true 4950")
+    end if defined?(Ractor)
   end
 rescue Exception
-end
\ No newline at end of file
+end
+
+if defined? Containers::MappedTreeMap
+  describe "MappedTreeMap" do
+    before(:each) do
+      @dir = Dir.mktmpdir
+      @path = File.join(@dir, "states.map")
+      @map = Containers::CRBTreeMap.new
+      @map["MA"] = "Massachusetts"
+      @map["GA"] = "Georgia"
+      @map["Gé"] = [1, 2]
+      500.times { |i| @map[i.to_s * 3] = i }
+      File.open(@path, "wb") { |f| @map.dump(f) }
+    end
+
+    after(:each) do
+      FileUtils.rm_rf(@dir)
+    end
+
+    it "should answer like the map it was dumped from" do
+      mapped = Containers::MappedTreeMap.open(@path)
+      expect(mapped.frozen?).to be true
+      expect(mapped.size).to eql(@map.size)
+      expect(mapped["MA"]).to eql("Massachusetts")
+      expect(mapped.get("Gé")).to eql([1, 2])
+      expect(mapped["MB"]).to be_nil
+      expect(mapped.has_key?("GA")).to be true
+      expect(mapped.has_key?("G")).to be false
+      expect(mapped.min_key).to eql(@map.min_key)
+      expect(mapped.max_key).to eql(@map.max_key)
+      expect(mapped.to_a).to eql(@map.to_a)
+      @map.each { |key, value| expect(mapped[key]).to eql(value) }
+    end
+
+    it "should open files written by CSplayTreeMap" do
+      splay = Containers::CSplayTreeMap.new
+      100.times { |i| splay[i * 2] = i }
+      File.open(@path, "wb") { |f| splay.dump(f) }
+      mapped = Containers::MappedTreeMap.open(@path)
+      expect(mapped[40]).to eql(20)
+      expect(mapped[41]).to be_nil
+      expect(mapped[40.0]).to eql(20)
+      expect(mapped.to_a).to eql(splay.to_a)
+    end
+
+    it "should reject files that are not one whole dump" do
+      File.binwrite(@path, "not a map" * 10)
+      expect { Containers::MappedTreeMap.open(@path) }.to raise_error(ArgumentError)
+      File.open(@path, "wb") { |f| @map.dump(f) }
+      File.binwrite(@path, File.binread(@path)[0..-2])
+      expect { Containers::MappedTreeMap.open(@path) }.to raise_error(ArgumentError)
+      expect { Containers::CRBTreeMap.load(StringIO.new(File.binread(@path)[0, 100])) }.to raise_error(ArgumentError)
+    end
+  end
+end
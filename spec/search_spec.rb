@@ -25,4 +25,155 @@ describe "search algorithms" do
   it "should let you include Search in String to enable instance methods" do
     expect("ABC ABCDAB ABCDABCDABDE".kmp_search("ABCDABD")).to eql(15)
   end
-end
\ No newline at end of file
+end
+
+if defined? Algorithms::Search::MultiPattern
+  describe Algorithms::Search::MultiPattern do
+    before(:each) do
+      @mp = Algorithms::Search::MultiPattern.new(%w(he she his hers))
+    end
+
+    it "should find every occurrence of every pattern" do
+      expect(@mp.search("ushers")).to eql([[1, 1], [0, 2], [3, 2]])
+      expect(@mp.search("ahishers")).to eql([[2, 1], [1, 3], [0, 4], [3, 4]])
+      expect(@mp.search("nothing to see")).to eql([])
+      expect(@mp.match?("ushers")).to be true
+      expect(@mp.match?("xyz")).to be false
+    end
+
+    it "should yield matches when given a block" do
+      found = []
+      @mp.search("she") { |id, offset| found << [id, offset] }
+      expect(found).to eql([[1, 0], [0, 1]])
+    end
+
+    it "should find matches spanning fed chunks" do
+      expect(@mp.feed("us")).to eql([])
+      expect(@mp.feed("h")).to eql([])
+      expect(@mp.feed("ers")).to eql([[1, 1], [0, 2], [3, 2]])
+      @mp.reset
+      expect(@mp.feed("hers")).to eql([[0, 0], [3, 0]])
+    end
+
+    it "should agree with a naive scan" do
+      patterns = Array.new(50) { Array.new(1 + rand(4)) { %w(a b c)[rand(3)] }.join }
+      text = Array.new(2000) { %w(a b c d)[rand(4)] }.join
+      mp = Algorithms::Search::MultiPattern.new(patterns)
+      expected = []
+      patterns.each_with_index do |pattern, id|
+        (0..text.size - pattern.size).each { |i| expected << [id, i] if text[i, pattern.size] == pattern }
+      end
+      expect(mp.search(text).sort).to eql(expected.sort)
+    end
+
+    it "should not allow empty patterns" do
+      expect { Algorithms::Search::MultiPattern.new(["a", ""]) }.to raise_error(ArgumentError)
+    end
+  end
+end
+
+if defined? Algorithms::Search::Pattern
+  describe Algorithms::Search::Pattern do
+    it "should find the first occurrence like kmp_search" do
+      pattern = Algorithms::Search::Pattern.new("ABCDABD")
+      expect(pattern.first("ABC ABCDAB ABCDABCDABDE")).to eql(15)
+      expect(pattern.first("ABCDAB")).to be_nil
+      expect(pattern.first("")).to be_nil
+    end
+
+    it "should find all overlapping occurrences" do
+      pattern = Algorithms::Search::Pattern.new("aba")
+      expect(pattern.all("ababa xaba")).to eql([0, 2, 7])
+      expect(pattern.count("ababa xaba")).to eql(3)
+      offsets = []
+      pattern.each_offset("ababa") { |i| offsets << i }
+      expect(offsets).to eql([0, 2])
+      expect(pattern.each_offset("aba").to_a).to eql([0])
+    end
+
+    it "should return character offsets in multibyte strings" do
+      pattern = Algorithms::Search::Pattern.new("ré")
+      expect(pattern.all("café résumé ré")).to eql([5, 12])
+      expect(pattern.first("ré")).to eql(0)
+    end
+
+    it "should agree with a naive scan on random and repetitive text" do
+      ["ab", "abc", "aaab"].each do |alphabet|
+        text = Array.new(5000) { alphabet[rand(alphabet.size)] }.join
+        20.times do
+          sub = Array.new(rand(8) + 1) { alphabet[rand(alphabet.size)] }.join
+          expected = (0..text.size - sub.size).select { |i| text[i, sub.size] == sub }
+          expect(Algorithms::Search::Pattern.new(sub).all(text)).to eql(expected)
+        end
+      end
+      text = "a" * 100000
+      expect(Algorithms::Search::Pattern.new("a" * 50 + "b").first(text)).to be_nil
+      expect(Algorithms::Search::Pattern.new("a" * 50).count(text)).to eql(100000 - 49)
+    end
+
+    it "should not allow empty patterns" do
+      expect { Algorithms::Search::Pattern.new("") }.to raise_error(ArgumentError)
+    end
+  end
+end
+
+if defined? Algorithms::Search::SortedIndex
+  describe Algorithms::Search::SortedIndex do
+    before(:each) do
+      @index = Algorithms::Search::SortedIndex.new([1, 3, 3, 7, 10])
+    end
+
+    it "should find lower and upper bounds" do
+      expect(@index.lower_bound(3)).to eql(1)
+      expect(@index.upper_bound(3)).to eql(3)
+      expect(@index.rank(4)).to eql(3)
+      expect(@index.lower_bound(0)).to eql(0)
+      expect(@index.lower_bound(11)).to eql(5)
+      expect(@index.lower_bound(3.5)).to eql(3)
+      expect(@index.upper_bound(2**70)).to eql(5)
+      expect(@index.lower_bound_many([0, 3, 8, 11, 2.5])).to eql([0, 1, 4, 5, 1])
+    end
+
+    it "should answer membership" do
+      expect(@index.include?(7)).to be_truthy
+      expect(@index.include?(7.0)).to be_truthy
+      expect(@index.include?(7.5)).to eql(false)
+      expect(@index.include?(2)).to eql(false)
+      expect(@index.size).to eql(5)
+      expect(@index[3]).to eql(7)
+    end
+
+    it "should agree with a linear scan on float keys" do
+      array = Array.new(500) { rand(-100.0..100.0) }.sort
+      index = Algorithms::Search::SortedIndex.new(array)
+      queries = Array.new(200) { rand(-110.0..110.0) } + array.first(20)
+      queries.each do |q|
+        expect(index.lower_bound(q)).to eql(array.index { |x| x >= q } || array.size)
+        expect(index.upper_bound(q)).to eql(array.index { |x| x > q } || array.size)
+      end
+      expect(index.lower_bound_many(queries)).to eql(queries.map { |q| index.lower_bound(q) })
+    end
+
+    it "should compare Integers that a double cannot hold exactly" do
+      [[1, 2**62, 2**62 + 1], [1.5, 2**62, 2**62 + 1], [0.5, 2**70, 2**70 + 1, 2**70 + 2]].each do |array|
+        index = Algorithms::Search::SortedIndex.new(array)
+        array.each_with_index do |x, i|
+          expect(index.lower_bound(x)).to eql(i)
+          expect(index.upper_bound(x)).to eql(i + 1)
+          expect(index.include?(x)).to eql(true)
+        end
+        expect(index.lower_bound_many(array)).to eql((0...array.size).to_a)
+        expect(index.include?(array.last + 3)).to eql(false)
+      end
+      index = Algorithms::Search::SortedIndex.new([1.0, 2**53, 2**53 + 1, 2.0**60])
+      expect(index.lower_bound(2.0**53)).to eql(1)
+      expect(index.upper_bound(2.0**53)).to eql(2)
+      expect { Algorithms::Search::SortedIndex.new([0.5, 2**62 + 1, 2**62]) }.to raise_error(ArgumentError)
+    end
+
+    it "should reject unsorted input" do
+      expect { Algorithms::Search::SortedIndex.new([2, 1]) }.to raise_error(ArgumentError)
+      expect { Algorithms::Search::SortedIndex.new(["a"]) }.to raise_error(TypeError)
+    end
+  end
+end
@@ -26,4 +26,122 @@ describe "sort algorithms" do
     @sorts.each { |sort| expect(Sort.send(sort, rand_array.dup)).to eql(sorted_array) }
   end    
 
+  it "should work for floats and strings" do
+    floats = Array.new(500) { rand(-1000.0..1000.0) } + [0.0, -0.0, Float::INFINITY, -Float::INFINITY]
+    strings = Array.new(500) { Array.new(rand(6)) { ("a".."e").to_a.sample }.join }
+    [floats, strings].each do |array|
+      @sorts.each { |sort| expect(Sort.send(sort, array.dup)).to eql(array.sort) }
+    end
+  end
+
+  it "should work for sorted, reversed and repetitive arrays" do
+    n = 1000
+    [(0...n).to_a, (0...n).to_a.reverse, Array.new(n) { rand(3) }, Array.new(n) { |i| i % 7 - 3 }].each do |array|
+      @sorts.each { |sort| expect(Sort.send(sort, array.dup)).to eql(array.sort) }
+    end
+  end
+
+  it "should fall back to <=> for mixed and custom elements" do
+    mixed = Array.new(200) { [rand(100), rand(100) / 3.0, 2**70 + rand(100)].sample }
+    versions = Array.new(200) { Gem::Version.new("#{rand(3)}.#{rand(10)}") }
+    [mixed, versions].each do |array|
+      @sorts.each { |sort| expect(Sort.send(sort, array.dup)).to eq(array.sort) }
+    end
+  end
+
+  it "should select the nth element, partially sort and find the top k" do
+    [Array.new(1000) { rand(100) }, Array.new(1000) { rand(-10.0..10.0) }, Array.new(300) { rand(36**3).to_s(36) }].each do |array|
+      sorted = array.sort
+      [0, 17, array.size / 2, array.size - 1].each do |k|
+        copy = array.dup
+        expect(Sort.nth_element(copy, k)).to eql(sorted[k])
+        expect(copy[0...k].all? { |x| x <= sorted[k] } && copy[k..-1].all? { |x| x >= sorted[k] }).to be_truthy
+        copy = array.dup
+        expect(Sort.partial_sort(copy, k)[0, k]).to eql(sorted[0, k])
+        expect(copy.sort).to eql(sorted)
+        expect(Sort.top_k(array, k)).to eql(sorted.reverse[0, k])
+      end
+    end
+    expect(Sort.top_k(%w(pear fig banana), 2) { |s| s.size }).to eql(%w(banana pear))
+    expect(Sort.nth_element([3, 1, 2], 0) { |x| -x }).to eql(3)
+    expect(Sort.top_k([1, 2], 5)).to eql([2, 1])
+    expect { Sort.nth_element([1, 2], 2) }.to raise_error(IndexError)
+  end
+
+  it "should stable sort by key, calling the block once per element" do
+    records = Array.new(2000) { |i| [rand(50), i] }
+    [records, records.sort, records.sort.reverse, records.sort + records.sort].each do |input|
+      calls = 0
+      sorted = Sort.stable_sort_by(input) { |r| calls += 1; r[0] }
+      expect(calls).to eql(input.size)
+      expect(sorted).to eql(input.each_with_index.sort_by { |r, i| [r[0], i] }.map(&:first))
+      expect(Sort.stable_sort_by(input) { |r| r[0] * 0.5 }).to eql(sorted)
+      expect(Sort.stable_sort_by(input) { |r| "%03d" % r[0] }).to eql(sorted)
+      expect(Sort.stable_sort_by(input) { |r| r[0] + 2**70 }).to eql(sorted)
+    end
+    expect(Sort.stable_sort_by(%w(pear fig banana kiwi)) { |s| s.size }).to eql(%w(fig pear kiwi banana))
+    expect(Sort.stable_sort_by(5.downto(1))).to eql([1, 2, 3, 4, 5])
+    expect(Sort.stable_sort_by([])).to eql([])
+    expect { Sort.stable_sort_by([1, "a"]) }.to raise_error(ArgumentError)
+  end
+
+  it "should sort lines larger than the memory limit with external_sort" do
+    require 'stringio'
+    lines = Array.new(2000) { "#{rand(50)} #{rand(10**6)}\n" }
+    output = StringIO.new
+    Sort.external_sort(StringIO.new(lines.join), output, :memory_limit => 1000, :fan_in => 3)
+    expect(output.string).to eql(lines.sort.join)
+
+    output = StringIO.new
+    Sort.external_sort(StringIO.new(lines.join.chomp), output, :memory_limit => 1000, :key => lambda { |line| line.to_i })
+    expect(output.string).to eql(lines.each_with_index.sort_by { |line, i| [line.to_i, i] }.map(&:first).join)
+  end
+
+  it "should sort a line before the longer lines it is a prefix of with external_sort" do
+    require 'stringio'
+    lines = Array.new(500) { ["key", "key\tvalue", "key\x01", "ke"].sample + ["", "\t#{rand(10)}"].sample }
+    [1 << 20, 100].each do |memory_limit|
+      output = StringIO.new
+      Sort.external_sort(StringIO.new(lines.join("\n")), output, :memory_limit => memory_limit, :fan_in => 2)
+      expect(output.string).to eql(lines.sort.map { |line| line + "\n" }.join)
+      output = StringIO.new
+      Sort.external_sort(StringIO.new(lines.join("\n")), output, :memory_limit => memory_limit, :key => lambda { |line| line })
+      expect(output.string).to eql(lines.sort.map { |line| line + "\n" }.join)
+    end
+    output = StringIO.new
+    Sort.external_sort(StringIO.new("key\tvalue\nkey\n"), output)
+    expect(output.string).to eql("key\nkey\tvalue\n")
+  end
+
+  if Algorithms::Sort.respond_to?(:native_sort!)
+    it "should sort homogeneous arrays natively and decline others" do
+      array = [3, -1, 2]
+      expect(Sort.native_sort!(array)).to be(array)
+      expect(array).to eql([-1, 2, 3])
+      expect(Sort.native_sort!([1, 2.0])).to be_nil
+      expect(Sort.native_sort!([1.0, 0.0 / 0.0])).to be_nil
+      expect(Sort.native_sort!(["b", :a])).to be_nil
+    end
+
+    it "should sort large arrays in parallel in place" do
+      ints = Array.new(20000) { rand(-10**12..10**12) }
+      floats = Array.new(20000) { rand(-100.0..100.0).round(2) }
+      [ints, floats].each do |array|
+        [1, 3, 8].each do |threads|
+          copy = array.dup
+          expect(Sort.parallel_sort(copy, threads: threads)).to be(copy)
+          expect(copy).to eql(array.sort)
+        end
+      end
+      strings = %w(pear fig apple)
+      expect(Sort.parallel_sort(strings, threads: 2)).to eql(%w(apple fig pear))
+      expect(Sort.parallel_sort([2, 1.5, 3], threads: 2)).to eql([1.5, 2, 3])
+    end
+
+    it "should keep equal strings in their original order" do
+      strings = Array.new(300) { rand(10).to_s }
+      sorted = Sort.native_sort!(strings.dup)
+      expect(sorted.map(&:object_id)).to eql(strings.each_with_index.sort_by { |s, i| [s, i] }.map { |s, i| s.object_id })
+    end
+  end
 end
@@ -1,5 +1,6 @@
 $: << File.join(File.expand_path(File.dirname(__FILE__)), '..', 'lib')
 require 'algorithms'
+require 'stringio'
   
 shared_examples "empty splaytree" do
   it "should let you push stuff in" do
@@ -71,6 +72,57 @@ shared_examples "non-empty splaytree" do
       counter += 1
     end
   end
+
+  it "should dump and load" do
+    @tree[@num_items] = "string"
+    @tree[@num_items + 1] = 1.5
+    io = StringIO.new("".b)
+    expect(@tree.dump(io).equal?(@tree)).to be true
+    io.rewind
+    loaded = @tree.class.load(io)
+    expect(loaded.class).to eql(@tree.class)
+    expect(loaded.to_a).to eql(@tree.to_a)
+    loaded[@num_items + 2] = 1
+    expect(loaded.delete(@random_array[0])).to eql(@random_array[0])
+    expected = @tree.to_a.reject { |key, value| key == @random_array[0] } + [[@num_items + 2, 1]]
+    expect(loaded.to_a).to eql(expected)
+  end
+end
+
+shared_examples "ordered splaytree" do
+  before(:each) do
+    @keys = (1..50).to_a.shuffle(random: Random.new(7))
+  end
+
+  it "should keep keys in descending order" do
+    map = @tree.class.new(order: :desc)
+    @keys.each { |key| map[key] = key.to_s }
+    expect(map.map { |key, _| key }).to eql((1..50).to_a.reverse)
+    expect(map.first).to eql([50, "50"])
+    expect(map.delete(10)).to eql("10")
+    expect(map.get(11)).to eql("11")
+    io = StringIO.new
+    map.dump(io)
+    io.rewind
+    expect(@tree.class.load(io, order: :desc).to_a).to eql(map.to_a)
+  end
+
+  it "should order Array keys element by element" do
+    keys = [[2, "a"], [1, "b"], [1, "a", 0], [1, "a"], [1], [0, "z"]]
+    keys.each { |key| @tree[key] = key }
+    expect(@tree.map { |key, _| key }).to eql(keys.sort)
+    expect(@tree.get([1, "a"])).to eql([1, "a"])
+    expect(@tree.has_key?([1, "c"])).to be false
+  end
+
+  it "should order keys by key_by" do
+    map = @tree.class.new(key_by: ->(key) { [key % 5, key] })
+    @keys.each { |key| map[key] = key }
+    expect(map.map { |key, _| key }).to eql((1..50).sort_by { |key| [key % 5, key] })
+    expect(map.delete(7)).to eql(7)
+    expect(map.has_key?(7)).to be false
+    expect { map.dump(StringIO.new) }.to raise_error(ArgumentError)
+  end
 end
 
 describe "empty splaytreemap" do
@@ -85,6 +137,7 @@ describe "full splaytreemap" do
     @tree = Containers::RubySplayTreeMap.new
   end
   it_should_behave_like "non-empty splaytree"
+  it_should_behave_like "ordered splaytree"
 end
 
 begin
@@ -101,6 +154,7 @@ begin
       @tree = Containers::CSplayTreeMap.new
     end
     it_should_behave_like "non-empty splaytree"
+    it_should_behave_like "ordered splaytree"
   end
 rescue Exception
 end
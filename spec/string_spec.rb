@@ -11,5 +11,50 @@ if defined? Algorithms::String
       expect(Algorithms::String.levenshtein_dist("Hello", "ello")).to eql(1)
       expect(Algorithms::String.levenshtein_dist("Hello", "Mello")).to eql(1)
     end
+
+    it "should find the k closest candidates with levenshtein_top_k" do
+      candidates = %w(Hello Jello Help Hell Yellow Hallo) + [""]
+      expect(Algorithms::String.levenshtein_top_k("Hello", candidates, 3)).to eql([[0, 0], [1, 1], [1, 3]])
+      expect(Algorithms::String.levenshtein_top_k("Hello", candidates, 10, max: 1)).to eql([[0, 0], [1, 1], [1, 3], [1, 5]])
+      expect(Algorithms::String.levenshtein_top_k("Hello", candidates, 0)).to eql([])
+      expect(Algorithms::String.levenshtein_top_k("Hello", [], 3)).to eql([])
+    end
+
+    it "should agree with levenshtein_dist for long strings and many threads" do
+      long = "abcdefghij" * 20
+      candidates = Array.new(300) { |i| long[0, 100 + i % 100] + ("x" * (i % 7)) }
+      expected = candidates.each_with_index.map { |c, i| [Algorithms::String.levenshtein_dist(long, c), i] }.sort.first(5)
+      expect(Algorithms::String.levenshtein_top_k(long, candidates, 5, threads: 4)).to eql(expected)
+    end
+
+    it "should read its options before the candidates" do
+      candidates = %w(Hello Jello Help) + ["x" * 1000]
+      threads = Object.new
+      threads.define_singleton_method(:to_int) { candidates.clear; 2 }
+      expect(Algorithms::String.levenshtein_top_k("Hello", candidates, 2, threads: threads)).to eql([])
+    end
+
+    if Signal.list.has_key?("USR1")
+      it "should finish its search when a signal handler interrupts it" do
+        candidates = Array.new(400_000) { |i| "candidate #{i}" }
+        old_handler = trap("USR1") {}
+        done = false
+        signaller = Thread.new do
+          until done
+            Process.kill("USR1", Process.pid)
+            sleep 0.001
+          end
+        end
+        begin
+          3.times do
+            expect(Algorithms::String.levenshtein_top_k("candidate", candidates, candidates.size).size).to eql(candidates.size)
+          end
+        ensure
+          done = true
+          signaller.join
+          trap("USR1", old_handler)
+        end
+      end
+    end
   end
 end
\ No newline at end of file
@@ -1,5 +1,6 @@
 $: << File.join(File.expand_path(File.dirname(__FILE__)), '..', 'lib')
 require 'algorithms'
+require 'tmpdir'
 
 describe "empty suffix array" do
   it "should not initialize with empty string" do
@@ -38,3 +39,159 @@ describe "non-empty suffix array" do
     expect(number.has_substring?(13)).to be false
   end
 end
+
+describe "suffix array queries" do
+  before(:each) do
+    @s_array = Containers::SuffixArray.new("abracadabra")
+  end
+
+  it "should count and locate occurrences" do
+    expect(@s_array.count("abra")).to eql(2)
+    expect(@s_array.count("a")).to eql(5)
+    expect(@s_array.count("nope")).to eql(0)
+    expect(@s_array.count("")).to eql(0)
+    expect(@s_array.locate("abra")).to eql([0, 7])
+    expect(@s_array.locate("a")).to eql([0, 3, 5, 7, 10])
+    expect(@s_array.locate("abracadabras")).to eql([])
+    expect(Containers::SuffixArray.new("aaaa").locate("aa")).to eql([0, 1, 2])
+  end
+
+  it "should find the longest repeated substring" do
+    expect(@s_array.longest_repeated_substring).to eql("abra")
+    expect(Containers::SuffixArray.new("aaaa").longest_repeated_substring).to eql("aaa")
+    expect(Containers::SuffixArray.new("abc").longest_repeated_substring).to eql("")
+  end
+
+  it "should find the longest common substring" do
+    expect(@s_array.longest_common_substring("cadaver")).to eql("cada")
+    expect(@s_array.longest_common_substring("xyz")).to eql("")
+    expect(@s_array.longest_common_substring("")).to eql("")
+  end
+
+  it "should work on the bytes of multibyte strings" do
+    s_array = Containers::SuffixArray.new("éaéa")
+    expect(s_array.locate("a")).to eql([2, 5])
+    expect(s_array.locate("é")).to eql([0, 3])
+    expect(s_array.has_substring?("éa")).to eql(true)
+    expect(s_array.longest_repeated_substring).to eql("éa".b)
+    expect(s_array.longest_repeated_substring.encoding).to eql(Encoding::ASCII_8BIT)
+    expect(Containers::SuffixArray.new("éè").longest_repeated_substring).to eql("\xC3".b)
+    expect(s_array.longest_common_substring("aé")).to eql("aé".b)
+    expect(s_array.longest_common_substring("aé").encoding).to eql(Encoding::ASCII_8BIT)
+  end
+end
+
+if defined? Containers::CSuffixArray
+  describe Containers::CSuffixArray do
+    it "should sort the suffixes of random strings" do
+      200.times do
+        string = Array.new(rand(1..80)) { ["a", "b", "c", "\0", "\xff"].sample }.join.b
+        expect(Containers::CSuffixArray.new(string).to_a).to eql((0...string.size).sort_by { |i| string[i..-1] })
+      end
+      string = "ab" * 500
+      expect(Containers::CSuffixArray.new(string).to_a).to eql((0...string.size).sort_by { |i| string[i..-1] })
+    end
+
+    it "should agree with the Ruby suffix array" do
+      string = Array.new(500) { %w(a b c).sample }.join
+      native, ruby = Containers::CSuffixArray.new(string), Containers::RubySuffixArray.new(string)
+      200.times do
+        i = rand(string.size)
+        substring = rand < 0.5 ? string[i, rand(1..8)] : Array.new(rand(1..8)) { %w(a b c d).sample }.join
+        expect(native.has_substring?(substring)).to eql(ruby.has_substring?(substring))
+      end
+      expect(native.size).to eql(500)
+    end
+
+    it "should agree with the Ruby suffix array on queries" do
+      50.times do
+        string = Array.new(rand(1..60)) { %w(a b c).sample }.join
+        native, ruby = Containers::CSuffixArray.new(string), Containers::RubySuffixArray.new(string)
+        10.times do
+          pattern = Array.new(rand(1..4)) { %w(a b c d).sample }.join
+          expect(native.locate(pattern)).to eql(ruby.locate(pattern))
+          expect(native.count(pattern)).to eql(ruby.count(pattern))
+        end
+        expect(native.longest_repeated_substring.size).to eql(ruby.longest_repeated_substring.size)
+        other = Array.new(rand(1..30)) { %w(a b c e).sample }.join
+        expect(native.longest_common_substring(other).size).to eql(ruby.longest_common_substring(other).size)
+      end
+    end
+  end
+end
+
+if defined? Containers::FMIndex
+  describe Containers::FMIndex do
+    before(:each) do
+      @index = Containers::FMIndex.new("abracadabra", sample_rate: 4)
+    end
+
+    it "should not initialize with empty string" do
+      expect { Containers::FMIndex.new("") }.to raise_error(ArgumentError)
+      expect { Containers::FMIndex.new("abc", sample_rate: 0) }.to raise_error(ArgumentError)
+    end
+
+    it "should count and locate occurrences" do
+      expect(@index.count("abra")).to eql(2)
+      expect(@index.count("a")).to eql(5)
+      expect(@index.count("nope")).to eql(0)
+      expect(@index.count("")).to eql(0)
+      expect(@index.locate("abra")).to eql([0, 7])
+      expect(@index.locate("a")).to eql([0, 3, 5, 7, 10])
+      expect(@index.locate("abracadabras")).to eql([])
+      expect(@index.has_substring?("cad")).to be true
+      expect(@index["cab"]).to be false
+    end
+
+    it "should extract the text like byteslice" do
+      expect(@index.extract(0, 11)).to eql("abracadabra")
+      expect(@index.extract(3, 4)).to eql("acad")
+      expect(@index.extract(-4, 10)).to eql("abra")
+      expect(@index.extract(11, 1)).to eql("")
+      expect(@index.extract(12, 1)).to be_nil
+      expect(@index.size).to eql(11)
+      expect(@index.sample_rate).to eql(4)
+    end
+
+    it "should agree with the text on random strings" do
+      50.times do
+        string = Array.new(rand(1..120)) { ["a", "b", "c", "\0", "\xff"].sample }.join.b
+        index = Containers::FMIndex.new(string, sample_rate: rand(1..8))
+        10.times do
+          pattern = Array.new(rand(1..3)) { ["a", "b", "c", "\0", "\xff"].sample }.join.b
+          expect(index.locate(pattern)).to eql((0...string.size).select { |i| string.byteslice(i, pattern.size) == pattern })
+          offset, length = rand(string.size), rand(10)
+          expect(index.extract(offset, length)).to eql(string.byteslice(offset, length))
+        end
+      end
+    end
+
+    it "should be smaller than a text of source code" do
+      string = Dir[File.expand_path("../lib/**/*.rb", __dir__)].sort.map { |f| File.binread(f) }.join
+      index = Containers::FMIndex.new(string)
+      expect(index.sample_rate).to eql(64)
+      expect(index.bytesize < string.bytesize).to be true
+      expect(index.locate("class Containers::RubySuffixArray").size).to eql(1)
+    end
+
+    it "should save and load" do
+      path = File.join(Dir.tmpdir, "fm_index_spec.#{Process.pid}")
+      begin
+        @index.save(path)
+        loaded = Containers::FMIndex.load(path)
+        expect(loaded.locate("abra")).to eql([0, 7])
+        expect(loaded.extract(0, 11)).to eql("abracadabra")
+        expect(loaded.bytesize).to eql(File.size(path))
+        image = File.binread(path)
+        [[16, 10_000], [32, 1]].each do |offset, value| # n, sample_rate
+          File.binwrite(path, image[0, offset] + [value].pack("Q") + image[offset + 8..-1])
+          expect { Containers::FMIndex.load(path) }.to raise_error(ArgumentError)
+        end
+        File.binwrite(path, "not an index" * 100)
+        expect { Containers::FMIndex.load(path) }.to raise_error(ArgumentError)
+      ensure
+        File.delete(path) if File.exist?(path)
+      end
+    end
+  end
+end
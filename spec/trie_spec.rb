@@ -1,5 +1,7 @@
 $: << File.join(File.expand_path(File.dirname(__FILE__)), '..', 'lib')
 require 'algorithms'
+require 'tmpdir'
+require 'fileutils'
 
 describe "empty trie" do
   before(:each) do
@@ -57,3 +59,158 @@ describe "non-empty trie" do
     expect(@trie.wildcard("Hel")).to eql([])
   end
 end
+
+describe "trie wildcards" do
+  it "should only match keys as long as the pattern" do
+    trie = Containers::Trie.new
+    %w(a ab abc b).each { |k| trie.push(k, k) }
+    expect(trie.wildcard("a.c")).to eql(["abc"])
+    expect(trie.wildcard("..")).to eql(["ab"])
+  end
+end
+
+if defined? Containers::CTrie
+  describe Containers::CTrie do
+    it "should agree with the Ruby trie on random keys" do
+      alphabet = ["a", "b", "ab", "é", "ü", "日"]
+      native, ruby = Containers::CTrie.new, Containers::RubyTrie.new
+      keys = Array.new(300) { Array.new(rand(1..6)) { alphabet.sample }.join }
+      keys.each_with_index { |k, i| expect(native.push(k, i % 40)).to eql(ruby.push(k, i % 40)) }
+      probes = keys.sample(50) + Array.new(50) { Array.new(rand(1..7)) { alphabet.sample }.join }
+      probes.each do |k|
+        expect(native.get(k)).to eql(ruby.get(k))
+        expect(native.has_key?(k)).to eql(ruby.has_key?(k))
+        expect(native.longest_prefix(k)).to eql(ruby.longest_prefix(k))
+        pattern = k.chars.map { |c| rand < 0.3 ? "." : c }.join
+        expect(native.wildcard(pattern)).to eql(ruby.wildcard(pattern))
+        expect(native.fuzzy_search(k, 1)).to eql(ruby.fuzzy_search(k, 1))
+        prefix = k[0, rand(k.size)]
+        expect(native.each_with_prefix(prefix).to_a).to eql(ruby.each_with_prefix(prefix).to_a)
+        expect(native.count_prefix(prefix)).to eql(ruby.count_prefix(prefix))
+        expect(native.top_k_with_prefix(prefix, 5)).to eql(ruby.top_k_with_prefix(prefix, 5))
+      end
+    end
+
+    it "should search long keys without deep recursion or large buffers" do
+      trie = Containers::CTrie.new
+      trie.push("a" * 1_000_000, 1)
+      trie.push("b" * 100_000, 2)
+      trie.push("b" * 50_000 + "c", 3)
+      expect(trie.wildcard("b" * 99_999 + ".")).to eql(["b" * 100_000])
+      expect(trie.wildcard("." * 100_000)).to eql(["b" * 100_000])
+      expect(trie.fuzzy_search("a" * 200, 2)).to eql([])
+      expect(trie.fuzzy_search("y" * 1_000_000, 1)).to eql([])
+      expect(trie.fuzzy_search("b" * 50_000 + "d", 1)).to eql([[1, "b" * 50_000 + "c"]])
+    end
+
+    it "should mark ruby object references" do
+      anon_class = Class.new
+      trie = Containers::CTrie.new
+      100.times { |i| trie.push(i, anon_class.new) }
+      ObjectSpace.garbage_collect
+      count = 0
+      ObjectSpace.each_object(anon_class) { |x| count += 1 }
+      expect(count).to eql(100)
+    end
+  end
+end
+
+describe "frozen trie" do
+  before(:each) do
+    @dir = Dir.mktmpdir
+    @path = File.join(@dir, "words.trie")
+    @trie = Containers::Trie.new
+    @trie.push("Hello", "World")
+    @trie.push("Hilly", [1, 2])
+    @trie.push("Hello, brother", nil)
+    @trie.push("héllo", 3)
+  end
+
+  after(:each) do
+    FileUtils.rm_rf(@dir)
+  end
+
+  it "should answer like the trie it was frozen from" do
+    expect(@trie.freeze_to(@path).equal?(@trie)).to be true
+    frozen = Containers::Trie.open(@path)
+    expect(frozen.get("Hello")).to eql("World")
+    expect(frozen.get("Hilly")).to eql([1, 2])
+    expect(frozen.has_key?("Hello, brother")).to be true
+    expect(frozen.get("Hello, brother")).to be_nil
+    expect(frozen.get("Hell")).to be_nil
+    expect(frozen.longest_prefix("Hello, brandon")).to eql("Hello")
+    expect(frozen.wildcard("H*ll.")).to eql(["Hello", "Hilly"])
+    expect(frozen.fuzzy_search("hello", 1)).to eql(@trie.fuzzy_search("hello", 1))
+  end
+
+  it "should not be modifiable" do
+    @trie.freeze_to(@path)
+    frozen = Containers::Trie.open(@path)
+    expect(frozen.frozen?).to be true
+    expect { frozen.push("new", 1) }.to raise_error(FrozenError)
+  end
+
+  it "should freeze an opened trie again" do
+    @trie.freeze_to(@path)
+    copy = File.join(@dir, "copy.trie")
+    Containers::Trie.open(@path).freeze_to(copy)
+    expect(Containers::Trie.open(copy).wildcard("*****")).to eql(["Hello", "Hilly", "héllo"])
+  end
+end
+
+if defined? Containers::CTrie
+  describe "frozen CTrie" do
+    it "should reject files it did not write" do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "bad.trie")
+        File.binwrite(path, "not a trie" * 10)
+        expect { Containers::CTrie.open(path) }.to raise_error(ArgumentError)
+        trie = Containers::CTrie.new
+        trie.push("a", 1)
+        trie.freeze_to(path)
+        File.binwrite(path, File.binread(path)[0..-2])
+        expect { Containers::CTrie.open(path) }.to raise_error(ArgumentError)
+      end
+    end
+  end
+end
+
+describe "trie prefix queries" do
+  before(:each) do
+    @trie = Containers::Trie.new
+    { "car" => 5, "card" => 9, "care" => 2, "cart" => 9, "cat" => 7, "dog" => 8, "cab" => "n/a" }.each do |k, v|
+      @trie.push(k, v)
+    end
+  end
+
+  it "should enumerate keys with a prefix in order" do
+    expect(@trie.each_with_prefix("car").to_a).to eql([["car", 5], ["card", 9], ["care", 2], ["cart", 9]])
+    expect(@trie.each_with_prefix("ca").map { |k, v| k }).to eql(%w(cab car card care cart cat))
+    expect(@trie.each_with_prefix("").to_a.size).to eql(7)
+    expect(@trie.each_with_prefix("cow").to_a).to eql([])
+    expect(@trie.each_with_prefix("ca").first(2)).to eql([["cab", "n/a"], ["car", 5]])
+  end
+
+  it "should count keys with a prefix" do
+    expect(@trie.count_prefix("car")).to eql(4)
+    expect(@trie.count_prefix("c")).to eql(6)
+    expect(@trie.count_prefix("")).to eql(7)
+    expect(@trie.count_prefix("cart")).to eql(1)
+    expect(@trie.count_prefix("carts")).to eql(0)
+    expect(@trie.each_with_prefix("ca").size).to eql(6)
+  end
+
+  it "should return the top scoring keys with a prefix" do
+    expect(@trie.top_k_with_prefix("ca", 3)).to eql([["card", 9], ["cart", 9], ["cat", 7]])
+    expect(@trie.top_k_with_prefix("car", 10)).to eql([["card", 9], ["cart", 9], ["car", 5], ["care", 2]])
+    expect(@trie.top_k_with_prefix("", 1)).to eql([["card", 9]])
+    expect(@trie.top_k_with_prefix("cab", 1)).to eql([])
+    expect(@trie.top_k_with_prefix("ca", 0)).to eql([])
+  end
+
+  it "should rank by the latest values" do
+    @trie.push("card", 1)
+    @trie.push("care", 20.5)
+    expect(@trie.top_k_with_prefix("car", 2)).to eql([["care", 20.5], ["cart", 9]])
+  end
+end